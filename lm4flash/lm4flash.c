@@ -25,6 +25,7 @@
 
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include <libusb.h>
@@ -59,6 +60,27 @@ static const uint32_t ROMCTL   = 0x400fe0f0;
 // Flash Memory Address: see Stellaris LM4F120H5QR Microcontroller Page 497
 static const uint32_t FMA      = 0x400fd000;
 
+// On-chip SRAM: see Stellaris LM4F120H5QR Microcontroller Section 2.4
+static const uint32_t SRAM_BASE = 0x20000000;
+
+// EEPROM Run Mode Clock Gating Control: Stellaris LM4F120H5QR Microcontroller Section 5.5
+static const uint32_t RCGCEEPROM = 0x400fe658;
+
+// EEPROM Peripheral Ready: Stellaris LM4F120H5QR Microcontroller Section 5.5
+static const uint32_t PREEPROM = 0x400fea58;
+
+// EEPROM controller: see Stellaris LM4F120H5QR Microcontroller Section 8.6
+static const uint32_t EEPROM_BASE = 0x400af000;
+static const uint32_t EESIZE   = 0x400af000;
+static const uint32_t EEDONE   = 0x400af018;
+static const uint32_t EESUPP   = 0x400af01c;
+
+// DHCSR fields: see ARM Av7mRM C1.6.2
+#define DHCSR_DBGKEY   0xa05f0000
+#define DHCSR_C_DEBUGEN (1 << 0)
+#define DHCSR_C_HALT   (1 << 1)
+#define DHCSR_S_HALT   (1 << 17)
+
 static const uint8_t INTERFACE_NR = 0x02;
 static const uint8_t ENDPOINT_IN  = 0x83;
 static const uint8_t ENDPOINT_OUT = 0x02;
@@ -79,10 +101,14 @@ static const uint8_t ENDPOINT_OUT = 0x02;
 #define FLASH_BLOCK_SIZE 512
 #define FLASH_ERASE_SIZE 1024
 
+/* Enough erase sectors for 1 MB of flash */
+#define FLASH_MAX_SECTORS 1024
+
 /* Prefix + potentially every flash byte escaped */
 #define BUF_SIZE 64 + 2*FLASH_BLOCK_SIZE
 
 static uint8_t flash_block[FLASH_BLOCK_SIZE];
+static uint8_t flash_blank[FLASH_MAX_SECTORS];
 static union {
 	char c[BUF_SIZE];
 	uint8_t u8[BUF_SIZE];
@@ -117,6 +143,7 @@ static uint32_t le32_to_cpu(const uint32_t x)
 static int do_verify = 0;
 static int erase_used = 0;
 static uint32_t start_addr = 0;
+static uint32_t check_len = 0;
 
 #define cpu_to_le32 le32_to_cpu
 
@@ -171,7 +198,11 @@ static int send_command(libusb_device_handle *handle, int size)
 	return retval;
 }
 
-static int wait_response(libusb_device_handle *handle, int *has_ack, int *size)
+/*
+ * Collect one reply. timeout is in ms per transfer, 0 waiting forever;
+ * running out of it is left for the caller to report.
+ */
+static int wait_response(libusb_device_handle *handle, int *has_ack, int *size, unsigned int timeout)
 {
 	int retval;
 	int transferred = 0;
@@ -185,9 +216,10 @@ static int wait_response(libusb_device_handle *handle, int *has_ack, int *size)
 		                              &buf.u8[*size],
 		                              BUF_SIZE - *size,
 		                              &transferred,
-		                              0);
+		                              timeout);
 		if (retval != 0) {
-			printf("Error receiving data %d\n", retval);
+			if (retval != LIBUSB_ERROR_TIMEOUT || !timeout)
+				printf("Error receiving data %d\n", retval);
 			return retval;
 		}
 
@@ -225,7 +257,7 @@ static int checksum_and_send(libusb_device_handle *handle, size_t idx, int *xfer
 	if (retval)
 		return retval;
 
-	retval = wait_response(handle, &has_ack, &transferred);
+	retval = wait_response(handle, &has_ack, &transferred, 0);
 	if (retval)
 		return retval;
 
@@ -324,35 +356,65 @@ static int send_flash_erase(libusb_device_handle *handle, const uint32_t start,
 	return send_u32_u32(handle, "vFlashErase:", start, ",", end, NULL);
 }
 
-static int send_flash_write(libusb_device_handle *handle, const uint32_t addr, const uint8_t *bytes, size_t len)
+/* Returns the number of encoded bytes or a negative libusb error */
+static int encode_buffer(const uint8_t *inbuf, size_t insize, char *outbuf, size_t outsize)
 {
 	size_t i;
-	char prefix[] = "vFlashWrite:12345678:";
-	char by, rawbuf[1024], *buf = rawbuf;
-
-	sprintf(strchr(prefix, ':') + 1, "%08x:", addr);
+	char by, *bp = outbuf;
 
-	for (i = 0; i < len; i++)
-		switch (by = bytes[i]) {
+	for (i = 0; i < insize; i++)
+		switch (by = inbuf[i]) {
 		case '#':
 		case '$':
 		case '}':
-			*buf++ = '}';
+			if (bp >= outbuf + outsize)
+				return LIBUSB_ERROR_NO_MEM;
+
+			*bp++ = '}';
 			by ^= 0x20;
 			/* fall through */
 		default:
-			if (buf >= rawbuf + sizeof(rawbuf))
+			if (bp >= outbuf + outsize)
 				return LIBUSB_ERROR_NO_MEM;
 
-			*buf++ = by;
+			*bp++ = by;
 			break;
 		}
 
-	i = buf - rawbuf;
+	return bp - outbuf;
+}
+
+static int send_flash_write(libusb_device_handle *handle, const uint32_t addr, const uint8_t *bytes, size_t len)
+{
+	char prefix[] = "vFlashWrite:12345678:";
+	char rawbuf[1024];
+	int i;
+
+	sprintf(strchr(prefix, ':') + 1, "%08x:", addr);
+
+	i = encode_buffer(bytes, len, rawbuf, sizeof(rawbuf));
+	if (i < 0)
+		return i;
 
 	return send_u8_binary(handle, prefix, rawbuf, i) ? -1 : i;
 }
 
+static int send_mem_write_block(libusb_device_handle *handle, const uint32_t addr, const uint8_t *bytes, size_t len)
+{
+	char prefix[] = "X12345678,12345678:";
+	char rawbuf[2 * FLASH_BLOCK_SIZE];
+	int i;
+
+	sprintf(prefix, "X%08x,%08x:", addr, (uint32_t)len);
+
+	i = encode_buffer(bytes, len, rawbuf, sizeof(rawbuf));
+	if (i < 0)
+		return i;
+
+	return send_u8_binary(handle, prefix, rawbuf, i);
+}
+
+/* Returns the number of decoded bytes or a negative libusb error */
 static int decode_buffer(char *inbuf, int insize, char *outbuf, int outsize)
 {
 	int i;
@@ -371,14 +433,29 @@ static int decode_buffer(char *inbuf, int insize, char *outbuf, int outsize)
 		}
 	}
 
-	return 0;
+	return bp - outbuf;
 }
 
-static int send_flash_verify(libusb_device_handle *handle, const uint32_t addr, const uint8_t *bytes, size_t len)
+static int hex_nibble(char c)
 {
-	size_t i, j;
-	char rawbuf[1024];
-	int retval, transferred;
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Read len bytes of target memory using the binary 'x' command. The ICDI
+ * answers with "OK:" followed by the escaped data.
+ */
+static int send_mem_read_block(libusb_device_handle *handle, const uint32_t addr, uint8_t *bytes, size_t len)
+{
+	char rawbuf[BUF_SIZE];
+	int retval, transferred, decoded;
+	const size_t hdr = strlen("+$OK:");
 
 	size_t idx = snprintf(buf.c, BUF_SIZE, START "x%x,%x", addr, (uint32_t)len);
 
@@ -386,20 +463,80 @@ static int send_flash_verify(libusb_device_handle *handle, const uint32_t addr,
 	if (retval)
 		return retval;
 
-	decode_buffer(buf.c, transferred, rawbuf, sizeof rawbuf);
+	decoded = decode_buffer(buf.c, transferred, rawbuf, sizeof rawbuf);
+	if (decoded < 0)
+		return decoded;
 
-	if (strncmp(rawbuf, "+$OK:", 5) != 0)
+	if (strncmp(rawbuf, "+$OK:", hdr) != 0)
 		return LIBUSB_ERROR_OTHER;
 
-	for (i = 0, j = strlen("+$OK:"); i < len; i++, j++) {
-		if (bytes[i] != (uint8_t)rawbuf[j]) {
+	/* Data sits between "+$OK:" and the trailing "#xx" */
+	if ((size_t)decoded < hdr + len + END_LEN)
+		return LIBUSB_ERROR_OTHER;
+
+	memcpy(bytes, rawbuf + hdr, len);
+
+	return 0;
+}
+
+static int send_flash_verify(libusb_device_handle *handle, const uint32_t addr, const uint8_t *bytes, size_t len)
+{
+	uint8_t rdbuf[FLASH_BLOCK_SIZE];
+	int retval;
+
+	if (len > sizeof rdbuf)
+		return LIBUSB_ERROR_NO_MEM;
+
+	retval = send_mem_read_block(handle, addr, rdbuf, len);
+	if (retval)
+		return retval;
+
+	if (memcmp(bytes, rdbuf, len) != 0)
+		return LIBUSB_ERROR_OTHER;
+
+	return 0;
+}
+
+/*
+ * Read a core register using the 'p' command. The ICDI numbers registers
+ * like the DCRSR REGSEL field: r0-r15 are 0-15 and xPSR is 16.
+ */
+static int send_reg_read(libusb_device_handle *handle, const unsigned int reg, uint32_t *val)
+{
+	int retval, transferred;
+	int i, hi, lo;
+	uint32_t u = 0;
+	size_t idx = snprintf(buf.c, BUF_SIZE, START "p%x", reg);
+
+	retval = checksum_and_send(handle, idx, &transferred);
+	if (retval)
+		return retval;
+
+	/* "+$" followed by 8 hex digits in target (little endian) byte order */
+	if (transferred < 2 + 8 || strncmp(buf.c, "+$", 2) != 0)
+		return LIBUSB_ERROR_OTHER;
+
+	for (i = 0; i < 4; i++) {
+		hi = hex_nibble(buf.c[2 + 2*i]);
+		lo = hex_nibble(buf.c[2 + 2*i + 1]);
+		if (hi < 0 || lo < 0)
 			return LIBUSB_ERROR_OTHER;
-		}
+		u |= (uint32_t)((hi << 4) | lo) << (8 * i);
 	}
 
+	*val = u;
+
 	return 0;
 }
 
+static int send_reg_write(libusb_device_handle *handle, const unsigned int reg, const uint32_t val)
+{
+	size_t idx = snprintf(buf.c, BUF_SIZE, START "P%x=%02x%02x%02x%02x", reg,
+			val & 0xff, (val >> 8) & 0xff, (val >> 16) & 0xff, val >> 24);
+
+	return checksum_and_send(handle, idx, NULL);
+}
+
 static int print_icdi_version(libusb_device_handle *handle)
 {
 	int retval = 0;
@@ -423,13 +560,8 @@ static int print_icdi_version(libusb_device_handle *handle)
 		return LIBUSB_ERROR_OTHER;
 
 	printf("ICDI version: ");
-	for (i = strlen("+$"); rawbuf[i] != '#'; i += 2) {
-		char r = rawbuf[i];
-		char c = (r <= '9') ? (r - '0') << 4 : (r - 'a' + 10) << 4;
-		r = rawbuf[i+1];
-		c |= (r <= '9') ? r - '0' : r - 'a' + 10;
-		printf("%c", c);
-	}
+	for (i = strlen("+$"); rawbuf[i] != '#'; i += 2)
+		printf("%c", (hex_nibble(rawbuf[i]) << 4) | hex_nibble(rawbuf[i+1]));
 
 	return 0;
 }
@@ -470,6 +602,190 @@ static int print_icdi_version(libusb_device_handle *handle)
 		return LIBUSB_ERROR_OTHER; \
 } while (0)
 
+static int halt_core(libusb_device_handle *handle)
+{
+	uint32_t val = 0;
+
+	MEM_READ(DHCSR, &val);
+	if (val & DHCSR_S_HALT)
+		return 0;
+
+	MEM_WRITE(DHCSR, DHCSR_DBGKEY | DHCSR_C_HALT | DHCSR_C_DEBUGEN);
+	MEM_READ(DHCSR, &val);
+	if (!(val & DHCSR_S_HALT)) {
+		printf("Unable to halt the core\n");
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+static int read_mem_range(libusb_device_handle *handle, uint32_t addr, uint8_t *data, uint32_t len)
+{
+	uint32_t off, chunk;
+	int retval;
+
+	for (off = 0; off < len; off += chunk) {
+		chunk = len - off;
+		if (chunk > FLASH_BLOCK_SIZE)
+			chunk = FLASH_BLOCK_SIZE;
+
+		retval = send_mem_read_block(handle, addr + off, data + off, chunk);
+		if (retval)
+			return retval;
+	}
+
+	return 0;
+}
+
+/* SRAM layout while a helper runs: code first, then data buffers */
+#define HELPER_CODE_OFFSET  0x000
+#define HELPER_DATA_OFFSET  0x100
+
+/* Longest a helper or the EEPROM controller may keep us waiting */
+#define HELPER_TIMEOUT_MS   10000
+
+#define XPSR_THUMB          0x01000000
+
+static uint64_t now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int load_sram(libusb_device_handle *handle, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	uint32_t off, chunk;
+	int retval;
+
+	for (off = 0; off < len; off += chunk) {
+		chunk = len - off;
+		if (chunk > FLASH_BLOCK_SIZE)
+			chunk = FLASH_BLOCK_SIZE;
+
+		retval = send_mem_write_block(handle, addr + off, data + off, chunk);
+		if (retval)
+			return retval;
+	}
+
+	return 0;
+}
+
+/*
+ * Run a routine previously loaded into SRAM with r0-r3 preset, and wait
+ * for it to halt on its closing bkpt. The core must already be halted.
+ *
+ * The ICDI acks the continue at once but only answers it when the core
+ * stops again, so the answer is waited for HELPER_TIMEOUT_MS. A helper
+ * that never gets there is interrupted, which produces the answer.
+ */
+static int run_sram_helper(libusb_device_handle *handle, uint32_t entry,
+                           uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+	const uint32_t regs[] = { r0, r1, r2, r3 };
+	unsigned int i;
+	int retval, has_ack, size;
+	size_t idx;
+	char *reply;
+
+	for (i = 0; i < 4; i++) {
+		retval = send_reg_write(handle, i, regs[i]);
+		if (retval)
+			return retval;
+	}
+
+	retval = send_reg_write(handle, 15, entry);
+	if (retval)
+		return retval;
+
+	retval = send_reg_write(handle, 16, XPSR_THUMB);
+	if (retval)
+		return retval;
+
+	idx = sprintf(buf.c, START "c" END "%02x", 'c');
+	retval = send_command(handle, idx);
+	if (retval)
+		return retval;
+
+	retval = wait_response(handle, &has_ack, &size, HELPER_TIMEOUT_MS);
+	if (retval == LIBUSB_ERROR_TIMEOUT) {
+		printf("SRAM helper did not finish\n");
+		buf.u8[0] = 0x03;
+		if (send_command(handle, 1) == 0)
+			wait_response(handle, &has_ack, &size, HELPER_TIMEOUT_MS);
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	if (retval)
+		return retval;
+	if (!has_ack)
+		return LIBUSB_ERROR_OTHER;
+
+	/* A bkpt stops the core with SIGTRAP, anything else is a fault */
+	reply = memchr(buf.c, '$', size);
+	if (!reply || (reply[1] != 'S' && reply[1] != 'T') || strncmp(reply + 2, "05", 2) != 0) {
+		printf("SRAM helper stopped unexpectedly\n");
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+/*
+ * Thumb routine loaded into SRAM to find erased sectors. It takes
+ * r0 = flash address, r1 = sector count, r2 = SRAM result buffer and
+ * r3 = sector size, and stores one byte per sector: 1 if every word
+ * reads back as 0xffffffff, 0 otherwise. It finishes with a bkpt.
+ */
+static const uint8_t blank_check_helper[] = {
+	0x72, 0xb6,		/*  0: cpsid  i */
+	0x00, 0x29,		/*  2: cmp    r1, #0 */
+	0x0d, 0xd0,		/*  4: beq    0x22 */
+	0xc5, 0x18,		/*  6: adds   r5, r0, r3 */
+	0x01, 0x26,		/*  8: movs   r6, #1 */
+	0x10, 0xc8,		/*  a: ldm    r0!, {r4} */
+	0x01, 0x34,		/*  c: adds   r4, #1 */
+	0x02, 0xd1,		/*  e: bne    0x16 */
+	0xa8, 0x42,		/* 10: cmp    r0, r5 */
+	0xfa, 0xd1,		/* 12: bne    0xa */
+	0x01, 0xe0,		/* 14: b      0x1a */
+	0x00, 0x26,		/* 16: movs   r6, #0 */
+	0x28, 0x46,		/* 18: mov    r0, r5 */
+	0x16, 0x70,		/* 1a: strb   r6, [r2] */
+	0x01, 0x32,		/* 1c: adds   r2, #1 */
+	0x01, 0x39,		/* 1e: subs   r1, #1 */
+	0xef, 0xe7,		/* 20: b      0x2 */
+	0x00, 0xbe,		/* 22: bkpt   #0 */
+};
+
+/* FLASHSZ in DC0[15:0] counts 2 KB units minus one */
+static uint32_t flash_size(uint32_t dc0)
+{
+	return ((dc0 & 0xffff) + 1) * 2048;
+}
+
+/*
+ * Fill blank[] with one entry per FLASH_ERASE_SIZE sector starting at
+ * addr, non-zero meaning the sector is erased. The core must be halted.
+ */
+static int blank_check(libusb_device_handle *handle, uint32_t addr, uint32_t sectors, uint8_t *blank)
+{
+	const uint32_t code = SRAM_BASE + HELPER_CODE_OFFSET;
+	const uint32_t data = SRAM_BASE + HELPER_DATA_OFFSET;
+	int retval;
+
+	retval = load_sram(handle, code, blank_check_helper, sizeof(blank_check_helper));
+	if (retval)
+		return retval;
+
+	retval = run_sram_helper(handle, code, addr, sectors, data, FLASH_ERASE_SIZE);
+	if (retval)
+		return retval;
+
+	return read_mem_range(handle, data, blank, sectors);
+}
+
 /*
  *  This flow is of commands is based on an USB capture of
  *  traffic between LM Flash Programmer and the Stellaris Launchpad
@@ -481,7 +797,7 @@ static int write_firmware(libusb_device_handle *handle, FILE *f)
 	uint32_t addr;
 	size_t rdbytes;
 	int retval = 0;
-	uint32_t size;
+	uint32_t size, flash, sectors, check, i;
 
 	print_icdi_version(handle);
 
@@ -508,14 +824,41 @@ static int write_firmware(libusb_device_handle *handle, FILE *f)
 	MEM_WRITE(FMA, 0x0);
 	MEM_READ(DHCSR, &val);
 
+	MEM_READ(DC0, &val);
+	flash = flash_size(val);
+
 	if (erase_used) {
 		fseek(f, 0, SEEK_END);
 		size = ftell(f);
-		for (addr = start_addr; addr < (start_addr + size); addr += FLASH_ERASE_SIZE)
-			FLASH_ERASE(addr, FLASH_ERASE_SIZE);
 		fseek(f, 0, SEEK_SET);
 	} else {
+		size = flash;
+	}
+
+	/*
+	 * Erasing is slow and most boards arrive blank, so skip the sectors
+	 * that already read back erased. If the check fails erase everything.
+	 * Only sectors inside flash are checked, the helper would fault on
+	 * the rest, so anything an oversized image spills past stays not blank.
+	 */
+	sectors = (size + FLASH_ERASE_SIZE - 1) / FLASH_ERASE_SIZE;
+	if (sectors > FLASH_MAX_SECTORS)
+		sectors = FLASH_MAX_SECTORS;
+	check = start_addr < flash ? (flash - start_addr) / FLASH_ERASE_SIZE : 0;
+	if (check > sectors)
+		check = sectors;
+	memset(flash_blank, 0, sizeof(flash_blank));
+	if (halt_core(handle) || (check && blank_check(handle, start_addr, check, flash_blank)))
+		memset(flash_blank, 0, sizeof(flash_blank));
+
+	if (erase_used) {
+		for (i = 0, addr = start_addr; addr < (start_addr + size); i++, addr += FLASH_ERASE_SIZE)
+			if (i >= sectors || !flash_blank[i])
+				FLASH_ERASE(addr, FLASH_ERASE_SIZE);
+	} else if (memchr(flash_blank, 0, sectors) != NULL) {
 		FLASH_ERASE(0, 0);
+	} else {
+		printf("Flash already blank, skipping erase\n");
 	}
 
 	SEND_COMMAND("debug creset");
@@ -575,6 +918,442 @@ static int write_firmware(libusb_device_handle *handle, FILE *f)
 	return retval;
 }
 
+/*
+ * Memory captured in addition to SRAM when dumping a core: the System
+ * Control Block (CPUID, ICSR, VTOR, fault status and address registers),
+ * the NVIC enable/pending/active bits and the system control registers
+ * up to RCC2. These are all free of read side effects.
+ */
+static const struct {
+	uint32_t addr;
+	uint32_t len;
+} core_extra_ranges[] = {
+	{ 0xe000ed00, 0x40 },
+	{ 0xe000e100, 0x20 },
+	{ 0xe000e200, 0x20 },
+	{ 0xe000e300, 0x20 },
+	{ 0x400fe000, 0x74 },
+};
+
+#define CORE_NUM_RANGES (1 + sizeof(core_extra_ranges) / sizeof(core_extra_ranges[0]))
+
+/* ELF32 layout, see the System V ABI and the ARM ELF supplement */
+#define ELF_EHDR_SIZE     52
+#define ELF_PHDR_SIZE     32
+#define ELF_NHDR_SIZE     12
+#define ELF_ET_CORE       4
+#define ELF_EM_ARM        40
+#define ELF_PT_LOAD       1
+#define ELF_PT_NOTE       4
+#define ELF_NT_PRSTATUS   1
+#define ELF_EF_ARM_EABI5  0x05000000
+
+/* ARM struct elf_prstatus: pr_reg (r0-r15, cpsr, orig_r0) lives at offset 72 */
+#define PRSTATUS_SIZE     148
+#define PRSTATUS_CURSIG   12
+#define PRSTATUS_REG      72
+#define PRSTATUS_NREGS    18
+
+#define SIGINT_NR 2
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static void core_put_phdr(uint8_t *p, uint32_t type, uint32_t offset, uint32_t vaddr,
+                          uint32_t size, uint32_t flags)
+{
+	memset(p, 0, ELF_PHDR_SIZE);
+	put_le32(p + 0, type);
+	put_le32(p + 4, offset);
+	put_le32(p + 8, vaddr);
+	put_le32(p + 12, vaddr);
+	put_le32(p + 16, size);
+	put_le32(p + 20, size);
+	put_le32(p + 24, flags);
+	put_le32(p + 28, type == ELF_PT_LOAD ? 4 : 0);
+}
+
+/*
+ * Halt the core and capture SRAM, the core registers and the ranges in
+ * core_extra_ranges into an ARM ELF core file that gdb can load offline.
+ * The core is left halted so the board can still be inspected afterwards.
+ */
+static int dump_core(libusb_device_handle *handle, FILE *f)
+{
+	uint8_t ehdr[ELF_EHDR_SIZE];
+	uint8_t phdr[ELF_PHDR_SIZE];
+	uint8_t note[ELF_NHDR_SIZE + 8 + PRSTATUS_SIZE];
+	uint32_t addr[CORE_NUM_RANGES], len[CORE_NUM_RANGES];
+	uint8_t *data[CORE_NUM_RANGES] = { NULL };
+	uint32_t regs[PRSTATUS_NREGS];
+	uint32_t val = 0, offset;
+	unsigned int i, nranges = CORE_NUM_RANGES;
+	int retval = 0;
+
+	print_icdi_version(handle);
+
+	SEND_COMMAND("debug clock \0");
+	SEND_STRING("qSupported");
+	SEND_STRING("?");
+
+	retval = halt_core(handle);
+	if (retval)
+		return retval;
+
+	/* r0-r15 and xPSR, orig_r0 is not meaningful here so mirror r0 */
+	for (i = 0; i <= 16; i++) {
+		retval = send_reg_read(handle, i, &regs[i]);
+		if (retval) {
+			printf("Error reading register %u\n", i);
+			return retval;
+		}
+	}
+	regs[17] = regs[0];
+
+	/* SRAMSZ in DC0[31:16] counts 256 byte units minus one */
+	MEM_READ(DC0, &val);
+	addr[0] = SRAM_BASE;
+	len[0] = ((val >> 16) + 1) * 256;
+
+	for (i = 1; i < nranges; i++) {
+		addr[i] = core_extra_ranges[i - 1].addr;
+		len[i] = core_extra_ranges[i - 1].len;
+	}
+
+	for (i = 0; i < nranges; i++) {
+		data[i] = malloc(len[i]);
+		if (!data[i]) {
+			retval = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+
+		retval = read_mem_range(handle, addr[i], data[i], len[i]);
+		if (retval) {
+			printf("Error reading 0x%08x-0x%08x\n", addr[i], addr[i] + len[i]);
+			goto out;
+		}
+	}
+
+	memset(ehdr, 0, sizeof ehdr);
+	memcpy(ehdr, "\177ELF", 4);
+	ehdr[4] = 1;		/* ELFCLASS32 */
+	ehdr[5] = 1;		/* ELFDATA2LSB */
+	ehdr[6] = 1;		/* EV_CURRENT */
+	put_le16(ehdr + 16, ELF_ET_CORE);
+	put_le16(ehdr + 18, ELF_EM_ARM);
+	put_le32(ehdr + 20, 1);
+	put_le32(ehdr + 28, ELF_EHDR_SIZE);
+	put_le32(ehdr + 36, ELF_EF_ARM_EABI5);
+	put_le16(ehdr + 40, ELF_EHDR_SIZE);
+	put_le16(ehdr + 42, ELF_PHDR_SIZE);
+	put_le16(ehdr + 44, 1 + nranges);
+
+	memset(note, 0, sizeof note);
+	put_le32(note + 0, 5);			/* strlen("CORE") + 1 */
+	put_le32(note + 4, PRSTATUS_SIZE);
+	put_le32(note + 8, ELF_NT_PRSTATUS);
+	memcpy(note + ELF_NHDR_SIZE, "CORE", 5);
+	put_le16(note + ELF_NHDR_SIZE + 8 + PRSTATUS_CURSIG, SIGINT_NR);
+	for (i = 0; i < PRSTATUS_NREGS; i++)
+		put_le32(note + ELF_NHDR_SIZE + 8 + PRSTATUS_REG + 4*i, regs[i]);
+
+	if (fwrite(ehdr, sizeof ehdr, 1, f) != 1)
+		goto write_error;
+
+	offset = ELF_EHDR_SIZE + (1 + nranges) * ELF_PHDR_SIZE;
+	core_put_phdr(phdr, ELF_PT_NOTE, offset, 0, sizeof note, 0);
+	if (fwrite(phdr, sizeof phdr, 1, f) != 1)
+		goto write_error;
+
+	offset += sizeof note;
+	for (i = 0; i < nranges; i++) {
+		/* PF_R | PF_W, plus PF_X for SRAM */
+		core_put_phdr(phdr, ELF_PT_LOAD, offset, addr[i], len[i], i ? 6 : 7);
+		if (fwrite(phdr, sizeof phdr, 1, f) != 1)
+			goto write_error;
+		offset += len[i];
+	}
+
+	if (fwrite(note, sizeof note, 1, f) != 1)
+		goto write_error;
+
+	for (i = 0; i < nranges; i++)
+		if (fwrite(data[i], len[i], 1, f) != 1)
+			goto write_error;
+
+	printf("Core dumped: %u bytes of SRAM, pc=0x%08x\n", len[0], regs[15]);
+	goto out;
+
+write_error:
+	perror("fwrite");
+	retval = LIBUSB_ERROR_OTHER;
+out:
+	for (i = 0; i < nranges; i++)
+		free(data[i]);
+
+	return retval;
+}
+
+/*
+ * Thumb routines loaded into SRAM to drive the EEPROM controller without
+ * a USB round trip per register access. Both take r0 = SRAM buffer,
+ * r1 = word count, r2 = EEPROM_BASE, r3 = first word and finish with a
+ * bkpt. On return r1 holds the number of words left and, for the write
+ * routine, r4 the EEDONE value that stopped it.
+ */
+static const uint8_t eeprom_helper[] = {
+	/* eeprom_write: */
+	0x72, 0xb6,		/*  0: cpsid  i */
+	0x00, 0x29,		/*  2: cmp    r1, #0 */
+	0x0e, 0xd0,		/*  4: beq    0x24 */
+	0x1c, 0x09,		/*  6: lsrs   r4, r3, #4 */
+	0x54, 0x60,		/*  8: str    r4, [r2, #4]     EEBLOCK */
+	0x0f, 0x25,		/*  a: movs   r5, #15 */
+	0x1d, 0x40,		/*  c: ands   r5, r3 */
+	0x95, 0x60,		/*  e: str    r5, [r2, #8]     EEOFFSET */
+	0x10, 0xc8,		/* 10: ldm    r0!, {r4} */
+	0x14, 0x61,		/* 12: str    r4, [r2, #16]    EERDWR */
+	0x94, 0x69,		/* 14: ldr    r4, [r2, #24]    EEDONE */
+	0x65, 0x08,		/* 16: lsrs   r5, r4, #1 */
+	0xfc, 0xd2,		/* 18: bcs    0x14             WORKING */
+	0x00, 0x2c,		/* 1a: cmp    r4, #0 */
+	0x02, 0xd1,		/* 1c: bne    0x24 */
+	0x01, 0x33,		/* 1e: adds   r3, #1 */
+	0x01, 0x39,		/* 20: subs   r1, #1 */
+	0xee, 0xe7,		/* 22: b      0x2 */
+	0x00, 0xbe,		/* 24: bkpt   #0 */
+	/* eeprom_read: */
+	0x72, 0xb6,		/* 26: cpsid  i */
+	0x00, 0x29,		/* 28: cmp    r1, #0 */
+	0x09, 0xd0,		/* 2a: beq    0x40 */
+	0x1c, 0x09,		/* 2c: lsrs   r4, r3, #4 */
+	0x54, 0x60,		/* 2e: str    r4, [r2, #4]     EEBLOCK */
+	0x0f, 0x25,		/* 30: movs   r5, #15 */
+	0x1d, 0x40,		/* 32: ands   r5, r3 */
+	0x95, 0x60,		/* 34: str    r5, [r2, #8]     EEOFFSET */
+	0x14, 0x69,		/* 36: ldr    r4, [r2, #16]    EERDWR */
+	0x10, 0xc0,		/* 38: stm    r0!, {r4} */
+	0x01, 0x33,		/* 3a: adds   r3, #1 */
+	0x01, 0x39,		/* 3c: subs   r1, #1 */
+	0xf3, 0xe7,		/* 3e: b      0x28 */
+	0x00, 0xbe,		/* 40: bkpt   #0 */
+};
+
+#define EEPROM_HELPER_WRITE 0x00
+#define EEPROM_HELPER_READ  0x26
+
+static int wait_eeprom_ready(libusb_device_handle *handle)
+{
+	const uint64_t deadline = now_ms() + HELPER_TIMEOUT_MS;
+	uint32_t val = 0;
+	int ready;
+
+	do {
+		MEM_READ(PREEPROM, &val);
+		ready = val & 0x1;
+	} while (!ready && now_ms() < deadline);
+
+	while (ready) {
+		MEM_READ(EEDONE, &val);
+		if (!(val & 0x1))
+			break;
+		if (now_ms() >= deadline)
+			ready = 0;
+	}
+
+	if (!ready) {
+		printf("EEPROM controller not ready\n");
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	/* PRETRY and ERETRY flag a failed power up recovery */
+	MEM_READ(EESUPP, &val);
+	if (val & 0xc) {
+		printf("EEPROM controller reports error (EESUPP=0x%08x)\n", val);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+/*
+ * Program the image file into the EEPROM starting at word 0 and read it
+ * back for verification. The image is staged in SRAM and written by
+ * eeprom_helper, so the whole transfer costs a handful of USB requests
+ * instead of several per word.
+ */
+static int write_eeprom(libusb_device_handle *handle, FILE *f)
+{
+	const uint32_t code = SRAM_BASE + HELPER_CODE_OFFSET;
+	const uint32_t data = SRAM_BASE + HELPER_DATA_OFFSET;
+	uint8_t *image = NULL, *readback = NULL;
+	uint32_t val = 0, size, words, left = 0;
+	long fsize;
+	int retval;
+
+	print_icdi_version(handle);
+
+	SEND_COMMAND("debug clock \0");
+	SEND_STRING("qSupported");
+	SEND_STRING("?");
+	SEND_COMMAND("debug sreset");
+
+	retval = halt_core(handle);
+	if (retval)
+		return retval;
+
+	MEM_WRITE(RCGCEEPROM, 0x1);
+	retval = wait_eeprom_ready(handle);
+	if (retval)
+		return retval;
+
+	/* WORDCNT in EESIZE[15:0] */
+	MEM_READ(EESIZE, &val);
+	size = (val & 0xffff) * 4;
+
+	fseek(f, 0, SEEK_END);
+	fsize = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (fsize <= 0 || (uint32_t)fsize > size) {
+		printf("EEPROM image must be 1 to %u bytes\n", size);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	/* Pad the image to whole words with the erased value */
+	words = (fsize + 3) / 4;
+	image = malloc(words * 4);
+	readback = malloc(words * 4);
+	if (!image || !readback) {
+		retval = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+	memset(image, 0xff, words * 4);
+
+	if (fread(image, 1, fsize, f) != (size_t)fsize) {
+		perror("fread");
+		retval = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	retval = load_sram(handle, code, eeprom_helper, sizeof(eeprom_helper));
+	if (!retval)
+		retval = load_sram(handle, data, image, words * 4);
+	if (retval)
+		goto out;
+
+	retval = run_sram_helper(handle, code + EEPROM_HELPER_WRITE, data, words, EEPROM_BASE, 0);
+	if (!retval)
+		retval = send_reg_read(handle, 1, &left);
+	if (!retval && left) {
+		send_reg_read(handle, 4, &val);
+		printf("Error writing EEPROM word %u (EEDONE=0x%08x)\n", words - left, val);
+		retval = LIBUSB_ERROR_OTHER;
+	}
+	if (retval)
+		goto out;
+
+	/* Read back into the buffer just past the staged image */
+	retval = run_sram_helper(handle, code + EEPROM_HELPER_READ, data + words * 4, words, EEPROM_BASE, 0);
+	if (!retval)
+		retval = read_mem_range(handle, data + words * 4, readback, words * 4);
+	if (retval)
+		goto out;
+
+	if (memcmp(image, readback, words * 4) != 0) {
+		printf("Error verifying EEPROM\n");
+		retval = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	printf("EEPROM programmed: %u bytes\n", words * 4);
+
+out:
+	free(image);
+	free(readback);
+
+	if (retval)
+		return retval;
+
+	/* reset board */
+	SEND_COMMAND("debug hreset");
+	SEND_COMMAND("set vectorcatch 0");
+	SEND_COMMAND("debug disable");
+
+	return 0;
+}
+
+/*
+ * Report which erase sectors in [start_addr, start_addr + check_len) are
+ * blank, check_len defaulting to the end of flash.
+ */
+static int report_blank(libusb_device_handle *handle)
+{
+	uint32_t val = 0, size, end, sectors, i, run, nblank = 0;
+	int retval;
+
+	print_icdi_version(handle);
+
+	SEND_COMMAND("debug clock \0");
+	SEND_STRING("qSupported");
+	SEND_STRING("?");
+
+	retval = halt_core(handle);
+	if (retval)
+		return retval;
+
+	MEM_READ(DC0, &val);
+	size = flash_size(val);
+
+	end = check_len ? start_addr + check_len : size;
+	if (end > size)
+		end = size;
+	if (start_addr >= end) {
+		printf("Range starts beyond the end of flash (0x%x)\n", size);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	sectors = (end - start_addr + FLASH_ERASE_SIZE - 1) / FLASH_ERASE_SIZE;
+	if (sectors > FLASH_MAX_SECTORS)
+		sectors = FLASH_MAX_SECTORS;
+
+	retval = blank_check(handle, start_addr, sectors, flash_blank);
+	if (retval) {
+		printf("Error running blank check\n");
+		return retval;
+	}
+
+	/* Print runs of sectors sharing the same state */
+	for (i = 0; i < sectors; i = run) {
+		for (run = i + 1; run < sectors && !flash_blank[run] == !flash_blank[i]; run++)
+			;
+		printf("0x%08x-0x%08x: %s\n",
+		       start_addr + i * FLASH_ERASE_SIZE,
+		       start_addr + run * FLASH_ERASE_SIZE - 1,
+		       flash_blank[i] ? "erased" : "programmed");
+		if (flash_blank[i])
+			nblank += run - i;
+	}
+	printf("%u of %u sectors erased\n", nblank, sectors);
+
+	/* reset board */
+	SEND_COMMAND("debug hreset");
+	SEND_COMMAND("set vectorcatch 0");
+	SEND_COMMAND("debug disable");
+
+	return 0;
+}
 
 enum flasher_error {
 	FLASHER_SUCCESS,
@@ -583,6 +1362,15 @@ enum flasher_error {
 	FLASHER_ERR_MULTIPLE_DEVICES,
 };
 
+enum flasher_mode {
+	FLASHER_MODE_FLASH,
+	FLASHER_MODE_CORE_DUMP,
+	FLASHER_MODE_EEPROM,
+	FLASHER_MODE_BLANK_CHECK,
+};
+
+static enum flasher_mode mode = FLASHER_MODE_FLASH;
+
 
 static enum flasher_error
 flasher_find_matching_device(
@@ -698,7 +1486,7 @@ out:
 
 static void flasher_usage()
 {
-	printf("Usage: lm4flash [options] <binary-file>\n");
+	printf("Usage: lm4flash [options] <binary-file | core-file>\n");
 	printf("\t-V\n");
 	printf("\t\tPrint version information\n");
 	printf("\t-h\n");
@@ -711,6 +1499,14 @@ static void flasher_usage()
 	printf("\t\tWrite binary at the given address (in hexadecimal)\n");
 	printf("\t-s SERIAL\n");
 	printf("\t\tFlash device with the following serial\n");
+	printf("\t-c\n");
+	printf("\t\tHalt the core and dump SRAM and registers to the given ELF core file\n");
+	printf("\t-e\n");
+	printf("\t\tProgram the binary file into the EEPROM instead of flash\n");
+	printf("\t-b\n");
+	printf("\t\tReport erased and programmed sectors starting at the -S address\n");
+	printf("\t-l length\n");
+	printf("\t\tLimit -b to the given length (in hexadecimal)\n");
 }
 
 
@@ -763,14 +1559,31 @@ static int flasher_flash(const char *serial, const char *rom_name)
 		goto done;
 	}
 
-	f = fopen(rom_name, "rb");
+	if (mode == FLASHER_MODE_BLANK_CHECK) {
+		retval = report_blank(handle);
+		goto done;
+	}
+
+	f = fopen(rom_name, mode == FLASHER_MODE_CORE_DUMP ? "wb" : "rb");
 	if (!f) {
 		perror("fopen");
 		retval = 1;
 		goto done;
 	}
 
-	retval = write_firmware(handle, f);
+	switch (mode) {
+	case FLASHER_MODE_FLASH:
+		retval = write_firmware(handle, f);
+		break;
+	case FLASHER_MODE_CORE_DUMP:
+		retval = dump_core(handle, f);
+		break;
+	case FLASHER_MODE_EEPROM:
+		retval = write_eeprom(handle, f);
+		break;
+	case FLASHER_MODE_BLANK_CHECK:
+		break;
+	}
 
 done:
 	if (f)
@@ -792,7 +1605,7 @@ int main(int argc, char *argv[])
 	const char *rom_name = NULL;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "VES:hvs:")) != -1) {
+	while ((opt = getopt(argc, argv, "VES:hvs:cebl:")) != -1) {
 		switch (opt) {
 		case 'V':
 			show_version();
@@ -814,17 +1627,30 @@ int main(int argc, char *argv[])
 		case 's':
 			serial = optarg;
 			break;
+		case 'c':
+			mode = FLASHER_MODE_CORE_DUMP;
+			break;
+		case 'e':
+			mode = FLASHER_MODE_EEPROM;
+			break;
+		case 'b':
+			mode = FLASHER_MODE_BLANK_CHECK;
+			break;
+		case 'l':
+			check_len = strtol(optarg, NULL, 16);
+			break;
 		default:
 			flasher_usage();
 			return EXIT_FAILURE;
 		}
 	}
 
-	if (optind >= argc) {
+	if (optind < argc)
+		rom_name = argv[optind];
+	else if (mode != FLASHER_MODE_BLANK_CHECK) {
 		flasher_usage();
 		return EXIT_FAILURE;
-	} else
-		rom_name = argv[optind];
+	}
 
 	if (start_addr && (start_addr % FLASH_ERASE_SIZE)) {
 		printf("Address given to -S must be 0x%x aligned\n", FLASH_ERASE_SIZE);
@@ -0,0 +1,1303 @@
+//*****************************************************************************
+//
+// bridge.c - routing of GDB packets between the TCP clients and the ICDI.
+//
+// Requests for the ICDI are queued and each response is matched to the
+// request that caused it, which lets the bridge answer or rewrite packets
+// itself.  Requests from all the clients of an ICDI go through the same
+// queue, so each response goes back to the client that asked, and the
+// other clients learn that the core stopped from a Stop notification.
+// Acks are terminated here on both sides: we ack GDB's packets ourselves
+// and never forward acks to or from the USB link.
+//
+// Up to PROBE_DEPTH requests are on the wire at once.  The ICDI answers
+// them in order, and acks them in the order it receives them, so a NAK
+// or a corrupted response is dealt with by sending that request again
+// behind the others already on the wire.  Nothing is sent past a request
+// that resumes the core, as its answer only comes when the core stops.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+#define PROBE_DEPTH             4
+
+//
+// The state of the link to one ICDI
+//
+struct _BRIDGE
+{
+    //
+    // Requests waiting for (or being answered by) the ICDI in the order
+    // their answers will come.  The ones on the wire are always at the
+    // front.
+    //
+    PROBEREQ *pProbeHead;
+    PROBEREQ *pProbeTail;
+    unsigned int iProbeSent;
+    unsigned int iProbeSeq;
+
+    //
+    // Set when the ICDI advertised QStartNoAckMode in its qSupported reply
+    // and once it has actually switched.
+    //
+    int bUsbNoAckOk;
+    int bUsbNoAck;
+
+    //
+    // The largest packet the ICDI takes, from its qSupported reply
+    //
+    unsigned int iUsbPacketSize;
+
+    //
+    // Where the last read of RAM ended, to spot GDB walking through memory
+    //
+    unsigned int iNextRead;
+};
+
+static const unsigned char pCtrlC[] = { 0x03 };
+
+static void probe_complete(PROBEREQ *pReq, unsigned char *pPayload,
+        unsigned int len);
+
+//*****************************************************************************
+//
+//! Tell the clients of pIcdi other than pCli that the core stopped, with
+//! the stop reply pCli gets in pPayload.
+//
+//*****************************************************************************
+void
+bridge_stop_broadcast(ICDI *pIcdi, GDBCLIENT *pCli,
+        const unsigned char *pPayload, unsigned int len)
+{
+    GDBCLIENT *pOther;
+
+    if ((len == 0) || (strchr("STWX", pPayload[0]) == NULL))
+    {
+        return;
+    }
+
+    for (pOther = pIcdi->pClients; pOther; pOther = pOther->pNext)
+    {
+        if (pOther != pCli)
+        {
+            gdb_notify(pOther, "Stop:", pPayload, len);
+        }
+    }
+}
+
+//*****************************************************************************
+//
+//! Warn pCli, starting pWhat, if a client of its ICDI is waiting for the
+//! core to stop.  Nothing gets to the ICDI until it does, see the README.
+//
+//*****************************************************************************
+void
+bridge_warn_resumed(GDBCLIENT *pCli, const char *pWhat)
+{
+    PROBEREQ *pReq;
+    char pLine[160];
+
+    for (pReq = pCli->pIcdi->pBridge->pProbeHead; pReq; pReq = pReq->pNext)
+    {
+        if (pReq->bBarrier)
+        {
+            snprintf(pLine, sizeof(pLine), "warning: the core was resumed "
+                     "by GDB, %s gets nothing until it stops\n", pWhat);
+            gdb_console(pCli, pLine);
+            return;
+        }
+    }
+}
+
+//
+// The USB transfer carrying pReq has let go of it.  If the response has
+// already come in, that was the last thing holding on to it.
+//
+static void
+probe_tx_done(void *pCtx)
+{
+    PROBEREQ *pReq = pCtx;
+
+    pReq->bOnWire = 0;
+    if (pReq->bDone)
+    {
+        free(pReq);
+    }
+}
+
+//
+// Put pReq on the wire (again).  The packet is sent from pReq itself
+// unless an earlier attempt is still holding it.
+//
+static void
+probe_send(PROBEREQ *pReq)
+{
+    BRIDGE *pBridge = pReq->pIcdi->pBridge;
+
+    pReq->iSeq = pBridge->iProbeSeq++;
+    pReq->bAcked = pBridge->bUsbNoAck;
+    metrics_sent(pReq);
+    if (pReq->bOnWire)
+    {
+        usbTxReq(pReq->pIcdi, pReq->pPkt, pReq->iLen);
+    }
+    else
+    {
+        pReq->bOnWire = 1;
+        usbTxPkt(pReq->pIcdi, pReq->pPkt, pReq->iLen, probe_tx_done, pReq);
+    }
+}
+
+//
+// Send queued requests while there is room on the wire
+//
+static void
+probe_kick(BRIDGE *pBridge)
+{
+    PROBEREQ *pReq;
+
+    for (pReq = pBridge->pProbeHead;
+         pReq && (pBridge->iProbeSent < PROBE_DEPTH); pReq = pReq->pNext)
+    {
+        if (!pReq->bSent)
+        {
+            pReq->bSent = 1;
+            pBridge->iProbeSent++;
+            probe_send(pReq);
+
+            //
+            // Without acks there is nothing to wait for at all.  Completing
+            // it carries on with the requests after it.
+            //
+            if (pReq->bNoReply && pReq->bAcked)
+            {
+                probe_complete(pReq, NULL, 0);
+                return;
+            }
+        }
+
+        if (pReq->bBarrier)
+        {
+            return;
+        }
+    }
+}
+
+//
+// Unlink pReq from the queue
+//
+static void
+probe_unlink(BRIDGE *pBridge, PROBEREQ *pReq)
+{
+    PROBEREQ **ppReq;
+
+    for (ppReq = &pBridge->pProbeHead; *ppReq != pReq;
+         ppReq = &(*ppReq)->pNext)
+    {
+    }
+
+    *ppReq = pReq->pNext;
+    if (pBridge->pProbeTail == pReq)
+    {
+        pBridge->pProbeTail = NULL;
+        for (pReq = pBridge->pProbeHead; pReq; pReq = pReq->pNext)
+        {
+            pBridge->pProbeTail = pReq;
+        }
+    }
+}
+
+//
+// pReq is done with: take it off the queue, get the next request going and
+// hand the response to whoever asked.
+//
+static void
+probe_complete(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    BRIDGE *pBridge = pReq->pIcdi->pBridge;
+
+    metrics_done(pReq);
+    probe_unlink(pBridge, pReq);
+    pBridge->iProbeSent--;
+    probe_kick(pBridge);
+
+    //
+    // Where the bridge resumes the core itself, it says when the others
+    // get to know
+    //
+    if (pReq->bBarrier && pReq->pCli)
+    {
+        bridge_stop_broadcast(pReq->pIcdi, pReq->pCli, pPayload, len);
+    }
+
+    if (pReq->pfnDone)
+    {
+        pReq->pfnDone(pReq, pPayload, len);
+    }
+
+    if (pReq->bOnWire)
+    {
+        pReq->bDone = 1;
+    }
+    else
+    {
+        free(pReq);
+    }
+}
+
+//
+// Send pReq again.  Its answer now comes after those of the other requests
+// already on the wire, so it moves behind them in the queue.
+//
+static void
+probe_resend(PROBEREQ *pReq)
+{
+    BRIDGE *pBridge = pReq->pIcdi->pBridge;
+    PROBEREQ *pLast, *pPos;
+
+    probe_unlink(pBridge, pReq);
+
+    pLast = NULL;
+    for (pPos = pBridge->pProbeHead; pPos && pPos->bSent; pPos = pPos->pNext)
+    {
+        pLast = pPos;
+    }
+
+    if (pLast)
+    {
+        pReq->pNext = pLast->pNext;
+        pLast->pNext = pReq;
+    }
+    else
+    {
+        pReq->pNext = pBridge->pProbeHead;
+        pBridge->pProbeHead = pReq;
+    }
+
+    if (pReq->pNext == NULL)
+    {
+        pBridge->pProbeTail = pReq;
+    }
+
+    probe_send(pReq);
+}
+
+//
+// The request on the wire the ICDI hasn't acked yet that was sent first
+//
+static PROBEREQ *
+probe_unacked(BRIDGE *pBridge)
+{
+    PROBEREQ *pReq, *pOldest = NULL;
+
+    for (pReq = pBridge->pProbeHead; pReq && pReq->bSent; pReq = pReq->pNext)
+    {
+        if (!pReq->bAcked &&
+            ((pOldest == NULL) || ((int)(pReq->iSeq - pOldest->iSeq) < 0)))
+        {
+            pOldest = pReq;
+        }
+    }
+    return pOldest;
+}
+
+//*****************************************************************************
+//
+//! Queue the packet with payload pPayload for pIcdi on behalf of pCli
+//! (NULL for the bridge's own requests).  pfnDone is called with the
+//! response once it arrives.
+//
+//*****************************************************************************
+void
+probe_submit(ICDI *pIcdi, GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len, PROBE_FN pfnDone, void *pCtx)
+{
+    BRIDGE *pBridge = pIcdi->pBridge;
+    PROBEREQ *pReq;
+
+    pReq = malloc(sizeof(PROBEREQ) + len + 4);
+    ASSERT(pReq != NULL);
+
+    pReq->pNext = NULL;
+    pReq->pIcdi = pIcdi;
+    pReq->pCli = pCli;
+    pReq->pfnDone = pfnDone;
+    pReq->pCtx = pCtx;
+    pReq->bSent = 0;
+    pReq->bAcked = 0;
+    pReq->bOnWire = 0;
+    pReq->bDone = 0;
+
+    //
+    // Resuming only gets an answer once the core stops
+    //
+    pReq->bBarrier = (len > 0) &&
+                     ((pPayload[0] == 'c') || (pPayload[0] == 'C') ||
+                      (pPayload[0] == 's') || (pPayload[0] == 'S') ||
+                      PKT_IS(pPayload, len, "vCont;"));
+
+    //
+    // Killing or restarting the program gets no answer at all
+    //
+    pReq->bNoReply = (len > 0) &&
+                     (((len == 1) && (pPayload[0] == 'k')) ||
+                      (pPayload[0] == 'R'));
+
+    pReq->iLen = gdb_frame(pReq->pPkt, pPayload, len);
+
+    if (pBridge->pProbeTail)
+    {
+        pBridge->pProbeTail->pNext = pReq;
+    }
+    else
+    {
+        pBridge->pProbeHead = pReq;
+    }
+    pBridge->pProbeTail = pReq;
+
+    probe_kick(pBridge);
+}
+
+//*****************************************************************************
+//
+//! Return the largest packet pIcdi accepts.
+//
+//*****************************************************************************
+unsigned int
+probe_packet_size(ICDI *pIcdi)
+{
+    return pIcdi->pBridge->iUsbPacketSize;
+}
+
+//*****************************************************************************
+//
+//! Set up the bridge state of pIcdi for a link we know nothing about yet.
+//
+//*****************************************************************************
+void
+bridge_init(ICDI *pIcdi)
+{
+    pIcdi->pBridge = calloc(1, sizeof(BRIDGE));
+    ASSERT(pIcdi->pBridge != NULL);
+    pIcdi->pBridge->iUsbPacketSize = DEFAULT_PACKET_SIZE;
+}
+
+//*****************************************************************************
+//
+//! Send a response with payload pPayload to the GDB client.
+//
+//*****************************************************************************
+void
+gdb_reply(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len)
+{
+    unsigned char *pOut;
+    unsigned int n;
+
+    if ((pCli == NULL) || (pCli->sd < 0))
+    {
+        return;
+    }
+
+    if (len + 4 > sizeof(pCli->pLast))
+    {
+        TRACE(ALWAYS, "%s: response too long (%d)\n", __FUNCTION__, len);
+        return;
+    }
+
+    //
+    // Frame straight into the output, keeping a copy only while the client
+    // may still NAK it
+    //
+    pOut = client_reserve(pCli, len + 4);
+    n = gdb_frame(pOut, pPayload, len);
+    if (!pCli->bNoAck)
+    {
+        memcpy(pCli->pLast, pOut, n);
+        pCli->iLast = n;
+    }
+    client_commit(pCli, n);
+}
+
+//*****************************************************************************
+//
+//! Print the string pText on the GDB client's console, as output of the
+//! monitor command it's waiting on.
+//
+//*****************************************************************************
+void
+gdb_console(GDBCLIENT *pCli, const char *pText)
+{
+    unsigned char pBuf[1 + 2 * 256];
+    unsigned int len = strlen(pText);
+    unsigned int n;
+
+    pBuf[0] = 'O';
+    while (len)
+    {
+        n = (len < 256) ? len : 256;
+        gdb_reply(pCli, pBuf, 1 + gdb_hex_encode(pBuf + 1,
+                  (const unsigned char *)pText, n));
+        pText += n;
+        len -= n;
+    }
+}
+
+//*****************************************************************************
+//
+//! Send the notification pName (including its ':') with payload pPayload to
+//! the GDB client.  Notifications aren't acked, so nothing is kept for a
+//! resend.
+//
+//*****************************************************************************
+void
+gdb_notify(GDBCLIENT *pCli, const char *pName, const unsigned char *pPayload,
+        unsigned int len)
+{
+    unsigned char pBuf[MSGSIZE];
+    unsigned char *pOut;
+    unsigned int n = strlen(pName);
+
+    if ((pCli == NULL) || (pCli->sd < 0) || (n + len + 4 > sizeof(pBuf)))
+    {
+        return;
+    }
+
+    memcpy(pBuf, pName, n);
+    memcpy(pBuf + n, pPayload, len);
+
+    pOut = client_reserve(pCli, n + len + 4);
+    n = gdb_frame(pOut, pBuf, n + len);
+    pOut[0] = '%';
+    client_commit(pCli, n);
+}
+
+//
+// Forward the ICDI's response unchanged
+//
+static void
+forward_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+//
+// Rewrite the ICDI's qSupported reply for GDB.  We advertise our own,
+// larger, PacketSize and split requests to fit the ICDI's, and make sure
+// GDB sees QStartNoAckMode+, noting whether the ICDI offered it itself.
+// Breakpoint conditions are evaluated here, whatever the ICDI does.
+//
+static void
+qsupported_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    static const char pNoAck[] = "QStartNoAckMode+";
+    static const char pOurs[] = ";ConditionalBreakpoints+";
+    BRIDGE *pBridge = pReq->pIcdi->pBridge;
+    unsigned char pBuf[MSGSIZE];
+    unsigned int i, n, iOut;
+
+    iOut = sprintf((char *)pBuf, "PacketSize=%x", GDB_PACKET_SIZE);
+
+    for (i = 0; i < len; i = n + 1)
+    {
+        for (n = i; (n < len) && (pPayload[n] != ';'); n++)
+        {
+        }
+
+        if (PKT_IS(pPayload + i, n - i, "PacketSize="))
+        {
+            gdb_parse_hex(pPayload + i + 11, n - i - 11,
+                          &pBridge->iUsbPacketSize);
+            if ((pBridge->iUsbPacketSize < 64) ||
+                (pBridge->iUsbPacketSize > MSGSIZE - 4))
+            {
+                pBridge->iUsbPacketSize = DEFAULT_PACKET_SIZE;
+            }
+            TRACE(1, "%s: ICDI packet size %d\n", __FUNCTION__,
+                  pBridge->iUsbPacketSize);
+            continue;
+        }
+
+        if ((n - i == sizeof(pNoAck) - 1) &&
+            (memcmp(pPayload + i, pNoAck, n - i) == 0))
+        {
+            pBridge->bUsbNoAckOk = 1;
+            continue;
+        }
+
+        if ((n > i) && (iOut + 1 + n - i <
+                        sizeof(pBuf) - sizeof(pNoAck) - sizeof(pOurs)))
+        {
+            pBuf[iOut++] = ';';
+            memcpy(pBuf + iOut, pPayload + i, n - i);
+            iOut += n - i;
+        }
+    }
+
+    pBuf[iOut++] = ';';
+    memcpy(pBuf + iOut, pNoAck, sizeof(pNoAck) - 1);
+    iOut += sizeof(pNoAck) - 1;
+    memcpy(pBuf + iOut, pOurs, sizeof(pOurs) - 1);
+    iOut += sizeof(pOurs) - 1;
+
+    gdb_reply(pReq->pCli, pBuf, iOut);
+}
+
+//
+// The client asked for no-ack mode.  Reply with OK, which GDB still acks,
+// and stop sending acks ourselves from then on.
+//
+static void
+noack_reply(GDBCLIENT *pCli)
+{
+    if (pCli == NULL)
+    {
+        return;
+    }
+    gdb_reply(pCli, (const unsigned char *)"OK", 2);
+    pCli->bNoAck = 1;
+    TRACE(1, "%s: client in no-ack mode\n", __FUNCTION__);
+}
+
+static void
+noack_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    if ((len == 2) && (memcmp(pPayload, "OK", 2) == 0))
+    {
+        pReq->pIcdi->pBridge->bUsbNoAck = 1;
+        TRACE(1, "%s: ICDI in no-ack mode\n", __FUNCTION__);
+    }
+    noack_reply(pReq->pCli);
+}
+
+//
+// A read that missed the cache.  For flash the line aligned window around
+// it is fetched with 'x', for sequential RAM reads a read-ahead window.
+// The original request is answered from the cache once that is filled.
+//
+typedef struct _READREQ
+{
+    int bWindow;
+    unsigned char cCmd;
+    unsigned int iAddr;
+    unsigned int iLen;
+    unsigned int iGen;
+    unsigned int iOrig;
+    unsigned char pOrig[];
+} READREQ;
+
+//
+// Answer an m or x read of iLen bytes at iAddr from the cache
+//
+static int
+read_reply(ICDI *pIcdi, GDBCLIENT *pCli, unsigned char cCmd,
+        unsigned int iAddr, unsigned int iLen)
+{
+    unsigned char pData[MAX_CACHED_READ];
+    unsigned char pBuf[2 * MAX_CACHED_READ + 3];
+    unsigned int n;
+
+    if (!cache_read(pIcdi, iAddr, iLen, pData))
+    {
+        return 0;
+    }
+
+    if (cCmd == 'm')
+    {
+        n = gdb_hex_encode(pBuf, pData, iLen);
+    }
+    else
+    {
+        memcpy(pBuf, "OK:", 3);
+        n = 3 + gdb_escape(pBuf + 3, pData, iLen);
+    }
+    gdb_reply(pCli, pBuf, n);
+    return 1;
+}
+
+static void
+read_fill_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    READREQ *pRead = pReq->pCtx;
+    unsigned int iAddr, iLen, n;
+
+    gdb_parse_range(pReq->pPkt + 2, pReq->iLen - 2, &iAddr, &iLen);
+
+    if ((len >= 3) && (memcmp(pPayload, "OK:", 3) == 0))
+    {
+        n = gdb_unescape(pPayload, pPayload + 3, len - 3);
+        if ((n == iLen) && pRead->bWindow)
+        {
+            cache_window_fill(pReq->pIcdi, pRead->iGen, iAddr, pPayload, n);
+        }
+        else if (n == iLen)
+        {
+            cache_fill(pReq->pIcdi, pRead->iGen, iAddr, pPayload, n);
+        }
+    }
+
+    //
+    // If the fill failed (or was overtaken by a write) let the ICDI answer
+    // the original request itself
+    //
+    if ((pReq->pCli != NULL) &&
+        !read_reply(pReq->pIcdi, pReq->pCli, pRead->cCmd, pRead->iAddr,
+                    pRead->iLen))
+    {
+        probe_submit(pReq->pIcdi, pReq->pCli, pRead->pOrig, pRead->iOrig,
+                     forward_done, NULL);
+    }
+    free(pRead);
+}
+
+//
+// The most we read from the ICDI in one go.  The 'x' reply is "OK:" and
+// the escaped data, which can take up to twice its size.
+//
+static unsigned int
+read_chunk(ICDI *pIcdi)
+{
+    return (pIcdi->pBridge->iUsbPacketSize - 8) / 2;
+}
+
+//
+// A read too large for a single ICDI packet.  It is fetched in pieces
+// that are all queued at once, and GDB gets them back as one reply.
+//
+typedef struct _SPLITREAD
+{
+    unsigned char cCmd;
+    unsigned int iAddr;
+    unsigned int iLen;
+    unsigned int iPending;
+    unsigned int iErr;
+    unsigned char pErr[16];
+    unsigned char pData[];
+} SPLITREAD;
+
+static void
+read_split_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    SPLITREAD *pSplit = pReq->pCtx;
+    unsigned char *pBuf;
+    unsigned int iAddr, iLen, n;
+
+    gdb_parse_range(pReq->pPkt + 2, pReq->iLen - 2, &iAddr, &iLen);
+
+    n = 0;
+    if ((len >= 3) && (memcmp(pPayload, "OK:", 3) == 0))
+    {
+        n = gdb_unescape(pPayload, pPayload + 3, len - 3);
+    }
+
+    if ((n == iLen) && (iAddr - pSplit->iAddr + n <= pSplit->iLen))
+    {
+        memcpy(pSplit->pData + (iAddr - pSplit->iAddr), pPayload, n);
+    }
+    else if (pSplit->iErr == 0)
+    {
+        pSplit->iErr = len < sizeof(pSplit->pErr) ? len : sizeof(pSplit->pErr);
+        memcpy(pSplit->pErr, pPayload, pSplit->iErr);
+        if ((pSplit->iErr == 0) || (pSplit->pErr[0] != 'E'))
+        {
+            pSplit->iErr = 3;
+            memcpy(pSplit->pErr, "E01", 3);
+        }
+    }
+
+    if (--pSplit->iPending)
+    {
+        return;
+    }
+
+    if (pSplit->iErr)
+    {
+        gdb_reply(pReq->pCli, pSplit->pErr, pSplit->iErr);
+    }
+    else
+    {
+        pBuf = malloc(2 * pSplit->iLen + 3);
+        ASSERT(pBuf != NULL);
+        if (pSplit->cCmd == 'm')
+        {
+            n = gdb_hex_encode(pBuf, pSplit->pData, pSplit->iLen);
+        }
+        else
+        {
+            memcpy(pBuf, "OK:", 3);
+            n = 3 + gdb_escape(pBuf + 3, pSplit->pData, pSplit->iLen);
+        }
+        gdb_reply(pReq->pCli, pBuf, n);
+        free(pBuf);
+    }
+    free(pSplit);
+}
+
+static int
+read_split(ICDI *pIcdi, GDBCLIENT *pCli, unsigned char cCmd,
+        unsigned int iAddr, unsigned int iLen)
+{
+    unsigned char pBuf[32];
+    unsigned int iChunk, i, n;
+    SPLITREAD *pSplit;
+
+    //
+    // The reply has to fit what we told GDB
+    //
+    if (2 * iLen + 3 > GDB_PACKET_SIZE)
+    {
+        gdb_reply(pCli, (const unsigned char *)"E01", 3);
+        return 1;
+    }
+
+    pSplit = malloc(sizeof(SPLITREAD) + iLen);
+    ASSERT(pSplit != NULL);
+    pSplit->cCmd = cCmd;
+    pSplit->iAddr = iAddr;
+    pSplit->iLen = iLen;
+    pSplit->iErr = 0;
+
+    iChunk = read_chunk(pIcdi);
+    pSplit->iPending = (iLen + iChunk - 1) / iChunk;
+
+    for (i = 0; i < iLen; i += iChunk)
+    {
+        n = sprintf((char *)pBuf, "x%x,%x", iAddr + i,
+                    (iLen - i < iChunk) ? iLen - i : iChunk);
+        probe_submit(pIcdi, pCli, pBuf, n, read_split_done, pSplit);
+    }
+    return 1;
+}
+
+//
+// An m or x request.  Reads of flash are served from the cache, missing
+// lines are fetched first.  Reads of RAM that carry on where the previous
+// one ended start a read-ahead window.  Returns 0 if the request should
+// simply be forwarded.
+//
+static int
+read_request(ICDI *pIcdi, GDBCLIENT *pCli, unsigned char *pPayload,
+        unsigned int len)
+{
+    BRIDGE *pBridge = pIcdi->pBridge;
+    unsigned char pBuf[32];
+    unsigned int iAddr, iLen, iStart, iWin, n;
+    int bFlash, bSequential;
+    READREQ *pRead;
+
+    if (gdb_parse_range(pPayload + 1, len - 1, &iAddr, &iLen) != len - 1)
+    {
+        return 0;
+    }
+
+    if (iLen > read_chunk(pIcdi))
+    {
+        return read_split(pIcdi, pCli, pPayload[0], iAddr, iLen);
+    }
+
+    if (iLen > MAX_CACHED_READ)
+    {
+        return 0;
+    }
+
+    bSequential = (iAddr == pBridge->iNextRead);
+    pBridge->iNextRead = iAddr + iLen;
+
+    if (read_reply(pIcdi, pCli, pPayload[0], iAddr, iLen))
+    {
+        TRACE(1, "%s: cache hit 0x%08x,%x\n", __FUNCTION__, iAddr, iLen);
+        metrics_add(pIcdi, METRIC_MEM_HITS, 1);
+        return 1;
+    }
+    metrics_add(pIcdi, METRIC_MEM_MISSES, 1);
+
+    bFlash = cache_is_flash(pIcdi, iAddr, iLen);
+    if (bFlash)
+    {
+        iStart = iAddr & ~(CACHE_LINE - 1);
+        iWin = ((iAddr + iLen + CACHE_LINE - 1) & ~(CACHE_LINE - 1)) - iStart;
+    }
+    else if (!bSequential || !regcache_halted(pIcdi) ||
+             !cache_window_for(pIcdi, iAddr, iLen, &iStart, &iWin))
+    {
+        return 0;
+    }
+
+    //
+    // Whatever we fetch has to come back in a single ICDI packet
+    //
+    if (iWin > read_chunk(pIcdi))
+    {
+        iWin = read_chunk(pIcdi);
+        if (iAddr + iLen - iStart > iWin)
+        {
+            return 0;
+        }
+    }
+
+    pRead = malloc(sizeof(READREQ) + len);
+    ASSERT(pRead != NULL);
+    pRead->bWindow = !bFlash;
+    pRead->cCmd = pPayload[0];
+    pRead->iAddr = iAddr;
+    pRead->iLen = iLen;
+    pRead->iGen = cache_generation(pIcdi);
+    pRead->iOrig = len;
+    memcpy(pRead->pOrig, pPayload, len);
+
+    n = sprintf((char *)pBuf, "x%x,%x", iStart, iWin);
+    probe_submit(pIcdi, pCli, pBuf, n, read_fill_done, pRead);
+    return 1;
+}
+
+//
+// A memory write split into several X packets.  GDB gets one answer once
+// the last of them is done: OK, or the first error the ICDI reported.
+//
+typedef struct _WRITEREQ
+{
+    unsigned int iPending;
+    unsigned int iErr;
+    unsigned char pErr[16];
+} WRITEREQ;
+
+static void
+write_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    WRITEREQ *pWrite = pReq->pCtx;
+
+    if ((pWrite->iErr == 0) && ((len != 2) || memcmp(pPayload, "OK", 2)))
+    {
+        pWrite->iErr = len < sizeof(pWrite->pErr) ? len : sizeof(pWrite->pErr);
+        memcpy(pWrite->pErr, pPayload, pWrite->iErr);
+        if (pWrite->iErr == 0)
+        {
+            //
+            // An empty reply means the ICDI didn't understand X at all
+            //
+            pWrite->iErr = 3;
+            memcpy(pWrite->pErr, "E01", 3);
+        }
+    }
+
+    if (--pWrite->iPending == 0)
+    {
+        if (pWrite->iErr)
+        {
+            gdb_reply(pReq->pCli, pWrite->pErr, pWrite->iErr);
+        }
+        else
+        {
+            gdb_reply(pReq->pCli, (const unsigned char *)"OK", 2);
+        }
+        free(pWrite);
+    }
+}
+
+//
+// Write iLen bytes of pData to iAddr with as few escaped binary X packets
+// as fit the ICDI's packet size
+//
+static void
+write_submit(ICDI *pIcdi, GDBCLIENT *pCli, unsigned int iAddr,
+        const unsigned char *pData, unsigned int iLen)
+{
+    unsigned char pBuf[MSGSIZE + 32];
+    unsigned int i, n;
+    WRITEREQ *pWrite;
+
+    pWrite = malloc(sizeof(WRITEREQ));
+    ASSERT(pWrite != NULL);
+    pWrite->iPending = 1;
+    pWrite->iErr = 0;
+
+    while (iLen)
+    {
+        n = gdb_build_write(pBuf, probe_packet_size(pIcdi), 0, iAddr, pData,
+                            iLen, &i);
+
+        pData += i;
+        iAddr += i;
+        iLen -= i;
+
+        //
+        // The last chunk completes the request
+        //
+        pWrite->iPending += (iLen != 0);
+        probe_submit(pIcdi, pCli, pBuf, n, write_done, pWrite);
+    }
+}
+
+//
+// A hex M write.  Turned into binary X packets, which take half the bytes
+// on the USB link.  Binary X writes larger than the ICDI takes are split
+// up the same way.  Returns 0 if the packet should simply be forwarded.
+//
+static int
+write_request(ICDI *pIcdi, GDBCLIENT *pCli, unsigned char *pPayload,
+        unsigned int len)
+{
+    unsigned int iAddr, iLen, i, n;
+
+    n = gdb_parse_range(pPayload + 1, len - 1, &iAddr, &iLen) + 1;
+    if ((n == 1) || (iLen == 0) || (n >= len) || (pPayload[n] != ':'))
+    {
+        return 0;
+    }
+
+    if (pPayload[0] == 'X')
+    {
+        if (len + 4 <= probe_packet_size(pIcdi))
+        {
+            return 0;
+        }
+
+        if (gdb_unescape(pPayload, pPayload + n + 1, len - n - 1) != iLen)
+        {
+            gdb_reply(pCli, (const unsigned char *)"E01", 3);
+        }
+        else
+        {
+            write_submit(pIcdi, pCli, iAddr, pPayload, iLen);
+        }
+        return 1;
+    }
+
+    if (len - n - 1 != 2 * iLen)
+    {
+        return 0;
+    }
+
+    //
+    // Decode the hex in place, the data is half as long as the text
+    //
+    for (i = 0; i < iLen; i++)
+    {
+        pPayload[i] = (hexchartoi(pPayload[n + 1 + 2 * i]) << 4) |
+                      hexchartoi(pPayload[n + 2 + 2 * i]);
+    }
+
+    write_submit(pIcdi, pCli, iAddr, pPayload, iLen);
+    return 1;
+}
+
+//
+// Pass the memory map on to the cache so it knows where flash is
+//
+static void
+memory_map_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    static const char pXfer[] = "$qXfer:memory-map:read::";
+    unsigned int iOffset, iLen;
+
+    if ((len >= 1) && ((pPayload[0] == 'm') || (pPayload[0] == 'l')) &&
+        gdb_parse_range(pReq->pPkt + sizeof(pXfer) - 1,
+                        pReq->iLen - sizeof(pXfer) + 1, &iOffset, &iLen))
+    {
+        cache_memory_map(pReq->pIcdi, iOffset, pPayload + 1, len - 1,
+                         pPayload[0] == 'l');
+    }
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+//
+// Drop anything cached that the packet in pPayload may change
+//
+static void
+cache_snoop(ICDI *pIcdi, unsigned char *pPayload, unsigned int len)
+{
+    unsigned int iAddr, iLen, i;
+
+    switch (pPayload[0])
+    {
+        case 'M':
+        case 'X':
+            if (gdb_parse_range(pPayload + 1, len - 1, &iAddr, &iLen))
+            {
+                cache_invalidate(pIcdi, iAddr, iLen);
+            }
+            break;
+
+        case 'v':
+            if (PKT_IS(pPayload, len, "vFlashErase:"))
+            {
+                if (gdb_parse_range(pPayload + 12, len - 12, &iAddr, &iLen))
+                {
+                    cache_invalidate(pIcdi, iAddr, iLen);
+                }
+            }
+            else if (PKT_IS(pPayload, len, "vFlashWrite:"))
+            {
+                i = 12 + gdb_parse_hex(pPayload + 12, len - 12, &iAddr) + 1;
+                for (iLen = 0; i < len; i++, iLen++)
+                {
+                    if (pPayload[i] == '}')
+                    {
+                        i++;
+                    }
+                }
+                cache_invalidate(pIcdi, iAddr, iLen);
+            }
+            break;
+
+        case 'R':
+        case 'r':
+        case 'k':
+            cache_flush(pIcdi);
+            break;
+
+        case 'q':
+            //
+            // Monitor commands can reset the part or mass erase it
+            //
+            if (PKT_IS(pPayload, len, "qRcmd,"))
+            {
+                cache_flush(pIcdi);
+            }
+            break;
+    }
+}
+
+//*****************************************************************************
+//
+//! Handle a complete packet (or Ctrl-C / NAK) from the GDB client.
+//
+//*****************************************************************************
+void
+bridge_client_packet(GDBCLIENT *pCli, GDBCTX *pGdbCtx, int bCsumValid)
+{
+    ICDI *pIcdi = pCli->pIcdi;
+    BRIDGE *pBridge = pIcdi->pBridge;
+    unsigned char *pPayload;
+    unsigned int len;
+
+    if (pGdbCtx->iRd == 1)
+    {
+        if (pGdbCtx->pPkt[0] == '+')
+        {
+            return;
+        }
+
+        if (pGdbCtx->pPkt[0] == 0x03)
+        {
+            //
+            // Ctrl-C goes out straight away, the request it interrupts is
+            // still at the head of the queue waiting for its stop reply.
+            //
+            cond_interrupt(pIcdi);
+            step_interrupt(pIcdi);
+            usbTxReq(pIcdi, pCtrlC, sizeof(pCtrlC));
+        }
+        else if (!pCli->bNoAck && pCli->iLast)
+        {
+            client_write(pCli, pCli->pLast, pCli->iLast);
+        }
+        return;
+    }
+
+    if (!bCsumValid)
+    {
+        TRACE(ALWAYS, "%s: bad checksum from client\n", __FUNCTION__);
+        if (!pCli->bNoAck)
+        {
+            client_write(pCli, (const unsigned char *)"-", 1);
+        }
+        else
+        {
+            //
+            // Without acks nothing is sent again, so GDB would wait for
+            // an answer forever
+            //
+            gdb_reply(pCli, (const unsigned char *)"E01", 3);
+        }
+        return;
+    }
+
+    if (!pCli->bNoAck)
+    {
+        client_write(pCli, (const unsigned char *)"+", 1);
+    }
+
+    pPayload = pGdbCtx->pPkt + 1;
+    len = pGdbCtx->iRd - 4;
+    metrics_packet(pIcdi, pPayload, len);
+    if (len == 0)
+    {
+        probe_submit(pIcdi, pCli, pPayload, len, forward_done, NULL);
+        return;
+    }
+
+    len = step_vcont(pPayload, len);
+    if (farm_request(pCli, pPayload, len) ||
+        elf_request(pCli, pPayload, len) ||
+        profile_request(pCli, pPayload, len) ||
+        rtt_request(pCli, pPayload, len) ||
+        watch_request(pCli, pPayload, len) ||
+        cond_request(pCli, pPayload, len) ||
+        step_request(pCli, pPayload, len))
+    {
+        return;
+    }
+
+    cache_snoop(pIcdi, pPayload, len);
+
+    if (flash_request(pIcdi, pCli, pPayload, len))
+    {
+        return;
+    }
+
+    if (PKT_IS(pPayload, len, "QStartNoAckMode"))
+    {
+        if (pBridge->bUsbNoAckOk && !pBridge->bUsbNoAck)
+        {
+            probe_submit(pIcdi, pCli, pPayload, len, noack_done, NULL);
+        }
+        else
+        {
+            noack_reply(pCli);
+        }
+    }
+    else if (PKT_IS(pPayload, len, "vStopped"))
+    {
+        //
+        // The acknowledgement of a Stop notification, and we never have
+        // more than one to report
+        //
+        gdb_reply(pCli, (const unsigned char *)"OK", 2);
+    }
+    else if (PKT_IS(pPayload, len, "qSupported"))
+    {
+        probe_submit(pIcdi, pCli, pPayload, len, qsupported_done, NULL);
+    }
+    else if (PKT_IS(pPayload, len, "qXfer:memory-map:read::"))
+    {
+        probe_submit(pIcdi, pCli, pPayload, len, memory_map_done, NULL);
+    }
+    else if (((pPayload[0] == 'm') || (pPayload[0] == 'x')) &&
+             read_request(pIcdi, pCli, pPayload, len))
+    {
+        return;
+    }
+    else if (((pPayload[0] == 'M') || (pPayload[0] == 'X')) &&
+             write_request(pIcdi, pCli, pPayload, len))
+    {
+        return;
+    }
+    else if (((len == 1) && (pPayload[0] == 'k')) || (pPayload[0] == 'R'))
+    {
+        //
+        // The program is gone, and with it whatever the session had going:
+        // a range step or conditional continue, half programmed flash and
+        // the cached state of the core.  There is no answer to pass on.
+        //
+        step_client_closed(pCli);
+        cond_client_closed(pCli);
+        flash_client_closed(pIcdi);
+        regcache_set_halted(pIcdi, 0);
+        pBridge->iNextRead = 0;
+        probe_submit(pIcdi, pCli, pPayload, len, NULL, NULL);
+    }
+    else if (regcache_request(pIcdi, pCli, pPayload, len))
+    {
+        return;
+    }
+    else
+    {
+        probe_submit(pIcdi, pCli, pPayload, len, forward_done, NULL);
+    }
+}
+
+//*****************************************************************************
+//
+//! Handle a complete packet, ack or NAK from the ICDI.
+//
+//*****************************************************************************
+void
+bridge_usb_packet(GDBCTX *pGdbCtx, int bCsumValid)
+{
+    ICDI *pIcdi = pGdbCtx->pOwner;
+    PROBEREQ *pReq;
+
+    if (pGdbCtx->iRd == 1)
+    {
+        pReq = probe_unacked(pIcdi->pBridge);
+        if (pReq == NULL)
+        {
+            return;
+        }
+
+        if (pGdbCtx->pPkt[0] == '+')
+        {
+            pReq->bAcked = 1;
+            if (pReq->bNoReply)
+            {
+                probe_complete(pReq, NULL, 0);
+            }
+        }
+        else
+        {
+            TRACE(ALWAYS, "%s: NAK from ICDI, retrying\n", __FUNCTION__);
+            metrics_add(pIcdi, METRIC_USB_RETRIES, 1);
+            probe_resend(pReq);
+        }
+        return;
+    }
+
+    pReq = pIcdi->pBridge->pProbeHead;
+    if ((pReq == NULL) || !pReq->bSent)
+    {
+        TRACE(ALWAYS, "%s: unsolicited response dropped\n", __FUNCTION__);
+        return;
+    }
+
+    if (!bCsumValid)
+    {
+        TRACE(ALWAYS, "%s: bad checksum from ICDI, retrying\n", __FUNCTION__);
+        metrics_add(pIcdi, METRIC_USB_RETRIES, 1);
+        probe_resend(pReq);
+        return;
+    }
+
+    TRACE(1, "%s: '%.*s'\n", __FUNCTION__, (int)pGdbCtx->iRd, pGdbCtx->pPkt);
+
+    probe_complete(pReq, pGdbCtx->pPkt + 1, pGdbCtx->iRd - 4);
+}
+
+//*****************************************************************************
+//
+//! A client disconnected.  Requests it still has queued are completed
+//! without anyone to answer to.
+//
+//*****************************************************************************
+void
+bridge_client_closed(GDBCLIENT *pCli)
+{
+    ICDI *pIcdi = pCli->pIcdi;
+    PROBEREQ *pReq;
+
+    for (pReq = pIcdi->pBridge->pProbeHead; pReq; pReq = pReq->pNext)
+    {
+        if (pReq->pCli == pCli)
+        {
+            pReq->pCli = NULL;
+        }
+    }
+    cond_client_closed(pCli);
+    step_client_closed(pCli);
+
+    if (pIcdi->iClients)
+    {
+        return;
+    }
+
+    //
+    // That was the last one.  The next session may well come with freshly
+    // programmed flash, and GDB may have left the core running
+    //
+    cache_flush(pIcdi);
+    regcache_set_halted(pIcdi, 0);
+    flash_client_closed(pIcdi);
+}
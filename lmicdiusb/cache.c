@@ -0,0 +1,481 @@
+//*****************************************************************************
+//
+// cache.c - read caches for target memory.
+//
+// GDB reads the same flash over and over for disassembly, unwinding and
+// constant data.  Flash only changes when somebody programs it through us,
+// so whole lines of it are kept here and reads that hit are answered
+// without going to the ICDI.
+//
+// RAM is only stable while the core is halted.  When GDB walks through it
+// with small sequential reads a larger window is read ahead and kept until
+// the core runs again or memory is written.
+//
+// Which ranges are flash or RAM is learned from the memory map GDB fetches
+// from the ICDI when it connects.  Nothing outside those ranges is ever
+// read ahead, since reading peripherals can have side effects.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+//
+// Direct mapped, CACHE_LINES lines of CACHE_LINE bytes each
+//
+#define CACHE_LINES             256
+#define CACHE_LINE_MASK         (CACHE_LINE - 1)
+
+#define MAX_REGIONS             8
+#define MAX_MEMORY_MAP          4096
+
+typedef struct _CACHELINE
+{
+    unsigned int iAddr;
+    int bValid;
+    unsigned char pData[CACHE_LINE];
+} CACHELINE;
+
+typedef struct _MEMREGION
+{
+    int bFlash;
+    unsigned int iStart;
+    unsigned int iLen;
+} MEMREGION;
+
+//
+// The read-ahead window over RAM
+//
+typedef struct _WINDOW
+{
+    int bValid;
+    unsigned int iAddr;
+    unsigned int iLen;
+    unsigned char pData[PREFETCH_WINDOW];
+} WINDOW;
+
+//
+// What we cache for one ICDI
+//
+struct _CACHE
+{
+    CACHELINE pLines[CACHE_LINES];
+    WINDOW window;
+
+    MEMREGION pRegions[MAX_REGIONS];
+    unsigned int iRegions;
+
+    char pMap[MAX_MEMORY_MAP + 1];
+    unsigned int iMap;
+
+    //
+    // Bumped on every invalidation so fills that were already on their
+    // way can tell their data may be stale
+    //
+    unsigned int iGeneration;
+};
+
+static CACHELINE *
+cache_line(CACHE *pCache, unsigned int iAddr)
+{
+    return &pCache->pLines[(iAddr / CACHE_LINE) % CACHE_LINES];
+}
+
+//
+// Find attribute pName in the XML element starting at pElem (and ending at
+// pEnd) and return its value, which ends at the next quote.  NULL if the
+// element doesn't have it.
+//
+static const char *
+xml_attr(const char *pElem, const char *pEnd, const char *pName)
+{
+    const char *p = pElem;
+    size_t n = strlen(pName);
+
+    while ((p = strstr(p + 1, pName)) && (p < pEnd))
+    {
+        if (((p[-1] == ' ') || (p[-1] == '\t') || (p[-1] == '\n')) &&
+            (p[n] == '=') && ((p[n + 1] == '"') || (p[n + 1] == '\'')))
+        {
+            return p + n + 2;
+        }
+    }
+    return NULL;
+}
+
+//
+// Pick the flash and RAM regions out of the memory map in pMap
+//
+static void
+cache_parse_map(CACHE *pCache)
+{
+    const char *pElem, *pEnd, *pType, *pStart, *pLen;
+    MEMREGION *pRegion;
+
+    pCache->iRegions = 0;
+    for (pElem = strstr(pCache->pMap, "<memory "); pElem;
+         pElem = strstr(pEnd, "<memory "))
+    {
+        pEnd = strchr(pElem, '>');
+        if (pEnd == NULL)
+        {
+            break;
+        }
+
+        pType = xml_attr(pElem, pEnd, "type");
+        pStart = xml_attr(pElem, pEnd, "start");
+        pLen = xml_attr(pElem, pEnd, "length");
+        if ((pType == NULL) || (pStart == NULL) || (pLen == NULL) ||
+            ((strncmp(pType, "flash", 5) != 0) &&
+             (strncmp(pType, "ram", 3) != 0)))
+        {
+            continue;
+        }
+
+        if (pCache->iRegions == MAX_REGIONS)
+        {
+            TRACE(ALWAYS, "%s: too many memory regions\n", __FUNCTION__);
+            break;
+        }
+
+        pRegion = &pCache->pRegions[pCache->iRegions];
+        pRegion->bFlash = (pType[0] == 'f');
+        pRegion->iStart = strtoul(pStart, NULL, 0);
+        pRegion->iLen = strtoul(pLen, NULL, 0);
+        if (pRegion->iLen)
+        {
+            TRACE(1, "%s: %s at 0x%08x, 0x%x bytes\n", __FUNCTION__,
+                  pRegion->bFlash ? "flash" : "ram", pRegion->iStart,
+                  pRegion->iLen);
+            pCache->iRegions++;
+        }
+    }
+}
+
+//*****************************************************************************
+//
+//! Set up the caches of pIcdi, empty until the memory map comes in.
+//
+//*****************************************************************************
+void
+cache_init(ICDI *pIcdi)
+{
+    pIcdi->pCache = calloc(1, sizeof(CACHE));
+    ASSERT(pIcdi->pCache != NULL);
+}
+
+//*****************************************************************************
+//
+//! Collect a piece of the memory map as returned for
+//! qXfer:memory-map:read::iOffset,... The regions are picked out of it
+//! once the last piece (bLast) has arrived.
+//
+//*****************************************************************************
+void
+cache_memory_map(ICDI *pIcdi, unsigned int iOffset,
+        const unsigned char *pData, unsigned int len, int bLast)
+{
+    CACHE *pCache = pIcdi->pCache;
+
+    if ((iOffset != pCache->iMap) || (iOffset + len > MAX_MEMORY_MAP))
+    {
+        //
+        // Either GDB started over or we missed a piece
+        //
+        pCache->iMap = 0;
+        if ((iOffset != 0) || (len > MAX_MEMORY_MAP))
+        {
+            return;
+        }
+    }
+
+    memcpy(pCache->pMap + pCache->iMap, pData, len);
+    pCache->iMap += len;
+    pCache->pMap[pCache->iMap] = 0;
+
+    if (bLast)
+    {
+        cache_parse_map(pCache);
+        cache_flush(pIcdi);
+        pCache->iMap = 0;
+    }
+}
+
+//*****************************************************************************
+//
+//! Return non-zero if the lines covering len bytes at iAddr all lie within
+//! a single flash region and so may be cached.
+//
+//*****************************************************************************
+int
+cache_is_flash(ICDI *pIcdi, unsigned int iAddr, unsigned int len)
+{
+    CACHE *pCache = pIcdi->pCache;
+    MEMREGION *pRegion;
+    unsigned int i, iStart, iEnd;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    iStart = iAddr & ~CACHE_LINE_MASK;
+    iEnd = (iAddr + len + CACHE_LINE_MASK) & ~CACHE_LINE_MASK;
+    if (iEnd <= iStart)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < pCache->iRegions; i++)
+    {
+        pRegion = &pCache->pRegions[i];
+        if (pRegion->bFlash && (iStart >= pRegion->iStart) &&
+            (iEnd - pRegion->iStart <= pRegion->iLen))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Work out the window to read ahead for a read of len bytes at iAddr.  The
+//! window starts at iAddr rounded down to a cache line, is PREFETCH_WINDOW
+//! bytes long and is cut off at the end of the RAM region.
+//!
+//! \return 1 with the window in *piStart and *piLen if the read lies in RAM
+//! and fits in the window, 0 otherwise.
+//
+//*****************************************************************************
+int
+cache_window_for(ICDI *pIcdi, unsigned int iAddr, unsigned int len,
+        unsigned int *piStart, unsigned int *piLen)
+{
+    CACHE *pCache = pIcdi->pCache;
+    MEMREGION *pRegion;
+    unsigned int i, iEnd;
+
+    for (i = 0; i < pCache->iRegions; i++)
+    {
+        pRegion = &pCache->pRegions[i];
+        if (pRegion->bFlash || (iAddr < pRegion->iStart) ||
+            (iAddr - pRegion->iStart >= pRegion->iLen) ||
+            (len > pRegion->iLen - (iAddr - pRegion->iStart)))
+        {
+            continue;
+        }
+
+        *piStart = iAddr & ~CACHE_LINE_MASK;
+        if (*piStart < pRegion->iStart)
+        {
+            *piStart = pRegion->iStart;
+        }
+
+        iEnd = pRegion->iStart + pRegion->iLen;
+        *piLen = iEnd - *piStart;
+        if (*piLen > PREFETCH_WINDOW)
+        {
+            *piLen = PREFETCH_WINDOW;
+        }
+        return (iAddr + len - *piStart) <= *piLen;
+    }
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Store the read-ahead window read from iAddr by a read issued at
+//! generation iGen.
+//
+//*****************************************************************************
+void
+cache_window_fill(ICDI *pIcdi, unsigned int iGen, unsigned int iAddr,
+        const unsigned char *pData, unsigned int len)
+{
+    CACHE *pCache = pIcdi->pCache;
+
+    if ((iGen != pCache->iGeneration) || (len > PREFETCH_WINDOW))
+    {
+        return;
+    }
+
+    memcpy(pCache->window.pData, pData, len);
+    pCache->window.iAddr = iAddr;
+    pCache->window.iLen = len;
+    pCache->window.bValid = 1;
+}
+
+//*****************************************************************************
+//
+//! Drop the read-ahead window, the core is about to run.
+//
+//*****************************************************************************
+void
+cache_window_drop(ICDI *pIcdi)
+{
+    pIcdi->pCache->iGeneration++;
+    pIcdi->pCache->window.bValid = 0;
+}
+
+//*****************************************************************************
+//
+//! Copy len bytes at iAddr from the cache to pOut.
+//!
+//! \return 1 if every byte was cached, 0 otherwise.
+//
+//*****************************************************************************
+int
+cache_read(ICDI *pIcdi, unsigned int iAddr, unsigned int len,
+        unsigned char *pOut)
+{
+    CACHE *pCache = pIcdi->pCache;
+    WINDOW *pWin = &pCache->window;
+    CACHELINE *pLine;
+    unsigned int iOff, n;
+
+    if (pWin->bValid && (iAddr >= pWin->iAddr) &&
+        (iAddr - pWin->iAddr < pWin->iLen) &&
+        (len <= pWin->iLen - (iAddr - pWin->iAddr)))
+    {
+        memcpy(pOut, pWin->pData + (iAddr - pWin->iAddr), len);
+        return 1;
+    }
+
+    while (len)
+    {
+        pLine = cache_line(pCache, iAddr);
+        if (!pLine->bValid || (pLine->iAddr != (iAddr & ~CACHE_LINE_MASK)))
+        {
+            return 0;
+        }
+
+        iOff = iAddr & CACHE_LINE_MASK;
+        n = CACHE_LINE - iOff;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(pOut, pLine->pData + iOff, n);
+        pOut += n;
+        iAddr += n;
+        len -= n;
+    }
+    return 1;
+}
+
+//*****************************************************************************
+//
+//! Store len bytes read from iAddr by a read issued at generation iGen.
+//! Only complete lines are kept.
+//
+//*****************************************************************************
+void
+cache_fill(ICDI *pIcdi, unsigned int iGen, unsigned int iAddr,
+        const unsigned char *pData, unsigned int len)
+{
+    CACHE *pCache = pIcdi->pCache;
+    CACHELINE *pLine;
+    unsigned int iSkip;
+
+    if (iGen != pCache->iGeneration)
+    {
+        return;
+    }
+
+    iSkip = (CACHE_LINE - (iAddr & CACHE_LINE_MASK)) & CACHE_LINE_MASK;
+    if (iSkip >= len)
+    {
+        return;
+    }
+    iAddr += iSkip;
+    pData += iSkip;
+    len -= iSkip;
+
+    for (; len >= CACHE_LINE; iAddr += CACHE_LINE, pData += CACHE_LINE,
+         len -= CACHE_LINE)
+    {
+        pLine = cache_line(pCache, iAddr);
+        pLine->iAddr = iAddr;
+        pLine->bValid = 1;
+        memcpy(pLine->pData, pData, CACHE_LINE);
+    }
+}
+
+//*****************************************************************************
+//
+//! Drop whatever we hold of the len bytes at iAddr.
+//
+//*****************************************************************************
+void
+cache_invalidate(ICDI *pIcdi, unsigned int iAddr, unsigned int len)
+{
+    CACHE *pCache = pIcdi->pCache;
+    WINDOW *pWin = &pCache->window;
+    CACHELINE *pLine;
+    unsigned int iLine, n;
+
+    if (len == 0)
+    {
+        return;
+    }
+    pCache->iGeneration++;
+
+    if (pWin->bValid && (iAddr < pWin->iAddr + pWin->iLen) &&
+        (iAddr + len > pWin->iAddr))
+    {
+        pWin->bValid = 0;
+    }
+
+    //
+    // Large ranges are quicker to throw away wholesale
+    //
+    if (len >= CACHE_LINES * CACHE_LINE)
+    {
+        cache_flush(pIcdi);
+        return;
+    }
+
+    n = (iAddr + len - 1) / CACHE_LINE - iAddr / CACHE_LINE + 1;
+    for (iLine = iAddr & ~CACHE_LINE_MASK; n--; iLine += CACHE_LINE)
+    {
+        pLine = cache_line(pCache, iLine);
+        if (pLine->iAddr == iLine)
+        {
+            pLine->bValid = 0;
+        }
+    }
+}
+
+//*****************************************************************************
+//
+//! Forget everything cached.
+//
+//*****************************************************************************
+void
+cache_flush(ICDI *pIcdi)
+{
+    CACHE *pCache = pIcdi->pCache;
+    unsigned int i;
+
+    pCache->iGeneration++;
+    pCache->window.bValid = 0;
+    for (i = 0; i < CACHE_LINES; i++)
+    {
+        pCache->pLines[i].bValid = 0;
+    }
+}
+
+//*****************************************************************************
+//
+//! Return the current generation of the cache.  A fill is only stored if
+//! nothing was invalidated since the read for it was issued.
+//
+//*****************************************************************************
+unsigned int
+cache_generation(ICDI *pIcdi)
+{
+    return pIcdi->pCache->iGeneration;
+}
@@ -0,0 +1,1129 @@
+//*****************************************************************************
+//
+// cond.c - conditional breakpoints evaluated in the bridge.
+//
+// Conditions come from GDB as agent expressions in its Z0 and Z1 packets
+// (we advertise ConditionalBreakpoints+), or from "monitor cond" as a
+// register or variable compared with a constant, and a hit count.  While
+// a breakpoint with a condition is inserted, GDB's continue goes out as
+// our own.  When the core stops on such a breakpoint, the registers and
+// memory the condition uses are read from here and the condition is
+// evaluated.  If it fails, we step off the breakpoint and continue again
+// without GDB knowing.  GDB only gets the stop reply once the condition
+// holds, the core stops for another reason, or GDB interrupts.
+//
+// The monitor conditions are compiled to agent expressions, so both kinds
+// go through the same interpreter.  An expression that uses something we
+// don't evaluate counts as true, leaving the decision to GDB.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+#define COND_BPS                32
+#define COND_EXPRS              4           // GDB conditions per breakpoint
+#define COND_EXPR_LEN           128
+#define COND_VALS               16          // values read for a stop
+#define COND_STACK              32
+#define COND_STEPS              1000        // bytecodes run per evaluation
+#define COND_TEXT               96
+
+#define REG_PC                  15
+
+//
+// The agent expression bytecodes we evaluate
+//
+#define AX_ADD                  0x02
+#define AX_SUB                  0x03
+#define AX_MUL                  0x04
+#define AX_DIV_SIGNED           0x05
+#define AX_DIV_UNSIGNED         0x06
+#define AX_REM_SIGNED           0x07
+#define AX_REM_UNSIGNED         0x08
+#define AX_LSH                  0x09
+#define AX_RSH_SIGNED           0x0a
+#define AX_RSH_UNSIGNED         0x0b
+#define AX_LOG_NOT              0x0e
+#define AX_BIT_AND              0x0f
+#define AX_BIT_OR               0x10
+#define AX_BIT_XOR              0x11
+#define AX_BIT_NOT              0x12
+#define AX_EQUAL                0x13
+#define AX_LESS_SIGNED          0x14
+#define AX_LESS_UNSIGNED        0x15
+#define AX_EXT                  0x16
+#define AX_REF8                 0x17
+#define AX_REF16                0x18
+#define AX_REF32                0x19
+#define AX_REF64                0x1a
+#define AX_IF_GOTO              0x20
+#define AX_GOTO                 0x21
+#define AX_CONST8               0x22
+#define AX_CONST16              0x23
+#define AX_CONST32              0x24
+#define AX_CONST64              0x25
+#define AX_REG                  0x26
+#define AX_END                  0x27
+#define AX_DUP                  0x28
+#define AX_POP                  0x29
+#define AX_ZERO_EXT             0x2a
+#define AX_SWAP                 0x2b
+#define AX_PICK                 0x32
+#define AX_ROT                  0x33
+
+//
+// What an evaluation came to, when it isn't false (0) or true (1)
+//
+#define COND_ERROR              -1          // can't say, so let GDB decide
+#define COND_NEED               -2          // waiting for a value
+
+//
+// A breakpoint GDB inserted, with the conditions GDB gave it and the one
+// set with "monitor cond" at its address.  Monitor conditions outlive the
+// breakpoint, as GDB removes and inserts its breakpoints at every stop.
+//
+typedef struct _CONDBP
+{
+    unsigned int iAddr;
+    unsigned int iKind;
+    unsigned char cType;
+    int bInserted;
+
+    unsigned int iGdbExprs;
+    unsigned int pGdbLen[COND_EXPRS];
+    unsigned char pGdbExpr[COND_EXPRS][COND_EXPR_LEN];
+
+    unsigned int iExpr;
+    unsigned char pExpr[COND_EXPR_LEN];
+    char pText[COND_TEXT];
+    unsigned int iCount;
+
+    unsigned int iHits;
+    unsigned int iEvals;
+} CONDBP;
+
+//
+// A register (bReg) or memory value read for the stop being judged
+//
+typedef struct _CONDVAL
+{
+    int bReg;
+    int bValid;
+    unsigned int iAddr;
+    unsigned int iSize;
+    unsigned long long iVal;
+} CONDVAL;
+
+struct _COND
+{
+    CONDBP pBps[COND_BPS];
+    unsigned int iBps;
+
+    //
+    // The continue we run for pCli, and the stop being judged
+    //
+    int bActive;
+    int bInterrupt;
+    GDBCLIENT *pCli;
+    unsigned int iResume;
+    unsigned char pResume[32];
+    unsigned int iStop;
+    unsigned char pStop[MSGSIZE];
+    CONDBP *pBp;
+
+    CONDVAL pVals[COND_VALS];
+    unsigned int iVals;
+
+    unsigned int iJudged;
+    unsigned int iResumed;
+};
+
+static void cond_judge(ICDI *pIcdi);
+
+//
+// The breakpoint at iAddr, NULL if there's none
+//
+static CONDBP *
+cond_find(COND *pCond, unsigned int iAddr)
+{
+    unsigned int i;
+
+    for (i = 0; i < pCond->iBps; i++)
+    {
+        if (pCond->pBps[i].iAddr == iAddr)
+        {
+            return &pCond->pBps[i];
+        }
+    }
+    return NULL;
+}
+
+//
+// The breakpoint at iAddr, made up if there's none.  NULL if there's no
+// room for it.
+//
+static CONDBP *
+cond_get(COND *pCond, unsigned int iAddr)
+{
+    CONDBP *pBp = cond_find(pCond, iAddr);
+
+    if ((pBp == NULL) && (pCond->iBps < COND_BPS))
+    {
+        pBp = &pCond->pBps[pCond->iBps++];
+        memset(pBp, 0, sizeof(CONDBP));
+        pBp->iAddr = iAddr;
+    }
+    return pBp;
+}
+
+//
+// Forget pBp once nothing is left of it.  The last breakpoint moves into
+// its slot, so the one being judged is followed there.
+//
+static void
+cond_tidy(COND *pCond, CONDBP *pBp)
+{
+    CONDBP *pLast = &pCond->pBps[pCond->iBps - 1];
+
+    if (!pBp->bInserted && (pBp->iExpr == 0) && (pBp->iCount == 0) &&
+        !(pCond->bActive && (pCond->pBp == pBp)))
+    {
+        *pBp = *pLast;
+        pCond->iBps--;
+        if (pCond->pBp == pLast)
+        {
+            pCond->pBp = pBp;
+        }
+    }
+}
+
+//
+// Does a continue need to go through us?
+//
+static int
+cond_armed(COND *pCond)
+{
+    unsigned int i;
+
+    for (i = 0; i < pCond->iBps; i++)
+    {
+        if (pCond->pBps[i].bInserted &&
+            (pCond->pBps[i].iGdbExprs || pCond->pBps[i].iExpr ||
+             pCond->pBps[i].iCount))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned long long
+ax_arg(const unsigned char *pExpr, unsigned int n)
+{
+    unsigned long long iVal = 0;
+
+    while (n--)
+    {
+        iVal = (iVal << 8) | *pExpr++;
+    }
+    return iVal;
+}
+
+static long long
+ax_ext(unsigned long long iVal, unsigned int iBits)
+{
+    if ((iBits == 0) || (iBits >= 64))
+    {
+        return iVal;
+    }
+    iVal &= (1ULL << iBits) - 1;
+    if (iVal & (1ULL << (iBits - 1)))
+    {
+        iVal |= ~((1ULL << iBits) - 1);
+    }
+    return iVal;
+}
+
+//
+// The value of a register (bReg) or of memory, read for this stop.  If we
+// don't have it yet, ask the ICDI for it.
+//
+static int
+cond_value(ICDI *pIcdi, int bReg, unsigned int iAddr, unsigned int iSize,
+        unsigned long long *piVal);
+
+//
+// Run the agent expression pExpr.  Returns whether it is true, or
+// COND_NEED if it is waiting for a value, or COND_ERROR.
+//
+static int
+cond_eval(ICDI *pIcdi, const unsigned char *pExpr, unsigned int iLen)
+{
+    unsigned long long pStack[COND_STACK], a, b;
+    unsigned int i = 0, n = 0, iSteps = 0, iArg;
+    unsigned char op;
+    int r;
+
+#define NEED(k)     if (n < (k)) return COND_ERROR
+#define ROOM()      if (n >= COND_STACK) return COND_ERROR
+#define ARG(k)      if (i + (k) > iLen) return COND_ERROR; \
+                    iArg = ax_arg(pExpr + i, (k))
+
+    while ((i < iLen) && (iSteps++ < COND_STEPS))
+    {
+        op = pExpr[i++];
+        switch (op)
+        {
+            case AX_ADD: case AX_SUB: case AX_MUL: case AX_LSH:
+            case AX_RSH_SIGNED: case AX_RSH_UNSIGNED: case AX_BIT_AND:
+            case AX_BIT_OR: case AX_BIT_XOR: case AX_EQUAL:
+            case AX_LESS_SIGNED: case AX_LESS_UNSIGNED: case AX_DIV_SIGNED:
+            case AX_DIV_UNSIGNED: case AX_REM_SIGNED: case AX_REM_UNSIGNED:
+                NEED(2);
+                b = pStack[--n];
+                a = pStack[n - 1];
+                if ((op >= AX_DIV_SIGNED) && (op <= AX_REM_UNSIGNED) &&
+                    (b == 0))
+                {
+                    return COND_ERROR;
+                }
+                if (((op == AX_DIV_SIGNED) || (op == AX_REM_SIGNED)) &&
+                    (b == (unsigned long long)-1) && (a == 1ULL << 63))
+                {
+                    return COND_ERROR;  // traps on the host
+                }
+                switch (op)
+                {
+                    case AX_ADD: a += b; break;
+                    case AX_SUB: a -= b; break;
+                    case AX_MUL: a *= b; break;
+                    case AX_DIV_SIGNED: a = (long long)a / (long long)b; break;
+                    case AX_DIV_UNSIGNED: a /= b; break;
+                    case AX_REM_SIGNED: a = (long long)a % (long long)b; break;
+                    case AX_REM_UNSIGNED: a %= b; break;
+                    case AX_LSH: a = (b < 64) ? a << b : 0; break;
+                    case AX_RSH_SIGNED:
+                        a = (long long)a >> ((b < 64) ? b : 63);
+                        break;
+                    case AX_RSH_UNSIGNED: a = (b < 64) ? a >> b : 0; break;
+                    case AX_BIT_AND: a &= b; break;
+                    case AX_BIT_OR: a |= b; break;
+                    case AX_BIT_XOR: a ^= b; break;
+                    case AX_EQUAL: a = (a == b); break;
+                    case AX_LESS_SIGNED: a = ((long long)a < (long long)b); break;
+                    case AX_LESS_UNSIGNED: a = (a < b); break;
+                }
+                pStack[n - 1] = a;
+                break;
+
+            case AX_LOG_NOT:
+                NEED(1);
+                pStack[n - 1] = !pStack[n - 1];
+                break;
+
+            case AX_BIT_NOT:
+                NEED(1);
+                pStack[n - 1] = ~pStack[n - 1];
+                break;
+
+            case AX_EXT:
+            case AX_ZERO_EXT:
+                NEED(1);
+                ARG(1);
+                i++;
+                if (op == AX_EXT)
+                {
+                    pStack[n - 1] = ax_ext(pStack[n - 1], iArg);
+                }
+                else if (iArg < 64)
+                {
+                    pStack[n - 1] &= (1ULL << iArg) - 1;
+                }
+                break;
+
+            case AX_REF8:
+            case AX_REF16:
+            case AX_REF32:
+            case AX_REF64:
+                NEED(1);
+                r = cond_value(pIcdi, 0, pStack[n - 1], 1 << (op - AX_REF8),
+                               &pStack[n - 1]);
+                if (r != 1)
+                {
+                    return r;
+                }
+                break;
+
+            case AX_IF_GOTO:
+            case AX_GOTO:
+                ARG(2);
+                i += 2;
+                if (op == AX_IF_GOTO)
+                {
+                    NEED(1);
+                    if (pStack[--n] == 0)
+                    {
+                        break;
+                    }
+                }
+                i = iArg;
+                break;
+
+            case AX_CONST8:
+            case AX_CONST16:
+            case AX_CONST32:
+            case AX_CONST64:
+                ROOM();
+                iArg = 1 << (op - AX_CONST8);
+                if (i + iArg > iLen)
+                {
+                    return COND_ERROR;
+                }
+                pStack[n++] = ax_arg(pExpr + i, iArg);
+                i += iArg;
+                break;
+
+            case AX_REG:
+                ROOM();
+                ARG(2);
+                i += 2;
+                r = cond_value(pIcdi, 1, iArg, 4, &pStack[n]);
+                if (r != 1)
+                {
+                    return r;
+                }
+                n++;
+                break;
+
+            case AX_END:
+                NEED(1);
+                return pStack[n - 1] != 0;
+
+            case AX_DUP:
+                NEED(1);
+                ROOM();
+                pStack[n] = pStack[n - 1];
+                n++;
+                break;
+
+            case AX_POP:
+                NEED(1);
+                n--;
+                break;
+
+            case AX_SWAP:
+                NEED(2);
+                a = pStack[n - 1];
+                pStack[n - 1] = pStack[n - 2];
+                pStack[n - 2] = a;
+                break;
+
+            case AX_PICK:
+                ARG(1);
+                i++;
+                NEED(iArg + 1);
+                ROOM();
+                pStack[n] = pStack[n - 1 - iArg];
+                n++;
+                break;
+
+            case AX_ROT:
+                NEED(3);
+                a = pStack[n - 3];
+                pStack[n - 3] = pStack[n - 2];
+                pStack[n - 2] = pStack[n - 1];
+                pStack[n - 1] = a;
+                break;
+
+            default:
+                TRACE(1, "%s: bytecode 0x%02x not evaluated\n", __FUNCTION__, op);
+                return COND_ERROR;
+        }
+    }
+
+#undef NEED
+#undef ROOM
+#undef ARG
+
+    return COND_ERROR;
+}
+
+//
+// A value asked for by cond_value() came in.  Judge the stop again, now
+// with the value.
+//
+static void
+cond_value_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+    COND *pCond = pIcdi->pCond;
+    CONDVAL *pVal = &pCond->pVals[pCond->iVals - 1];
+    unsigned char pData[8];
+    unsigned int i, n = 0;
+
+    if (pVal->bReg)
+    {
+        if ((len <= 16) && (len % 2 == 0) && (len > 0) &&
+            isxdigit(pPayload[0]))
+        {
+            n = gdb_hex_decode(pData, pPayload, len);
+        }
+    }
+    else if ((len >= 3) && (memcmp(pPayload, "OK:", 3) == 0))
+    {
+        n = gdb_unescape(pPayload, pPayload + 3, len - 3);
+        memcpy(pData, pPayload, (n <= 8) ? n : 0);
+        n = (n == pVal->iSize) ? n : 0;
+    }
+
+    pVal->iVal = 0;
+    for (i = n; i > 0; i--)
+    {
+        pVal->iVal = (pVal->iVal << 8) | pData[i - 1];
+    }
+    pVal->bValid = (n > 0);
+
+    cond_judge(pIcdi);
+}
+
+static int
+cond_value(ICDI *pIcdi, int bReg, unsigned int iAddr, unsigned int iSize,
+        unsigned long long *piVal)
+{
+    COND *pCond = pIcdi->pCond;
+    unsigned char pBuf[32];
+    CONDVAL *pVal;
+    unsigned int i, n;
+
+    for (i = 0; i < pCond->iVals; i++)
+    {
+        pVal = &pCond->pVals[i];
+        if ((pVal->bReg == bReg) && (pVal->iAddr == iAddr) &&
+            (pVal->iSize == iSize))
+        {
+            *piVal = pVal->iVal;
+            return pVal->bValid ? 1 : COND_ERROR;
+        }
+    }
+
+    if (pCond->iVals == COND_VALS)
+    {
+        return COND_ERROR;
+    }
+
+    pVal = &pCond->pVals[pCond->iVals++];
+    pVal->bReg = bReg;
+    pVal->iAddr = iAddr;
+    pVal->iSize = iSize;
+    pVal->bValid = 0;
+
+    if (bReg)
+    {
+        n = sprintf((char *)pBuf, "p%x", iAddr);
+    }
+    else
+    {
+        n = sprintf((char *)pBuf, "x%x,%x", iAddr, iSize);
+    }
+    probe_submit(pIcdi, NULL, pBuf, n, cond_value_done, NULL);
+    return COND_NEED;
+}
+
+//
+// Give GDB the stop reply it has been waiting for, and tell the other
+// clients
+//
+static void
+cond_report(ICDI *pIcdi)
+{
+    COND *pCond = pIcdi->pCond;
+
+    pCond->bActive = 0;
+    regcache_set_halted(pIcdi, (pCond->iStop >= 3) &&
+                        ((pCond->pStop[0] == 'S') || (pCond->pStop[0] == 'T')));
+    gdb_reply(pCond->pCli, pCond->pStop, pCond->iStop);
+    bridge_stop_broadcast(pIcdi, pCond->pCli, pCond->pStop, pCond->iStop);
+    pCond->pCli = NULL;
+}
+
+static void cond_stop_done(PROBEREQ *pReq, unsigned char *pPayload,
+        unsigned int len);
+
+//
+// Run GDB's continue, stepping off the breakpoint pBp with it removed
+// first if the core sits on one
+//
+static void
+cond_resume(ICDI *pIcdi, CONDBP *pBp)
+{
+    COND *pCond = pIcdi->pCond;
+    unsigned char pBuf[32];
+    unsigned int n;
+
+    regcache_set_halted(pIcdi, 0);
+    if (pBp)
+    {
+        n = sprintf((char *)pBuf, "z%c,%x,%x", pBp->cType, pBp->iAddr,
+                    pBp->iKind);
+        probe_submit(pIcdi, NULL, pBuf, n, NULL, NULL);
+        probe_submit(pIcdi, NULL, (const unsigned char *)"s", 1, NULL, NULL);
+        pBuf[0] = 'Z';
+        probe_submit(pIcdi, NULL, pBuf, n, NULL, NULL);
+    }
+    probe_submit(pIcdi, NULL, pCond->pResume, pCond->iResume, cond_stop_done,
+                 NULL);
+}
+
+//
+// Decide on the stop on pCond->pBp: the conditions GDB gave it (any one
+// will do) and the monitor condition must hold, as often as the monitor
+// hit count asks.  Runs again for each value the conditions need.
+//
+static void
+cond_judge(ICDI *pIcdi)
+{
+    COND *pCond = pIcdi->pCond;
+    CONDBP *pBp = pCond->pBp;
+    int bHold = 1, r;
+    unsigned int i;
+
+    if (pCond->bInterrupt || (pCond->pCli == NULL))
+    {
+        cond_report(pIcdi);
+        return;
+    }
+
+    if (pBp->iExpr)
+    {
+        r = cond_eval(pIcdi, pBp->pExpr, pBp->iExpr);
+        if (r == COND_NEED)
+        {
+            return;
+        }
+        bHold = (r != 0);
+    }
+
+    for (i = 0; bHold && (i < pBp->iGdbExprs); i++)
+    {
+        r = cond_eval(pIcdi, pBp->pGdbExpr[i], pBp->pGdbLen[i]);
+        if (r == COND_NEED)
+        {
+            return;
+        }
+        if (r != 0)
+        {
+            break;
+        }
+    }
+    if (pBp->iGdbExprs && (i == pBp->iGdbExprs))
+    {
+        bHold = 0;
+    }
+
+    pBp->iEvals++;
+    if (bHold && (++pBp->iHits >= pBp->iCount))
+    {
+        cond_report(pIcdi);
+        return;
+    }
+
+    pCond->iResumed++;
+    cond_resume(pIcdi, pBp);
+}
+
+//
+// The PC of the stopped core came in.  If it is on a breakpoint with a
+// condition, judge the condition.
+//
+static void
+cond_pc_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+    COND *pCond = pIcdi->pCond;
+    unsigned char pData[4];
+    unsigned int iPc;
+
+    pCond->pBp = NULL;
+    if ((len == 8) && isxdigit(pPayload[0]))
+    {
+        gdb_hex_decode(pData, pPayload, 8);
+        iPc = pData[0] | (pData[1] << 8) | (pData[2] << 16) |
+              ((unsigned int)pData[3] << 24);
+        pCond->pBp = cond_find(pCond, iPc);
+    }
+
+    if ((pCond->pBp == NULL) || !pCond->pBp->bInserted)
+    {
+        cond_report(pIcdi);
+        return;
+    }
+
+    pCond->iJudged++;
+    pCond->iVals = 0;
+    cond_judge(pIcdi);
+}
+
+//
+// The core stopped.  Find out where, unless GDB wants to know anyway.
+//
+static void
+cond_stop_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+    COND *pCond = pIcdi->pCond;
+    unsigned char pBuf[8];
+    unsigned int n;
+
+    memcpy(pCond->pStop, pPayload, len);
+    pCond->iStop = len;
+
+    if (pCond->bInterrupt || (pCond->pCli == NULL) || (len < 3) ||
+        ((pPayload[0] != 'S') && (pPayload[0] != 'T')))
+    {
+        cond_report(pIcdi);
+        return;
+    }
+
+    n = sprintf((char *)pBuf, "p%x", REG_PC);
+    probe_submit(pIcdi, NULL, pBuf, n, cond_pc_done, NULL);
+}
+
+//
+// The ICDI answered a Z or z packet.  A breakpoint it didn't insert isn't
+// one the core can stop on.
+//
+static void
+cond_z_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    COND *pCond = pReq->pIcdi->pCond;
+    unsigned int iAddr, iKind;
+    CONDBP *pBp;
+
+    if ((pReq->pPkt[1] == 'Z') &&
+        ((len != 2) || (memcmp(pPayload, "OK", 2) != 0)) &&
+        gdb_parse_range(pReq->pPkt + 4, pReq->iLen - 4, &iAddr, &iKind) &&
+        ((pBp = cond_find(pCond, iAddr)) != NULL))
+    {
+        pBp->bInserted = 0;
+        pBp->iGdbExprs = 0;
+        cond_tidy(pCond, pBp);
+    }
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+//
+// GDB inserts or removes the breakpoint in pPayload.  Note it, with the
+// conditions that follow, and pass it on without them.
+//
+static int
+cond_breakpoint(ICDI *pIcdi, GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len)
+{
+    COND *pCond = pIcdi->pCond;
+    unsigned int iAddr, iKind, i, n, iExpr;
+    CONDBP *pBp;
+
+    if ((len < 4) || (pPayload[2] != ',') ||
+        ((pPayload[1] != '0') && (pPayload[1] != '1')))
+    {
+        return 0;
+    }
+
+    n = gdb_parse_range(pPayload + 3, len - 3, &iAddr, &iKind);
+    if (n == 0)
+    {
+        return 0;
+    }
+    n += 3;
+
+    pBp = (pPayload[0] == 'Z') ? cond_get(pCond, iAddr) : cond_find(pCond, iAddr);
+    if ((pBp == NULL) && (pPayload[0] == 'Z'))
+    {
+        //
+        // A breakpoint we don't know of would be stepped over by a range
+        // step, so GDB can't have it
+        //
+        TRACE(ALWAYS, "%s: too many breakpoints\n", __FUNCTION__);
+        gdb_reply(pCli, (const unsigned char *)"E01", 3);
+        return 1;
+    }
+    else if (pPayload[0] == 'Z')
+    {
+        pBp->bInserted = 1;
+        pBp->cType = pPayload[1];
+        pBp->iKind = iKind;
+        pBp->iGdbExprs = 0;
+
+        //
+        // ;X<len>,<bytecode> for each condition
+        //
+        for (i = n; (i + 2 < len) && (pPayload[i] == ';') &&
+                    (pPayload[i + 1] == 'X'); )
+        {
+            i += 2;
+            i += gdb_parse_hex(pPayload + i, len - i, &iExpr) + 1;
+            if ((i + 2 * iExpr > len) || (iExpr > COND_EXPR_LEN) ||
+                (pBp->iGdbExprs == COND_EXPRS))
+            {
+                //
+                // A condition we can't hold is always true, so GDB gets
+                // to evaluate it
+                //
+                pBp->iGdbExprs = 0;
+                break;
+            }
+            gdb_hex_decode(pBp->pGdbExpr[pBp->iGdbExprs], pPayload + i,
+                           2 * iExpr);
+            pBp->pGdbLen[pBp->iGdbExprs++] = iExpr;
+            i += 2 * iExpr;
+        }
+    }
+    else if (pBp)
+    {
+        pBp->bInserted = 0;
+        pBp->iGdbExprs = 0;
+        cond_tidy(pCond, pBp);
+    }
+
+    probe_submit(pIcdi, pCli, pPayload, n, cond_z_done, NULL);
+    return 1;
+}
+
+//
+// Compile the monitor condition "operand op value" in pText into an agent
+// expression for pBp.  The operand is a core register, or *addr or *var
+// for memory, and is compared with value as a signed 32 bit number.
+// Returns a message if it doesn't parse.
+//
+static const char *
+cond_compile(ICDI *pIcdi, CONDBP *pBp, const char *pText)
+{
+    static const char *pRegs[] = { "sp", "lr", "pc" };
+    static const char *pOps[] = { "==", "!=", "<", ">=", ">", "<=" };
+    unsigned char *pExpr = pBp->pExpr;
+    char pOperand[64], pOp[4], c;
+    unsigned int iAddr, iSize = 4, iReg, i, n = 0;
+    long iValue;
+    char *pEnd;
+
+    if (sscanf(pText, "%63s %3s %li", pOperand, pOp, &iValue) != 3)
+    {
+        return "a condition is operand op value\n";
+    }
+
+    for (i = 0; (i < 6) && (strcmp(pOp, pOps[i]) != 0); i++)
+    {
+    }
+    if (i == 6)
+    {
+        return "op is one of == != < >= > <=\n";
+    }
+
+    if (pOperand[0] == '*')
+    {
+        iAddr = strtoul(pOperand + 1, &pEnd, 0);
+        if (((*pEnd != 0) || (pEnd == pOperand + 1)) &&
+            !elf_object(pIcdi->pElf, pOperand + 1, &iAddr, &iSize))
+        {
+            return "no such variable\n";
+        }
+        if ((iSize != 1) && (iSize != 2))
+        {
+            iSize = 4;
+        }
+        pExpr[n++] = AX_CONST32;
+        pExpr[n++] = iAddr >> 24;
+        pExpr[n++] = iAddr >> 16;
+        pExpr[n++] = iAddr >> 8;
+        pExpr[n++] = iAddr;
+        pExpr[n++] = (iSize == 1) ? AX_REF8 : (iSize == 2) ? AX_REF16 : AX_REF32;
+    }
+    else
+    {
+        for (iReg = 0; (iReg < 3) && (strcmp(pOperand, pRegs[iReg]) != 0);
+             iReg++)
+        {
+        }
+        iReg += 13;
+        if ((iReg == 16) && ((sscanf(pOperand, "r%u%c", &iReg, &c) != 1) ||
+                             (iReg > 15)))
+        {
+            return "operand is r0-r15, sp, lr, pc, *addr or *var\n";
+        }
+        pExpr[n++] = AX_REG;
+        pExpr[n++] = 0;
+        pExpr[n++] = iReg;
+    }
+
+    //
+    // Values narrower than 32 bits are compared unsigned
+    //
+    if (iSize == 4)
+    {
+        pExpr[n++] = AX_EXT;
+        pExpr[n++] = 32;
+    }
+
+    pExpr[n++] = AX_CONST32;
+    pExpr[n++] = iValue >> 24;
+    pExpr[n++] = iValue >> 16;
+    pExpr[n++] = iValue >> 8;
+    pExpr[n++] = iValue;
+    pExpr[n++] = AX_EXT;
+    pExpr[n++] = 32;
+
+    switch (i)
+    {
+        case 0:
+            pExpr[n++] = AX_EQUAL;
+            break;
+
+        case 1:
+            pExpr[n++] = AX_EQUAL;
+            pExpr[n++] = AX_LOG_NOT;
+            break;
+
+        case 2:
+        case 3:
+            pExpr[n++] = AX_LESS_SIGNED;
+            break;
+
+        default:
+            pExpr[n++] = AX_SWAP;
+            pExpr[n++] = AX_LESS_SIGNED;
+            break;
+    }
+    if ((i == 3) || (i == 5))
+    {
+        pExpr[n++] = AX_LOG_NOT;
+    }
+    pExpr[n++] = AX_END;
+
+    pBp->iExpr = n;
+    snprintf(pBp->pText, sizeof(pBp->pText), "%s %s %ld", pOperand,
+             pOps[i], iValue);
+    return NULL;
+}
+
+//
+// List the breakpoints with conditions
+//
+static void
+cond_status(COND *pCond, GDBCLIENT *pCli)
+{
+    char pLine[160];
+    unsigned int i, n;
+    CONDBP *pBp;
+
+    snprintf(pLine, sizeof(pLine),
+             "%u stops on conditional breakpoints, %u resumed from here\n",
+             pCond->iJudged, pCond->iResumed);
+    gdb_console(pCli, pLine);
+
+    for (i = 0; i < pCond->iBps; i++)
+    {
+        pBp = &pCond->pBps[i];
+        if (!pBp->iGdbExprs && !pBp->iExpr && !pBp->iCount)
+        {
+            continue;
+        }
+
+        n = snprintf(pLine, sizeof(pLine), "0x%08x %-8s", pBp->iAddr,
+                     pBp->bInserted ? "inserted" : "");
+        if (pBp->iGdbExprs)
+        {
+            n += snprintf(pLine + n, sizeof(pLine) - n, " %u from GDB",
+                          pBp->iGdbExprs);
+        }
+        if (pBp->iExpr)
+        {
+            n += snprintf(pLine + n, sizeof(pLine) - n, " if %s", pBp->pText);
+        }
+        if (pBp->iCount)
+        {
+            n += snprintf(pLine + n, sizeof(pLine) - n, " hits %u",
+                          pBp->iCount);
+        }
+        snprintf(pLine + n, sizeof(pLine) - n, ", held %u of %u\n",
+                 pBp->iHits, pBp->iEvals);
+        gdb_console(pCli, pLine);
+    }
+}
+
+//
+// Handle "monitor cond ..."
+//
+static void
+cond_monitor(ICDI *pIcdi, GDBCLIENT *pCli, const char *pArgs)
+{
+    COND *pCond = pIcdi->pCond;
+    const char *pMsg = NULL;
+    char pText[128], *pHits, *pEnd;
+    unsigned int iAddr, iCount = 0;
+    CONDBP *pBp;
+
+    while (*pArgs == ' ')
+    {
+        pArgs++;
+    }
+
+    if (*pArgs == 0)
+    {
+        cond_status(pCond, pCli);
+        gdb_reply(pCli, (const unsigned char *)"OK", 2);
+        return;
+    }
+
+    iAddr = strtoul(pArgs, &pEnd, 0);
+    if ((pEnd == pArgs) || ((*pEnd != 0) && (*pEnd != ' ')))
+    {
+        pMsg = "usage: cond [addr [operand op value] [hits n]]\n";
+    }
+    else if (pCond->bActive)
+    {
+        pMsg = "wait for the core to stop\n";
+    }
+    else if ((pBp = cond_get(pCond, iAddr)) == NULL)
+    {
+        pMsg = "too many breakpoints\n";
+    }
+    else
+    {
+        snprintf(pText, sizeof(pText), "%s", pEnd);
+        pHits = strstr(pText, " hits");
+        if (pHits)
+        {
+            if (sscanf(pHits, " hits %u", &iCount) != 1)
+            {
+                pMsg = "hits takes a count\n";
+            }
+            *pHits = 0;
+        }
+
+        pBp->iExpr = 0;
+        pBp->iCount = iCount;
+        pBp->iHits = 0;
+        pBp->iEvals = 0;
+        if ((pMsg == NULL) && (strspn(pText, " ") != strlen(pText)))
+        {
+            pMsg = cond_compile(pIcdi, pBp, pText);
+            if (pMsg)
+            {
+                pBp->iExpr = 0;
+            }
+        }
+        cond_tidy(pCond, pBp);
+    }
+
+    if (pMsg)
+    {
+        gdb_console(pCli, pMsg);
+    }
+    gdb_reply(pCli, (const unsigned char *)"OK", 2);
+}
+
+//*****************************************************************************
+//
+//! Set up the conditional breakpoints of pIcdi, with none yet.
+//
+//*****************************************************************************
+void
+cond_init(ICDI *pIcdi)
+{
+    pIcdi->pCond = calloc(1, sizeof(COND));
+    ASSERT(pIcdi->pCond != NULL);
+}
+
+//*****************************************************************************
+//
+//! Handle the packets from pCli that concern conditional breakpoints:
+//!
+//!   Z0, Z1, z0, z1    breakpoints, with GDB's conditions
+//!   c                 resumes, run by us while a breakpoint has a
+//!                     condition (vCont;c is rewritten as c first)
+//!   monitor cond                                list them
+//!   monitor cond addr [operand op value] [hits n]
+//!                     stop at the breakpoint at addr only when the
+//!                     condition holds, from its nth time on, or always
+//!                     if neither is given
+//!
+//! \return 1 if the packet was handled here, 0 otherwise.
+//
+//*****************************************************************************
+int
+cond_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pCli->pIcdi;
+    COND *pCond = pIcdi->pCond;
+    char pCmd[256];
+
+    if ((pPayload[0] == 'Z') || (pPayload[0] == 'z'))
+    {
+        return cond_breakpoint(pIcdi, pCli, pPayload, len);
+    }
+
+    if ((len == 1) && (pPayload[0] == 'c') && !pCond->bActive &&
+        cond_armed(pCond))
+    {
+        pCond->bActive = 1;
+        pCond->bInterrupt = 0;
+        pCond->pCli = pCli;
+        memcpy(pCond->pResume, pPayload, len);
+        pCond->iResume = len;
+        cond_resume(pIcdi, NULL);
+        return 1;
+    }
+
+    if (gdb_monitor(pPayload, len, pCmd, sizeof(pCmd)) &&
+        (strncmp(pCmd, "cond", 4) == 0) && ((pCmd[4] == 0) || (pCmd[4] == ' ')))
+    {
+        cond_monitor(pIcdi, pCli, pCmd + 4);
+        return 1;
+    }
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Return whether GDB has a breakpoint inserted at iAddr on pIcdi.
+//
+//*****************************************************************************
+int
+cond_breakpoint_at(ICDI *pIcdi, unsigned int iAddr)
+{
+    CONDBP *pBp = cond_find(pIcdi->pCond, iAddr);
+
+    return pBp && pBp->bInserted;
+}
+
+//*****************************************************************************
+//
+//! GDB interrupted pIcdi.  If we are running a continue for it, the next
+//! stop goes to GDB whatever the conditions say.
+//
+//*****************************************************************************
+void
+cond_interrupt(ICDI *pIcdi)
+{
+    pIcdi->pCond->bInterrupt = 1;
+}
+
+//*****************************************************************************
+//
+//! pCli disconnected.  If we are running a continue for it, its stop is
+//! reported to the others.
+//
+//*****************************************************************************
+void
+cond_client_closed(GDBCLIENT *pCli)
+{
+    COND *pCond = pCli->pIcdi->pCond;
+
+    if (pCond->pCli == pCli)
+    {
+        pCond->pCli = NULL;
+    }
+}
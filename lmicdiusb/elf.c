@@ -0,0 +1,397 @@
+//*****************************************************************************
+//
+// elf.c - the symbols of the firmware, from its ELF file.
+//
+// "monitor elf file" loads the symbol table of the firmware running on
+// an ICDI, so the profiler can name functions and the watch can take
+// variables by name.  Just enough of the ELF format is defined here to
+// read the symbol table of an executable for our (little endian, 32 bit)
+// target, so no libelf is needed.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <stdint.h>
+
+typedef struct _ELFHDR
+{
+    unsigned char e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} ELFHDR;
+
+typedef struct _ELFSHDR
+{
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint32_t sh_flags;
+    uint32_t sh_addr;
+    uint32_t sh_offset;
+    uint32_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint32_t sh_addralign;
+    uint32_t sh_entsize;
+} ELFSHDR;
+
+typedef struct _ELFSYM
+{
+    uint32_t st_name;
+    uint32_t st_value;
+    uint32_t st_size;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+} ELFSYM;
+
+#define SHT_SYMTAB              2
+#define STT_OBJECT              1
+#define STT_FUNC                2
+
+//
+// A function or variable of the firmware
+//
+typedef struct _ELFSYMBOL
+{
+    unsigned int iAddr;
+    unsigned int iSize;
+    const char *pName;
+} ELFSYMBOL;
+
+//
+// The functions sorted by address and the variables in the order of the
+// symbol table.  The names point into pData, the file as read.
+//
+struct _ELFSYMS
+{
+    char *pData;
+    ELFSYMBOL *pFuncs;
+    unsigned int iFuncs;
+    ELFSYMBOL *pObjs;
+    unsigned int iObjs;
+    char pFile[256];
+};
+
+static int
+sym_compare(const void *pA, const void *pB)
+{
+    const ELFSYMBOL *pSymA = pA, *pSymB = pB;
+
+    return (pSymA->iAddr > pSymB->iAddr) - (pSymA->iAddr < pSymB->iAddr);
+}
+
+//*****************************************************************************
+//
+//! Load the function and variable symbols of the ELF file pName.
+//!
+//! \return the symbols, or NULL with *ppErr saying what went wrong.
+//
+//*****************************************************************************
+ELFSYMS *
+elf_load(const char *pName, const char **ppErr)
+{
+    const ELFHDR *pHdr;
+    const ELFSHDR *pShdr, *pStrtab;
+    const ELFSYM *pSym;
+    ELFSYMBOL *pSymbol;
+    unsigned int i, j, iSize, n;
+    ELFSYMS *pElf;
+    FILE *pFile;
+    char *pData;
+    long lSize;
+
+    pFile = fopen(pName, "rb");
+    if (pFile == NULL)
+    {
+        *ppErr = "can't open the ELF file\n";
+        return NULL;
+    }
+
+    fseek(pFile, 0, SEEK_END);
+    lSize = ftell(pFile);
+    fseek(pFile, 0, SEEK_SET);
+    if (lSize < (long)sizeof(ELFHDR))
+    {
+        fclose(pFile);
+        *ppErr = "not an ELF file\n";
+        return NULL;
+    }
+
+    iSize = lSize;
+    pData = malloc(iSize + 1);
+    ASSERT(pData != NULL);
+    n = fread(pData, 1, iSize, pFile);
+    fclose(pFile);
+    pData[iSize] = 0;
+
+    pHdr = (const ELFHDR *)pData;
+    if ((n != iSize) || (memcmp(pHdr->e_ident, "\177ELF", 4) != 0) ||
+        (pHdr->e_ident[4] != 1) || (pHdr->e_ident[5] != 1) ||
+        (pHdr->e_shentsize != sizeof(ELFSHDR)) ||
+        (pHdr->e_shoff + pHdr->e_shnum * sizeof(ELFSHDR) > iSize))
+    {
+        free(pData);
+        *ppErr = "not a 32 bit little endian ELF file\n";
+        return NULL;
+    }
+
+    pShdr = (const ELFSHDR *)(pData + pHdr->e_shoff);
+    for (i = 0; i < pHdr->e_shnum; i++)
+    {
+        if ((pShdr[i].sh_type == SHT_SYMTAB) &&
+            (pShdr[i].sh_link < pHdr->e_shnum) &&
+            (pShdr[i].sh_offset + pShdr[i].sh_size <= iSize))
+        {
+            break;
+        }
+    }
+
+    pStrtab = (i < pHdr->e_shnum) ? &pShdr[pShdr[i].sh_link] : NULL;
+    if ((pStrtab == NULL) ||
+        (pStrtab->sh_offset + pStrtab->sh_size > iSize))
+    {
+        free(pData);
+        *ppErr = "no symbol table in the ELF file\n";
+        return NULL;
+    }
+
+    n = pShdr[i].sh_size / sizeof(ELFSYM);
+    pElf = calloc(1, sizeof(ELFSYMS));
+    ASSERT(pElf != NULL);
+    pElf->pData = pData;
+    pElf->pFuncs = malloc(n * sizeof(ELFSYMBOL) + 1);
+    pElf->pObjs = malloc(n * sizeof(ELFSYMBOL) + 1);
+    ASSERT((pElf->pFuncs != NULL) && (pElf->pObjs != NULL));
+    snprintf(pElf->pFile, sizeof(pElf->pFile), "%s", pName);
+
+    pSym = (const ELFSYM *)(pData + pShdr[i].sh_offset);
+    for (j = 0; j < n; j++)
+    {
+        if (pSym[j].st_name >= pStrtab->sh_size)
+        {
+            continue;
+        }
+
+        switch (pSym[j].st_info & 0xf)
+        {
+            case STT_FUNC:
+                pSymbol = &pElf->pFuncs[pElf->iFuncs++];
+                break;
+
+            case STT_OBJECT:
+                pSymbol = &pElf->pObjs[pElf->iObjs++];
+                break;
+
+            default:
+                continue;
+        }
+
+        //
+        // Thumb function addresses have bit 0 set
+        //
+        pSymbol->iAddr = pSym[j].st_value;
+        if ((pSym[j].st_info & 0xf) == STT_FUNC)
+        {
+            pSymbol->iAddr &= ~1;
+        }
+        pSymbol->iSize = pSym[j].st_size;
+        pSymbol->pName = pData + pStrtab->sh_offset + pSym[j].st_name;
+    }
+
+    qsort(pElf->pFuncs, pElf->iFuncs, sizeof(ELFSYMBOL), sym_compare);
+    return pElf;
+}
+
+//*****************************************************************************
+//
+//! Free the symbols pElf.
+//
+//*****************************************************************************
+void
+elf_free(ELFSYMS *pElf)
+{
+    if (pElf)
+    {
+        free(pElf->pFuncs);
+        free(pElf->pObjs);
+        free(pElf->pData);
+        free(pElf);
+    }
+}
+
+//*****************************************************************************
+//
+//! Return the number of functions in pElf, which may be NULL.
+//
+//*****************************************************************************
+unsigned int
+elf_function_count(ELFSYMS *pElf)
+{
+    return pElf ? pElf->iFuncs : 0;
+}
+
+//*****************************************************************************
+//
+//! Return the index of the function iAddr is in, -1 if there is none.
+//
+//*****************************************************************************
+int
+elf_function(ELFSYMS *pElf, unsigned int iAddr)
+{
+    int iLo = 0, iHi, iMid;
+    const ELFSYMBOL *pSym;
+
+    if (pElf == NULL)
+    {
+        return -1;
+    }
+
+    iHi = (int)pElf->iFuncs - 1;
+    while (iLo <= iHi)
+    {
+        iMid = (iLo + iHi) / 2;
+        if (pElf->pFuncs[iMid].iAddr <= iAddr)
+        {
+            iLo = iMid + 1;
+        }
+        else
+        {
+            iHi = iMid - 1;
+        }
+    }
+
+    if (iHi < 0)
+    {
+        return -1;
+    }
+
+    //
+    // A function without a size runs up to the next one
+    //
+    pSym = &pElf->pFuncs[iHi];
+    if ((pSym->iSize != 0) && (iAddr - pSym->iAddr >= pSym->iSize))
+    {
+        return -1;
+    }
+    return iHi;
+}
+
+//*****************************************************************************
+//
+//! Return the name of the function iFunc of pElf.
+//
+//*****************************************************************************
+const char *
+elf_function_name(ELFSYMS *pElf, int iFunc)
+{
+    return pElf->pFuncs[iFunc].pName;
+}
+
+//*****************************************************************************
+//
+//! Look up the variable pName in pElf, which may be NULL.
+//!
+//! \return 1 with its address and size in *piAddr and *piSize if found,
+//! 0 otherwise.
+//
+//*****************************************************************************
+int
+elf_object(ELFSYMS *pElf, const char *pName, unsigned int *piAddr,
+        unsigned int *piSize)
+{
+    unsigned int i;
+
+    for (i = 0; pElf && (i < pElf->iObjs); i++)
+    {
+        if (strcmp(pElf->pObjs[i].pName, pName) == 0)
+        {
+            *piAddr = pElf->pObjs[i].iAddr;
+            *piSize = pElf->pObjs[i].iSize;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Load the ELF file pName as the firmware of pIcdi, replacing the one
+//! loaded before.
+//!
+//! \return NULL on success, a message saying what went wrong otherwise.
+//
+//*****************************************************************************
+const char *
+elf_attach(ICDI *pIcdi, const char *pName)
+{
+    const char *pErr;
+    ELFSYMS *pElf;
+
+    pElf = elf_load(pName, &pErr);
+    if (pElf == NULL)
+    {
+        return pErr;
+    }
+
+    elf_free(pIcdi->pElf);
+    pIcdi->pElf = pElf;
+    return NULL;
+}
+
+//*****************************************************************************
+//
+//! Handle "monitor elf [file]" from pCli, which loads the symbols of file
+//! or shows those loaded.
+//!
+//! \return 1 if the packet was handled here, 0 otherwise.
+//
+//*****************************************************************************
+int
+elf_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pCli->pIcdi;
+    char pCmd[300], pArg[256], pLine[320];
+    const char *pMsg = NULL;
+
+    if (!gdb_monitor(pPayload, len, pCmd, sizeof(pCmd)) ||
+        (strncmp(pCmd, "elf", 3) != 0) || ((pCmd[3] != 0) && (pCmd[3] != ' ')))
+    {
+        return 0;
+    }
+
+    if (sscanf(pCmd + 3, " %255s", pArg) == 1)
+    {
+        pMsg = elf_attach(pIcdi, pArg);
+    }
+
+    if (pMsg)
+    {
+        gdb_console(pCli, pMsg);
+    }
+    else if (pIcdi->pElf)
+    {
+        snprintf(pLine, sizeof(pLine), "%u functions and %u variables from %s\n",
+                 pIcdi->pElf->iFuncs, pIcdi->pElf->iObjs, pIcdi->pElf->pFile);
+        gdb_console(pCli, pLine);
+    }
+    else
+    {
+        gdb_console(pCli, "no ELF file loaded\n");
+    }
+    gdb_reply(pCli, (const unsigned char *)"OK", 2);
+    return 1;
+}
@@ -0,0 +1,469 @@
+//*****************************************************************************
+//
+// event.c - the event loop that drives the bridge.  It multiplexes the TCP
+//           sockets and sleeps until one of them is ready or one of our own
+//           timers is due.  USB transfers complete on a thread of their
+//           own, which wakes the loop through a pipe (see usb.c).
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL 1
+#endif
+
+//
+// One registered file descriptor.  Slots are referred to by index so the
+// table can grow without invalidating what the kernel hands back to us.
+// The generation tells a reused slot apart from events still pending for
+// the descriptor that previously lived in it.
+//
+typedef struct _EVENTSLOT
+{
+    int fd;
+    unsigned int iGen;
+    short events;
+    EVENT_FN pfnEvent;
+    void *pCtx;
+} EVENTSLOT;
+
+//
+// A periodic timer.  iDue is on the clock of event_now().
+//
+typedef struct _EVENTTIMER
+{
+    TIMER_FN pfnTimer;
+    void *pCtx;
+    unsigned int iPeriod;
+    unsigned long long iDue;
+} EVENTTIMER;
+
+static EVENTTIMER *pTimers;
+static unsigned int iTimers;
+
+static EVENTSLOT *pSlots;
+static unsigned int iSlots;
+static volatile sig_atomic_t bRunning;
+
+#ifdef USE_EPOLL
+static int epfd = -1;
+#else
+static struct pollfd *pPollFds;
+static unsigned int *pPollSlot;
+static unsigned int *pPollGen;
+#endif
+
+#ifdef USE_EPOLL
+static unsigned int
+poll_to_epoll(short events)
+{
+    unsigned int ev = 0;
+
+    if (events & POLLIN)  ev |= EPOLLIN;
+    if (events & POLLPRI) ev |= EPOLLPRI;
+    if (events & POLLOUT) ev |= EPOLLOUT;
+    return ev;
+}
+
+static short
+epoll_to_poll(unsigned int ev)
+{
+    short events = 0;
+
+    if (ev & EPOLLIN)  events |= POLLIN;
+    if (ev & EPOLLPRI) events |= POLLPRI;
+    if (ev & EPOLLOUT) events |= POLLOUT;
+    if (ev & EPOLLERR) events |= POLLERR;
+    if (ev & EPOLLHUP) events |= POLLHUP;
+    return events;
+}
+#endif
+
+static EVENTSLOT *
+event_find(int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < iSlots; i++)
+    {
+        if (pSlots[i].fd == fd)
+        {
+            return &pSlots[i];
+        }
+    }
+    return NULL;
+}
+
+//*****************************************************************************
+//
+//! Start watching fd for the poll() style events in 'events'.  pfnEvent is
+//! called from event_run() with the events that are ready.
+//!
+//! \return 0 on success, -1 otherwise.
+//
+//*****************************************************************************
+int
+event_add(int fd, short events, EVENT_FN pfnEvent, void *pCtx)
+{
+    unsigned int i;
+    EVENTSLOT *pSlot;
+
+    ASSERT(event_find(fd) == NULL);
+
+    for (i = 0; i < iSlots; i++)
+    {
+        if (pSlots[i].fd < 0)
+        {
+            break;
+        }
+    }
+
+    if (i == iSlots)
+    {
+        pSlot = realloc(pSlots, (iSlots + 1) * sizeof(EVENTSLOT));
+        if (pSlot == NULL)
+        {
+            return -1;
+        }
+        pSlots = pSlot;
+        pSlots[iSlots].iGen = 0;
+#ifndef USE_EPOLL
+        pPollFds = realloc(pPollFds, (iSlots + 1) * sizeof(struct pollfd));
+        pPollSlot = realloc(pPollSlot, (iSlots + 1) * sizeof(unsigned int));
+        pPollGen = realloc(pPollGen, (iSlots + 1) * sizeof(unsigned int));
+        ASSERT((pPollFds != NULL) && (pPollSlot != NULL) && (pPollGen != NULL));
+#endif
+        iSlots++;
+    }
+
+    pSlot = &pSlots[i];
+    pSlot->iGen++;
+    pSlot->fd = fd;
+    pSlot->events = events;
+    pSlot->pfnEvent = pfnEvent;
+    pSlot->pCtx = pCtx;
+
+#ifdef USE_EPOLL
+    {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = poll_to_epoll(events);
+        ev.data.u64 = ((uint64_t)pSlot->iGen << 32) | i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            perror("epoll_ctl(ADD)");
+            pSlot->fd = -1;
+            return -1;
+        }
+    }
+#endif
+
+    TRACE(1, "%s: fd %d events 0x%x\n", __FUNCTION__, fd, events);
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Change the set of events we wait for on an already registered fd.
+//
+//*****************************************************************************
+int
+event_mod(int fd, short events)
+{
+    EVENTSLOT *pSlot = event_find(fd);
+
+    if (pSlot == NULL)
+    {
+        return -1;
+    }
+
+    pSlot->events = events;
+
+#ifdef USE_EPOLL
+    {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = poll_to_epoll(events);
+        ev.data.u64 = ((uint64_t)pSlot->iGen << 32) | (pSlot - pSlots);
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+        {
+            perror("epoll_ctl(MOD)");
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Stop watching fd.  It is safe to call this from inside a callback, even
+//! for a descriptor that has further events pending in the same round.
+//
+//*****************************************************************************
+void
+event_del(int fd)
+{
+    EVENTSLOT *pSlot = event_find(fd);
+
+    if (pSlot == NULL)
+    {
+        return;
+    }
+
+#ifdef USE_EPOLL
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    pSlot->fd = -1;
+    pSlot->pfnEvent = NULL;
+
+    TRACE(1, "%s: fd %d\n", __FUNCTION__, fd);
+}
+
+//
+// Milliseconds on a clock that doesn't jump
+//
+static unsigned long long
+event_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//*****************************************************************************
+//
+//! Call pfnTimer with pCtx every iPeriod milliseconds from event_run().
+//!
+//! \return a handle for event_timer_del(), or -1 on failure.
+//
+//*****************************************************************************
+int
+event_timer_add(unsigned int iPeriod, TIMER_FN pfnTimer, void *pCtx)
+{
+    unsigned int i;
+    EVENTTIMER *pTimer;
+
+    for (i = 0; i < iTimers; i++)
+    {
+        if (pTimers[i].pfnTimer == NULL)
+        {
+            break;
+        }
+    }
+
+    if (i == iTimers)
+    {
+        pTimer = realloc(pTimers, (iTimers + 1) * sizeof(EVENTTIMER));
+        if (pTimer == NULL)
+        {
+            return -1;
+        }
+        pTimers = pTimer;
+        iTimers++;
+    }
+
+    pTimer = &pTimers[i];
+    pTimer->pfnTimer = pfnTimer;
+    pTimer->pCtx = pCtx;
+    pTimer->iPeriod = iPeriod ? iPeriod : 1;
+    pTimer->iDue = event_now() + pTimer->iPeriod;
+    return i;
+}
+
+//*****************************************************************************
+//
+//! Stop the timer iTimer returned by event_timer_add().
+//
+//*****************************************************************************
+void
+event_timer_del(int iTimer)
+{
+    if ((iTimer >= 0) && (iTimer < (int)iTimers))
+    {
+        pTimers[iTimer].pfnTimer = NULL;
+    }
+}
+
+//
+// Run the timers that are due.  One that fell behind by more than a period
+// skips the ticks it missed rather than firing them all at once.
+//
+static void
+event_timers_run(void)
+{
+    unsigned long long iNow = event_now();
+    EVENTTIMER *pTimer;
+    unsigned int i;
+
+    for (i = 0; i < iTimers; i++)
+    {
+        pTimer = &pTimers[i];
+        if ((pTimer->pfnTimer == NULL) || (pTimer->iDue > iNow))
+        {
+            continue;
+        }
+
+        pTimer->iDue += pTimer->iPeriod;
+        if (pTimer->iDue <= iNow)
+        {
+            pTimer->iDue = iNow + pTimer->iPeriod;
+        }
+        pTimer->pfnTimer(pTimer->pCtx);
+    }
+}
+
+//*****************************************************************************
+//
+//! Prepare the event loop.
+//!
+//! \return 0 on success, -1 otherwise.
+//
+//*****************************************************************************
+int
+event_init(void)
+{
+#ifdef USE_EPOLL
+    epfd = epoll_create(16);
+    if (epfd == -1)
+    {
+        perror("epoll_create");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+//
+// Work out how long we may sleep: until the next of our timers is due, or
+// until an fd is ready if there is none
+//
+static int
+event_timeout(void)
+{
+    unsigned long long iNow = event_now();
+    unsigned int i;
+    int iTimeoutms = -1;
+
+    for (i = 0; i < iTimers; i++)
+    {
+        if (pTimers[i].pfnTimer == NULL)
+        {
+            continue;
+        }
+
+        if (pTimers[i].iDue <= iNow)
+        {
+            return 0;
+        }
+
+        if ((iTimeoutms < 0) || ((int)(pTimers[i].iDue - iNow) < iTimeoutms))
+        {
+            iTimeoutms = (int)(pTimers[i].iDue - iNow);
+        }
+    }
+
+    return iTimeoutms;
+}
+
+//*****************************************************************************
+//
+//! Dispatch events until event_stop() is called or waiting fails.
+//!
+//! \return 0 when stopped, -1 on error.
+//
+//*****************************************************************************
+int
+event_run(void)
+{
+    int rc, i, iTimeoutms;
+    EVENTSLOT *pSlot;
+
+    bRunning = 1;
+    while (bRunning)
+    {
+        iTimeoutms = event_timeout();
+
+#ifdef USE_EPOLL
+        {
+            struct epoll_event pEv[16];
+
+            rc = epoll_wait(epfd, pEv, sizeof(pEv) / sizeof(pEv[0]), iTimeoutms);
+            if ((rc == -1) && (errno != EINTR))
+            {
+                perror("epoll_wait");
+                return -1;
+            }
+
+            for (i = 0; i < rc; i++)
+            {
+                pSlot = &pSlots[(uint32_t)pEv[i].data.u64];
+                if ((pSlot->fd < 0) || (pSlot->pfnEvent == NULL) ||
+                    (pSlot->iGen != (unsigned int)(pEv[i].data.u64 >> 32)))
+                {
+                    continue;
+                }
+                pSlot->pfnEvent(pSlot->fd, epoll_to_poll(pEv[i].events),
+                                pSlot->pCtx);
+            }
+        }
+#else
+        {
+            unsigned int n = 0;
+
+            for (i = 0; i < (int)iSlots; i++)
+            {
+                if (pSlots[i].fd >= 0)
+                {
+                    pPollFds[n].fd = pSlots[i].fd;
+                    pPollFds[n].events = pSlots[i].events;
+                    pPollFds[n].revents = 0;
+                    pPollGen[n] = pSlots[i].iGen;
+                    pPollSlot[n++] = i;
+                }
+            }
+
+            rc = poll(pPollFds, n, iTimeoutms);
+            if ((rc == -1) && (errno != EINTR))
+            {
+                perror("poll");
+                return -1;
+            }
+
+            for (i = 0; (rc > 0) && (i < (int)n); i++)
+            {
+                pSlot = &pSlots[pPollSlot[i]];
+                if ((pPollFds[i].revents == 0) || (pSlot->fd < 0) ||
+                    (pSlot->iGen != pPollGen[i]) || (pSlot->pfnEvent == NULL))
+                {
+                    continue;
+                }
+                pSlot->pfnEvent(pSlot->fd, pPollFds[i].revents, pSlot->pCtx);
+            }
+        }
+#endif
+
+        event_timers_run();
+    }
+
+    return 0;
+}
+
+void
+event_stop(void)
+{
+    bRunning = 0;
+}
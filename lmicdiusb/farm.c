@@ -0,0 +1,292 @@
+//*****************************************************************************
+//
+// farm.c - hand a pool of identical boards out to GDB sessions.
+//
+// With a farm port, GDB doesn't connect to a particular ICDI.  Each
+// session connecting to the farm port is given the board that has been
+// idle the longest, or waits in line until one comes free.  A board goes
+// back to the pool when its session ends.  "monitor farm" shows how busy
+// the boards are.
+//
+// A session waiting in line gets no answers, and what its GDB sends is
+// kept for the board it gets.  GDB gives up on a target that doesn't
+// answer within its remotetimeout, 2 s by default, so sessions that may
+// have to wait need it raised.  One that gives up leaves the line.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+//
+// A session waiting for a board
+//
+typedef struct _FARMWAIT FARMWAIT;
+struct _FARMWAIT
+{
+    FARMWAIT *pNext;
+    int sd;
+    time_t tSince;
+    unsigned int iLen;
+    unsigned char pBuf[MSGSIZE];    // what GDB sent meanwhile
+};
+
+static ICDI *pFarmList;
+static int sdFarm = -1;
+static unsigned int iFarmUse;
+
+static FARMWAIT *pWaitHead;
+static FARMWAIT *pWaitTail;
+static unsigned int iWaiting;
+
+//
+// The idle board that was handed out least recently, NULL if all are busy
+//
+static ICDI *
+farm_idle(void)
+{
+    ICDI *pIcdi, *pBest = NULL;
+
+    for (pIcdi = pFarmList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        if ((pIcdi->iClients == 0) &&
+            ((pBest == NULL) || (pIcdi->iLastUse < pBest->iLastUse)))
+        {
+            pBest = pIcdi;
+        }
+    }
+    return pBest;
+}
+
+//
+// Give pIcdi to the session on socket sd, with the iLen bytes at pBuf it
+// sent while waiting
+//
+static void
+farm_assign(ICDI *pIcdi, int sd, unsigned char *pBuf, unsigned int iLen)
+{
+    pIcdi->iLastUse = ++iFarmUse;
+    TRACE(ALWAYS, "farm: session on ICDI %s, %d waiting\n", pIcdi->pSerial,
+          iWaiting);
+    client_attach(pIcdi, sd, pBuf, iLen);
+}
+
+//
+// Take pWait out of the line
+//
+static void
+farm_unwait(FARMWAIT *pWait)
+{
+    FARMWAIT **ppWait;
+
+    for (ppWait = &pWaitHead; *ppWait != pWait; ppWait = &(*ppWait)->pNext)
+    {
+    }
+    *ppWait = pWait->pNext;
+
+    pWaitTail = NULL;
+    for (pWait = pWaitHead; pWait; pWait = pWait->pNext)
+    {
+        pWaitTail = pWait;
+    }
+    iWaiting--;
+}
+
+//
+// A session waiting in line sent something, or went away
+//
+static void
+farm_wait_event(int fd, short revents, void *pCtx)
+{
+    FARMWAIT *pWait = pCtx;
+    ssize_t rx;
+
+    rx = recv(fd, pWait->pBuf + pWait->iLen,
+              sizeof(pWait->pBuf) - pWait->iLen, 0);
+    if (rx > 0)
+    {
+        pWait->iLen += rx;
+        if (pWait->iLen == sizeof(pWait->pBuf))
+        {
+            //
+            // That's more than GDB sends before it waits for an answer
+            //
+            TRACE(ALWAYS, "farm: socket %d sent too much while waiting\n",
+                  fd);
+            rx = 0;
+        }
+    }
+
+    if (rx <= 0)
+    {
+        TRACE(ALWAYS, "farm: socket %d gave up after %ds, %d waiting\n", fd,
+              (int)(time(NULL) - pWait->tSince), iWaiting - 1);
+        event_del(fd);
+        close(fd);
+        farm_unwait(pWait);
+        free(pWait);
+    }
+}
+
+//
+// A session connected to the farm port.  Put it on a free board, or at the
+// back of the line.  Its GDB gets no answer until it has a board.
+//
+static void
+farm_event(int fd, short revents, void *pCtx)
+{
+    struct sockaddr_in pin;
+    socklen_t addrlen = sizeof(pin);
+    FARMWAIT *pWait;
+    ICDI *pIcdi;
+    int sd;
+
+	if ((sd = accept(fd, (struct sockaddr *)  &pin, &addrlen)) == -1) {
+		perror("accept");
+		return;
+	}
+
+    pIcdi = farm_idle();
+    if (pIcdi)
+    {
+        farm_assign(pIcdi, sd, NULL, 0);
+        return;
+    }
+
+    pWait = malloc(sizeof(FARMWAIT));
+    ASSERT(pWait != NULL);
+    pWait->pNext = NULL;
+    pWait->sd = sd;
+    pWait->tSince = time(NULL);
+    pWait->iLen = 0;
+    event_add(sd, POLLIN, farm_wait_event, pWait);
+
+    if (pWaitTail)
+    {
+        pWaitTail->pNext = pWait;
+    }
+    else
+    {
+        pWaitHead = pWait;
+    }
+    pWaitTail = pWait;
+    iWaiting++;
+
+    TRACE(ALWAYS, "farm: all boards busy, %d waiting\n", iWaiting);
+}
+
+//*****************************************************************************
+//
+//! Pool the ICDIs in pIcdiList and hand them out to the sessions connecting
+//! to iPort.
+//!
+//! \return 0 on success, -1 if the port can't be opened.
+//
+//*****************************************************************************
+int
+farm_init(ICDI *pIcdiList, int iPort)
+{
+    ICDI *pIcdi;
+
+    sdFarm = Listen(iPort);
+    if (sdFarm < 0)
+    {
+        TRACE(ALWAYS, "farm: unable to listen on port %d\n", iPort);
+        return -1;
+    }
+
+    pFarmList = pIcdiList;
+    for (pIcdi = pIcdiList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        pIcdi->bFarm = 1;
+        TRACE(ALWAYS, "farm: ICDI %s\n", pIcdi->pSerial);
+    }
+
+    TRACE(ALWAYS, "farm on port %d\n", iPort);
+    return event_add(sdFarm, POLLIN, farm_event, NULL);
+}
+
+//*****************************************************************************
+//
+//! The session on pIcdi has ended.  Hand the board to the session that has
+//! waited longest, if there is one.
+//
+//*****************************************************************************
+void
+farm_release(ICDI *pIcdi)
+{
+    FARMWAIT *pWait = pWaitHead;
+
+    if (pWait == NULL)
+    {
+        TRACE(ALWAYS, "farm: ICDI %s idle\n", pIcdi->pSerial);
+        return;
+    }
+
+    farm_unwait(pWait);
+
+    TRACE(1, "%s: socket %d waited %ds\n", __FUNCTION__, pWait->sd,
+          (int)(time(NULL) - pWait->tSince));
+    event_del(pWait->sd);
+    farm_assign(pIcdi, pWait->sd, pWait->pBuf, pWait->iLen);
+    free(pWait);
+}
+
+//*****************************************************************************
+//
+//! Answer "monitor farm" from pCli with how busy each board is.
+//!
+//! \return 1 if the packet was handled here, 0 otherwise.
+//
+//*****************************************************************************
+int
+farm_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len)
+{
+    char pLine[128];
+    time_t tNow;
+    ICDI *pIcdi;
+
+    if (!gdb_monitor(pPayload, len, pLine, sizeof(pLine)) ||
+        (strcmp(pLine, "farm") != 0))
+    {
+        return 0;
+    }
+
+    if (pFarmList == NULL)
+    {
+        gdb_console(pCli, "not serving a farm\n");
+        gdb_reply(pCli, (const unsigned char *)"OK", 2);
+        return 1;
+    }
+
+    tNow = time(NULL);
+    gdb_console(pCli, "serial           state  sessions  busy (s)\n");
+    for (pIcdi = pFarmList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        snprintf(pLine, sizeof(pLine), "%-16.16s %-6s %8u  %8u\n",
+                 pIcdi->pSerial, pIcdi->tAttached ? "busy" : "idle",
+                 pIcdi->iSessions,
+                 (unsigned int)(pIcdi->tBusy +
+                                (pIcdi->tAttached ?
+                                 tNow - pIcdi->tAttached : 0)));
+        gdb_console(pCli, pLine);
+    }
+
+    snprintf(pLine, sizeof(pLine), "%u session(s) waiting", iWaiting);
+    if (pWaitHead)
+    {
+        snprintf(pLine + strlen(pLine), sizeof(pLine) - strlen(pLine),
+                 ", longest for %us", (unsigned int)(tNow - pWaitHead->tSince));
+    }
+    strcat(pLine, "\n");
+    gdb_console(pCli, pLine);
+
+    gdb_reply(pCli, (const unsigned char *)"OK", 2);
+    return 1;
+}
@@ -0,0 +1,210 @@
+//*****************************************************************************
+//
+// flash.c - coalescing of the flash writes of a GDB 'load'.
+//
+// GDB sizes its vFlashWrite packets by its own limits and by section
+// boundaries, and waits for each to be answered.  Between vFlashErase and
+// vFlashDone we answer them straight away and collect the data instead,
+// sending it on in packets as large as the ICDI takes.  Any error the ICDI
+// reports on the way is handed to GDB as the answer to vFlashDone.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+#define FLASH_BUFFER            (2 * MSGSIZE)
+
+struct _FLASHBUF
+{
+    //
+    // Set from the first vFlashErase until vFlashDone
+    //
+    int bSession;
+
+    //
+    // Data waiting to be written: iLen bytes for iAddr onwards
+    //
+    unsigned int iAddr;
+    unsigned int iLen;
+    unsigned char pData[FLASH_BUFFER];
+
+    //
+    // The first error the ICDI reported during this session
+    //
+    unsigned int iErr;
+    unsigned char pErr[16];
+};
+
+static void
+flash_write_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    FLASHBUF *pFlash = pReq->pIcdi->pFlash;
+
+    if ((pFlash->iErr != 0) ||
+        ((len == 2) && (memcmp(pPayload, "OK", 2) == 0)))
+    {
+        return;
+    }
+
+    TRACE(ALWAYS, "%s: flash write failed: '%.*s'\n", __FUNCTION__,
+          (int)len, pPayload);
+
+    pFlash->iErr = len < sizeof(pFlash->pErr) ? len : sizeof(pFlash->pErr);
+    memcpy(pFlash->pErr, pPayload, pFlash->iErr);
+    if (pFlash->iErr == 0)
+    {
+        pFlash->iErr = 3;
+        memcpy(pFlash->pErr, "E01", 3);
+    }
+}
+
+static void
+flash_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    FLASHBUF *pFlash = pReq->pIcdi->pFlash;
+
+    if (pFlash->iErr)
+    {
+        gdb_reply(pReq->pCli, pFlash->pErr, pFlash->iErr);
+    }
+    else
+    {
+        gdb_reply(pReq->pCli, pPayload, len);
+    }
+}
+
+//
+// Send the buffered data to the ICDI in packets as large as it takes.
+// Unless bAll is set, a tail that wouldn't fill a packet is held back for
+// more data to join it.
+//
+static void
+flash_emit(ICDI *pIcdi, int bAll)
+{
+    FLASHBUF *pFlash = pIcdi->pFlash;
+    unsigned char pBuf[MSGSIZE + 32];
+    unsigned int iSize, iOff, i, n;
+
+    iSize = probe_packet_size(pIcdi);
+    for (iOff = 0;
+         (iOff < pFlash->iLen) && (bAll || (pFlash->iLen - iOff >= iSize));
+         iOff += i)
+    {
+        n = gdb_build_write(pBuf, iSize, 1, pFlash->iAddr + iOff,
+                            pFlash->pData + iOff, pFlash->iLen - iOff, &i);
+        probe_submit(pIcdi, NULL, pBuf, n, flash_write_done, NULL);
+    }
+
+    memmove(pFlash->pData, pFlash->pData + iOff, pFlash->iLen - iOff);
+    pFlash->iAddr += iOff;
+    pFlash->iLen -= iOff;
+}
+
+//
+// Take the data of a vFlashWrite, still escaped in pEsc
+//
+static void
+flash_buffer(ICDI *pIcdi, unsigned int iWrite, const unsigned char *pEsc,
+        unsigned int len)
+{
+    FLASHBUF *pFlash = pIcdi->pFlash;
+
+    if (pFlash->iLen && (iWrite != pFlash->iAddr + pFlash->iLen))
+    {
+        flash_emit(pIcdi, 1);
+    }
+
+    if (pFlash->iLen + len > sizeof(pFlash->pData))
+    {
+        flash_emit(pIcdi, 0);
+    }
+
+    if (pFlash->iLen == 0)
+    {
+        pFlash->iAddr = iWrite;
+    }
+
+    pFlash->iLen += gdb_unescape(pFlash->pData + pFlash->iLen, pEsc, len);
+    flash_emit(pIcdi, 0);
+}
+
+//*****************************************************************************
+//
+//! Set up the flash write buffer of pIcdi.
+//
+//*****************************************************************************
+void
+flash_init(ICDI *pIcdi)
+{
+    pIcdi->pFlash = calloc(1, sizeof(FLASHBUF));
+    ASSERT(pIcdi->pFlash != NULL);
+}
+
+//*****************************************************************************
+//
+//! Look at every packet from the client for the flash programming ones.
+//! Anything else first pushes out the data we are holding so the ICDI
+//! sees requests in the order GDB sent them.
+//!
+//! \return 1 if the packet was dealt with, 0 if it should be handled as
+//! usual.
+//
+//*****************************************************************************
+int
+flash_request(ICDI *pIcdi, GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len)
+{
+    FLASHBUF *pFlash = pIcdi->pFlash;
+    unsigned int iWrite, n;
+
+    if (pFlash->bSession && PKT_IS(pPayload, len, "vFlashWrite:"))
+    {
+        n = 12 + gdb_parse_hex(pPayload + 12, len - 12, &iWrite);
+        if ((n == 12) || (n >= len) || (pPayload[n] != ':'))
+        {
+            gdb_reply(pCli, (const unsigned char *)"E01", 3);
+            return 1;
+        }
+
+        flash_buffer(pIcdi, iWrite, pPayload + n + 1, len - n - 1);
+        gdb_reply(pCli, (const unsigned char *)"OK", 2);
+        return 1;
+    }
+
+    flash_emit(pIcdi, 1);
+
+    if (PKT_IS(pPayload, len, "vFlashErase:"))
+    {
+        if (!pFlash->bSession)
+        {
+            pFlash->bSession = 1;
+            pFlash->iErr = 0;
+        }
+        return 0;
+    }
+
+    if (pFlash->bSession && PKT_IS(pPayload, len, "vFlashDone"))
+    {
+        pFlash->bSession = 0;
+        probe_submit(pIcdi, pCli, pPayload, len, flash_done, NULL);
+        return 1;
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! The client went away in the middle of programming.  Whatever it still
+//! wanted written is dropped.
+//
+//*****************************************************************************
+void
+flash_client_closed(ICDI *pIcdi)
+{
+    pIcdi->pFlash->bSession = 0;
+    pIcdi->pFlash->iLen = 0;
+}
@@ -40,6 +40,24 @@
 
 #include "lmicdi.h"
 
+//****************************************************************************
+//
+//  calculates the modulo 256 sum of 'len' bytes of 'pBuf', as used for
+//  GDB packet checksums.
+//
+//****************************************************************************
+unsigned char
+gdb_checksum(const unsigned char *pBuf, unsigned int len)
+{
+    unsigned char csum = 0;
+
+    while (len--)
+    {
+        csum += *pBuf++;
+    }
+    return csum;
+}
+
 //****************************************************************************
 //
 //  calculates the checksum across the last GDB payload.  Returns 0 if the
@@ -47,35 +65,292 @@
 //
 //****************************************************************************
 static int
-gdb_validate()
+gdb_validate(GDBCTX *pGdbCtx)
 {
     //
-    // TODO: Take payload and calculate checksum...
-    // 
-    return 0;
+    // pPkt points at "$<payload>#nn"
+    //
+    return gdb_checksum(pGdbCtx->pPkt + 1, pGdbCtx->iRd - 4) != pGdbCtx->csum;
 }
 
-static int
+int
 hexchartoi(char c)
 {
     if ((c >= '0') && (c <= '9'))
     {
-        return '0' - c;
+        return c - '0';
     }
 
     if ((c >= 'a') && (c <= 'f'))
     {
-        return 'a' - c + 10;
+        return c - 'a' + 10;
     }
 
-    if ((c >= 'a') && (c <= 'f'))
+    if ((c >= 'A') && (c <= 'F'))
     {
-        return 'A' - c + 10;
+        return c - 'A' + 10;
     }
 
     return 0;
 }
 
+//****************************************************************************
+//
+//  parses up to 'len' characters of hex number at pBuf into *pVal.  Returns
+//  the number of characters consumed, 0 if pBuf doesn't start with a digit.
+//
+//****************************************************************************
+unsigned int
+gdb_parse_hex(const unsigned char *pBuf, unsigned int len, unsigned int *pVal)
+{
+    unsigned int i;
+
+    *pVal = 0;
+    for (i = 0; (i < len) && isxdigit(pBuf[i]); i++)
+    {
+        *pVal = (*pVal << 4) | hexchartoi(pBuf[i]);
+    }
+    return i;
+}
+
+//****************************************************************************
+//
+//  parses the "<addr>,<length>" that follows the command letter of m, M, x
+//  and X packets.  Returns the number of characters consumed, 0 if the
+//  packet is malformed.
+//
+//****************************************************************************
+unsigned int
+gdb_parse_range(const unsigned char *pBuf, unsigned int len,
+        unsigned int *pAddr, unsigned int *pLen)
+{
+    unsigned int i, n;
+
+    i = gdb_parse_hex(pBuf, len, pAddr);
+    if ((i == 0) || (i >= len) || (pBuf[i] != ','))
+    {
+        return 0;
+    }
+    i++;
+
+    n = gdb_parse_hex(pBuf + i, len - i, pLen);
+    if (n == 0)
+    {
+        return 0;
+    }
+    return i + n;
+}
+
+//****************************************************************************
+//
+//  writes 'len' bytes of pIn as hex to pOut.  Returns the number of
+//  characters written (2 * len).
+//
+//****************************************************************************
+unsigned int
+gdb_hex_encode(unsigned char *pOut, const unsigned char *pIn, unsigned int len)
+{
+    static const char pHex[] = "0123456789abcdef";
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+    {
+        *pOut++ = pHex[pIn[i] >> 4];
+        *pOut++ = pHex[pIn[i] & 0xf];
+    }
+    return 2 * len;
+}
+
+//****************************************************************************
+//
+//  reads up to 'len' hex characters from pIn as bytes into pOut, stopping
+//  at the first pair that isn't hex.  Returns the number of bytes written.
+//
+//****************************************************************************
+unsigned int
+gdb_hex_decode(unsigned char *pOut, const unsigned char *pIn, unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; (i + 1 < len) && isxdigit(pIn[i]) && isxdigit(pIn[i + 1]);
+         i += 2)
+    {
+        *pOut++ = (hexchartoi(pIn[i]) << 4) | hexchartoi(pIn[i + 1]);
+    }
+    return i / 2;
+}
+
+//****************************************************************************
+//
+//  if pPayload is a monitor command (qRcmd), puts its text in pCmd as a
+//  string and returns 1, otherwise returns 0.  pCmd has room for iSize
+//  characters including the terminating NUL.
+//
+//****************************************************************************
+int
+gdb_monitor(const unsigned char *pPayload, unsigned int len, char *pCmd,
+        unsigned int iSize)
+{
+    unsigned int n;
+
+    if (!PKT_IS(pPayload, len, "qRcmd,") || ((len - 6) / 2 >= iSize))
+    {
+        return 0;
+    }
+
+    n = gdb_hex_decode((unsigned char *)pCmd, pPayload + 6, len - 6);
+    pCmd[n] = 0;
+    return 1;
+}
+
+//****************************************************************************
+//
+//  escapes 'len' bytes of binary data for a packet payload.  pOut needs
+//  room for up to 2 * len bytes.  Returns the number of bytes written.
+//
+//****************************************************************************
+unsigned int
+gdb_escape(unsigned char *pOut, const unsigned char *pIn, unsigned int len)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if ((pIn[i] == '#') || (pIn[i] == '$') || (pIn[i] == '}') ||
+            (pIn[i] == '*'))
+        {
+            pOut[n++] = '}';
+            pOut[n++] = pIn[i] ^ 0x20;
+        }
+        else
+        {
+            pOut[n++] = pIn[i];
+        }
+    }
+    return n;
+}
+
+//****************************************************************************
+//
+//  undoes gdb_escape().  pOut may be the same buffer as pIn.  Returns the
+//  number of bytes decoded.
+//
+//****************************************************************************
+unsigned int
+gdb_unescape(unsigned char *pOut, const unsigned char *pIn, unsigned int len)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if ((pIn[i] == '}') && (i + 1 < len))
+        {
+            pOut[n++] = pIn[++i] ^ 0x20;
+        }
+        else
+        {
+            pOut[n++] = pIn[i];
+        }
+    }
+    return n;
+}
+
+//****************************************************************************
+//
+//  builds the payload of a binary memory write, "X<addr>,<len>:<data>" or
+//  with bFlash "vFlashWrite:<addr>:<data>", carrying as much of the 'len'
+//  bytes at pData as fits in a packet of iPacketSize bytes.  pOut needs
+//  room for iPacketSize + 32 bytes.  Returns the length of the payload and
+//  sets *piUsed to the number of data bytes in it.
+//
+//****************************************************************************
+unsigned int
+gdb_build_write(unsigned char *pOut, unsigned int iPacketSize, int bFlash,
+        unsigned int iAddr, const unsigned char *pData, unsigned int len,
+        unsigned int *piUsed)
+{
+    unsigned int iMax, iHdr, i, n;
+
+    //
+    // Leave room for the framing and the longest possible header
+    //
+    iMax = iPacketSize - 4 - sizeof("vFlashWrite:12345678:");
+
+    //
+    // Escape as much as fits after a gap for the header, whose length
+    // depends on how much that is
+    //
+    for (i = 0, n = 0; (i < len) && (n + 2 <= iMax); i++)
+    {
+        n += gdb_escape(pOut + 32 + n, pData + i, 1);
+    }
+
+    if (bFlash)
+    {
+        iHdr = sprintf((char *)pOut, "vFlashWrite:%x:", iAddr);
+    }
+    else
+    {
+        iHdr = sprintf((char *)pOut, "X%x,%x:", iAddr, i);
+    }
+    memmove(pOut + iHdr, pOut + 32, n);
+
+    *piUsed = i;
+    return iHdr + n;
+}
+
+//****************************************************************************
+//
+//  builds the packet "$<payload>#nn" for 'len' bytes of pPayload in pOut,
+//  which must have room for len + 4 bytes.  The payload must already be
+//  escaped.  Returns the length of the packet.
+//
+//****************************************************************************
+unsigned int
+gdb_frame(unsigned char *pOut, const unsigned char *pPayload, unsigned int len)
+{
+    static const char pHex[] = "0123456789abcdef";
+    unsigned char csum;
+
+    pOut[0] = '$';
+    memmove(pOut + 1, pPayload, len);
+    csum = gdb_checksum(pOut + 1, len);
+    pOut[len + 1] = '#';
+    pOut[len + 2] = pHex[csum >> 4];
+    pOut[len + 3] = pHex[csum & 0xf];
+    return len + 4;
+}
+
+//
+// Hand the complete packet of len bytes at pPkt to pFn.  pPkt is either
+// where the packet arrived or, if it came in pieces, pResp.
+//
+static void
+gdb_deliver(GDBCTX *pGdbCtx, unsigned char *pPkt, unsigned int len,
+        void(*pFn)(GDBCTX*, int))
+{
+    if (pFn)
+    {
+        pGdbCtx->pPkt = pPkt;
+        pGdbCtx->iRd = len;
+        pFn(pGdbCtx, (len < 4) ||
+            (!pGdbCtx->bTooLong && (gdb_validate(pGdbCtx) == 0)));
+    }
+    pGdbCtx->iRd = 0;
+    pGdbCtx->bTooLong = 0;
+}
+
+//
+// Hand a single out-of-band byte (Ctrl-C or a NAK) to pFn as a one byte
+// "packet".
+//
+static void
+gdb_deliver_byte(GDBCTX *pGdbCtx, unsigned char *pByte,
+        void(*pFn)(GDBCTX*, int))
+{
+    gdb_deliver(pGdbCtx, pByte, 1, pFn);
+}
+
 //****************************************************************************
 //
 //  handle 'len' bytes of 'pBuf' and advance the gdb state machine 
@@ -83,132 +358,128 @@ hexchartoi(char c)
 //
 //  When a complete packet has been received, call pFn passing the GDB 
 //  context structure and a boolean flag indicating whether or not the 
-//  checksum was valid.
+//  checksum was valid.  pPkt then points at exactly "$<payload>#nn".
+//
+//  Packets are found by scanning pBuf in place.  One that lies wholly in
+//  pBuf is handed over where it is, so pFn may get a pointer into pBuf
+//  (and may modify the packet there).  Only a packet split over several
+//  calls is gathered in pResp.
+//
+//  Acks ('+'), NAKs ('-') and GDB's Ctrl-C (0x03) are passed to pFn as one
+//  byte packets since the receiver may have to act on them.
+//
+//  A packet too long for pResp is read to its end all the same, so none of
+//  its bytes are taken for acks or Ctrl-C.  pFn gets it as "$#nn" with an
+//  invalid checksum, to NAK it.
 //
 //****************************************************************************
 void
 gdb_statemachine(GDBCTX *pGdbCtx, unsigned char *pBuf, unsigned int len,
         void(*pFn)(GDBCTX*, int))
 {
-    while (len--)
+    unsigned char *pEnd = pBuf + len;
+    unsigned char *pHash;
+    unsigned int n;
+
+    while (pBuf < pEnd)
     {
         switch(pGdbCtx->gdb_state)
         {
             case GDB_IDLE:
-               TRACE(0, "GDB_IDLE: '%c'\n", *pBuf);
                if (*pBuf == '$') 
                {
+                    pHash = memchr(pBuf, '#', pEnd - pBuf);
+                    if (pHash && (pEnd - pHash >= 3))
+                    {
+                        //
+                        // The whole packet is here, no need to move it
+                        //
+                        n = pHash + 3 - pBuf;
+                        pGdbCtx->csum = (hexchartoi(pHash[1]) << 4) |
+                                        hexchartoi(pHash[2]);
+                        if (n >= MSGSIZE)
+                        {
+                            TRACE(ALWAYS, "%s: packet too long, dropped\n",
+                                  __FUNCTION__);
+                            pGdbCtx->bTooLong = 1;
+                            memcpy(pGdbCtx->pResp, "$#", 2);
+                            memcpy(pGdbCtx->pResp + 2, pHash + 1, 2);
+                            gdb_deliver(pGdbCtx, pGdbCtx->pResp, 4, pFn);
+                        }
+                        else
+                        {
+                            gdb_deliver(pGdbCtx, pBuf, n, pFn);
+                        }
+                        pBuf += n;
+                        break;
+                    }
+
                     pGdbCtx->gdb_state = GDB_PAYLOAD;
+                    pGdbCtx->iRd = 0;
+                    pGdbCtx->pResp[pGdbCtx->iRd++] = *pBuf;
                }
-               if (*pBuf == '+')
+               else if (*pBuf == '+')
                {
                     pGdbCtx->iAckCount++;
+                    gdb_deliver_byte(pGdbCtx, pBuf, pFn);
                } 
-               if (*pBuf == '-')
+               else if (*pBuf == '-')
                {
                     pGdbCtx->iNakCount++;
+                    gdb_deliver_byte(pGdbCtx, pBuf, pFn);
                }
-               pGdbCtx->pResp[pGdbCtx->iRd++] = *pBuf;
-               if (*pBuf == 0x03)
+               else if (*pBuf == 0x03)
                {
                    /* GDB Ctrl-C */
-                   if (pFn)
-                   {
-                       pFn(pGdbCtx, 1);
-                       pGdbCtx->iRd = 0;
-                   }
+                   gdb_deliver_byte(pGdbCtx, pBuf, pFn);
                }
                pBuf++;
                break;
             case GDB_PAYLOAD:
-               TRACE(0, "GDB_PAYLOAD: '%c' 0x%02x\n", isprint(*pBuf) ? *pBuf : '.', *pBuf);
-                   pGdbCtx->pResp[pGdbCtx->iRd++] = *pBuf;
-               if (*pBuf == '#')
+               //
+               // Take everything up to and including the '#' in one go
+               //
+               pHash = memchr(pBuf, '#', pEnd - pBuf);
+               n = (pHash ? pHash + 1 : pEnd) - pBuf;
+
+               //
+               // Drop the payload of packets that would overflow our
+               // buffer (leaving room for the checksum), keeping the '#'
+               //
+               if (!pGdbCtx->bTooLong && (pGdbCtx->iRd + n > MSGSIZE - 3))
+               {
+                   TRACE(ALWAYS, "%s: packet too long, dropped\n", __FUNCTION__);
+                   pGdbCtx->bTooLong = 1;
+                   pGdbCtx->iRd = 1;
+               }
+               if (!pGdbCtx->bTooLong)
+               {
+                   memcpy(pGdbCtx->pResp + pGdbCtx->iRd, pBuf, n);
+                   pGdbCtx->iRd += n;
+               }
+               else if (pHash)
+               {
+                   pGdbCtx->pResp[pGdbCtx->iRd++] = '#';
+               }
+               pBuf += n;
+               if (pHash)
                {
                    pGdbCtx->gdb_state = GDB_CSUM1;
                }
-               pBuf++;
                break;
             case GDB_CSUM1:
-               TRACE(0, "GDB_CSUM1: '%c'\n", *pBuf);
                pGdbCtx->csum = hexchartoi(*pBuf) << 4;
                pGdbCtx->gdb_state = GDB_CSUM2;
                pGdbCtx->pResp[pGdbCtx->iRd++] = *pBuf;
                pBuf++;
                break;
             case GDB_CSUM2:
-               TRACE(0, "GDB_CSUM2: '%c'\n", *pBuf);
                pGdbCtx->csum |= hexchartoi(*pBuf);
                pGdbCtx->pResp[pGdbCtx->iRd++] = *pBuf;
-               if (pFn)
-               {
-                   if (gdb_validate(pGdbCtx->pResp, pGdbCtx->csum) == 0)
-                   {
-                       pFn(pGdbCtx, 1);
-                   }
-                   else
-                   {
-                       pFn(pGdbCtx, 0);
-                   }
-               }
-               pGdbCtx->iRd = 0;
                pGdbCtx->gdb_state = GDB_IDLE;
+               gdb_deliver(pGdbCtx, pGdbCtx->pResp, pGdbCtx->iRd, pFn);
                pBuf++;
                break;
         }
     }
 }
-
-//
-// Grab the payload from the GDB context and call pass it over to the socket
-// handling code.
-//
-static void gdb_packet_from_usb(GDBCTX *pGdbCtx, int bCsumValid)
-{
-    pGdbCtx->pResp[pGdbCtx->iRd] = 0;
-    usbRxResp(pGdbCtx->pResp, pGdbCtx->iRd);
-}
-
-//****************************************************************************
-//
-//  This is the USB callback that gets called whenever our background read
-//  operation RX'es anything from the USB devices (ie. the GDB server)
-//
-//****************************************************************************
-void LIBUSB_CALL
-usb_callback(struct libusb_transfer *pTrans)
-{
-    int rc;
-    
-    TRACE(1, "%s: enter\n", __FUNCTION__);
-    //
-    // Here we want to "digest" the received packet.  Then, hopefully,
-    // we can resubmit this same pTrans structure for the next receive
-    //
-    switch(pTrans->status)
-    {
-        case LIBUSB_TRANSFER_COMPLETED:
-            //
-            // Process whatever data we've RX'ed by invoking the GDB state
-            // machine.  When a complete GDB packet has been RX'ed the state
-            // machine will call gdb_packet_from_usb.
-            //
-            gdb_statemachine(pTrans->user_data, pTrans->buffer,
-                             pTrans->actual_length, gdb_packet_from_usb);
-
-            //
-            // Requeue the async RX operation so that we catch the next packet
-            // from the USB device
-            //
-            rc = libusb_submit_transfer(pTrans);
-            if (rc != 0)
-            {
-                TRACE(ALWAYS, "%s: submit_transfer: rc = 0x%08x\n", __FUNCTION__, rc);
-            }
-            break;
-
-        default:
-            TRACE(ALWAYS, "%s: status = 0x%08x\n", __FUNCTION__, pTrans->status);
-            break;
-    }
-}
@@ -0,0 +1,426 @@
+//*****************************************************************************
+//
+// lmcheck.c - checks a bridge against GDB sessions that went wrong before.
+//
+//     lmcheck host:port
+//
+// Runs a few short GDB sessions against the bridge on host:port and checks
+// that every request gets the answer GDB expects, and nothing else.  The
+// answers checked are those of a simulated ICDI, so the bridge is meant to
+// be lmicdi -S, which "make check" starts for it.  Exits with a failure
+// if any check fails.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CHECK_TIMEOUT           2000        // ms to wait for an answer
+#define CHECK_QUIET             200         // ms nothing may come in
+#define CHECK_PACKETS           8           // received and not yet looked at
+
+unsigned int gTraceLvl = 3;
+
+//
+// A GDB session with the bridge
+//
+typedef struct _SESSION
+{
+    int sd;
+    int bNoAck;
+    GDBCTX gdbCtx;
+    unsigned char pResp[MSGSIZE];
+
+    //
+    // The packets received, oldest first, and the NAKs
+    //
+    unsigned char pPkts[CHECK_PACKETS][MSGSIZE];
+    unsigned int pLens[CHECK_PACKETS];
+    unsigned int iPkts;
+    unsigned int iNaks;
+} SESSION;
+
+//
+// Connect to pTarget, "host:port", giving the bridge a moment to start
+//
+static int
+check_connect(const char *pTarget)
+{
+    struct addrinfo hints, *pAddr;
+    char pHost[256];
+    const char *pPort;
+    int sd, i, one = 1;
+
+    pPort = strrchr(pTarget, ':');
+    if ((pPort == NULL) || (pPort - pTarget >= (int)sizeof(pHost)))
+    {
+        fprintf(stderr, "%s: expected host:port\n", pTarget);
+        return -1;
+    }
+    memcpy(pHost, pTarget, pPort - pTarget);
+    pHost[pPort - pTarget] = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(pHost, pPort + 1, &hints, &pAddr) != 0)
+    {
+        fprintf(stderr, "%s: unknown host\n", pHost);
+        return -1;
+    }
+
+    for (i = 0; i < 50; i++)
+    {
+        sd = socket(pAddr->ai_family, pAddr->ai_socktype,
+                    pAddr->ai_protocol);
+        if ((sd >= 0) &&
+            (connect(sd, pAddr->ai_addr, pAddr->ai_addrlen) == 0))
+        {
+            freeaddrinfo(pAddr);
+            setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return sd;
+        }
+        if (sd >= 0)
+        {
+            close(sd);
+        }
+        usleep(100000);
+    }
+
+    perror(pTarget);
+    freeaddrinfo(pAddr);
+    return -1;
+}
+
+//
+// A packet or NAK from the bridge.  Packets are acked unless in no-ack
+// mode and kept for session_recv().
+//
+static void
+session_packet(GDBCTX *pGdbCtx, int bCsumValid)
+{
+    SESSION *pSes = pGdbCtx->pOwner;
+    unsigned int len;
+
+    if (pGdbCtx->iRd == 1)
+    {
+        pSes->iNaks += (pGdbCtx->pPkt[0] == '-');
+        return;
+    }
+
+    if (!pSes->bNoAck)
+    {
+        send(pSes->sd, bCsumValid ? "+" : "-", 1, 0);
+    }
+
+    len = pGdbCtx->iRd - 4;
+    if (!bCsumValid || (pSes->iPkts == CHECK_PACKETS))
+    {
+        fprintf(stderr, "  packet dropped: '%.*s'\n", (int)len,
+                pGdbCtx->pPkt + 1);
+        return;
+    }
+    memcpy(pSes->pPkts[pSes->iPkts], pGdbCtx->pPkt + 1, len);
+    pSes->pLens[pSes->iPkts++] = len;
+}
+
+//
+// Read from the bridge for up to iMs ms, or until a packet comes in if
+// bOne is set
+//
+static void
+session_read(SESSION *pSes, int iMs, int bOne)
+{
+    static unsigned char pBuf[MSGSIZE];
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = pSes->sd;
+    pfd.events = POLLIN;
+    while (!(bOne && pSes->iPkts) && (poll(&pfd, 1, iMs) > 0))
+    {
+        n = recv(pSes->sd, pBuf, sizeof(pBuf), 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        gdb_statemachine(&pSes->gdbCtx, pBuf, n, session_packet);
+    }
+}
+
+//
+// Take the oldest packet received, waiting for one if need be.  Returns
+// its length, or -1 if none came.
+//
+static int
+session_recv(SESSION *pSes, unsigned char *pPayload)
+{
+    unsigned int len;
+
+    session_read(pSes, CHECK_TIMEOUT, 1);
+    if (pSes->iPkts == 0)
+    {
+        return -1;
+    }
+
+    len = pSes->pLens[0];
+    memcpy(pPayload, pSes->pPkts[0], len);
+    pSes->iPkts--;
+    memmove(pSes->pPkts[0], pSes->pPkts[1], pSes->iPkts * MSGSIZE);
+    memmove(pSes->pLens, pSes->pLens + 1,
+            pSes->iPkts * sizeof(pSes->pLens[0]));
+    return len;
+}
+
+static void
+session_send(SESSION *pSes, const unsigned char *pPayload, unsigned int len)
+{
+    static unsigned char pBuf[MSGSIZE * 2];
+
+    send(pSes->sd, pBuf, gdb_frame(pBuf, pPayload, len), 0);
+}
+
+//
+// Send pRequest and check that the answer starts with pExpect.  Returns 0
+// if it does.
+//
+static int
+session_expect(SESSION *pSes, const char *pRequest, const char *pExpect)
+{
+    unsigned char pPayload[MSGSIZE];
+    int len;
+
+    session_send(pSes, (const unsigned char *)pRequest, strlen(pRequest));
+    len = session_recv(pSes, pPayload);
+    if (len < 0)
+    {
+        fprintf(stderr, "  %s: no answer\n", pRequest);
+        return -1;
+    }
+    if (((unsigned int)len < strlen(pExpect)) ||
+        (memcmp(pPayload, pExpect, strlen(pExpect)) != 0))
+    {
+        fprintf(stderr, "  %s: expected '%s...', got '%.*s'\n", pRequest,
+                pExpect, len, pPayload);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Check that nothing more comes in for a while.  Returns 0 if it doesn't.
+//
+static int
+session_quiet(SESSION *pSes)
+{
+    session_read(pSes, CHECK_QUIET, 0);
+    if (pSes->iPkts)
+    {
+        fprintf(stderr, "  unexpected '%.*s'\n", (int)pSes->pLens[0],
+                pSes->pPkts[0]);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Start a session on pTarget the way GDB does, in no-ack mode if bNoAck
+// is set.  Returns NULL if that fails.
+//
+static SESSION *
+session_open(const char *pTarget, int bNoAck)
+{
+    SESSION *pSes = calloc(1, sizeof(SESSION));
+
+    ASSERT(pSes != NULL);
+    pSes->gdbCtx.gdb_state = GDB_IDLE;
+    pSes->gdbCtx.pResp = pSes->pResp;
+    pSes->gdbCtx.pOwner = pSes;
+    pSes->sd = check_connect(pTarget);
+    if ((pSes->sd < 0) ||
+        (session_expect(pSes, "qSupported:multiprocess+",
+                        "PacketSize=") != 0) ||
+        (bNoAck && (session_expect(pSes, "QStartNoAckMode", "OK") != 0)))
+    {
+        if (pSes->sd >= 0)
+        {
+            close(pSes->sd);
+        }
+        free(pSes);
+        return NULL;
+    }
+    pSes->bNoAck = bNoAck;
+    return pSes;
+}
+
+static void
+session_close(SESSION *pSes)
+{
+    close(pSes->sd);
+    free(pSes);
+}
+
+//
+// Send len bytes of pData as they are, in pieces of iPiece bytes that
+// arrive one by one
+//
+static void
+session_send_raw(SESSION *pSes, const unsigned char *pData, unsigned int len,
+        unsigned int iPiece)
+{
+    unsigned int n;
+
+    for (; len; pData += n, len -= n)
+    {
+        n = (len < iPiece) ? len : iPiece;
+        send(pSes->sd, pData, n, 0);
+        usleep(50000);
+    }
+}
+
+//
+// GDB gets no answer to k, and its next session starts from scratch on a
+// reset core
+//
+static int
+check_kill(const char *pTarget, int bNoAck)
+{
+    SESSION *pSes;
+    int iErr;
+
+    pSes = session_open(pTarget, bNoAck);
+    if (pSes == NULL)
+    {
+        return -1;
+    }
+    iErr = session_expect(pSes, "?", "S05");
+    session_send(pSes, (const unsigned char *)"k", 1);
+    iErr |= session_quiet(pSes);
+    session_close(pSes);
+
+    pSes = session_open(pTarget, bNoAck);
+    if (pSes == NULL)
+    {
+        return -1;
+    }
+    iErr |= session_expect(pSes, "?", "S05");
+    iErr |= session_expect(pSes, "m0,4", "");
+    iErr |= session_quiet(pSes);
+    session_close(pSes);
+    return iErr;
+}
+
+//
+// A packet too long for the bridge is NAKed, or answered with an error in
+// no-ack mode, and none of it is taken for something else.  Its binary
+// data holds Ctrl-C, '+' and '-', in the pieces that come after the
+// bridge has run out of room.  With acks the core is kept running, so a
+// Ctrl-C would stop it.
+//
+static int
+check_too_long(const char *pTarget, int bNoAck)
+{
+    static unsigned char pPkt[MSGSIZE * 2];
+    static const unsigned char pStray[] = { 0x03, '+', '-', 0x03 };
+    unsigned char pPayload[MSGSIZE];
+    unsigned int len, i;
+    SESSION *pSes;
+    int iErr = 0;
+
+    pSes = session_open(pTarget, bNoAck);
+    if (pSes == NULL)
+    {
+        return -1;
+    }
+
+    len = sprintf((char *)pPkt, "X20000000,%x:", MSGSIZE);
+    for (i = 0; i < MSGSIZE; i++)
+    {
+        pPkt[len++] = (i < MSGSIZE / 2) ? 0x55 : pStray[i % 4];
+    }
+    len = gdb_frame(pPkt, pPkt, len);
+
+    if (!bNoAck)
+    {
+        session_send(pSes, (const unsigned char *)"c", 1);
+    }
+    session_send_raw(pSes, pPkt, len, MSGSIZE / 4);
+
+    if (bNoAck)
+    {
+        iErr |= (session_recv(pSes, pPayload) != 3) ||
+                (memcmp(pPayload, "E01", 3) != 0);
+        iErr |= session_quiet(pSes);
+        iErr |= session_expect(pSes, "?", "S05");
+    }
+    else
+    {
+        iErr |= session_quiet(pSes);
+        iErr |= (pSes->iNaks != 1);
+        session_send_raw(pSes, pStray, 1, 1);
+        iErr |= (session_recv(pSes, pPayload) != 3) ||
+                (memcmp(pPayload, "S02", 3) != 0);
+    }
+    if (iErr)
+    {
+        fprintf(stderr, "  %u NAKs\n", pSes->iNaks);
+    }
+    iErr |= session_quiet(pSes);
+    session_close(pSes);
+    return iErr;
+}
+
+//
+// The checks, each run with acks and in no-ack mode
+//
+static const struct
+{
+    const char *pName;
+    int (*pfnCheck)(const char *pTarget, int bNoAck);
+} pChecks[] =
+{
+    { "kill",       check_kill },
+    { "too long",   check_too_long },
+};
+#define CHECK_COUNT             (sizeof(pChecks) / sizeof(pChecks[0]))
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int i, iFailed = 0;
+    int bNoAck;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s host:port\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < CHECK_COUNT; i++)
+    {
+        for (bNoAck = 0; bNoAck <= 1; bNoAck++)
+        {
+            if (pChecks[i].pfnCheck(argv[1], bNoAck) == 0)
+            {
+                printf("%-12s %-7s ok\n", pChecks[i].pName,
+                       bNoAck ? "no-ack" : "ack");
+            }
+            else
+            {
+                printf("%-12s %-7s FAILED\n", pChecks[i].pName,
+                       bNoAck ? "no-ack" : "ack");
+                iFailed++;
+            }
+        }
+    }
+
+    return iFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
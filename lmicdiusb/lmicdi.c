@@ -40,6 +40,7 @@
 #include "lmicdi.h"
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 
 struct libusb_context *pCtx;
 
@@ -48,10 +49,19 @@ struct libusb_context *pCtx;
 #endif
 unsigned int gTraceLvl = TRACE_LEVEL;
 
-const struct libusb_endpoint_descriptor *pdEndpIn, *pdEndpOut;
-libusb_device_handle *phDev;
+//
+// Ports asked for on the command line for particular serial numbers
+//
+typedef struct _PORTMAP
+{
+    const char *pSerial;
+    int iPort;
+} PORTMAP;
+
+#define MAX_PORTMAP             32
 
-unsigned char pResp[MSGSIZE];
+static PORTMAP pPortMap[MAX_PORTMAP];
+static unsigned int iPortMap;
 
 
 void
@@ -119,99 +129,25 @@ _dump_if_strings(libusb_device_handle *phDev,
 }
 
 //
-// This is the GDB context for GDB responses from the USB target
+// Find the vendor specific interface of the ICDI behind pIcdi->phDev, claim
+// it and note its bulk endpoints.  Returns 0 on success.
 //
-unsigned char pUsbResp[MSGSIZE];
-GDBCTX gdbUsbCtx =
-{
-    GDB_IDLE,                   // gdb_state
-    pUsbResp,                   // pResp
-    0,                          // iRd
-    0,                          // csum
-    0,                          // iAckCount
-    0                           // iNakCount
-};
-//
-// This is the transfer structure that maintains the USB read in 
-// the background.
-//
-struct libusb_transfer *pTrans;
-
-//*****************************************************************************
-//
-//! Initializes the sample API.
-//!
-//! This function prepares the sample API for use by the application.
-//!
-//! \return None.
-//
-//*****************************************************************************
-int
-main(int argc, char *argv[])
+static int
+icdi_claim(ICDI *pIcdi, libusb_device *pDev,
+        struct libusb_device_descriptor *pdDev)
 {
     int rc;
-    unsigned int iDev, iCfg, iIf, iAlt, iEndp;
-    ssize_t nDevs;
-
-    libusb_device        **pDevices;
-    libusb_device        *pDev;
-
+    unsigned int iCfg, iIf, iAlt, iEndp;
     struct libusb_config_descriptor *pdCfg;
-    struct libusb_device_descriptor dDev;
-
-    rc = libusb_init(&pCtx);
-    ASSERT(rc == 0);
-
-    // libusb_set_debug(pCtx, 5);
-
-
-    nDevs = libusb_get_device_list(pCtx, &pDevices);
-    TRACE(0, "nDevs = %d\n", (int)nDevs);
-    ASSERT(nDevs >= 0);
-
-    pDev = NULL;
-    for (iDev = 0; iDev < nDevs; iDev++)
-    {
-        TRACE(0, "Considering device %d\n", iDev);
-        //
-        // Get the device descriptor so we know how many configurations there are
-        //
-        rc = libusb_get_device_descriptor(pDevices[iDev], &dDev);
-        ASSERT(rc == 0);
-        if ((dDev.idVendor == LMICDI_VID) &&
-            (dDev.idProduct == LMICDI_PID))
-        {
-            pDev = pDevices[iDev];
-            TRACE(1, "Found device with matching VID and PID.  pDev = %p\n", pDev);
-            break;
-        }
-    }
-
-    if (NULL == pDev)
-    {
-        fprintf(stderr, "No ICDI device with USB VID:PID %04x:%04x found!\n",
-                LMICDI_VID, LMICDI_PID);
-        return EXIT_FAILURE;
-    }
-
-    rc = libusb_open(pDev, &phDev);
-    if (rc != 0)
-    {
-        TRACE(ALWAYS, "Failed to open device.  rc = %d\n", rc);
-        libusb_free_device_list(pDevices, 1);
-        goto out;
-    }
+    libusb_device_handle *phDev = pIcdi->phDev;
 
     //
-    // NOTE: If/When we get here dDev should still be valid
-    //
-
     // For each configuration... 
     //   for each interface...
     //     for each alternate config for the interface...
     //        for each endpoint...
     //
-    for (iCfg = 0; iCfg < dDev.bNumConfigurations; iCfg++)
+    for (iCfg = 0; iCfg < pdDev->bNumConfigurations; iCfg++)
     {
         TRACE(1, D0 "iCfg = %d\n", iCfg);
 
@@ -245,16 +181,12 @@ main(int argc, char *argv[])
             }
         }
 #endif
-        //
-        // if the MFGr string is coming back as 0 then the device is wedged.
-        //
-        if (dDev.iManufacturer == 0) exit(EXIT_FAILURE);
 
         //
         // TODO: Figure out why some string indexes are coming back as 0
         //
         // _dump_cfg_strings(phDev, pdCfg, D0);
-        // _dump_dev_strings(phDev, &dDev, D0);
+        // _dump_dev_strings(phDev, pdDev, D0);
 
         for (iIf = 0; iIf < pdCfg->bNumInterfaces; iIf++)
         {
@@ -290,7 +222,14 @@ main(int argc, char *argv[])
                 }
 
                 rc = libusb_claim_interface(phDev, iIf);
-                ASSERT(rc == 0);
+                if (rc != 0)
+                {
+                    TRACE(ALWAYS, "Failed to claim interface %d.  rc = %d\n",
+                          iIf, rc);
+                    libusb_free_config_descriptor(pdCfg);
+                    return -1;
+                }
+                pIcdi->iIf = iIf;
                 
                 for (iEndp = 0; iEndp < pdIf->bNumEndpoints; iEndp++)
                 {
@@ -308,7 +247,7 @@ main(int argc, char *argv[])
                             LIBUSB_ENDPOINT_IN)
                     {
                         TRACE(1, D3 "Found ENDPOINT_IN\n");
-                        pdEndpIn = pdEndp;
+                        pIcdi->iEndpIn = pdEndp->bEndpointAddress;
                         continue;
                     }
 
@@ -316,7 +255,7 @@ main(int argc, char *argv[])
                             LIBUSB_ENDPOINT_OUT)
                     {
                         TRACE(1, D3 "Found ENDPOINT_OUT\n");
-                        pdEndpOut = pdEndp;
+                        pIcdi->iEndpOut = pdEndp->bEndpointAddress;
                         continue;
                     }
 
@@ -327,45 +266,378 @@ main(int argc, char *argv[])
                     TRACE(ALWAYS, "%s[%d]: Unexpected error\n", __FILE__, __LINE__);
                     ASSERT(0);
                 }
-                goto found;
+                libusb_free_config_descriptor(pdCfg);
+                return 0;
             }    
         }
+        libusb_free_config_descriptor(pdCfg);
+    }
+
+    TRACE(ALWAYS, "No ICDI interface found\n");
+    return -1;
+}
+
+//
+// Open the ICDI pDev and return it set up for bridging, NULL if it can't
+// be used.
+//
+static ICDI *
+icdi_open(libusb_device *pDev, struct libusb_device_descriptor *pdDev)
+{
+    ICDI *pIcdi;
+    int rc;
+
+    //
+    // if the MFGr string is coming back as 0 then the device is wedged.
+    //
+    if (pdDev->iManufacturer == 0)
+    {
+        TRACE(ALWAYS, "Skipping wedged ICDI device\n");
+        return NULL;
+    }
+
+    pIcdi = calloc(1, sizeof(ICDI));
+    ASSERT(pIcdi != NULL);
+
+    rc = libusb_open(pDev, &pIcdi->phDev);
+    if (rc != 0)
+    {
+        TRACE(ALWAYS, "Failed to open device.  rc = %d\n", rc);
+        free(pIcdi);
+        return NULL;
     }
 
-found:
+    rc = libusb_get_string_descriptor_ascii(pIcdi->phDev,
+            pdDev->iSerialNumber, (unsigned char *)pIcdi->pSerial,
+            sizeof(pIcdi->pSerial));
+    if (rc <= 0)
+    {
+        snprintf(pIcdi->pSerial, sizeof(pIcdi->pSerial), "bus%d-dev%d",
+                 libusb_get_bus_number(pDev), libusb_get_device_address(pDev));
+    }
+
+    if (icdi_claim(pIcdi, pDev, pdDev) != 0)
+    {
+        libusb_close(pIcdi->phDev);
+        free(pIcdi);
+        return NULL;
+    }
+
+    return pIcdi;
+}
+
+//
+// Open every ICDI on USB.  *pppIcdi is set to an array of them, which the
+// caller frees.
+//
+static unsigned int
+icdi_find(ICDI ***pppIcdi)
+{
+    int rc;
+    unsigned int iDev, nIcdi;
+    ssize_t nDevs;
+
+    libusb_device        **pDevices;
+    ICDI                 **ppIcdi;
+    ICDI                 *pIcdi;
+
+    struct libusb_device_descriptor dDev;
+
+    nDevs = libusb_get_device_list(pCtx, &pDevices);
+    TRACE(0, "nDevs = %d\n", (int)nDevs);
+    ASSERT(nDevs >= 0);
+
+    ppIcdi = calloc(nDevs + 1, sizeof(ICDI *));
+    ASSERT(ppIcdi != NULL);
+
+    nIcdi = 0;
+    for (iDev = 0; iDev < nDevs; iDev++)
+    {
+        TRACE(0, "Considering device %d\n", iDev);
+        //
+        // Get the device descriptor so we know how many configurations there are
+        //
+        rc = libusb_get_device_descriptor(pDevices[iDev], &dDev);
+        ASSERT(rc == 0);
+        if ((dDev.idVendor != LMICDI_VID) ||
+            (dDev.idProduct != LMICDI_PID))
+        {
+            continue;
+        }
+
+        TRACE(1, "Found device with matching VID and PID.  pDev = %p\n",
+              pDevices[iDev]);
+        pIcdi = icdi_open(pDevices[iDev], &dDev);
+        if (pIcdi)
+        {
+            ppIcdi[nIcdi++] = pIcdi;
+        }
+    }
     libusb_free_device_list(pDevices, 1);
 
+    *pppIcdi = ppIcdi;
+    return nIcdi;
+}
+
+//
+// Make iSim simulated ICDIs, see sim.c.  *pppIcdi is set to an array of
+// them, which the caller frees.
+//
+static unsigned int
+icdi_simulate(unsigned int iSim, ICDI ***pppIcdi)
+{
+    ICDI **ppIcdi;
+    unsigned int nIcdi;
+
+    ppIcdi = calloc(iSim, sizeof(ICDI *));
+    ASSERT(ppIcdi != NULL);
+
+    for (nIcdi = 0; nIcdi < iSim; nIcdi++)
+    {
+        ppIcdi[nIcdi] = sim_open(nIcdi);
+        if (ppIcdi[nIcdi] == NULL)
+        {
+            break;
+        }
+    }
+
+    *pppIcdi = ppIcdi;
+    return nIcdi;
+}
+
+//
+// Order ICDIs by serial number, so the fallback ports don't depend on the
+// order the USB stack lists them in
+//
+static int
+icdi_compare(const void *pA, const void *pB)
+{
+    return strcmp((*(ICDI * const *)pA)->pSerial,
+                  (*(ICDI * const *)pB)->pSerial);
+}
+
+//
+// The port the ICDI with serial number pSerial and index iIndex is served
+// on: whatever was asked for on the command line, else iBasePort + iIndex
+//
+static int
+icdi_port(const char *pSerial, unsigned int iIndex, int iBasePort)
+{
+    unsigned int i;
+
+    for (i = 0; i < iPortMap; i++)
+    {
+        if (strcmp(pPortMap[i].pSerial, pSerial) == 0)
+        {
+            return pPortMap[i].iPort;
+        }
+    }
+    return iBasePort + iIndex;
+}
+
+//
+// Get the modules serving pIcdi going and start listening to the ICDI
+//
+static void
+icdi_start(ICDI *pIcdi)
+{
     //
-    // EXPERIMENT:  Can we kick of an async receive and then do a 
-    // synchronous transmit? ANSWER:  YES!
+    // This is the GDB context for GDB responses from the USB target
     //
-    pTrans = libusb_alloc_transfer(0);
-    ASSERT(pTrans != NULL);
-    
+    pIcdi->gdbUsbCtx.gdb_state = GDB_IDLE;
+    pIcdi->gdbUsbCtx.pResp = pIcdi->pUsbResp;
+    pIcdi->gdbUsbCtx.pOwner = pIcdi;
+
+    bridge_init(pIcdi);
+    cache_init(pIcdi);
+    regcache_init(pIcdi);
+    flash_init(pIcdi);
+    profile_init(pIcdi);
+    rtt_init(pIcdi);
+    watch_init(pIcdi);
+    cond_init(pIcdi);
+    step_init(pIcdi);
+    metrics_init(pIcdi);
+
     //
-    // Set up a pending receive...
+    // Keep receives pending in the background while we transmit
     //
-    libusb_fill_bulk_transfer(pTrans, phDev, pdEndpIn->bEndpointAddress,
-            pResp, sizeof(pResp), usb_callback, &gdbUsbCtx, 0);
+    usb_rx_start(pIcdi);
+}
+
+static void
+on_signal(int iSig)
+{
+    event_stop();
+}
+
+static void
+usage(const char *pName)
+{
+    fprintf(stderr,
+            "usage: %s [-p base-port] [-s serial=port]... [-f farm-port]\n"
+            "       [-m metrics-port] [-r trace-file] [-S count [-L ms]]\n"
+            "\n"
+            "Serves every ICDI attached on a TCP port of its own.  An ICDI\n"
+            "named with -s gets the port given for it, the others get the\n"
+            "base port (%d by default) plus their index in order of serial\n"
+            "number.\n"
+            "\n"
+            "With -f the ICDIs are pooled instead: each session connecting\n"
+            "to the farm port gets an idle one, or waits for one to come\n"
+            "free.\n"
+            "\n"
+            "With -m the counters of the bridge are served for Prometheus\n"
+            "at http://host:metrics-port/metrics.\n"
+            "\n"
+            "With -r all the traffic through the bridge is recorded to\n"
+            "trace-file, for lmreplay.\n"
+            "\n"
+            "With -S count simulated ICDIs are served instead of the ones\n"
+            "on USB, each answering ms milliseconds (-L, 0 by default)\n"
+            "after a request.\n", pName, PORT);
+}
+
+//*****************************************************************************
+//
+//! Initializes the sample API.
+//!
+//! This function prepares the sample API for use by the application.
+//!
+//! \return None.
+//
+//*****************************************************************************
+int
+main(int argc, char *argv[])
+{
+    int rc, iOpt, iBasePort = PORT, iFarmPort = -1, iMetricsPort = -1;
+    const char *pRecord = NULL;
+    unsigned int iDev, nIcdi, iSim = 0;
+    char *pEq;
+
+    ICDI                 **ppIcdi;
+    ICDI                 *pIcdiList, *pIcdi;
+
+    while ((iOpt = getopt(argc, argv, "p:s:f:m:r:S:L:")) != -1)
+    {
+        switch (iOpt)
+        {
+            case 'p':
+                iBasePort = atoi(optarg);
+                break;
+
+            case 's':
+                pEq = strchr(optarg, '=');
+                if ((pEq == NULL) || (iPortMap == MAX_PORTMAP))
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                *pEq = 0;
+                pPortMap[iPortMap].pSerial = optarg;
+                pPortMap[iPortMap].iPort = atoi(pEq + 1);
+                iPortMap++;
+                break;
+
+            case 'f':
+                iFarmPort = atoi(optarg);
+                break;
+
+            case 'm':
+                iMetricsPort = atoi(optarg);
+                break;
+
+            case 'r':
+                pRecord = optarg;
+                break;
+
+            case 'S':
+                iSim = atoi(optarg);
+                break;
+
+            case 'L':
+                sim_set_latency(atoi(optarg));
+                break;
+
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    rc = libusb_init(&pCtx);
+    ASSERT(rc == 0);
+
+    // libusb_set_debug(pCtx, 5);
+
+    if (iSim)
+    {
+        nIcdi = icdi_simulate(iSim, &ppIcdi);
+    }
+    else
+    {
+        nIcdi = icdi_find(&ppIcdi);
+    }
+
+    if (nIcdi == 0)
+    {
+        fprintf(stderr, iSim ? "Can't simulate ICDIs!\n" :
+                "No ICDI device with USB VID:PID %04x:%04x found!\n",
+                LMICDI_VID, LMICDI_PID);
+        free(ppIcdi);
+        libusb_exit(pCtx);
+        return EXIT_FAILURE;
+    }
 
     //
-    // And wait for a RX operation to complete...
+    // Number them and chain them up in order of serial number
     //
-    rc = libusb_submit_transfer(pTrans);
-    if (rc != 0)
+    qsort(ppIcdi, nIcdi, sizeof(ICDI *), icdi_compare);
+    pIcdiList = NULL;
+    for (iDev = nIcdi; iDev-- > 0; )
     {
-        TRACE(ALWAYS, "%s: ERROR: submit_transfer rc = %d\n", __FUNCTION__, rc);
+        pIcdi = ppIcdi[iDev];
+        pIcdi->iIndex = iDev;
+        pIcdi->iPort = icdi_port(pIcdi->pSerial, iDev, iBasePort);
+        pIcdi->pNext = pIcdiList;
+        pIcdiList = pIcdi;
+
+        icdi_start(pIcdi);
     }
+    free(ppIcdi);
 
-    SocketIO(PORT, phDev);
+    //
+    // A trace is only complete once it's closed, so stop cleanly when
+    // asked to
+    //
+    if (pRecord)
+    {
+        if (record_open(pRecord) != 0)
+        {
+            libusb_exit(pCtx);
+            return EXIT_FAILURE;
+        }
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+    }
 
-    TRACE(1, "%s: libusb_release_interface\n", __FUNCTION__);
-    libusb_release_interface(phDev, iIf);
+    SocketIO(pIcdiList, iFarmPort, iMetricsPort);
+    record_close();
 
-    TRACE(1, "%s: libusb_close(phDev)\n", __FUNCTION__);
-    libusb_close(phDev);
+    for (pIcdi = pIcdiList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        if (pIcdi->phDev == NULL)
+        {
+            continue;
+        }
+
+        TRACE(1, "%s: libusb_release_interface\n", __FUNCTION__);
+        libusb_release_interface(pIcdi->phDev, pIcdi->iIf);
+
+        TRACE(1, "%s: libusb_close(phDev)\n", __FUNCTION__);
+        libusb_close(pIcdi->phDev);
+    }
 
-out:
     TRACE(1, "%s: libusb_exit\n", __FUNCTION__);
     libusb_exit(pCtx);
 
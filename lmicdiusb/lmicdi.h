@@ -67,8 +67,27 @@
 // Behavior related
 //
 #define PORT 					7777
+#define MAX_SERIAL              64
+#define MAX_CLIENTS             4
 #define MSGSIZE 8192
 
+//
+// Flash reads are cached in lines of CACHE_LINE bytes, and reads longer
+// than MAX_CACHED_READ go straight to the ICDI.  Sequential RAM reads are
+// served from a window of PREFETCH_WINDOW bytes read ahead.
+//
+#define CACHE_LINE              64
+#define MAX_CACHED_READ         1024
+#define PREFETCH_WINDOW         512
+
+//
+// The packet size we assume for the ICDI until its qSupported reply says,
+// and the one we advertise to GDB.  Requests from GDB that don't fit the
+// ICDI's are split up in the bridge.
+//
+#define DEFAULT_PACKET_SIZE     0x400
+#define GDB_PACKET_SIZE         (MSGSIZE - 32)
+
 //
 // Debug related
 //
@@ -82,6 +101,12 @@
 
 #define ALWAYS                  -1
 
+//
+// Does the packet payload p of length len start with the string str?
+//
+#define PKT_IS(p, len, str) \
+    (((len) >= sizeof(str) - 1) && (memcmp((p), (str), sizeof(str) - 1) == 0))
+
 #define D0                      ""
 #define D1                      "\t"
 #define D2                      "\t\t"
@@ -100,11 +125,161 @@ typedef struct _GDBCTX
 	GDB_STATE gdb_state;
 	unsigned char *pResp;
 	unsigned int iRd;
+	int bTooLong;               // the packet being read didn't fit
 	unsigned char csum;
 	unsigned int iAckCount;
 	unsigned int iNakCount;
+	unsigned char *pPkt;        // the packet handed to the callback
+	void *pOwner;               // whoever the packets are for
 } GDBCTX;
 
+typedef struct _ICDI ICDI;
+
+//
+// A GDB client connected to our TCP port.  Packets to the client are
+// collected in pOut and flushed once per batch of work, and the last
+// response is kept in case the client NAKs it.  Several clients may share
+// an ICDI, chained through pNext.
+//
+typedef struct _GDBCLIENT GDBCLIENT;
+struct _GDBCLIENT
+{
+	GDBCLIENT *pNext;
+	ICDI *pIcdi;
+	int sd;
+	unsigned int iSession;      // of its ICDI, counting from 1
+	GDBCTX gdbCtx;
+	int bNoAck;
+	int bBatch;
+	unsigned int iOut;
+	unsigned int iLast;
+	unsigned char pOut[MSGSIZE];
+	unsigned char pLast[MSGSIZE];
+	unsigned char pReq[MSGSIZE];
+};
+
+//
+// A request queued for the ICDI on behalf of pCli.  pfnDone is called with
+// the payload of the matching response (without the framing, in a buffer
+// that is only valid during the call).
+//
+typedef struct _PROBEREQ PROBEREQ;
+typedef void (*PROBE_FN)(PROBEREQ *pReq, unsigned char *pPayload,
+        unsigned int iLen);
+struct _PROBEREQ
+{
+	PROBEREQ *pNext;
+	ICDI *pIcdi;
+	GDBCLIENT *pCli;
+	PROBE_FN pfnDone;
+	void *pCtx;
+	int bSent;
+	int bAcked;
+	int bBarrier;
+	int bNoReply;               // k and R: done with once the ICDI has it
+	int bOnWire;                // pPkt is in a USB transfer
+	int bDone;                  // free once the transfer lets go
+	unsigned int iSeq;
+	unsigned long long iSentUs; // when it last went on the wire
+	unsigned int iLen;
+	unsigned char pPkt[];
+};
+
+//
+// The state each module keeps per ICDI, private to that module
+//
+typedef struct _BRIDGE BRIDGE;
+typedef struct _CACHE CACHE;
+typedef struct _REGCACHE REGCACHE;
+typedef struct _FLASHBUF FLASHBUF;
+typedef struct _USBIO USBIO;
+typedef struct _PROFILE PROFILE;
+typedef struct _RTT RTT;
+typedef struct _WATCH WATCH;
+typedef struct _COND COND;
+typedef struct _STEP STEP;
+typedef struct _METRICS METRICS;
+typedef struct _SIM SIM;
+typedef struct _ELFSYMS ELFSYMS;
+
+//
+// One ICDI we serve: its USB link, the port GDB reaches it on and the
+// clients connected there.  bFarm is set when it's handed out from the
+// farm port instead.
+//
+struct _ICDI
+{
+	ICDI *pNext;
+	unsigned int iIndex;
+	char pSerial[MAX_SERIAL];
+	libusb_device_handle *phDev;
+	int iIf;
+	unsigned char iEndpIn;
+	unsigned char iEndpOut;
+	GDBCTX gdbUsbCtx;           // responses from the ICDI
+	unsigned char pUsbResp[MSGSIZE];
+	int iPort;
+	int sdListen;
+	int bFarm;
+	GDBCLIENT *pClients;
+	unsigned int iClients;
+	BRIDGE *pBridge;
+	CACHE *pCache;
+	REGCACHE *pRegCache;
+	FLASHBUF *pFlash;
+	USBIO *pUsb;
+	PROFILE *pProfile;
+	RTT *pRtt;
+	WATCH *pWatch;
+	COND *pCond;
+	STEP *pStep;
+	METRICS *pMetrics;
+	SIM *pSim;                  // the simulation, if it's not on USB
+	ELFSYMS *pElf;               // symbols of its firmware, if loaded
+	unsigned int iSessions;     // sessions served so far
+	unsigned int iLastUse;      // when the farm last handed it out
+	time_t tAttached;           // start of the current session, 0 if idle
+	time_t tBusy;               // seconds spent in earlier sessions
+};
+
+//
+// The counters kept per ICDI for the metrics page
+//
+typedef enum
+{
+	METRIC_GDB_BYTES_IN, METRIC_GDB_BYTES_OUT,
+	METRIC_USB_BYTES_IN, METRIC_USB_BYTES_OUT,
+	METRIC_MEM_HITS, METRIC_MEM_MISSES, METRIC_REG_HITS, METRIC_REG_MISSES,
+	METRIC_USB_RETRIES, METRIC_USB_ERRORS,
+	METRIC_COUNTERS
+} METRIC;
+
+//
+// What a record of a trace file holds, see record.c
+//
+#define REC_MAGIC               "LMREC\0\1\0"
+#define REC_HEADER              10
+
+typedef enum
+{
+	REC_GDB_IN,                 // from a GDB client
+	REC_GDB_OUT,                // to a GDB client
+	REC_USB_OUT,                // to the ICDI
+	REC_USB_IN,                 // from the ICDI
+	REC_OPEN,                   // a GDB client connected
+	REC_CLOSE                   // a GDB client went away
+} REC_KIND;
+
+//
+// Called from event_run() with the poll() style events ready on fd
+//
+typedef void (*EVENT_FN)(int fd, short revents, void *pCtx);
+
+//
+// Called from event_run() each time a timer is due
+//
+typedef void (*TIMER_FN)(void *pCtx);
+
 //*****************************************************************************
 //
 //   GLOBALS
@@ -113,9 +288,6 @@ typedef struct _GDBCTX
 extern struct libusb_context *pCtx;
 extern unsigned int gTraceLvl;
 
-extern const struct libusb_endpoint_descriptor *pdEndpIn, *pdEndpOut;
-extern libusb_device_handle *phDev;
-
 
 //*****************************************************************************
 //
@@ -123,18 +295,332 @@ extern libusb_device_handle *phDev;
 //
 //*****************************************************************************
 extern int
-SocketIO(int iPort, libusb_device_handle *phDev);
+SocketIO(ICDI *pIcdiList, int iFarmPort, int iMetricsPort);
+
+int
+Listen(unsigned int iPort);
+
+void
+client_attach(ICDI *pIcdi, int sd, unsigned char *pPending,
+        unsigned int iPending);
 
 void LIBUSB_CALL usb_callback
 (struct libusb_transfer *pTrans);
 
 void
-gdb_send_ack(const char cAck);
+usbTxReq(ICDI *pIcdi, const unsigned char *pBuf, unsigned int len);
+
+void
+usbTxPkt(ICDI *pIcdi, unsigned char *pBuf, unsigned int len,
+        void (*pfnDone)(void *pCtx), void *pCtx);
+
+int
+usb_rx_start(ICDI *pIcdi);
 
 void
-usbRxResp(unsigned char *pResp, unsigned int len);
+usb_rx_deliver(ICDI *pIcdi, unsigned char *pBuf, unsigned int len);
+
+int
+usb_thread_start(struct libusb_context *pUsbCtx);
+
+void
+usb_thread_stop(void);
 
 void
 gdb_statemachine(GDBCTX *pGdbCtx, unsigned char *pBuf, unsigned int len,
         void(*pFn)(GDBCTX*, int));
 
+unsigned char
+gdb_checksum(const unsigned char *pBuf, unsigned int len);
+
+unsigned int
+gdb_frame(unsigned char *pOut, const unsigned char *pPayload, unsigned int len);
+
+int
+hexchartoi(char c);
+
+unsigned int
+gdb_parse_hex(const unsigned char *pBuf, unsigned int len, unsigned int *pVal);
+
+unsigned int
+gdb_parse_range(const unsigned char *pBuf, unsigned int len,
+        unsigned int *pAddr, unsigned int *pLen);
+
+unsigned int
+gdb_hex_encode(unsigned char *pOut, const unsigned char *pIn, unsigned int len);
+
+unsigned int
+gdb_hex_decode(unsigned char *pOut, const unsigned char *pIn, unsigned int len);
+
+int
+gdb_monitor(const unsigned char *pPayload, unsigned int len, char *pCmd,
+        unsigned int iSize);
+
+unsigned int
+gdb_escape(unsigned char *pOut, const unsigned char *pIn, unsigned int len);
+
+unsigned int
+gdb_unescape(unsigned char *pOut, const unsigned char *pIn, unsigned int len);
+
+unsigned int
+gdb_build_write(unsigned char *pOut, unsigned int iPacketSize, int bFlash,
+        unsigned int iAddr, const unsigned char *pData, unsigned int len,
+        unsigned int *piUsed);
+
+void
+client_write(GDBCLIENT *pCli, const unsigned char *pBuf, unsigned int len);
+
+unsigned char *
+client_reserve(GDBCLIENT *pCli, unsigned int len);
+
+void
+client_commit(GDBCLIENT *pCli, unsigned int len);
+
+void
+client_flush(GDBCLIENT *pCli);
+
+void
+gdb_reply(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len);
+
+void
+gdb_console(GDBCLIENT *pCli, const char *pText);
+
+void
+gdb_notify(GDBCLIENT *pCli, const char *pName, const unsigned char *pPayload,
+        unsigned int len);
+
+void
+probe_submit(ICDI *pIcdi, GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len, PROBE_FN pfnDone, void *pCtx);
+
+unsigned int
+probe_packet_size(ICDI *pIcdi);
+
+void
+bridge_init(ICDI *pIcdi);
+
+void
+bridge_client_packet(GDBCLIENT *pCli, GDBCTX *pGdbCtx, int bCsumValid);
+
+void
+bridge_usb_packet(GDBCTX *pGdbCtx, int bCsumValid);
+
+void
+bridge_client_closed(GDBCLIENT *pCli);
+
+void
+bridge_stop_broadcast(ICDI *pIcdi, GDBCLIENT *pCli,
+        const unsigned char *pPayload, unsigned int len);
+
+void
+bridge_warn_resumed(GDBCLIENT *pCli, const char *pWhat);
+
+void
+cache_init(ICDI *pIcdi);
+
+void
+cache_memory_map(ICDI *pIcdi, unsigned int iOffset,
+        const unsigned char *pData, unsigned int len, int bLast);
+
+int
+cache_is_flash(ICDI *pIcdi, unsigned int iAddr, unsigned int len);
+
+int
+cache_read(ICDI *pIcdi, unsigned int iAddr, unsigned int len,
+        unsigned char *pOut);
+
+void
+cache_fill(ICDI *pIcdi, unsigned int iGen, unsigned int iAddr,
+        const unsigned char *pData, unsigned int len);
+
+void
+cache_invalidate(ICDI *pIcdi, unsigned int iAddr, unsigned int len);
+
+int
+cache_window_for(ICDI *pIcdi, unsigned int iAddr, unsigned int len,
+        unsigned int *piStart, unsigned int *piLen);
+
+void
+cache_window_fill(ICDI *pIcdi, unsigned int iGen, unsigned int iAddr,
+        const unsigned char *pData, unsigned int len);
+
+void
+cache_window_drop(ICDI *pIcdi);
+
+void
+cache_flush(ICDI *pIcdi);
+
+unsigned int
+cache_generation(ICDI *pIcdi);
+
+void
+regcache_init(ICDI *pIcdi);
+
+void
+regcache_invalidate(ICDI *pIcdi);
+
+void
+regcache_set_halted(ICDI *pIcdi, int bHalt);
+
+int
+regcache_halted(ICDI *pIcdi);
+
+int
+regcache_request(ICDI *pIcdi, GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len);
+
+void
+flash_init(ICDI *pIcdi);
+
+int
+flash_request(ICDI *pIcdi, GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len);
+
+void
+flash_client_closed(ICDI *pIcdi);
+
+int
+farm_init(ICDI *pIcdiList, int iPort);
+
+void
+farm_release(ICDI *pIcdi);
+
+int
+farm_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len);
+
+void
+profile_init(ICDI *pIcdi);
+
+int
+profile_request(GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len);
+
+void
+rtt_init(ICDI *pIcdi);
+
+int
+rtt_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len);
+
+void
+watch_init(ICDI *pIcdi);
+
+int
+watch_request(GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len);
+
+void
+cond_init(ICDI *pIcdi);
+
+int
+cond_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len);
+
+int
+cond_breakpoint_at(ICDI *pIcdi, unsigned int iAddr);
+
+void
+cond_interrupt(ICDI *pIcdi);
+
+void
+cond_client_closed(GDBCLIENT *pCli);
+
+void
+step_init(ICDI *pIcdi);
+
+unsigned int
+step_vcont(unsigned char *pPayload, unsigned int len);
+
+int
+step_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len);
+
+void
+step_interrupt(ICDI *pIcdi);
+
+void
+step_client_closed(GDBCLIENT *pCli);
+
+void
+metrics_init(ICDI *pIcdi);
+
+void
+metrics_add(ICDI *pIcdi, METRIC eCounter, unsigned int n);
+
+void
+metrics_packet(ICDI *pIcdi, const unsigned char *pPayload, unsigned int len);
+
+void
+metrics_sent(PROBEREQ *pReq);
+
+void
+metrics_done(PROBEREQ *pReq);
+
+int
+metrics_serve(ICDI *pIcdiList, int iPort);
+
+int
+record_open(const char *pName);
+
+void
+record_close(void);
+
+void
+record_bytes(ICDI *pIcdi, unsigned int iSession, REC_KIND eKind,
+        const unsigned char *pBuf, unsigned int len);
+
+void
+sim_set_latency(unsigned int iLatency);
+
+ICDI *
+sim_open(unsigned int iIndex);
+
+void
+sim_send(ICDI *pIcdi, const unsigned char *pBuf, unsigned int len);
+
+ELFSYMS *
+elf_load(const char *pName, const char **ppErr);
+
+void
+elf_free(ELFSYMS *pElf);
+
+unsigned int
+elf_function_count(ELFSYMS *pElf);
+
+int
+elf_function(ELFSYMS *pElf, unsigned int iAddr);
+
+const char *
+elf_function_name(ELFSYMS *pElf, int iFunc);
+
+int
+elf_object(ELFSYMS *pElf, const char *pName, unsigned int *piAddr,
+        unsigned int *piSize);
+
+const char *
+elf_attach(ICDI *pIcdi, const char *pName);
+
+int
+elf_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len);
+
+int
+event_init(void);
+
+int
+event_add(int fd, short events, EVENT_FN pfnEvent, void *pCtx);
+
+int
+event_mod(int fd, short events);
+
+void
+event_del(int fd);
+
+int
+event_timer_add(unsigned int iPeriod, TIMER_FN pfnTimer, void *pCtx);
+
+void
+event_timer_del(int iTimer);
+
+int
+event_run(void);
+
+void
+event_stop(void);
+
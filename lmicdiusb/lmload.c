@@ -0,0 +1,465 @@
+//*****************************************************************************
+//
+// lmload.c - puts a bridge under load from many GDB clients at once.
+//
+//     lmload [-c clients] [-t seconds] host:port...
+//
+// Connects the given number of clients to each host:port and has them
+// start as GDB does: no-ack mode, qSupported, the memory map and the stop
+// reason, which is what lets the bridge cache flash and registers.  Then
+// each of them sends the requests GDB sends most while a program is being
+// debugged, one after the other as fast as they are answered: reading the
+// registers, single registers, RAM and flash, and writing RAM.  Now and
+// then a client kills the program with k, which gets no answer, and
+// starts a new session; the time that takes is reported as that of k.
+// After the given time it reports how many requests were answered a
+// second and how long they took to be, by type.
+//
+// Against lmicdi -S this measures the bridge itself, with the latency of
+// the simulated ICDIs (-L) standing in for the USB link.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LOAD_TIMEOUT            10000       // ms to wait for an answer
+#define LOAD_MAX_CLIENTS        1024
+
+unsigned int gTraceLvl = 3;
+
+//
+// The requests each client sends in turn
+//
+static const struct
+{
+    const char *pName;
+    const char *pPayload;
+} pMix[] =
+{
+    { "g",        "g" },
+    { "p",        "p0f" },
+    { "m ram",    "m20000000,100" },
+    { "p",        "p0d" },
+    { "m flash",  "m0,100" },
+    { "M ram",    "M20000100,8:0123456789abcdef" },
+    { "m ram",    "m20000100,8" },
+    { "m periph", "m400fe000,4" },
+    { "k",        "k" },
+};
+#define MIX_COUNT               (sizeof(pMix) / sizeof(pMix[0]))
+
+//
+// What each client sends first, as GDB does when it connects.  The memory
+// map is read on from where the last part of it ended until it is all in.
+//
+static const char *pHello[] =
+{
+    "QStartNoAckMode",
+    "qSupported:multiprocess+;qRelocInsn+",
+    "qXfer:memory-map:read::%x,fff",
+    "?",
+};
+#define HELLO_COUNT             (sizeof(pHello) / sizeof(pHello[0]))
+#define HELLO_MAP               2
+
+//
+// The latencies measured for one type of request
+//
+typedef struct _LATENCY
+{
+    const char *pName;
+    unsigned long long *pUs;
+    unsigned int iCount;
+    unsigned int iSize;
+} LATENCY;
+
+static LATENCY pLatency[MIX_COUNT];
+static unsigned int iTypes;
+
+typedef struct _CLIENT
+{
+    const char *pTarget;
+    struct pollfd *pPfd;
+    int sd;
+    GDBCTX gdbCtx;
+    unsigned char pResp[MSGSIZE];
+    unsigned int iHello;        // into pHello, until the mix starts
+    unsigned int iMapOffset;    // of the memory map read so far
+    unsigned int iNext;         // into pMix
+    unsigned long long iSent;
+    unsigned long long iKilled; // when the last session ended with k
+    LATENCY *pLatency;
+} CLIENT;
+
+static unsigned long long iErrors;
+
+static unsigned long long
+load_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+// Connect to pTarget, "host:port"
+//
+static int
+load_connect(const char *pTarget)
+{
+    struct addrinfo hints, *pAddr;
+    char pHost[256];
+    const char *pPort;
+    int sd, one = 1;
+
+    pPort = strrchr(pTarget, ':');
+    if ((pPort == NULL) || (pPort - pTarget >= (int)sizeof(pHost)))
+    {
+        fprintf(stderr, "%s: expected host:port\n", pTarget);
+        return -1;
+    }
+    memcpy(pHost, pTarget, pPort - pTarget);
+    pHost[pPort - pTarget] = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(pHost, pPort + 1, &hints, &pAddr) != 0)
+    {
+        fprintf(stderr, "%s: unknown host\n", pHost);
+        return -1;
+    }
+
+    sd = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+    if ((sd < 0) || (connect(sd, pAddr->ai_addr, pAddr->ai_addrlen) != 0))
+    {
+        perror(pTarget);
+        freeaddrinfo(pAddr);
+        return -1;
+    }
+    freeaddrinfo(pAddr);
+
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sd;
+}
+
+//
+// Where the latencies of requests called pName go
+//
+static LATENCY *
+latency_find(const char *pName)
+{
+    unsigned int i;
+
+    for (i = 0; i < iTypes; i++)
+    {
+        if (strcmp(pLatency[i].pName, pName) == 0)
+        {
+            return &pLatency[i];
+        }
+    }
+    pLatency[iTypes].pName = pName;
+    return &pLatency[iTypes++];
+}
+
+static void
+latency_add(LATENCY *pLat, unsigned long long iUs)
+{
+    if (pLat->iCount == pLat->iSize)
+    {
+        pLat->iSize = pLat->iSize ? 2 * pLat->iSize : 4096;
+        pLat->pUs = realloc(pLat->pUs, pLat->iSize * sizeof(pLat->pUs[0]));
+        ASSERT(pLat->pUs != NULL);
+    }
+    pLat->pUs[pLat->iCount++] = iUs;
+}
+
+static int
+latency_compare(const void *pA, const void *pB)
+{
+    unsigned long long iA = *(const unsigned long long *)pA;
+    unsigned long long iB = *(const unsigned long long *)pB;
+
+    return (iA > iB) - (iA < iB);
+}
+
+//
+// Print the spread of the latencies in pLat, sorting them
+//
+static void
+latency_print(const char *pName, LATENCY *pLat, double fSecs)
+{
+    unsigned long long iSum = 0, *pUs = pLat->pUs;
+    unsigned int i, iCount = pLat->iCount;
+
+    if (iCount == 0)
+    {
+        return;
+    }
+
+    qsort(pUs, iCount, sizeof(pUs[0]), latency_compare);
+    for (i = 0; i < iCount; i++)
+    {
+        iSum += pUs[i];
+    }
+
+    printf("%-9s %8.0f %8llu %8llu %8llu %8llu %8llu %8llu\n", pName,
+           iCount / fSecs, pUs[0], iSum / iCount, pUs[iCount / 2],
+           pUs[iCount * 9 / 10], pUs[iCount * 99 / 100], pUs[iCount - 1]);
+}
+
+static int
+client_send(CLIENT *pCli, const char *pPayload)
+{
+    unsigned char pBuf[MSGSIZE];
+    unsigned int n;
+
+    n = gdb_frame(pBuf, (const unsigned char *)pPayload, strlen(pPayload));
+    pCli->iSent = load_now();
+    if (send(pCli->sd, pBuf, n, 0) != (ssize_t)n)
+    {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+static int client_hello(CLIENT *pCli);
+
+//
+// Connect pCli to its bridge and start a session
+//
+static int
+client_start(CLIENT *pCli)
+{
+    pCli->sd = load_connect(pCli->pTarget);
+    if (pCli->sd < 0)
+    {
+        return -1;
+    }
+    pCli->gdbCtx.gdb_state = GDB_IDLE;
+    pCli->gdbCtx.pResp = pCli->pResp;
+    pCli->gdbCtx.pOwner = pCli;
+    pCli->pPfd->fd = pCli->sd;
+    pCli->pPfd->events = POLLIN;
+    pCli->iHello = 0;
+    pCli->iMapOffset = 0;
+    return client_hello(pCli);
+}
+
+static int
+client_next(CLIENT *pCli)
+{
+    pCli->pLatency = latency_find(pMix[pCli->iNext].pName);
+    if (strcmp(pMix[pCli->iNext].pPayload, "k") == 0)
+    {
+        //
+        // There is no answer to wait for, the session just ends
+        //
+        client_send(pCli, "k");
+        pCli->iKilled = pCli->iSent;
+        close(pCli->sd);
+        return client_start(pCli);
+    }
+    return client_send(pCli, pMix[pCli->iNext].pPayload);
+}
+
+//
+// Send the next packet of the start up, or go on with the mix after the
+// last
+//
+static int
+client_hello(CLIENT *pCli)
+{
+    char pPayload[64];
+
+    if (pCli->iHello == HELLO_COUNT)
+    {
+        if (pCli->iKilled)
+        {
+            latency_add(pCli->pLatency, load_now() - pCli->iKilled);
+            pCli->iKilled = 0;
+            pCli->iNext = (pCli->iNext + 1) % MIX_COUNT;
+        }
+        return client_next(pCli);
+    }
+
+    snprintf(pPayload, sizeof(pPayload), pHello[pCli->iHello],
+             pCli->iMapOffset);
+    return client_send(pCli, pPayload);
+}
+
+//
+// An answer to pCli: count it and send the next request
+//
+static void
+client_packet(GDBCTX *pGdbCtx, int bCsumValid)
+{
+    CLIENT *pCli = pGdbCtx->pOwner;
+    unsigned char *pPayload = pGdbCtx->pPkt + 1;
+
+    if (pGdbCtx->iRd == 1)
+    {
+        return;
+    }
+
+    if (pCli->iHello < HELLO_COUNT)
+    {
+        if (pCli->iHello == 0)
+        {
+            //
+            // The answer to QStartNoAckMode, the last one to ack
+            //
+            send(pCli->sd, "+", 1, 0);
+        }
+        else if (!bCsumValid || (pPayload[0] == 'E'))
+        {
+            iErrors++;
+        }
+
+        if ((pCli->iHello == HELLO_MAP) && (pPayload[0] == 'm'))
+        {
+            pCli->iMapOffset += pGdbCtx->iRd - 5;
+        }
+        else
+        {
+            pCli->iHello++;
+        }
+        client_hello(pCli);
+        return;
+    }
+
+    if (!bCsumValid || (pPayload[0] == 'E'))
+    {
+        iErrors++;
+    }
+    latency_add(pCli->pLatency, load_now() - pCli->iSent);
+
+    pCli->iNext = (pCli->iNext + 1) % MIX_COUNT;
+    client_next(pCli);
+}
+
+static void
+usage(const char *pName)
+{
+    fprintf(stderr,
+            "usage: %s [-c clients] [-t seconds] host:port...\n"
+            "\n"
+            "Connects clients GDB clients (1 by default) to each bridge\n"
+            "port and has them send requests as fast as they are answered\n"
+            "for the given time (10 s by default), then reports the rate\n"
+            "and latency of the answers.\n", pName);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static struct pollfd pPfd[LOAD_MAX_CLIENTS];
+    static CLIENT pClients[LOAD_MAX_CLIENTS];
+    static unsigned char pBuf[MSGSIZE];
+    unsigned long long iStart, iEnd, iTotal = 0;
+    unsigned int iPerTarget = 1, iSecs = 10, iCount = 0, i, j;
+    CLIENT *pCli;
+    double fSecs;
+    ssize_t n;
+    int iOpt;
+
+    while ((iOpt = getopt(argc, argv, "c:t:")) != -1)
+    {
+        switch (iOpt)
+        {
+            case 'c':
+                iPerTarget = atoi(optarg);
+                break;
+
+            case 't':
+                iSecs = atoi(optarg);
+                break;
+
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((optind == argc) || (iPerTarget == 0) || (iSecs == 0) ||
+        (iPerTarget * (argc - optind) > LOAD_MAX_CLIENTS))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        for (j = 0; j < iPerTarget; j++)
+        {
+            pCli = &pClients[iCount];
+            pCli->pTarget = argv[i];
+            pCli->pPfd = &pPfd[iCount];
+            pCli->iNext = iCount % MIX_COUNT;
+            if (client_start(pCli) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+            iCount++;
+        }
+    }
+
+    iStart = load_now();
+    iEnd = iStart + iSecs * 1000000ULL;
+    while (load_now() < iEnd)
+    {
+        if (poll(pPfd, iCount, LOAD_TIMEOUT) <= 0)
+        {
+            fprintf(stderr, "no answer for %u ms\n", LOAD_TIMEOUT);
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < iCount; i++)
+        {
+            if (pPfd[i].revents == 0)
+            {
+                continue;
+            }
+
+            n = recv(pPfd[i].fd, pBuf, sizeof(pBuf), 0);
+            if (n <= 0)
+            {
+                fprintf(stderr, "the bridge closed a connection\n");
+                return EXIT_FAILURE;
+            }
+            gdb_statemachine(&pClients[i].gdbCtx, pBuf, n, client_packet);
+        }
+    }
+    fSecs = (load_now() - iStart) / 1e6;
+
+    for (i = 0; i < iCount; i++)
+    {
+        close(pClients[i].sd);
+    }
+
+    for (i = 0; i < iTypes; i++)
+    {
+        iTotal += pLatency[i].iCount;
+    }
+    printf("%u clients, %llu requests in %.3f s: %.0f requests/s, "
+           "%llu errors\n", iCount, iTotal, fSecs, iTotal / fSecs, iErrors);
+    printf("request    req/s   min us   avg us   p50 us   p90 us   p99 us"
+           "   max us\n");
+    for (i = 0; i < iTypes; i++)
+    {
+        latency_print(pLatency[i].pName, &pLatency[i], fSecs);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,603 @@
+//*****************************************************************************
+//
+// lmreplay.c - replays the traces lmicdi records with -r, as a benchmark.
+//
+//     lmreplay -l trace
+//         lists the GDB sessions in the trace
+//
+//     lmreplay [-i icdi] [-s session] trace host:port
+//         plays a GDB session back against the bridge on host:port.  Each
+//         chunk the client sent is sent as recorded, as soon as the bridge
+//         has sent the packets it sent back then in answer to the one
+//         before.  The time each request takes to be answered is compared
+//         with the time it took in the recording.
+//
+//     lmreplay -p [-n loops] trace
+//         feeds what the GDB clients and the ICDIs sent, chunk by chunk as
+//         it arrived, through the packet parser of the bridge loops times
+//         and reports its throughput.
+//
+// The bridge replayed against may be serving a real ICDI or any other
+// target, as long as it answers the way the recorded one did.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define REPLAY_TIMEOUT          10000       // ms to wait for an answer
+#define REPLAY_STREAMS          256         // parsed at once with -p
+
+unsigned int gTraceLvl = 3;
+
+//
+// A record of the trace, with its time from the start of the trace
+//
+typedef struct _RECORD
+{
+    unsigned long long iTime;
+    REC_KIND eKind;
+    unsigned int iIcdi;
+    unsigned int iSession;
+    const unsigned char *pData;
+    unsigned int iLen;
+} RECORD;
+
+static RECORD *pRecs;
+static unsigned int iRecs;
+
+//
+// Counts the packets and notifications in a stream to a GDB client
+//
+typedef struct _FRAMES
+{
+    int iState;                 // 0 between frames, 1 in one, 2-3 checksum
+    unsigned int iCount;
+} FRAMES;
+
+static void
+frames_count(FRAMES *pFrames, const unsigned char *pBuf, unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+    {
+        switch (pFrames->iState)
+        {
+            case 0:
+                if ((pBuf[i] == '$') || (pBuf[i] == '%'))
+                {
+                    pFrames->iState = 1;
+                }
+                break;
+
+            case 1:
+                if (pBuf[i] == '#')
+                {
+                    pFrames->iState = 2;
+                }
+                break;
+
+            case 2:
+                pFrames->iState = 3;
+                break;
+
+            default:
+                pFrames->iState = 0;
+                pFrames->iCount++;
+                break;
+        }
+    }
+}
+
+static unsigned long long
+replay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+// Read the trace pName into pRecs.  Returns 0 on success.
+//
+static int
+trace_load(const char *pName)
+{
+    unsigned char *pData;
+    unsigned long long iTime = 0;
+    unsigned int i, n, iSize;
+    FILE *pFile;
+    long lSize;
+
+    pFile = fopen(pName, "rb");
+    if (pFile == NULL)
+    {
+        perror(pName);
+        return -1;
+    }
+
+    fseek(pFile, 0, SEEK_END);
+    lSize = ftell(pFile);
+    fseek(pFile, 0, SEEK_SET);
+    iSize = (lSize > 0) ? lSize : 0;
+    pData = malloc(iSize + 1);
+    ASSERT(pData != NULL);
+    n = fread(pData, 1, iSize, pFile);
+    fclose(pFile);
+
+    if ((n != iSize) || (iSize < 8) || memcmp(pData, REC_MAGIC, 8))
+    {
+        fprintf(stderr, "%s: not an lmicdi trace\n", pName);
+        free(pData);
+        return -1;
+    }
+
+    //
+    // Count the records, then take them in
+    //
+    for (i = 8, n = 0; i + REC_HEADER <= iSize; n++)
+    {
+        i += REC_HEADER + (pData[i + 4] | (pData[i + 5] << 8));
+    }
+
+    pRecs = calloc(n + 1, sizeof(RECORD));
+    ASSERT(pRecs != NULL);
+
+    for (i = 8; (i + REC_HEADER <= iSize) && (iRecs < n); iRecs++)
+    {
+        RECORD *pRec = &pRecs[iRecs];
+
+        iTime += pData[i] | (pData[i + 1] << 8) | (pData[i + 2] << 16) |
+                 ((unsigned int)pData[i + 3] << 24);
+        pRec->iTime = iTime;
+        pRec->iLen = pData[i + 4] | (pData[i + 5] << 8);
+        pRec->eKind = pData[i + 6];
+        pRec->iIcdi = pData[i + 7];
+        pRec->iSession = pData[i + 8] | (pData[i + 9] << 8);
+        pRec->pData = pData + i + REC_HEADER;
+
+        i += REC_HEADER + pRec->iLen;
+        if (i > iSize)
+        {
+            fprintf(stderr, "%s: truncated, %u records used\n", pName, iRecs);
+            break;
+        }
+    }
+    return 0;
+}
+
+//
+// -l: what each session sent and got, and how long it lasted
+//
+static void
+replay_list(void)
+{
+    unsigned long long iBytesIn, iBytesOut, iEnd;
+    unsigned int i, j, iChunks;
+    FRAMES frames;
+
+    printf("icdi session  chunks in  packets out   bytes in  bytes out  "
+           "seconds\n");
+    for (i = 0; i < iRecs; i++)
+    {
+        if (pRecs[i].eKind != REC_OPEN)
+        {
+            continue;
+        }
+
+        memset(&frames, 0, sizeof(frames));
+        iBytesIn = iBytesOut = 0;
+        iChunks = 0;
+        iEnd = pRecs[i].iTime;
+        for (j = i; j < iRecs; j++)
+        {
+            if ((pRecs[j].iIcdi != pRecs[i].iIcdi) ||
+                (pRecs[j].iSession != pRecs[i].iSession))
+            {
+                continue;
+            }
+
+            iEnd = pRecs[j].iTime;
+            if (pRecs[j].eKind == REC_GDB_IN)
+            {
+                iChunks++;
+                iBytesIn += pRecs[j].iLen;
+            }
+            else if (pRecs[j].eKind == REC_GDB_OUT)
+            {
+                frames_count(&frames, pRecs[j].pData, pRecs[j].iLen);
+                iBytesOut += pRecs[j].iLen;
+            }
+            else if (pRecs[j].eKind == REC_CLOSE)
+            {
+                break;
+            }
+        }
+
+        printf("%4u %7u %10u %12u %10llu %10llu %8.3f\n", pRecs[i].iIcdi,
+               pRecs[i].iSession, iChunks, frames.iCount, iBytesIn, iBytesOut,
+               (iEnd - pRecs[i].iTime) / 1e6);
+    }
+}
+
+//
+// Connect to pTarget, "host:port"
+//
+static int
+replay_connect(const char *pTarget)
+{
+    struct addrinfo hints, *pAddr;
+    char pHost[256];
+    const char *pPort;
+    int sd, one = 1;
+
+    pPort = strrchr(pTarget, ':');
+    if ((pPort == NULL) || (pPort - pTarget >= (int)sizeof(pHost)))
+    {
+        fprintf(stderr, "%s: expected host:port\n", pTarget);
+        return -1;
+    }
+    memcpy(pHost, pTarget, pPort - pTarget);
+    pHost[pPort - pTarget] = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(pHost, pPort + 1, &hints, &pAddr) != 0)
+    {
+        fprintf(stderr, "%s: unknown host\n", pHost);
+        return -1;
+    }
+
+    sd = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+    if ((sd < 0) || (connect(sd, pAddr->ai_addr, pAddr->ai_addrlen) != 0))
+    {
+        perror(pTarget);
+        freeaddrinfo(pAddr);
+        return -1;
+    }
+    freeaddrinfo(pAddr);
+
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sd;
+}
+
+static int
+latency_compare(const void *pA, const void *pB)
+{
+    unsigned long long iA = *(const unsigned long long *)pA;
+    unsigned long long iB = *(const unsigned long long *)pB;
+
+    return (iA > iB) - (iA < iB);
+}
+
+//
+// Print the spread of the iCount latencies in pUs, sorting them
+//
+static void
+latency_print(const char *pName, unsigned long long *pUs, unsigned int iCount)
+{
+    unsigned long long iSum = 0;
+    unsigned int i;
+
+    if (iCount == 0)
+    {
+        return;
+    }
+
+    qsort(pUs, iCount, sizeof(pUs[0]), latency_compare);
+    for (i = 0; i < iCount; i++)
+    {
+        iSum += pUs[i];
+    }
+
+    printf("%-9s %8llu %8llu %8llu %8llu %8llu %8llu\n", pName, pUs[0],
+           iSum / iCount, pUs[iCount / 2], pUs[iCount * 9 / 10],
+           pUs[iCount * 99 / 100], pUs[iCount - 1]);
+}
+
+//
+// Play session iSession of ICDI iIcdi back against pTarget.  Returns 0 if
+// the bridge answered everything.
+//
+static int
+replay_session(unsigned int iIcdi, unsigned int iSession, const char *pTarget)
+{
+    unsigned long long *pRecUs, *pRunUs, iSent, iStart, iBytesIn = 0;
+    unsigned long long iBytesOut = 0;
+    unsigned int i, j, iSteps = 0, iAnswered = 0, iWant = 0;
+    unsigned char pBuf[MSGSIZE];
+    struct pollfd pfd;
+    FRAMES recFrames, runFrames;
+    ssize_t n;
+    int sd, rc = 0;
+
+    pRecUs = malloc((iRecs + 1) * sizeof(pRecUs[0]));
+    pRunUs = malloc((iRecs + 1) * sizeof(pRunUs[0]));
+    ASSERT((pRecUs != NULL) && (pRunUs != NULL));
+    memset(&recFrames, 0, sizeof(recFrames));
+    memset(&runFrames, 0, sizeof(runFrames));
+
+    sd = replay_connect(pTarget);
+    if (sd < 0)
+    {
+        return -1;
+    }
+
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+    iStart = replay_now();
+
+    for (i = 0; i < iRecs; i++)
+    {
+        if ((pRecs[i].iIcdi != iIcdi) || (pRecs[i].iSession != iSession) ||
+            (pRecs[i].eKind != REC_GDB_IN))
+        {
+            continue;
+        }
+
+        //
+        // Everything the bridge sent the client until it next spoke is
+        // the answer to this chunk
+        //
+        for (j = i + 1; j < iRecs; j++)
+        {
+            if ((pRecs[j].iIcdi != iIcdi) || (pRecs[j].iSession != iSession))
+            {
+                continue;
+            }
+            if ((pRecs[j].eKind == REC_GDB_IN) ||
+                (pRecs[j].eKind == REC_CLOSE))
+            {
+                break;
+            }
+            if (pRecs[j].eKind == REC_GDB_OUT)
+            {
+                frames_count(&recFrames, pRecs[j].pData, pRecs[j].iLen);
+                if (recFrames.iCount > iWant)
+                {
+                    pRecUs[iAnswered] = pRecs[j].iTime - pRecs[i].iTime;
+                }
+            }
+        }
+
+        iSent = replay_now();
+        if (send(sd, pRecs[i].pData, pRecs[i].iLen, 0) != (ssize_t)pRecs[i].iLen)
+        {
+            perror("send");
+            rc = -1;
+            break;
+        }
+        iBytesOut += pRecs[i].iLen;
+        iSteps++;
+
+        if (recFrames.iCount == iWant)
+        {
+            continue;
+        }
+        iWant = recFrames.iCount;
+
+        while (runFrames.iCount < iWant)
+        {
+            if (poll(&pfd, 1, REPLAY_TIMEOUT) <= 0)
+            {
+                fprintf(stderr, "no answer to chunk %u: '%.*s'\n", iSteps,
+                        (int)pRecs[i].iLen, pRecs[i].pData);
+                rc = -1;
+                break;
+            }
+
+            n = recv(sd, pBuf, sizeof(pBuf), 0);
+            if (n <= 0)
+            {
+                fprintf(stderr, "the bridge closed the connection\n");
+                rc = -1;
+                break;
+            }
+            frames_count(&runFrames, pBuf, n);
+            iBytesIn += n;
+        }
+
+        if (rc != 0)
+        {
+            break;
+        }
+        pRunUs[iAnswered++] = replay_now() - iSent;
+    }
+
+    close(sd);
+
+    printf("%u chunks sent, %u answered in %.3f s: %.0f answers/s, "
+           "%llu bytes out, %llu bytes in\n", iSteps, iAnswered,
+           (replay_now() - iStart) / 1e6,
+           iAnswered * 1e6 / (replay_now() - iStart + 1), iBytesOut,
+           iBytesIn);
+    printf("latency     min us   avg us   p50 us   p90 us   p99 us   max us\n");
+    latency_print("recorded", pRecUs, iAnswered);
+    latency_print("replayed", pRunUs, iAnswered);
+
+    free(pRecUs);
+    free(pRunUs);
+    return rc;
+}
+
+//
+// -p: the packets parsed and how many were corrupt
+//
+static unsigned int iParsed;
+static unsigned int iCorrupt;
+
+static void
+parse_packet(GDBCTX *pGdbCtx, int bCsumValid)
+{
+    iParsed++;
+    iCorrupt += !bCsumValid;
+}
+
+//
+// Parse what the clients and the ICDIs sent loops times over
+//
+static void
+replay_parse(unsigned int iLoops)
+{
+    static unsigned char pResp[REPLAY_STREAMS][MSGSIZE];
+    static GDBCTX pCtxs[REPLAY_STREAMS];
+    unsigned int pKeys[REPLAY_STREAMS];
+    unsigned long long iStart, iUs, iBytes = 0;
+    unsigned int i, j, k, iStreams = 0, iKey;
+    int *pStream;
+
+    //
+    // Each client and ICDI gets a parser of its own
+    //
+    pStream = malloc((iRecs + 1) * sizeof(pStream[0]));
+    ASSERT(pStream != NULL);
+    for (i = 0; i < iRecs; i++)
+    {
+        pStream[i] = -1;
+        if ((pRecs[i].eKind != REC_GDB_IN) && (pRecs[i].eKind != REC_USB_IN))
+        {
+            continue;
+        }
+
+        iKey = (pRecs[i].iIcdi << 16) | pRecs[i].iSession;
+        for (j = 0; (j < iStreams) && (pKeys[j] != iKey); j++)
+        {
+        }
+        if (j == REPLAY_STREAMS)
+        {
+            continue;
+        }
+        if (j == iStreams)
+        {
+            pKeys[iStreams++] = iKey;
+            pCtxs[j].gdb_state = GDB_IDLE;
+            pCtxs[j].pResp = pResp[j];
+        }
+        pStream[i] = j;
+        iBytes += pRecs[i].iLen;
+    }
+
+    iStart = replay_now();
+    for (k = 0; k < iLoops; k++)
+    {
+        for (i = 0; i < iRecs; i++)
+        {
+            if (pStream[i] >= 0)
+            {
+                gdb_statemachine(&pCtxs[pStream[i]],
+                                 (unsigned char *)pRecs[i].pData,
+                                 pRecs[i].iLen, parse_packet);
+            }
+        }
+    }
+    iUs = replay_now() - iStart + 1;
+    free(pStream);
+
+    printf("%llu bytes, %u packets (%u corrupt) a pass, %u passes "
+           "in %.3f s\n", iBytes, iParsed / iLoops, iCorrupt / iLoops, iLoops,
+           iUs / 1e6);
+    printf("%.1f MB/s, %.0f packets/s, %.0f ns a packet\n",
+           iBytes * iLoops / (double)iUs, iParsed * 1e6 / iUs,
+           iParsed ? iUs * 1e3 / iParsed : 0.0);
+}
+
+static void
+usage(const char *pName)
+{
+    fprintf(stderr,
+            "usage: %s -l trace\n"
+            "       %s [-i icdi] [-s session] trace host:port\n"
+            "       %s -p [-n loops] trace\n"
+            "\n"
+            "Replays a trace recorded with lmicdi -r: lists its sessions,\n"
+            "plays a session back against the bridge on host:port, or runs\n"
+            "everything received through the packet parser.\n",
+            pName, pName, pName);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int iOpt, bList = 0, bParse = 0;
+    unsigned int iIcdi = 0, iSession = 0, iLoops = 100, i;
+
+    while ((iOpt = getopt(argc, argv, "lpn:i:s:")) != -1)
+    {
+        switch (iOpt)
+        {
+            case 'l':
+                bList = 1;
+                break;
+
+            case 'p':
+                bParse = 1;
+                break;
+
+            case 'n':
+                iLoops = atoi(optarg);
+                break;
+
+            case 'i':
+                iIcdi = atoi(optarg);
+                break;
+
+            case 's':
+                iSession = atoi(optarg);
+                break;
+
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((optind + ((bList || bParse) ? 1 : 2) != argc) || (iLoops == 0) ||
+        (trace_load(argv[optind]) != 0))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (bList)
+    {
+        replay_list();
+        return EXIT_SUCCESS;
+    }
+
+    if (bParse)
+    {
+        replay_parse(iLoops);
+        return EXIT_SUCCESS;
+    }
+
+    //
+    // Without -s, the first session on the ICDI
+    //
+    for (i = 0; (iSession == 0) && (i < iRecs); i++)
+    {
+        if ((pRecs[i].eKind == REC_OPEN) && (pRecs[i].iIcdi == iIcdi))
+        {
+            iSession = pRecs[i].iSession;
+        }
+    }
+
+    if (iSession == 0)
+    {
+        fprintf(stderr, "no session on ICDI %u in the trace\n", iIcdi);
+        return EXIT_FAILURE;
+    }
+
+    return replay_session(iIcdi, iSession, argv[optind + 1]) ? EXIT_FAILURE :
+           EXIT_SUCCESS;
+}
@@ -0,0 +1,505 @@
+//*****************************************************************************
+//
+// metrics.c - counters of the bridge, served over HTTP for Prometheus.
+//
+// Each ICDI counts the packets its GDB clients send, by type, and how
+// long each request took from the moment it went on the wire to the ICDI
+// to the moment its answer came back, in a histogram per type.  It also
+// counts the bytes crossing each side of the bridge, the hits and misses
+// of the memory and register caches, and the retries and errors on the
+// USB link.  With -m, "GET /metrics" on that port returns them all in the
+// Prometheus text format, labelled with the serial number of the ICDI.
+//
+// The time of a request that resumes the core (c, s, ...) is how long
+// the core ran, not the time the link took.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define METRICS_TYPES           32          // packet types told apart
+#define METRICS_TYPE_NAME       16
+
+//
+// The upper bounds of the latency buckets, in microseconds
+//
+static const unsigned int g_pBuckets[] =
+{
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000,
+};
+
+#define METRICS_BUCKETS         (sizeof(g_pBuckets) / sizeof(g_pBuckets[0]))
+
+//
+// What we know about one type of packet.  pBuckets[i] counts the requests
+// that took up to g_pBuckets[i], the last one those that took longer.
+//
+typedef struct _METRICSTYPE
+{
+    char pName[METRICS_TYPE_NAME];
+    unsigned long long iGdb;
+    unsigned long long iRequests;
+    unsigned long long iTotalUs;
+    unsigned long long pBuckets[METRICS_BUCKETS + 1];
+} METRICSTYPE;
+
+struct _METRICS
+{
+    //
+    // The first METRICS_TYPES - 1 types seen, and "other" for the rest
+    //
+    METRICSTYPE pTypes[METRICS_TYPES];
+    unsigned int iTypes;
+
+    unsigned long long pCounters[METRIC_COUNTERS];
+};
+
+//
+// The ICDIs to report on, and the socket we serve them on
+//
+static ICDI *pMetricsList;
+static int sdMetrics = -1;
+
+static unsigned long long
+metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+// The type of the packet in pPayload: the name of q, Q and v packets, the
+// command letter of any other
+//
+static METRICSTYPE *
+metrics_type(METRICS *pMetrics, const unsigned char *pPayload,
+        unsigned int len)
+{
+    char pName[METRICS_TYPE_NAME];
+    unsigned int i, n = 1;
+
+    if ((len == 0) || !isgraph(pPayload[0]) || (pPayload[0] == '"') ||
+        (pPayload[0] == '\\'))
+    {
+        strcpy(pName, "other");
+    }
+    else
+    {
+        if (strchr("qQv", pPayload[0]))
+        {
+            while ((n < len) && (n < sizeof(pName) - 1) && isalpha(pPayload[n]))
+            {
+                n++;
+            }
+        }
+        memcpy(pName, pPayload, n);
+        pName[n] = 0;
+    }
+
+    for (i = 0; i < pMetrics->iTypes; i++)
+    {
+        if (strcmp(pMetrics->pTypes[i].pName, pName) == 0)
+        {
+            return &pMetrics->pTypes[i];
+        }
+    }
+
+    if (pMetrics->iTypes == METRICS_TYPES - 1)
+    {
+        strcpy(pName, "other");
+    }
+    else if (pMetrics->iTypes == METRICS_TYPES)
+    {
+        return &pMetrics->pTypes[METRICS_TYPES - 1];
+    }
+
+    strcpy(pMetrics->pTypes[pMetrics->iTypes].pName, pName);
+    return &pMetrics->pTypes[pMetrics->iTypes++];
+}
+
+//*****************************************************************************
+//
+//! Set up the counters of pIcdi.
+//
+//*****************************************************************************
+void
+metrics_init(ICDI *pIcdi)
+{
+    pIcdi->pMetrics = calloc(1, sizeof(METRICS));
+    ASSERT(pIcdi->pMetrics != NULL);
+}
+
+//*****************************************************************************
+//
+//! Add n to the counter eCounter of pIcdi.
+//
+//*****************************************************************************
+void
+metrics_add(ICDI *pIcdi, METRIC eCounter, unsigned int n)
+{
+    pIcdi->pMetrics->pCounters[eCounter] += n;
+}
+
+//*****************************************************************************
+//
+//! Count the packet with payload pPayload a GDB client sent to pIcdi.
+//
+//*****************************************************************************
+void
+metrics_packet(ICDI *pIcdi, const unsigned char *pPayload, unsigned int len)
+{
+    metrics_type(pIcdi->pMetrics, pPayload, len)->iGdb++;
+}
+
+//*****************************************************************************
+//
+//! pReq is going on the wire.  Its time starts over if it is sent again.
+//
+//*****************************************************************************
+void
+metrics_sent(PROBEREQ *pReq)
+{
+    pReq->iSentUs = metrics_now();
+}
+
+//*****************************************************************************
+//
+//! The answer to pReq is in.  Count the time it took.
+//
+//*****************************************************************************
+void
+metrics_done(PROBEREQ *pReq)
+{
+    METRICSTYPE *pType;
+    unsigned long long iUs = metrics_now() - pReq->iSentUs;
+    unsigned int i;
+
+    pType = metrics_type(pReq->pIcdi->pMetrics, pReq->pPkt + 1,
+                         pReq->iLen - 4);
+    pType->iRequests++;
+    pType->iTotalUs += iUs;
+
+    for (i = 0; (i < METRICS_BUCKETS) && (iUs > g_pBuckets[i]); i++)
+    {
+    }
+    pType->pBuckets[i]++;
+}
+
+//
+// A growing text buffer for the page
+//
+typedef struct _METRICSPAGE
+{
+    char *pBuf;
+    unsigned int iLen;
+    unsigned int iSize;
+} METRICSPAGE;
+
+static void
+page_printf(METRICSPAGE *pPage, const char *pFmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;)
+    {
+        va_start(ap, pFmt);
+        n = vsnprintf(pPage->pBuf + pPage->iLen, pPage->iSize - pPage->iLen,
+                      pFmt, ap);
+        va_end(ap);
+        ASSERT(n >= 0);
+
+        if (pPage->iLen + n < pPage->iSize)
+        {
+            pPage->iLen += n;
+            return;
+        }
+
+        pPage->iSize = 2 * pPage->iSize + n;
+        pPage->pBuf = realloc(pPage->pBuf, pPage->iSize);
+        ASSERT(pPage->pBuf != NULL);
+    }
+}
+
+//
+// The HELP and TYPE lines of the metric pName
+//
+static void
+page_header(METRICSPAGE *pPage, const char *pName, const char *pType,
+        const char *pHelp)
+{
+    page_printf(pPage, "# HELP %s %s\n# TYPE %s %s\n", pName, pHelp, pName,
+                pType);
+}
+
+//
+// The latency histograms of pIcdi, whose labels are in pLabel
+//
+static void
+page_histograms(METRICSPAGE *pPage, ICDI *pIcdi, const char *pLabel)
+{
+    METRICS *pMetrics = pIcdi->pMetrics;
+    METRICSTYPE *pType;
+    unsigned long long iCount;
+    unsigned int i, j;
+
+    for (i = 0; i < pMetrics->iTypes; i++)
+    {
+        pType = &pMetrics->pTypes[i];
+        if (pType->iRequests == 0)
+        {
+            continue;
+        }
+
+        for (iCount = 0, j = 0; j < METRICS_BUCKETS; j++)
+        {
+            iCount += pType->pBuckets[j];
+            page_printf(pPage, "lmicdi_icdi_request_seconds_bucket{%s,"
+                        "packet=\"%s\",le=\"%g\"} %llu\n", pLabel,
+                        pType->pName, g_pBuckets[j] / 1e6, iCount);
+        }
+        page_printf(pPage, "lmicdi_icdi_request_seconds_bucket{%s,"
+                    "packet=\"%s\",le=\"+Inf\"} %llu\n", pLabel,
+                    pType->pName, pType->iRequests);
+        page_printf(pPage, "lmicdi_icdi_request_seconds_sum{%s,"
+                    "packet=\"%s\"} %.6f\n", pLabel, pType->pName,
+                    pType->iTotalUs / 1e6);
+        page_printf(pPage, "lmicdi_icdi_request_seconds_count{%s,"
+                    "packet=\"%s\"} %llu\n", pLabel, pType->pName,
+                    pType->iRequests);
+    }
+}
+
+//
+// Counters with labels of their own, one line per ICDI each
+//
+typedef struct _METRICSLINE
+{
+    METRIC eCounter;
+    const char *pName;
+    const char *pLabels;
+} METRICSLINE;
+
+static const METRICSLINE g_pBytes[] =
+{
+    { METRIC_GDB_BYTES_IN, "lmicdi_bytes_total", "link=\"gdb\",dir=\"in\"" },
+    { METRIC_GDB_BYTES_OUT, "lmicdi_bytes_total", "link=\"gdb\",dir=\"out\"" },
+    { METRIC_USB_BYTES_IN, "lmicdi_bytes_total", "link=\"usb\",dir=\"in\"" },
+    { METRIC_USB_BYTES_OUT, "lmicdi_bytes_total", "link=\"usb\",dir=\"out\"" },
+};
+
+static const METRICSLINE g_pCache[] =
+{
+    { METRIC_MEM_HITS, "lmicdi_cache_lookups_total",
+      "cache=\"memory\",result=\"hit\"" },
+    { METRIC_MEM_MISSES, "lmicdi_cache_lookups_total",
+      "cache=\"memory\",result=\"miss\"" },
+    { METRIC_REG_HITS, "lmicdi_cache_lookups_total",
+      "cache=\"registers\",result=\"hit\"" },
+    { METRIC_REG_MISSES, "lmicdi_cache_lookups_total",
+      "cache=\"registers\",result=\"miss\"" },
+};
+
+static void
+page_counters(METRICSPAGE *pPage, const METRICSLINE *pLines,
+        unsigned int iLines)
+{
+    ICDI *pIcdi;
+    unsigned int i;
+
+    for (pIcdi = pMetricsList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        for (i = 0; i < iLines; i++)
+        {
+            page_printf(pPage, "%s{serial=\"%s\",%s} %llu\n", pLines[i].pName,
+                        pIcdi->pSerial, pLines[i].pLabels,
+                        pIcdi->pMetrics->pCounters[pLines[i].eCounter]);
+        }
+    }
+}
+
+static void
+page_counter(METRICSPAGE *pPage, METRIC eCounter, const char *pName)
+{
+    ICDI *pIcdi;
+
+    for (pIcdi = pMetricsList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        page_printf(pPage, "%s{serial=\"%s\"} %llu\n", pName,
+                    pIcdi->pSerial, pIcdi->pMetrics->pCounters[eCounter]);
+    }
+}
+
+//
+// The whole page
+//
+static void
+metrics_page(METRICSPAGE *pPage)
+{
+    METRICSTYPE *pType;
+    char pLabel[MAX_SERIAL + 16];
+    ICDI *pIcdi;
+    unsigned int i;
+
+    page_header(pPage, "lmicdi_gdb_clients", "gauge",
+                "GDB clients connected.");
+    for (pIcdi = pMetricsList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        page_printf(pPage, "lmicdi_gdb_clients{serial=\"%s\"} %u\n",
+                    pIcdi->pSerial, pIcdi->iClients);
+    }
+
+    page_header(pPage, "lmicdi_gdb_packets_total", "counter",
+                "Packets received from GDB clients, by type.");
+    for (pIcdi = pMetricsList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        for (i = 0; i < pIcdi->pMetrics->iTypes; i++)
+        {
+            pType = &pIcdi->pMetrics->pTypes[i];
+            if (pType->iGdb)
+            {
+                page_printf(pPage, "lmicdi_gdb_packets_total{serial=\"%s\","
+                            "packet=\"%s\"} %llu\n", pIcdi->pSerial,
+                            pType->pName, pType->iGdb);
+            }
+        }
+    }
+
+    page_header(pPage, "lmicdi_icdi_request_seconds", "histogram",
+                "Time from sending a request to the ICDI to its answer, "
+                "by type.");
+    for (pIcdi = pMetricsList; pIcdi; pIcdi = pIcdi->pNext)
+    {
+        snprintf(pLabel, sizeof(pLabel), "serial=\"%s\"", pIcdi->pSerial);
+        page_histograms(pPage, pIcdi, pLabel);
+    }
+
+    page_header(pPage, "lmicdi_bytes_total", "counter",
+                "Bytes crossing the bridge, by link and direction.");
+    page_counters(pPage, g_pBytes, sizeof(g_pBytes) / sizeof(g_pBytes[0]));
+
+    page_header(pPage, "lmicdi_cache_lookups_total", "counter",
+                "Reads of GDB looked up in the caches of the bridge.");
+    page_counters(pPage, g_pCache, sizeof(g_pCache) / sizeof(g_pCache[0]));
+
+    page_header(pPage, "lmicdi_usb_retries_total", "counter",
+                "Requests sent again after a NAK or a corrupted answer.");
+    page_counter(pPage, METRIC_USB_RETRIES, "lmicdi_usb_retries_total");
+
+    page_header(pPage, "lmicdi_usb_errors_total", "counter",
+                "USB transfers that failed.");
+    page_counter(pPage, METRIC_USB_ERRORS, "lmicdi_usb_errors_total");
+}
+
+//
+// Send len bytes at pBuf to sd, as far as it takes them
+//
+static void
+metrics_send(int sd, const char *pBuf, unsigned int len)
+{
+    ssize_t tx;
+
+    while (len > 0)
+    {
+        tx = send(sd, pBuf, len, 0);
+        if (tx <= 0)
+        {
+            perror("send() failed");
+            return;
+        }
+        pBuf += tx;
+        len -= tx;
+    }
+}
+
+//
+// A scraper sent its request.  Anything but a GET of / or /metrics gets a
+// 404, and the connection is closed after the answer.
+//
+static void
+metrics_client_event(int fd, short revents, void *pCtx)
+{
+    static const char pNotFound[] =
+        "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    METRICSPAGE page = { NULL, 0, 0 };
+    char pReq[512], pHdr[160];
+    ssize_t rx;
+    int n;
+
+    rx = recv(fd, pReq, sizeof(pReq) - 1, 0);
+    if (rx > 0)
+    {
+        pReq[rx] = 0;
+        if ((strncmp(pReq, "GET /metrics ", 13) == 0) ||
+            (strncmp(pReq, "GET / ", 6) == 0))
+        {
+            metrics_page(&page);
+            n = snprintf(pHdr, sizeof(pHdr), "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %u\r\nConnection: close\r\n\r\n",
+                         page.iLen);
+            metrics_send(fd, pHdr, n);
+            metrics_send(fd, page.pBuf, page.iLen);
+            free(page.pBuf);
+        }
+        else
+        {
+            metrics_send(fd, pNotFound, sizeof(pNotFound) - 1);
+        }
+    }
+
+    event_del(fd);
+    close(fd);
+}
+
+static void
+metrics_listen_event(int fd, short revents, void *pCtx)
+{
+    struct sockaddr_in pin;
+    socklen_t addrlen = sizeof(pin);
+    int sd;
+
+	if ((sd = accept(fd, (struct sockaddr *)  &pin, &addrlen)) == -1) {
+		perror("accept");
+		return;
+	}
+
+    if (event_add(sd, POLLIN, metrics_client_event, NULL) != 0)
+    {
+        close(sd);
+    }
+}
+
+//*****************************************************************************
+//
+//! Serve the metrics of the ICDIs in pIcdiList over HTTP on iPort.
+//!
+//! \return 0 on success, -1 if the port can't be opened.
+//
+//*****************************************************************************
+int
+metrics_serve(ICDI *pIcdiList, int iPort)
+{
+    sdMetrics = Listen(iPort);
+    if (sdMetrics < 0)
+    {
+        TRACE(ALWAYS, "metrics: unable to listen on port %d\n", iPort);
+        return -1;
+    }
+
+    pMetricsList = pIcdiList;
+    TRACE(ALWAYS, "metrics on port %d\n", iPort);
+    return event_add(sdMetrics, POLLIN, metrics_listen_event, NULL);
+}
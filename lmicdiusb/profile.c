@@ -0,0 +1,524 @@
+//*****************************************************************************
+//
+// profile.c - statistical profiling of the running target by PC sampling.
+//
+// The DWT of the Cortex-M4 latches the PC of the instruction being
+// executed into DWT_PCSR each time the register is read, without halting
+// the core.  While profiling we read it at the rate asked for through the
+// same request queue as GDB, so a session can stay attached.  Samples are
+// counted per PC and symbolized at report time against the functions of
+// the ELF file loaded with "monitor elf".  The report is a flat profile,
+// or folded stacks for flamegraph.pl with one frame per sample, as PCSR
+// doesn't tell us the callers.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+//
+// DWT_PCSR reads as all ones while the core is halted.  It only samples
+// with trace enabled in DEMCR.
+//
+#define DWT_PCSR                0xe000101c
+#define DEMCR                   0xe000edfc
+#define DEMCR_TRCENA            (1 << 24)
+#define PCSR_HALTED             0xffffffff
+
+#define PROFILE_RATE            1000        // default samples per second
+#define PROFILE_DEPTH           4           // sample reads queued at once
+#define PROFILE_TOP             20          // lines of a flat profile shown
+
+//
+// A line of a report: a function (iFunc >= 0) or a PC with no symbol
+//
+typedef struct _PROFLINE
+{
+    int iFunc;
+    unsigned int iPc;
+    unsigned int iCount;
+} PROFLINE;
+
+struct _PROFILE
+{
+    int bRunning;
+    int iTimer;
+    unsigned int iRate;
+    unsigned int iPerTick;
+    unsigned int iInFlight;
+
+    //
+    // What became of the samples taken so far
+    //
+    unsigned int iSamples;
+    unsigned int iHalted;
+    unsigned int iSkipped;
+    unsigned int iErrors;
+
+    //
+    // Samples per PC, open addressed on the PC.  Free slots hold
+    // PCSR_HALTED, which is never counted here.
+    //
+    unsigned int *pPc;
+    unsigned int *pCount;
+    unsigned int iSlots;
+    unsigned int iUsed;
+
+};
+
+//
+// The slot of PC iPc in the table, taken for it (with no samples yet) if
+// it isn't there
+//
+static unsigned int
+profile_slot(PROFILE *pProf, unsigned int iPc)
+{
+    unsigned int i;
+
+    for (i = (iPc >> 1) * 2654435761u; ; i++)
+    {
+        i &= pProf->iSlots - 1;
+        if (pProf->pPc[i] == iPc)
+        {
+            return i;
+        }
+        if (pProf->pPc[i] == PCSR_HALTED)
+        {
+            pProf->pPc[i] = iPc;
+            pProf->pCount[i] = 0;
+            pProf->iUsed++;
+            return i;
+        }
+    }
+}
+
+//
+// Count a sample of PC iPc, growing the table once it's half full
+//
+static void
+profile_count(PROFILE *pProf, unsigned int iPc)
+{
+    unsigned int *pOldPc = pProf->pPc;
+    unsigned int *pOldCount = pProf->pCount;
+    unsigned int i, iOld = pProf->iSlots;
+
+    if (2 * (pProf->iUsed + 1) > pProf->iSlots)
+    {
+        pProf->iSlots = iOld ? 2 * iOld : 1024;
+        pProf->pPc = malloc(pProf->iSlots * sizeof(unsigned int));
+        pProf->pCount = malloc(pProf->iSlots * sizeof(unsigned int));
+        ASSERT((pProf->pPc != NULL) && (pProf->pCount != NULL));
+        memset(pProf->pPc, 0xff, pProf->iSlots * sizeof(unsigned int));
+        pProf->iUsed = 0;
+
+        for (i = 0; i < iOld; i++)
+        {
+            if (pOldPc[i] != PCSR_HALTED)
+            {
+                pProf->pCount[profile_slot(pProf, pOldPc[i])] = pOldCount[i];
+            }
+        }
+        free(pOldPc);
+        free(pOldCount);
+    }
+
+    pProf->pCount[profile_slot(pProf, iPc)]++;
+}
+
+//
+// A DWT_PCSR read came back
+//
+static void
+pcsr_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    PROFILE *pProf = pReq->pIcdi->pProfile;
+    unsigned char pData[4];
+    unsigned int iPc;
+
+    pProf->iInFlight--;
+    if ((len != 8) || (gdb_hex_decode(pData, pPayload, len) != 4))
+    {
+        pProf->iErrors++;
+        return;
+    }
+
+    iPc = pData[0] | (pData[1] << 8) | (pData[2] << 16) |
+          ((unsigned int)pData[3] << 24);
+    pProf->iSamples++;
+    if (iPc == PCSR_HALTED)
+    {
+        pProf->iHalted++;
+    }
+    else
+    {
+        profile_count(pProf, iPc);
+    }
+}
+
+//
+// Take the samples due this tick, as far as there is room in the queue
+//
+static void
+profile_tick(void *pCtx)
+{
+    ICDI *pIcdi = pCtx;
+    PROFILE *pProf = pIcdi->pProfile;
+    unsigned char pRead[16];
+    unsigned int n, iLen;
+
+    iLen = sprintf((char *)pRead, "m%x,4", DWT_PCSR);
+    for (n = 0; n < pProf->iPerTick; n++)
+    {
+        if (pProf->iInFlight == PROFILE_DEPTH)
+        {
+            pProf->iSkipped += pProf->iPerTick - n;
+            return;
+        }
+        pProf->iInFlight++;
+        probe_submit(pIcdi, NULL, pRead, iLen, pcsr_done, NULL);
+    }
+}
+
+//
+// Start sampling at pProf->iRate.  The timer runs at most every
+// millisecond, faster rates take several samples per tick.
+//
+static void
+profile_run(ICDI *pIcdi)
+{
+    PROFILE *pProf = pIcdi->pProfile;
+    unsigned int iPeriod;
+
+    if (pProf->iRate >= 1000)
+    {
+        iPeriod = 1;
+        pProf->iPerTick = pProf->iRate / 1000;
+    }
+    else
+    {
+        iPeriod = 1000 / pProf->iRate;
+        pProf->iPerTick = 1;
+    }
+
+    pProf->iTimer = event_timer_add(iPeriod, profile_tick, pIcdi);
+    pProf->bRunning = (pProf->iTimer >= 0);
+}
+
+//
+// Stop sampling.  Samples still queued are counted when they come back.
+//
+static void
+profile_stop(PROFILE *pProf)
+{
+    event_timer_del(pProf->iTimer);
+    pProf->iTimer = -1;
+    pProf->bRunning = 0;
+}
+
+//
+// DEMCR came back.  Set TRCENA, which DWT_PCSR needs, and start sampling
+// unless we were stopped in the meantime.
+//
+static void
+demcr_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    unsigned char pData[4];
+    unsigned char pBuf[32];
+    unsigned int n;
+
+    if (!pReq->pIcdi->pProfile->bRunning)
+    {
+        return;
+    }
+
+    if ((len == 8) && (gdb_hex_decode(pData, pPayload, len) == 4) &&
+        !(pData[3] & (DEMCR_TRCENA >> 24)))
+    {
+        pData[3] |= DEMCR_TRCENA >> 24;
+        n = sprintf((char *)pBuf, "M%x,4:", DEMCR);
+        n += gdb_hex_encode(pBuf + n, pData, 4);
+        probe_submit(pReq->pIcdi, NULL, pBuf, n, NULL, NULL);
+    }
+
+    profile_run(pReq->pIcdi);
+}
+
+static int
+line_compare(const void *pA, const void *pB)
+{
+    const PROFLINE *pLineA = pA, *pLineB = pB;
+
+    return (pLineA->iCount < pLineB->iCount) -
+           (pLineA->iCount > pLineB->iCount);
+}
+
+//
+// Collect the samples into lines per function, or per PC for those no
+// function covers, most samples first.  Returns the number of lines in
+// *ppLines, to be freed by the caller.
+//
+static unsigned int
+profile_lines(PROFILE *pProf, ELFSYMS *pElf, PROFLINE **ppLines)
+{
+    PROFLINE *pLines;
+    unsigned int *pFuncCount;
+    unsigned int i, n = 0;
+    int iFunc;
+
+    pLines = malloc((pProf->iUsed + 1) * sizeof(PROFLINE));
+    pFuncCount = calloc(elf_function_count(pElf) + 1, sizeof(unsigned int));
+    ASSERT((pLines != NULL) && (pFuncCount != NULL));
+
+    for (i = 0; i < pProf->iSlots; i++)
+    {
+        if (pProf->pPc[i] == PCSR_HALTED)
+        {
+            continue;
+        }
+
+        iFunc = elf_function(pElf, pProf->pPc[i]);
+        if (iFunc >= 0)
+        {
+            pFuncCount[iFunc] += pProf->pCount[i];
+        }
+        else
+        {
+            pLines[n].iFunc = -1;
+            pLines[n].iPc = pProf->pPc[i];
+            pLines[n++].iCount = pProf->pCount[i];
+        }
+    }
+
+    for (i = 0; i < elf_function_count(pElf); i++)
+    {
+        if (pFuncCount[i])
+        {
+            pLines[n].iFunc = i;
+            pLines[n++].iCount = pFuncCount[i];
+        }
+    }
+    free(pFuncCount);
+
+    qsort(pLines, n, sizeof(PROFLINE), line_compare);
+    *ppLines = pLines;
+    return n;
+}
+
+//
+// The name of the report line pLine
+//
+static const char *
+line_name(ELFSYMS *pElf, const PROFLINE *pLine, char *pBuf,
+        unsigned int iSize)
+{
+    if (pLine->iFunc >= 0)
+    {
+        return elf_function_name(pElf, pLine->iFunc);
+    }
+    snprintf(pBuf, iSize, "0x%08x", pLine->iPc);
+    return pBuf;
+}
+
+//
+// Write a flat (bFolded 0) or folded stack report to pFile, or the top of
+// the flat one to pCli's console if pFile is NULL
+//
+static void
+profile_report(PROFILE *pProf, GDBCLIENT *pCli, FILE *pFile, int bFolded)
+{
+    ELFSYMS *pElf = pCli->pIcdi->pElf;
+    PROFLINE *pLines;
+    unsigned int i, n, iTotal = 0;
+    char pName[16], pLine[320];
+
+    n = profile_lines(pProf, pElf, &pLines);
+    for (i = 0; i < n; i++)
+    {
+        iTotal += pLines[i].iCount;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (bFolded)
+        {
+            fprintf(pFile, "%s %u\n",
+                    line_name(pElf, &pLines[i], pName, sizeof(pName)),
+                    pLines[i].iCount);
+            continue;
+        }
+
+        snprintf(pLine, sizeof(pLine), "%8u %5.1f%%  %s\n", pLines[i].iCount,
+                 100.0 * pLines[i].iCount / iTotal,
+                 line_name(pElf, &pLines[i], pName, sizeof(pName)));
+        if (pFile)
+        {
+            fputs(pLine, pFile);
+        }
+        else if (i < PROFILE_TOP)
+        {
+            gdb_console(pCli, pLine);
+        }
+    }
+    free(pLines);
+}
+
+//
+// Print where profiling stands
+//
+static void
+profile_status(PROFILE *pProf, GDBCLIENT *pCli)
+{
+    char pLine[512];
+
+    snprintf(pLine, sizeof(pLine),
+             "profiling %s at %u Hz\n"
+             "%u samples, %u with the core halted, %u skipped, %u failed\n"
+             "%u distinct PCs, %u functions known\n",
+             pProf->bRunning ? "running" : "stopped", pProf->iRate,
+             pProf->iSamples, pProf->iHalted, pProf->iSkipped, pProf->iErrors,
+             pProf->iUsed, elf_function_count(pCli->pIcdi->pElf));
+    gdb_console(pCli, pLine);
+}
+
+//
+// Forget the samples taken so far
+//
+static void
+profile_clear(PROFILE *pProf)
+{
+    free(pProf->pPc);
+    free(pProf->pCount);
+    pProf->pPc = NULL;
+    pProf->pCount = NULL;
+    pProf->iSlots = 0;
+    pProf->iUsed = 0;
+    pProf->iSamples = 0;
+    pProf->iHalted = 0;
+    pProf->iSkipped = 0;
+    pProf->iErrors = 0;
+}
+
+//*****************************************************************************
+//
+//! Set up the profiler of pIcdi, not sampling yet.
+//
+//*****************************************************************************
+void
+profile_init(ICDI *pIcdi)
+{
+    pIcdi->pProfile = calloc(1, sizeof(PROFILE));
+    ASSERT(pIcdi->pProfile != NULL);
+    pIcdi->pProfile->iTimer = -1;
+    pIcdi->pProfile->iRate = PROFILE_RATE;
+}
+
+//*****************************************************************************
+//
+//! Handle "monitor profile ..." from pCli:
+//!
+//!   profile                     show the state of the profiler
+//!   profile start [rate]        sample rate times a second (1000)
+//!   profile stop
+//!   profile clear               forget the samples taken
+//!   profile elf file            the same as "elf file"
+//!   profile flat [file]         flat profile to file, or its top here
+//!   profile folded file         folded stacks for flamegraph.pl
+//!
+//! \return 1 if the packet was handled here, 0 otherwise.
+//
+//*****************************************************************************
+int
+profile_request(GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len)
+{
+    ICDI *pIcdi = pCli->pIcdi;
+    PROFILE *pProf = pIcdi->pProfile;
+    char pCmd[512], pArg[256];
+    unsigned char pBuf[16];
+    const char *pMsg = NULL;
+    unsigned int iRate;
+    int n, bFolded = 0;
+    FILE *pFile;
+
+    if (!gdb_monitor(pPayload, len, pCmd, sizeof(pCmd)) ||
+        (strncmp(pCmd, "profile", 7) != 0) ||
+        ((pCmd[7] != 0) && (pCmd[7] != ' ')))
+    {
+        return 0;
+    }
+
+    pArg[0] = 0;
+    n = sscanf(pCmd + 7, " start %u", &iRate);
+    if (strncmp(pCmd + 7, " start", 6) == 0)
+    {
+        if (pProf->bRunning)
+        {
+            pMsg = "already profiling\n";
+        }
+        else if ((n == 1) && ((iRate == 0) || (iRate > 1000000)))
+        {
+            pMsg = "rate out of range\n";
+        }
+        else
+        {
+            pProf->iRate = (n == 1) ? iRate : PROFILE_RATE;
+            pProf->bRunning = 1;
+            n = sprintf((char *)pBuf, "m%x,4", DEMCR);
+            probe_submit(pIcdi, NULL, pBuf, n, demcr_done, NULL);
+            bridge_warn_resumed(pCli, "the profiler");
+            pMsg = "profiling\n";
+        }
+    }
+    else if (strcmp(pCmd + 7, " stop") == 0)
+    {
+        profile_stop(pProf);
+    }
+    else if (strcmp(pCmd + 7, " clear") == 0)
+    {
+        profile_clear(pProf);
+    }
+    else if (sscanf(pCmd + 7, " elf %255s", pArg) == 1)
+    {
+        pMsg = elf_attach(pIcdi, pArg);
+        if (pMsg == NULL)
+        {
+            profile_status(pProf, pCli);
+        }
+    }
+    else if ((strcmp(pCmd + 7, " flat") == 0) ||
+             (sscanf(pCmd + 7, " flat %255s", pArg) == 1) ||
+             (bFolded = (sscanf(pCmd + 7, " folded %255s", pArg) == 1)))
+    {
+        pFile = NULL;
+        if (pArg[0] && ((pFile = fopen(pArg, "w")) == NULL))
+        {
+            pMsg = "can't write the report file\n";
+        }
+        else
+        {
+            profile_report(pProf, pCli, pFile, bFolded);
+            if (pFile)
+            {
+                fclose(pFile);
+            }
+        }
+    }
+    else if (pCmd[7] == 0)
+    {
+        profile_status(pProf, pCli);
+    }
+    else
+    {
+        pMsg = "usage: profile [start [rate]|stop|clear|elf file|"
+               "flat [file]|folded file]\n";
+    }
+
+    if (pMsg)
+    {
+        gdb_console(pCli, pMsg);
+    }
+    gdb_reply(pCli, (const unsigned char *)"OK", 2);
+    return 1;
+}
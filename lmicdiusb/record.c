@@ -0,0 +1,135 @@
+//*****************************************************************************
+//
+// record.c - recording of the traffic through the bridge, for lmreplay.
+//
+// With -r every chunk of bytes crossing the bridge is written to a trace
+// file as it goes: what each GDB client sent and was sent, and what went
+// to and came from each ICDI, along with the sessions starting and ending.
+// lmreplay plays the sessions of a trace back against a bridge, or feeds
+// the recorded streams to the packet parser, to benchmark changes against
+// real debugging sessions.
+//
+// The file starts with the 8 bytes REC_MAGIC.  Each record is a header of
+//
+//     u32 microseconds since the previous record
+//     u16 bytes of data
+//     u8  REC_KIND
+//     u8  index of the ICDI
+//     u16 session of the GDB client on that ICDI, 0 for the USB side
+//
+// all little endian, followed by the data.  Records are buffered and
+// written out every REC_FLUSH ms, so the trace costs a copy per chunk.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+#define REC_FLUSH               1000        // ms
+#define REC_BUFFER              (256 * 1024)
+
+static FILE *pRecFile;
+static unsigned long long iRecLast;
+static int iRecTimer = -1;
+
+static unsigned long long
+record_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+record_flush(void *pCtx)
+{
+    fflush(pRecFile);
+}
+
+//*****************************************************************************
+//
+//! Start recording to the trace file pName.
+//!
+//! \return 0 on success, -1 if the file can't be written.
+//
+//*****************************************************************************
+int
+record_open(const char *pName)
+{
+    pRecFile = fopen(pName, "wb");
+    if (pRecFile == NULL)
+    {
+        perror(pName);
+        return -1;
+    }
+
+    setvbuf(pRecFile, NULL, _IOFBF, REC_BUFFER);
+    fwrite(REC_MAGIC, 1, 8, pRecFile);
+    iRecLast = record_now();
+    iRecTimer = event_timer_add(REC_FLUSH, record_flush, NULL);
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Finish the trace, if we are recording one.
+//
+//*****************************************************************************
+void
+record_close(void)
+{
+    if (pRecFile)
+    {
+        event_timer_del(iRecTimer);
+        fclose(pRecFile);
+        pRecFile = NULL;
+    }
+}
+
+//*****************************************************************************
+//
+//! Record len bytes at pBuf crossing the bridge of pIcdi in the direction
+//! eKind, for the client with session iSession (0 on the USB side).
+//! Chunks longer than a record takes are split.
+//
+//*****************************************************************************
+void
+record_bytes(ICDI *pIcdi, unsigned int iSession, REC_KIND eKind,
+        const unsigned char *pBuf, unsigned int len)
+{
+    unsigned char pHdr[REC_HEADER];
+    unsigned long long iNow;
+    unsigned int iDelta, n;
+
+    if (pRecFile == NULL)
+    {
+        return;
+    }
+
+    do
+    {
+        iNow = record_now();
+        iDelta = (iNow - iRecLast > 0xffffffff) ? 0xffffffff : iNow - iRecLast;
+        iRecLast = iNow;
+        n = (len > 0xffff) ? 0xffff : len;
+
+        pHdr[0] = iDelta;
+        pHdr[1] = iDelta >> 8;
+        pHdr[2] = iDelta >> 16;
+        pHdr[3] = iDelta >> 24;
+        pHdr[4] = n;
+        pHdr[5] = n >> 8;
+        pHdr[6] = eKind;
+        pHdr[7] = pIcdi->iIndex;
+        pHdr[8] = iSession;
+        pHdr[9] = iSession >> 8;
+
+        fwrite(pHdr, 1, sizeof(pHdr), pRecFile);
+        fwrite(pBuf, 1, n, pRecFile);
+        pBuf += n;
+        len -= n;
+    } while (len);
+}
@@ -0,0 +1,330 @@
+//*****************************************************************************
+//
+// regcache.c - register cache for a halted target.
+//
+// Every time the target stops GDB reads the whole register file with 'g'
+// and then asks for single registers with 'p'.  While the core is halted
+// none of them can change behind our back, so the answers are kept here
+// and served locally until the target is resumed, stepped or reset.
+// Register writes go through to the ICDI and update the cache once the
+// ICDI has accepted them.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+//
+// 'p' replies are kept for registers 0 to MAX_REGS - 1.  r0 to r15 are 4
+// bytes each at the start of the 'g' reply whatever register layout GDB
+// uses, so those are served from the 'g' reply as well.
+//
+#define MAX_REGS                64
+#define MAX_REG_HEX             32
+#define CORE_REGS               16
+#define MAX_G_HEX               1024
+
+typedef struct _REGVAL
+{
+    unsigned int iLen;
+    unsigned char pHex[MAX_REG_HEX];
+} REGVAL;
+
+//
+// The registers we hold for one ICDI
+//
+struct _REGCACHE
+{
+    int bHalted;
+
+    unsigned int iGLen;
+    unsigned char pG[MAX_G_HEX];
+
+    REGVAL pVals[MAX_REGS];
+};
+
+//*****************************************************************************
+//
+//! Set up the register cache of pIcdi.  We know nothing about the core
+//! until it is seen to stop.
+//
+//*****************************************************************************
+void
+regcache_init(ICDI *pIcdi)
+{
+    pIcdi->pRegCache = calloc(1, sizeof(REGCACHE));
+    ASSERT(pIcdi->pRegCache != NULL);
+}
+
+//*****************************************************************************
+//
+//! Forget all cached registers.
+//
+//*****************************************************************************
+void
+regcache_invalidate(ICDI *pIcdi)
+{
+    REGCACHE *pRegs = pIcdi->pRegCache;
+    unsigned int i;
+
+    pRegs->iGLen = 0;
+    for (i = 0; i < MAX_REGS; i++)
+    {
+        pRegs->pVals[i].iLen = 0;
+    }
+}
+
+//*****************************************************************************
+//
+//! Record whether the core is halted.  Registers and RAM are only cached
+//! while it is, anything cached is dropped as soon as it may run.
+//
+//*****************************************************************************
+void
+regcache_set_halted(ICDI *pIcdi, int bHalt)
+{
+    if (!bHalt)
+    {
+        regcache_invalidate(pIcdi);
+        cache_window_drop(pIcdi);
+    }
+    pIcdi->pRegCache->bHalted = bHalt;
+}
+
+int
+regcache_halted(ICDI *pIcdi)
+{
+    return pIcdi->pRegCache->bHalted;
+}
+
+//
+// Does this payload look like a stop reply?
+//
+static int
+is_stop_reply(const unsigned char *pPayload, unsigned int len)
+{
+    return (len >= 3) && ((pPayload[0] == 'S') || (pPayload[0] == 'T')) &&
+           isxdigit(pPayload[1]) && isxdigit(pPayload[2]);
+}
+
+static int
+is_ok(const unsigned char *pPayload, unsigned int len)
+{
+    return (len == 2) && (memcmp(pPayload, "OK", 2) == 0);
+}
+
+//
+// The response to '?' or a resume.  A stop reply means the core is
+// halted again, anything else leaves us not knowing.
+//
+static void
+stop_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    regcache_set_halted(pReq->pIcdi, is_stop_reply(pPayload, len));
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+static void
+g_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    REGCACHE *pRegs = pReq->pIcdi->pRegCache;
+
+    if (pRegs->bHalted && (len <= sizeof(pRegs->pG)) &&
+        (len >= 8 * CORE_REGS) && isxdigit(pPayload[0]))
+    {
+        memcpy(pRegs->pG, pPayload, len);
+        pRegs->iGLen = len;
+    }
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+static void
+p_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    REGCACHE *pRegs = pReq->pIcdi->pRegCache;
+    unsigned int iReg;
+
+    gdb_parse_hex(pReq->pPkt + 2, pReq->iLen - 2, &iReg);
+    if (pRegs->bHalted && (iReg < MAX_REGS) && (len > 0) &&
+        (len <= MAX_REG_HEX) && isxdigit(pPayload[0]))
+    {
+        memcpy(pRegs->pVals[iReg].pHex, pPayload, len);
+        pRegs->pVals[iReg].iLen = len;
+    }
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+//
+// The ICDI answered a 'P<n>=<value>'.  Once it took the value, it is
+// what the register holds.
+//
+static void
+P_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    REGCACHE *pRegs = pReq->pIcdi->pRegCache;
+    unsigned char *pPkt = pReq->pPkt + 2;
+    unsigned int iPkt = pReq->iLen - 5;
+    unsigned int iReg, i, n;
+
+    i = gdb_parse_hex(pPkt, iPkt, &iReg) + 1;
+    n = iPkt - i;
+
+    if (!is_ok(pPayload, len))
+    {
+        regcache_invalidate(pReq->pIcdi);
+    }
+    else if (pRegs->bHalted && (iReg < MAX_REGS) && (n <= MAX_REG_HEX))
+    {
+        memcpy(pRegs->pVals[iReg].pHex, pPkt + i, n);
+        pRegs->pVals[iReg].iLen = n;
+        if ((iReg < CORE_REGS) && (n == 8))
+        {
+            memcpy(pRegs->pG + 8 * iReg, pPkt + i, n);
+        }
+        else
+        {
+            //
+            // We don't know where other registers live in the 'g' reply
+            //
+            pRegs->iGLen = 0;
+        }
+    }
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+static void
+G_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    REGCACHE *pRegs = pReq->pIcdi->pRegCache;
+    unsigned int n = pReq->iLen - 5;
+
+    regcache_invalidate(pReq->pIcdi);
+    if (is_ok(pPayload, len) && pRegs->bHalted && (n <= sizeof(pRegs->pG)) &&
+        (n >= 8 * CORE_REGS))
+    {
+        memcpy(pRegs->pG, pReq->pPkt + 2, n);
+        pRegs->iGLen = n;
+    }
+    gdb_reply(pReq->pCli, pPayload, len);
+}
+
+//
+// Answer 'p<n>' from the cache if we can
+//
+static int
+p_reply(REGCACHE *pRegs, GDBCLIENT *pCli, unsigned int iReg)
+{
+    if ((iReg < MAX_REGS) && pRegs->pVals[iReg].iLen)
+    {
+        gdb_reply(pCli, pRegs->pVals[iReg].pHex, pRegs->pVals[iReg].iLen);
+        return 1;
+    }
+
+    if ((iReg < CORE_REGS) && pRegs->iGLen)
+    {
+        gdb_reply(pCli, pRegs->pG + 8 * iReg, 8);
+        return 1;
+    }
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Handle the register accesses and run control packets pCli sent to
+//! pIcdi.
+//!
+//! \return 1 if the packet was dealt with, 0 if it is none of ours.
+//
+//*****************************************************************************
+int
+regcache_request(ICDI *pIcdi, GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len)
+{
+    REGCACHE *pRegs = pIcdi->pRegCache;
+    unsigned int iReg;
+
+    switch (pPayload[0])
+    {
+        case 'g':
+            if (len != 1)
+            {
+                return 0;
+            }
+            if (pRegs->iGLen)
+            {
+                TRACE(1, "%s: 'g' from cache\n", __FUNCTION__);
+                metrics_add(pIcdi, METRIC_REG_HITS, 1);
+                gdb_reply(pCli, pRegs->pG, pRegs->iGLen);
+            }
+            else
+            {
+                metrics_add(pIcdi, METRIC_REG_MISSES, 1);
+                probe_submit(pIcdi, pCli, pPayload, len, g_done, NULL);
+            }
+            return 1;
+
+        case 'p':
+            if (gdb_parse_hex(pPayload + 1, len - 1, &iReg) != len - 1)
+            {
+                return 0;
+            }
+            if (p_reply(pRegs, pCli, iReg))
+            {
+                TRACE(1, "%s: 'p%x' from cache\n", __FUNCTION__, iReg);
+                metrics_add(pIcdi, METRIC_REG_HITS, 1);
+            }
+            else
+            {
+                metrics_add(pIcdi, METRIC_REG_MISSES, 1);
+                probe_submit(pIcdi, pCli, pPayload, len, p_done, NULL);
+            }
+            return 1;
+
+        case 'P':
+            probe_submit(pIcdi, pCli, pPayload, len, P_done, NULL);
+            return 1;
+
+        case 'G':
+            probe_submit(pIcdi, pCli, pPayload, len, G_done, NULL);
+            return 1;
+
+        case '?':
+            probe_submit(pIcdi, pCli, pPayload, len, stop_done, NULL);
+            return 1;
+
+        case 'c':
+        case 'C':
+        case 's':
+        case 'S':
+            regcache_set_halted(pIcdi, 0);
+            probe_submit(pIcdi, pCli, pPayload, len, stop_done, NULL);
+            return 1;
+
+        case 'v':
+            if (PKT_IS(pPayload, len, "vCont;"))
+            {
+                regcache_set_halted(pIcdi, 0);
+                probe_submit(pIcdi, pCli, pPayload, len, stop_done, NULL);
+                return 1;
+            }
+            return 0;
+
+        case 'r':
+        case 'D':
+            regcache_set_halted(pIcdi, 0);
+            return 0;
+
+        case 'q':
+            //
+            // Monitor commands may reset or resume the core
+            //
+            if (PKT_IS(pPayload, len, "qRcmd,"))
+            {
+                regcache_set_halted(pIcdi, 0);
+            }
+            return 0;
+    }
+    return 0;
+}
@@ -0,0 +1,842 @@
+//*****************************************************************************
+//
+// rtt.c - streaming of the target's ring buffer channels (RTT) over TCP.
+//
+// The target keeps a control block in RAM, tagged "SEGGER RTT", listing
+// ring buffers going up (target to host) and down (host to target), each
+// with a write and a read offset.  We find the control block, serve each
+// channel on a TCP port of its own and copy data between the two.
+//
+// Each poll reads the descriptors of all the channels in one request.
+// Then, per channel, one read fetches the data waiting in the up buffer
+// and a small write of its read offset frees the space.  Data from the
+// TCP client is written to the down buffer in the same way.  The queue to
+// the ICDI keeps these in order, so nothing needs to wait for anything
+// else.  Polling speeds up to RTT_POLL_MIN while data is moving and backs
+// off to RTT_POLL_MAX while the target is quiet, and stops altogether
+// while no channel has a client.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define RTT_PORT                19021       // of channel 0 of the first ICDI
+#define RTT_CHANNELS            8           // channels served per direction
+#define RTT_POLL_MIN            1           // ms
+#define RTT_POLL_MAX            64          // ms
+#define RTT_DOWN_BUFFER         1024
+
+//
+// Where we look for the control block unless told
+//
+#define RTT_RAM                 0x20000000
+#define RTT_RAM_SIZE            0x8000
+
+//
+// The control block: the ID, the number of up and down buffers and their
+// descriptors, up buffers first
+//
+#define RTT_ID                  "SEGGER RTT"
+#define RTT_HDR_SIZE            24
+#define RTT_DESC_SIZE           24
+#define RTT_DESC_BUFFER         4
+#define RTT_DESC_SIZEOF         8
+#define RTT_DESC_WROFF          12
+#define RTT_DESC_RDOFF          16
+
+//
+// One channel: its port and client, and the buffers the target has for it
+// as of the last poll
+//
+typedef struct _RTTCHAN
+{
+    ICDI *pIcdi;
+    unsigned int iChan;
+    int iPort;
+    int sdListen;
+    int sd;
+    unsigned int iUpBuf;
+    unsigned int iUpSize;
+    unsigned int iDownBuf;
+    unsigned int iDownSize;
+    unsigned int iIn;
+    unsigned char pIn[RTT_DOWN_BUFFER];
+} RTTCHAN;
+
+typedef enum { RTT_OFF, RTT_SEARCH, RTT_FOUND } RTT_STATE;
+
+struct _RTT
+{
+    RTT_STATE eState;
+    unsigned int iGen;
+
+    //
+    // Where the search has got to, and where it ends
+    //
+    unsigned int iSearch;
+    unsigned int iSearchEnd;
+
+    //
+    // The control block and the buffers of it we serve
+    //
+    unsigned int iAddr;
+    unsigned int iMaxUp;
+    unsigned int iUp;
+    unsigned int iDown;
+    RTTCHAN pChan[RTT_CHANNELS];
+
+    //
+    // Polling: the timer and its period, and the requests of the poll on
+    // the wire
+    //
+    int iTimer;
+    unsigned int iPeriod;
+    unsigned int iPending;
+    int bMoved;
+
+    unsigned long long iBytesUp;
+    unsigned long long iBytesDown;
+};
+
+//
+// The context of our requests, to tell them from those of a session of
+// the RTT that has since been stopped
+//
+typedef struct _RTTREQ
+{
+    unsigned int iGen;
+    unsigned int iChan;
+} RTTREQ;
+
+static void rtt_tick(void *pCtx);
+
+static unsigned int
+rtt_le32(const unsigned char *pData)
+{
+    return pData[0] | (pData[1] << 8) | (pData[2] << 16) |
+           ((unsigned int)pData[3] << 24);
+}
+
+//
+// The most a binary read of the ICDI returns in one go
+//
+static unsigned int
+rtt_chunk(ICDI *pIcdi)
+{
+    return (probe_packet_size(pIcdi) - 8) / 2;
+}
+
+//
+// Queue a request for the RTT of pIcdi: a read ('x') or a write ('M', 'X')
+// of the packet in pPayload.  pfnDone gets a fresh RTTREQ in pCtx.
+//
+static void
+rtt_submit(ICDI *pIcdi, const unsigned char *pPayload, unsigned int len,
+        PROBE_FN pfnDone, unsigned int iChan)
+{
+    RTT *pRtt = pIcdi->pRtt;
+    RTTREQ *pCtx;
+
+    pCtx = malloc(sizeof(RTTREQ));
+    ASSERT(pCtx != NULL);
+    pCtx->iGen = pRtt->iGen;
+    pCtx->iChan = iChan;
+
+    pRtt->iPending++;
+    probe_submit(pIcdi, NULL, pPayload, len, pfnDone, pCtx);
+}
+
+//
+// The response to pReq was the binary data of a read.  Unescape it in
+// place and return its length, or -1 if the request was of an RTT session
+// that is gone or failed.
+//
+static int
+rtt_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    RTT *pRtt = pReq->pIcdi->pRtt;
+    RTTREQ *pCtx = pReq->pCtx;
+    int bCurrent = (pCtx->iGen == pRtt->iGen);
+
+    if (bCurrent)
+    {
+        pRtt->iPending--;
+    }
+
+    if (!bCurrent || (len < 3) || (memcmp(pPayload, "OK:", 3) != 0))
+    {
+        return -1;
+    }
+    return gdb_unescape(pPayload, pPayload + 3, len - 3);
+}
+
+//
+// The poll is done with.  Speed up if it moved data, back off otherwise.
+//
+static void
+rtt_poll_done(ICDI *pIcdi)
+{
+    RTT *pRtt = pIcdi->pRtt;
+    unsigned int iPeriod;
+
+    if ((pRtt->iPending != 0) || (pRtt->eState != RTT_FOUND))
+    {
+        return;
+    }
+
+    iPeriod = pRtt->bMoved ? RTT_POLL_MIN : 2 * pRtt->iPeriod;
+    if (iPeriod > RTT_POLL_MAX)
+    {
+        iPeriod = RTT_POLL_MAX;
+    }
+
+    if (iPeriod != pRtt->iPeriod)
+    {
+        pRtt->iPeriod = iPeriod;
+        event_timer_del(pRtt->iTimer);
+        pRtt->iTimer = event_timer_add(iPeriod, rtt_tick, pIcdi);
+    }
+}
+
+//
+// A response of the RTT that isn't otherwise looked at
+//
+static void
+rtt_write_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+
+    if (((RTTREQ *)pReq->pCtx)->iGen == pIcdi->pRtt->iGen)
+    {
+        pIcdi->pRtt->iPending--;
+        rtt_poll_done(pIcdi);
+    }
+    free(pReq->pCtx);
+}
+
+//
+// Write the offset iOff to the descriptor field at iAddr.  What GDB may
+// have cached of RAM we write to is dropped.
+//
+static void
+rtt_set_offset(ICDI *pIcdi, unsigned int iAddr, unsigned int iOff)
+{
+    unsigned char pData[4];
+    unsigned char pBuf[32];
+    unsigned int n;
+
+    pData[0] = iOff;
+    pData[1] = iOff >> 8;
+    pData[2] = iOff >> 16;
+    pData[3] = iOff >> 24;
+    n = sprintf((char *)pBuf, "M%x,4:", iAddr);
+    n += gdb_hex_encode(pBuf + n, pData, 4);
+    rtt_submit(pIcdi, pBuf, n, rtt_write_done, 0);
+    cache_invalidate(pIcdi, iAddr, 4);
+}
+
+//
+// Data from an up buffer came in.  Pass it on to the channel's client.
+//
+static void
+rtt_up_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    RTT *pRtt = pReq->pIcdi->pRtt;
+    RTTCHAN *pChan = &pRtt->pChan[((RTTREQ *)pReq->pCtx)->iChan];
+    int n = rtt_done(pReq, pPayload, len);
+    ssize_t tx;
+
+    free(pReq->pCtx);
+    if (n < 0)
+    {
+        return;
+    }
+
+    pRtt->iBytesUp += n;
+    while ((pChan->sd >= 0) && (n > 0))
+    {
+        tx = send(pChan->sd, pPayload, n, 0);
+        if (tx <= 0)
+        {
+            perror("send() failed");
+            break;
+        }
+        pPayload += tx;
+        n -= tx;
+    }
+    rtt_poll_done(pReq->pIcdi);
+}
+
+//
+// Fetch what waits in the up buffer of pChan, from iRd to iWr, as far as
+// it goes without wrapping, and free its space
+//
+static void
+rtt_up(ICDI *pIcdi, RTTCHAN *pChan, unsigned int iWr, unsigned int iRd)
+{
+    RTT *pRtt = pIcdi->pRtt;
+    unsigned char pBuf[32];
+    unsigned int iLen, n;
+
+    iLen = (iWr >= iRd) ? iWr - iRd : pChan->iUpSize - iRd;
+    if (iLen > rtt_chunk(pIcdi))
+    {
+        iLen = rtt_chunk(pIcdi);
+    }
+
+    n = sprintf((char *)pBuf, "x%x,%x", pChan->iUpBuf + iRd, iLen);
+    rtt_submit(pIcdi, pBuf, n, rtt_up_done, pChan->iChan);
+
+    iRd += iLen;
+    if (iRd == pChan->iUpSize)
+    {
+        iRd = 0;
+    }
+    rtt_set_offset(pIcdi, pRtt->iAddr + RTT_HDR_SIZE +
+                   pChan->iChan * RTT_DESC_SIZE + RTT_DESC_RDOFF, iRd);
+    pRtt->bMoved = 1;
+}
+
+//
+// Write what the client of pChan sent to the down buffer, from iWr up to
+// just before iRd, as far as it goes without wrapping, and hand it over
+//
+static void
+rtt_down(ICDI *pIcdi, RTTCHAN *pChan, unsigned int iWr, unsigned int iRd)
+{
+    RTT *pRtt = pIcdi->pRtt;
+    unsigned char pBuf[MSGSIZE + 32];
+    unsigned int iLen, iUsed, n;
+
+    iLen = (iRd > iWr) ? iRd - iWr - 1 :
+           pChan->iDownSize - iWr - (iRd == 0);
+    if (iLen > pChan->iIn)
+    {
+        iLen = pChan->iIn;
+    }
+    if (iLen == 0)
+    {
+        return;
+    }
+
+    n = gdb_build_write(pBuf, probe_packet_size(pIcdi), 0,
+                        pChan->iDownBuf + iWr, pChan->pIn, iLen, &iUsed);
+    rtt_submit(pIcdi, pBuf, n, rtt_write_done, pChan->iChan);
+    cache_invalidate(pIcdi, pChan->iDownBuf + iWr, iUsed);
+
+    iWr += iUsed;
+    if (iWr == pChan->iDownSize)
+    {
+        iWr = 0;
+    }
+    rtt_set_offset(pIcdi, pRtt->iAddr + RTT_HDR_SIZE +
+                   (pRtt->iMaxUp + pChan->iChan) * RTT_DESC_SIZE +
+                   RTT_DESC_WROFF, iWr);
+
+    pChan->iIn -= iUsed;
+    memmove(pChan->pIn, pChan->pIn + iUsed, pChan->iIn);
+    pRtt->iBytesDown += iUsed;
+    pRtt->bMoved = 1;
+
+    //
+    // There's room for more from the client again
+    //
+    if (pChan->sd >= 0)
+    {
+        event_mod(pChan->sd, POLLIN);
+    }
+}
+
+//
+// The descriptors of the buffers came in.  Move whatever data there is to
+// move for the channels with a client.
+//
+static void
+rtt_desc_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+    RTT *pRtt = pIcdi->pRtt;
+    const unsigned char *pDesc;
+    unsigned int iWr, iRd, i;
+    RTTCHAN *pChan;
+    int n = rtt_done(pReq, pPayload, len);
+
+    free(pReq->pCtx);
+    if (n < 0)
+    {
+        return;
+    }
+
+    pRtt->bMoved = 0;
+    for (i = 0; i < RTT_CHANNELS; i++)
+    {
+        pChan = &pRtt->pChan[i];
+        if (pChan->sd < 0)
+        {
+            continue;
+        }
+
+        pDesc = pPayload + i * RTT_DESC_SIZE;
+        if ((i < pRtt->iUp) && ((i + 1) * RTT_DESC_SIZE <= n))
+        {
+            pChan->iUpBuf = rtt_le32(pDesc + RTT_DESC_BUFFER);
+            pChan->iUpSize = rtt_le32(pDesc + RTT_DESC_SIZEOF);
+            iWr = rtt_le32(pDesc + RTT_DESC_WROFF);
+            iRd = rtt_le32(pDesc + RTT_DESC_RDOFF);
+            if ((iWr != iRd) && (iWr < pChan->iUpSize) &&
+                (iRd < pChan->iUpSize))
+            {
+                rtt_up(pIcdi, pChan, iWr, iRd);
+            }
+        }
+
+        pDesc = pPayload + (pRtt->iMaxUp + i) * RTT_DESC_SIZE;
+        if ((i < pRtt->iDown) &&
+            ((pRtt->iMaxUp + i + 1) * RTT_DESC_SIZE <= n) && pChan->iIn)
+        {
+            pChan->iDownBuf = rtt_le32(pDesc + RTT_DESC_BUFFER);
+            pChan->iDownSize = rtt_le32(pDesc + RTT_DESC_SIZEOF);
+            iWr = rtt_le32(pDesc + RTT_DESC_WROFF);
+            iRd = rtt_le32(pDesc + RTT_DESC_RDOFF);
+            if ((iWr < pChan->iDownSize) && (iRd < pChan->iDownSize))
+            {
+                rtt_down(pIcdi, pChan, iWr, iRd);
+            }
+        }
+    }
+
+    rtt_poll_done(pIcdi);
+}
+
+//
+// Poll the buffers, unless the last poll is still on the wire or no one
+// is listening
+//
+static void
+rtt_tick(void *pCtx)
+{
+    ICDI *pIcdi = pCtx;
+    RTT *pRtt = pIcdi->pRtt;
+    unsigned char pBuf[32];
+    unsigned int i, n;
+
+    if (pRtt->iPending)
+    {
+        return;
+    }
+
+    for (i = 0; (i < RTT_CHANNELS) && (pRtt->pChan[i].sd < 0); i++)
+    {
+    }
+    if (i == RTT_CHANNELS)
+    {
+        return;
+    }
+
+    n = sprintf((char *)pBuf, "x%x,%x", pRtt->iAddr + RTT_HDR_SIZE,
+                (pRtt->iMaxUp + pRtt->iDown) * RTT_DESC_SIZE);
+    rtt_submit(pIcdi, pBuf, n, rtt_desc_done, 0);
+}
+
+static void rtt_listen_event(int fd, short revents, void *pCtx);
+
+//
+// The client of pChan went away
+//
+static void
+rtt_client_close(RTTCHAN *pChan)
+{
+    event_del(pChan->sd);
+    close(pChan->sd);
+    pChan->sd = -1;
+    pChan->iIn = 0;
+
+    if (pChan->sdListen >= 0)
+    {
+        event_add(pChan->sdListen, POLLIN, rtt_listen_event, pChan);
+    }
+}
+
+//
+// The client of pChan sent data for the down buffer.  Take what fits and
+// stop listening to it while the buffer is full.
+//
+static void
+rtt_client_event(int fd, short revents, void *pCtx)
+{
+    RTTCHAN *pChan = pCtx;
+    ssize_t rx;
+
+    if (pChan->iIn == sizeof(pChan->pIn))
+    {
+        event_mod(fd, 0);
+        return;
+    }
+
+    rx = recv(fd, pChan->pIn + pChan->iIn, sizeof(pChan->pIn) - pChan->iIn, 0);
+    if (rx <= 0)
+    {
+        rtt_client_close(pChan);
+        return;
+    }
+
+    //
+    // Data for a channel without a down buffer is dropped
+    //
+    if (pChan->iChan < pChan->pIcdi->pRtt->iDown)
+    {
+        pChan->iIn += rx;
+    }
+}
+
+//
+// Someone connected to the port of pChan.  One client per channel.
+//
+static void
+rtt_listen_event(int fd, short revents, void *pCtx)
+{
+    RTTCHAN *pChan = pCtx;
+    struct sockaddr_in pin;
+    socklen_t addrlen = sizeof(pin);
+
+	if ((pChan->sd = accept(fd, (struct sockaddr *)  &pin, &addrlen)) == -1) {
+		perror("accept");
+		return;
+	}
+
+    TRACE(1, "%s: RTT channel %d connected\n", __FUNCTION__, pChan->iChan);
+    event_del(pChan->sdListen);
+    event_add(pChan->sd, POLLIN, rtt_client_event, pChan);
+}
+
+//
+// Stop serving the channels and forget the control block
+//
+static void
+rtt_stop(ICDI *pIcdi)
+{
+    RTT *pRtt = pIcdi->pRtt;
+    RTTCHAN *pChan;
+    unsigned int i;
+
+    for (i = 0; i < RTT_CHANNELS; i++)
+    {
+        pChan = &pRtt->pChan[i];
+        if (pChan->sd >= 0)
+        {
+            rtt_client_close(pChan);
+        }
+        if (pChan->sdListen >= 0)
+        {
+            event_del(pChan->sdListen);
+            close(pChan->sdListen);
+            pChan->sdListen = -1;
+        }
+    }
+
+    event_timer_del(pRtt->iTimer);
+    pRtt->iTimer = -1;
+    pRtt->eState = RTT_OFF;
+    pRtt->iPending = 0;
+    pRtt->iGen++;
+}
+
+//
+// The header of the control block came in.  Open the ports of the
+// channels and start polling.
+//
+static void
+rtt_header_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+    RTT *pRtt = pIcdi->pRtt;
+    unsigned int i, iMaxDown;
+    RTTCHAN *pChan;
+    int n = rtt_done(pReq, pPayload, len);
+
+    free(pReq->pCtx);
+    if (n < 0)
+    {
+        return;
+    }
+
+    pRtt->iMaxUp = rtt_le32(pPayload + 16);
+    iMaxDown = rtt_le32(pPayload + 20);
+    if ((n != RTT_HDR_SIZE) || (memcmp(pPayload, RTT_ID, sizeof(RTT_ID)) != 0) ||
+        (pRtt->iMaxUp > 64) || (iMaxDown > 64))
+    {
+        TRACE(ALWAYS, "ICDI %s: bad RTT control block at 0x%08x\n",
+              pIcdi->pSerial, pRtt->iAddr);
+        pRtt->eState = RTT_OFF;
+        return;
+    }
+
+    //
+    // All the descriptors we serve are read in one go, so take no more
+    // than fit
+    //
+    pRtt->iUp = (pRtt->iMaxUp < RTT_CHANNELS) ? pRtt->iMaxUp : RTT_CHANNELS;
+    pRtt->iDown = (iMaxDown < RTT_CHANNELS) ? iMaxDown : RTT_CHANNELS;
+    while ((pRtt->iDown > 0) &&
+           ((pRtt->iMaxUp + pRtt->iDown) * RTT_DESC_SIZE > rtt_chunk(pIcdi)))
+    {
+        pRtt->iDown--;
+    }
+
+    pRtt->eState = RTT_FOUND;
+    TRACE(ALWAYS, "ICDI %s: RTT at 0x%08x, %d up and %d down buffers\n",
+          pIcdi->pSerial, pRtt->iAddr, pRtt->iMaxUp, iMaxDown);
+
+    for (i = 0; (i < pRtt->iUp) || (i < pRtt->iDown); i++)
+    {
+        pChan = &pRtt->pChan[i];
+        pChan->sdListen = Listen(pChan->iPort);
+        if (pChan->sdListen < 0)
+        {
+            TRACE(ALWAYS, "RTT channel %d: unable to listen on port %d\n",
+                  i, pChan->iPort);
+            continue;
+        }
+        TRACE(ALWAYS, "RTT channel %d on port %d\n", i, pChan->iPort);
+        event_add(pChan->sdListen, POLLIN, rtt_listen_event, pChan);
+    }
+
+    pRtt->iPeriod = RTT_POLL_MAX;
+    pRtt->iTimer = event_timer_add(pRtt->iPeriod, rtt_tick, pIcdi);
+}
+
+//
+// Read the header of the control block at iAddr
+//
+static void
+rtt_attach(ICDI *pIcdi, unsigned int iAddr)
+{
+    unsigned char pBuf[32];
+    unsigned int n;
+
+    pIcdi->pRtt->iAddr = iAddr;
+    n = sprintf((char *)pBuf, "x%x,%x", iAddr, RTT_HDR_SIZE);
+    rtt_submit(pIcdi, pBuf, n, rtt_header_done, 0);
+}
+
+static void rtt_search(ICDI *pIcdi);
+
+//
+// A piece of RAM came in.  Look for the ID of the control block in it,
+// and in the next piece if it isn't there.  The pieces overlap by the
+// length of the ID.
+//
+static void
+rtt_search_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+    RTT *pRtt = pIcdi->pRtt;
+    int bCurrent = (((RTTREQ *)pReq->pCtx)->iGen == pRtt->iGen);
+    int n = rtt_done(pReq, pPayload, len);
+    int i;
+
+    free(pReq->pCtx);
+    if (n < 0)
+    {
+        if (bCurrent)
+        {
+            TRACE(ALWAYS, "ICDI %s: RTT search failed at 0x%08x\n",
+                  pIcdi->pSerial, pRtt->iSearch);
+            pRtt->eState = RTT_OFF;
+        }
+        return;
+    }
+
+    for (i = 0; i + (int)sizeof(RTT_ID) <= n; i++)
+    {
+        if (memcmp(pPayload + i, RTT_ID, sizeof(RTT_ID)) == 0)
+        {
+            rtt_attach(pIcdi, pRtt->iSearch + i);
+            return;
+        }
+    }
+
+    pRtt->iSearch += (n > (int)sizeof(RTT_ID)) ? n - sizeof(RTT_ID) + 1 : n;
+    if ((n == 0) || (pRtt->iSearch + sizeof(RTT_ID) > pRtt->iSearchEnd))
+    {
+        TRACE(ALWAYS, "ICDI %s: no RTT control block found\n", pIcdi->pSerial);
+        pRtt->eState = RTT_OFF;
+        return;
+    }
+    rtt_search(pIcdi);
+}
+
+//
+// Read the next piece of RAM to search
+//
+static void
+rtt_search(ICDI *pIcdi)
+{
+    RTT *pRtt = pIcdi->pRtt;
+    unsigned char pBuf[32];
+    unsigned int iLen, n;
+
+    iLen = rtt_chunk(pIcdi);
+    if (iLen > pRtt->iSearchEnd - pRtt->iSearch)
+    {
+        iLen = pRtt->iSearchEnd - pRtt->iSearch;
+    }
+
+    n = sprintf((char *)pBuf, "x%x,%x", pRtt->iSearch, iLen);
+    rtt_submit(pIcdi, pBuf, n, rtt_search_done, 0);
+}
+
+//
+// Print where the RTT stands
+//
+static void
+rtt_status(ICDI *pIcdi, GDBCLIENT *pCli)
+{
+    RTT *pRtt = pIcdi->pRtt;
+    char pLine[128];
+    unsigned int i;
+
+    switch (pRtt->eState)
+    {
+        case RTT_OFF:
+            gdb_console(pCli, "RTT stopped\n");
+            return;
+
+        case RTT_SEARCH:
+            snprintf(pLine, sizeof(pLine), "RTT searching at 0x%08x\n",
+                     pRtt->iSearch);
+            gdb_console(pCli, pLine);
+            return;
+
+        case RTT_FOUND:
+            break;
+    }
+
+    snprintf(pLine, sizeof(pLine),
+             "RTT at 0x%08x, polled every %u ms, %llu bytes up, %llu down\n",
+             pRtt->iAddr, pRtt->iPeriod, pRtt->iBytesUp, pRtt->iBytesDown);
+    gdb_console(pCli, pLine);
+
+    for (i = 0; (i < pRtt->iUp) || (i < pRtt->iDown); i++)
+    {
+        snprintf(pLine, sizeof(pLine), "channel %u%s%s on port %d, %s\n", i,
+                 (i < pRtt->iUp) ? " up" : "", (i < pRtt->iDown) ? " down" : "",
+                 pRtt->pChan[i].iPort,
+                 (pRtt->pChan[i].sd >= 0) ? "connected" : "idle");
+        gdb_console(pCli, pLine);
+    }
+}
+
+//*****************************************************************************
+//
+//! Set up the RTT of pIcdi, not started.  Its channel n is served on
+//! RTT_PORT + iIndex * RTT_CHANNELS + n unless "rtt start" says otherwise.
+//
+//*****************************************************************************
+void
+rtt_init(ICDI *pIcdi)
+{
+    unsigned int i;
+
+    pIcdi->pRtt = calloc(1, sizeof(RTT));
+    ASSERT(pIcdi->pRtt != NULL);
+    pIcdi->pRtt->iTimer = -1;
+
+    for (i = 0; i < RTT_CHANNELS; i++)
+    {
+        pIcdi->pRtt->pChan[i].pIcdi = pIcdi;
+        pIcdi->pRtt->pChan[i].iChan = i;
+        pIcdi->pRtt->pChan[i].iPort = RTT_PORT + pIcdi->iIndex * RTT_CHANNELS + i;
+        pIcdi->pRtt->pChan[i].sdListen = -1;
+        pIcdi->pRtt->pChan[i].sd = -1;
+    }
+}
+
+//*****************************************************************************
+//
+//! Handle "monitor rtt ..." from pCli:
+//!
+//!   rtt                             show the state of the RTT
+//!   rtt start [port [addr [len]]]   find the control block in len bytes
+//!                                   from addr, or at addr if len is 0,
+//!                                   and serve channel n on port + n
+//!   rtt stop
+//!
+//! \return 1 if the packet was handled here, 0 otherwise.
+//
+//*****************************************************************************
+int
+rtt_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pCli->pIcdi;
+    RTT *pRtt = pIcdi->pRtt;
+    unsigned int iPort, iAddr = RTT_RAM, iLen = RTT_RAM_SIZE, i;
+    const char *pMsg = NULL;
+    char pCmd[128];
+    int n;
+
+    if (!gdb_monitor(pPayload, len, pCmd, sizeof(pCmd)) ||
+        (strncmp(pCmd, "rtt", 3) != 0) || ((pCmd[3] != 0) && (pCmd[3] != ' ')))
+    {
+        return 0;
+    }
+
+    n = sscanf(pCmd + 3, " start %u %x %x", &iPort, &iAddr, &iLen);
+    if (strncmp(pCmd + 3, " start", 6) == 0)
+    {
+        if (pRtt->eState != RTT_OFF)
+        {
+            pMsg = "RTT already started\n";
+        }
+        else
+        {
+            pRtt->iBytesUp = 0;
+            pRtt->iBytesDown = 0;
+            for (i = 0; (n >= 1) && (i < RTT_CHANNELS); i++)
+            {
+                pRtt->pChan[i].iPort = iPort + i;
+            }
+
+            if ((n == 3) && (iLen == 0))
+            {
+                pRtt->eState = RTT_SEARCH;
+                rtt_attach(pIcdi, iAddr);
+            }
+            else
+            {
+                pRtt->eState = RTT_SEARCH;
+                pRtt->iSearch = iAddr;
+                pRtt->iSearchEnd = iAddr + iLen;
+                rtt_search(pIcdi);
+            }
+            bridge_warn_resumed(pCli, "RTT");
+            pMsg = "looking for the RTT control block\n";
+        }
+    }
+    else if (strcmp(pCmd + 3, " stop") == 0)
+    {
+        rtt_stop(pIcdi);
+    }
+    else if (pCmd[3] == 0)
+    {
+        rtt_status(pIcdi, pCli);
+    }
+    else
+    {
+        pMsg = "usage: rtt [start [port [addr [len]]]|stop]\n";
+    }
+
+    if (pMsg)
+    {
+        gdb_console(pCli, pMsg);
+    }
+    gdb_reply(pCli, (const unsigned char *)"OK", 2);
+    return 1;
+}
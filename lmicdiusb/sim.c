@@ -0,0 +1,736 @@
+//*****************************************************************************
+//
+// sim.c - a simulated ICDI, to run the bridge without hardware.
+//
+// With -S lmicdi serves simulated ICDIs instead of the ones on USB, so the
+// bridge can be load tested and benchmarked anywhere.  Each one answers the
+// packets in commands.txt the way the ICDI firmware does, over a model of
+// an LM4F120: 256KB of flash at 0, 32KB of SRAM at 0x20000000, peripherals
+// that read as zero, and a core that runs from breakpoint to breakpoint.
+// Continuing with no breakpoint set runs until GDB interrupts.
+//
+// The USB link is replaced by a socket pair.  What the bridge sends is
+// parsed and answered straight away, and the answer is written to the
+// socket SIM_LATENCY ms later (-L), where the event loop picks it up just
+// as it would a USB transfer.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define SIM_FLASH_SIZE          0x40000
+#define SIM_FLASH_PAGE          0x400
+#define SIM_SRAM                0x20000000
+#define SIM_SRAM_SIZE           0x8000
+#define SIM_PERIPH_SIZE         0x100000    // at 0x40000000 and 0xe0000000
+#define SIM_PACKET_SIZE         0x400
+#define SIM_BPS                 16
+
+//
+// Registers as GDB numbers them for an ARM without a target description:
+// r0-r15, eight FPA registers of 12 bytes, fps and cpsr
+//
+#define SIM_REG_PC              15
+#define SIM_REG_FPS             0x18
+#define SIM_REG_CPSR            0x19
+
+static const char pMemoryMap[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE memory-map PUBLIC"
+    " \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\""
+    " \"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+    "<memory-map>"
+    "<memory type=\"flash\" start=\"0x0\" length=\"0x40000\">"
+    "<property name=\"blocksize\">0x400</property>"
+    "</memory>"
+    "<memory type=\"ram\" start=\"0x20000000\" length=\"0x8000\"/>"
+    "</memory-map>";
+
+//
+// An answer on its way to the bridge
+//
+typedef struct _SIMRESP SIMRESP;
+struct _SIMRESP
+{
+    SIMRESP *pNext;
+    unsigned long long iDue;
+    unsigned int iLen;
+    unsigned char pData[];
+};
+
+struct _SIM
+{
+    ICDI *pIcdi;
+    GDBCTX gdbCtx;              // packets from the bridge
+    unsigned char pReq[MSGSIZE];
+    int bNoAck;
+
+    //
+    // The core
+    //
+    int bRunning;
+    unsigned int pRegs[16];
+    unsigned int iCpsr;
+    unsigned int pBps[SIM_BPS];
+    unsigned int iBps;
+    unsigned char *pFlash;
+    unsigned char *pSram;
+
+    //
+    // The link: answers are written to sd[0] once due and come out of
+    // sd[1] into the bridge
+    //
+    int sd[2];
+    int bAttached;
+    unsigned int iLatency;
+    int iTimer;
+    SIMRESP *pHead;
+    SIMRESP *pTail;
+};
+
+static unsigned int iSimLatency;
+
+static unsigned long long
+sim_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//
+// Write the answers that are due to the link
+//
+static void
+sim_tick(void *pCtx)
+{
+    SIM *pSim = pCtx;
+    SIMRESP *pResp;
+    unsigned long long iNow = sim_now();
+
+    while (pSim->pHead && (pSim->pHead->iDue <= iNow))
+    {
+        pResp = pSim->pHead;
+        pSim->pHead = pResp->pNext;
+        if (pSim->pHead == NULL)
+        {
+            pSim->pTail = NULL;
+        }
+
+        if (send(pSim->sd[0], pResp->pData, pResp->iLen, 0) !=
+            (ssize_t)pResp->iLen)
+        {
+            perror("sim: send() failed");
+        }
+        free(pResp);
+    }
+}
+
+//
+// Send len bytes at pBuf to the bridge, once the latency has passed
+//
+static void
+sim_write(SIM *pSim, const unsigned char *pBuf, unsigned int len)
+{
+    SIMRESP *pResp;
+
+    if ((pSim->iLatency == 0) && (pSim->pHead == NULL))
+    {
+        if (send(pSim->sd[0], pBuf, len, 0) != (ssize_t)len)
+        {
+            perror("sim: send() failed");
+        }
+        return;
+    }
+
+    pResp = malloc(sizeof(SIMRESP) + len);
+    ASSERT(pResp != NULL);
+    pResp->pNext = NULL;
+    pResp->iDue = sim_now() + pSim->iLatency;
+    pResp->iLen = len;
+    memcpy(pResp->pData, pBuf, len);
+
+    if (pSim->pTail)
+    {
+        pSim->pTail->pNext = pResp;
+    }
+    else
+    {
+        pSim->pHead = pResp;
+    }
+    pSim->pTail = pResp;
+}
+
+static void
+sim_reply(SIM *pSim, const unsigned char *pPayload, unsigned int len)
+{
+    unsigned char pBuf[MSGSIZE + 4];
+
+    sim_write(pSim, pBuf, gdb_frame(pBuf, pPayload, len));
+}
+
+static void
+sim_reply_str(SIM *pSim, const char *pText)
+{
+    sim_reply(pSim, (const unsigned char *)pText, strlen(pText));
+}
+
+//
+// Answer a monitor command with pText for GDB's console.  Like the ICDI,
+// the text is the whole answer, hex encoded.
+//
+static void
+sim_console(SIM *pSim, const char *pText)
+{
+    unsigned char pBuf[2 * 256];
+    unsigned int n = strlen(pText);
+
+    n = (n < 256) ? n : 256;
+    sim_reply(pSim, pBuf, gdb_hex_encode(pBuf, (const unsigned char *)pText,
+              n));
+}
+
+static unsigned int
+sim_le32(const unsigned char *pData)
+{
+    return pData[0] | (pData[1] << 8) | (pData[2] << 16) |
+           ((unsigned int)pData[3] << 24);
+}
+
+//
+// A core reset: the stack pointer and entry point come from the vectors
+//
+static void
+sim_reset(SIM *pSim)
+{
+    memset(pSim->pRegs, 0, sizeof(pSim->pRegs));
+    pSim->pRegs[13] = sim_le32(pSim->pFlash);
+    pSim->pRegs[SIM_REG_PC] = sim_le32(pSim->pFlash + 4) & ~1;
+    pSim->iCpsr = 0x01000000;
+}
+
+//
+// Where len bytes at iAddr are modeled, NULL if not all of them are.
+// Peripherals read as zero and ignore writes.
+//
+static unsigned char *
+sim_memory(SIM *pSim, unsigned int iAddr, unsigned int len, int bWrite)
+{
+    static unsigned char pPeriph[MSGSIZE];
+
+    if ((iAddr < SIM_FLASH_SIZE) && (len <= SIM_FLASH_SIZE - iAddr))
+    {
+        return pSim->pFlash + iAddr;
+    }
+
+    if ((iAddr >= SIM_SRAM) && (iAddr - SIM_SRAM < SIM_SRAM_SIZE) &&
+        (len <= SIM_SRAM_SIZE - (iAddr - SIM_SRAM)))
+    {
+        return pSim->pSram + (iAddr - SIM_SRAM);
+    }
+
+    if ((((iAddr >> 20) == 0x400) || ((iAddr >> 20) == 0xe00)) &&
+        (len <= sizeof(pPeriph)) &&
+        ((iAddr & (SIM_PERIPH_SIZE - 1)) + len <= SIM_PERIPH_SIZE))
+    {
+        if (!bWrite)
+        {
+            memset(pPeriph, 0, len);
+        }
+        return pPeriph;
+    }
+    return NULL;
+}
+
+//
+// The value of register iReg as GDB wants it in hex, 0 if there's none
+//
+static unsigned int
+sim_reg_hex(SIM *pSim, unsigned int iReg, unsigned char *pOut)
+{
+    unsigned char pData[12];
+    unsigned int iVal;
+
+    if (iReg < 16)
+    {
+        iVal = pSim->pRegs[iReg];
+    }
+    else if (iReg < SIM_REG_FPS)
+    {
+        memset(pData, 0, sizeof(pData));
+        return gdb_hex_encode(pOut, pData, 12);
+    }
+    else if (iReg == SIM_REG_FPS)
+    {
+        iVal = 0;
+    }
+    else if (iReg == SIM_REG_CPSR)
+    {
+        iVal = pSim->iCpsr;
+    }
+    else
+    {
+        return 0;
+    }
+
+    pData[0] = iVal;
+    pData[1] = iVal >> 8;
+    pData[2] = iVal >> 16;
+    pData[3] = iVal >> 24;
+    return gdb_hex_encode(pOut, pData, 4);
+}
+
+//
+// Continue: run to the next breakpoint after the PC, if there is one
+//
+static void
+sim_continue(SIM *pSim)
+{
+    unsigned int i, iPc = pSim->pRegs[SIM_REG_PC], iNext = 0;
+    int bFound = 0;
+
+    for (i = 0; i < pSim->iBps; i++)
+    {
+        if ((pSim->pBps[i] != iPc) &&
+            (!bFound || (pSim->pBps[i] - iPc - 1 < iNext - iPc - 1)))
+        {
+            iNext = pSim->pBps[i];
+            bFound = 1;
+        }
+    }
+
+    if (!bFound)
+    {
+        pSim->bRunning = 1;
+        return;
+    }
+
+    pSim->pRegs[SIM_REG_PC] = iNext;
+    sim_reply_str(pSim, "S05");
+}
+
+//
+// "monitor ..." of GDB, as the commands in commands.txt
+//
+static void
+sim_monitor(SIM *pSim, const char *pCmd)
+{
+    if (strcmp(pCmd, "version") == 0)
+    {
+        sim_console(pSim, "ICDI version: simulated\n");
+        return;
+    }
+    else if ((strcmp(pCmd, "debug sreset") == 0) ||
+             (strcmp(pCmd, "debug creset") == 0) ||
+             (strcmp(pCmd, "debug hreset") == 0))
+    {
+        sim_reset(pSim);
+    }
+    else if (strcmp(pCmd, "debug unlock") == 0)
+    {
+        memset(pSim->pFlash, 0xff, SIM_FLASH_SIZE);
+        sim_reset(pSim);
+    }
+    else if ((strncmp(pCmd, "mfg getu0", 9) == 0) ||
+             (strncmp(pCmd, "mfg getu1", 9) == 0))
+    {
+        sim_console(pSim, "0xffffffff\n");
+        return;
+    }
+    else if ((strncmp(pCmd, "debug", 5) != 0) &&
+             (strncmp(pCmd, "set", 3) != 0) &&
+             (strncmp(pCmd, "mfg", 3) != 0) &&
+             (strcmp(pCmd, "dfu-update") != 0))
+    {
+        sim_reply_str(pSim, "");
+        return;
+    }
+    sim_reply_str(pSim, "OK");
+}
+
+//
+// The q, Q and v packets we know
+//
+static void
+sim_query(SIM *pSim, unsigned char *pPayload, unsigned int len)
+{
+    static const char pXfer[] = "qXfer:memory-map:read::";
+    unsigned char pBuf[MSGSIZE];
+    char pCmd[128];
+    unsigned int iAddr, iLen, n, i;
+    unsigned char *pMem;
+
+    if (PKT_IS(pPayload, len, "qSupported"))
+    {
+        n = sprintf((char *)pBuf, "PacketSize=%x;qXfer:memory-map:read+;"
+                    "QStartNoAckMode+", SIM_PACKET_SIZE);
+        sim_reply(pSim, pBuf, n);
+    }
+    else if (PKT_IS(pPayload, len, pXfer) &&
+             gdb_parse_range(pPayload + sizeof(pXfer) - 1,
+                             len - sizeof(pXfer) + 1, &iAddr, &iLen))
+    {
+        n = sizeof(pMemoryMap) - 1;
+        iAddr = (iAddr < n) ? iAddr : n;
+        iLen = (iLen < n - iAddr) ? iLen : n - iAddr;
+        iLen = (iLen < (MSGSIZE - 4) / 2) ? iLen : (MSGSIZE - 4) / 2;
+        pBuf[0] = (iAddr + iLen < n) ? 'm' : 'l';
+        sim_reply(pSim, pBuf, 1 + gdb_escape(pBuf + 1,
+                  (const unsigned char *)pMemoryMap + iAddr, iLen));
+    }
+    else if (gdb_monitor(pPayload, len, pCmd, sizeof(pCmd)))
+    {
+        sim_monitor(pSim, pCmd);
+    }
+    else if (PKT_IS(pPayload, len, "QStartNoAckMode"))
+    {
+        sim_reply_str(pSim, "OK");
+        pSim->bNoAck = 1;
+    }
+    else if (PKT_IS(pPayload, len, "vFlashErase:") &&
+             gdb_parse_range(pPayload + 12, len - 12, &iAddr, &iLen) &&
+             (iAddr % SIM_FLASH_PAGE == 0) && (iLen % SIM_FLASH_PAGE == 0) &&
+             (iAddr < SIM_FLASH_SIZE) && (iLen <= SIM_FLASH_SIZE - iAddr))
+    {
+        memset(pSim->pFlash + iAddr, 0xff, iLen);
+        sim_reply_str(pSim, "OK");
+    }
+    else if (PKT_IS(pPayload, len, "vFlashWrite:"))
+    {
+        //
+        // Flash only programs bits from 1 to 0
+        //
+        i = 12 + gdb_parse_hex(pPayload + 12, len - 12, &iAddr);
+        n = (i < len) ? gdb_unescape(pBuf, pPayload + i + 1, len - i - 1) : 0;
+        pMem = sim_memory(pSim, iAddr, n, 1);
+        if ((i >= len) || (pPayload[i] != ':') ||
+            (pMem != pSim->pFlash + iAddr))
+        {
+            sim_reply_str(pSim, "E01");
+            return;
+        }
+        for (i = 0; i < n; i++)
+        {
+            pMem[i] &= pBuf[i];
+        }
+        sim_reply_str(pSim, "OK");
+    }
+    else if (PKT_IS(pPayload, len, "vFlashDone"))
+    {
+        sim_reply_str(pSim, "OK");
+    }
+    else if (PKT_IS(pPayload, len, "vFlash"))
+    {
+        sim_reply_str(pSim, "E01");
+    }
+    else
+    {
+        sim_reply_str(pSim, "");
+    }
+}
+
+//
+// Answer the packet in pPayload
+//
+static void
+sim_request(SIM *pSim, unsigned char *pPayload, unsigned int len)
+{
+    unsigned char pBuf[MSGSIZE];
+    unsigned char *pMem;
+    unsigned int iAddr, iLen, iVal, i, n;
+
+    switch (len ? pPayload[0] : 0)
+    {
+        case '?':
+            sim_reply_str(pSim, pSim->bRunning ? "S00" : "S05");
+            return;
+
+        case '!':
+        case 'D':
+            sim_reply_str(pSim, "OK");
+            return;
+
+        case 'g':
+            for (i = 0, n = 0; i <= SIM_REG_CPSR; i++)
+            {
+                n += sim_reg_hex(pSim, i, pBuf + n);
+            }
+            sim_reply(pSim, pBuf, n);
+            return;
+
+        case 'p':
+            n = 0;
+            if (gdb_parse_hex(pPayload + 1, len - 1, &i) == len - 1)
+            {
+                n = sim_reg_hex(pSim, i, pBuf);
+            }
+            sim_reply(pSim, n ? pBuf : (const unsigned char *)"E01", n ? n : 3);
+            return;
+
+        case 'P':
+            n = 1 + gdb_parse_hex(pPayload + 1, len - 1, &i);
+            if ((n + 9 != len) || (pPayload[n] != '=') || (i >= 16 &&
+                i != SIM_REG_CPSR))
+            {
+                sim_reply_str(pSim, "E01");
+                return;
+            }
+            gdb_hex_decode(pBuf, pPayload + n + 1, 8);
+            iVal = sim_le32(pBuf);
+            if (i == SIM_REG_CPSR)
+            {
+                pSim->iCpsr = iVal;
+            }
+            else
+            {
+                pSim->pRegs[i] = iVal;
+            }
+            sim_reply_str(pSim, "OK");
+            return;
+
+        case 'm':
+        case 'x':
+            if (!gdb_parse_range(pPayload + 1, len - 1, &iAddr, &iLen) ||
+                (iLen > SIM_PACKET_SIZE) ||
+                ((pMem = sim_memory(pSim, iAddr, iLen, 0)) == NULL))
+            {
+                sim_reply_str(pSim, "E01");
+            }
+            else if (pPayload[0] == 'm')
+            {
+                sim_reply(pSim, pBuf, gdb_hex_encode(pBuf, pMem, iLen));
+            }
+            else
+            {
+                memcpy(pBuf, "OK:", 3);
+                sim_reply(pSim, pBuf, 3 + gdb_escape(pBuf + 3, pMem, iLen));
+            }
+            return;
+
+        case 'M':
+        case 'X':
+            n = 1 + gdb_parse_range(pPayload + 1, len - 1, &iAddr, &iLen);
+            if ((n == 1) || (n >= len) || (pPayload[n] != ':'))
+            {
+                sim_reply_str(pSim, "E01");
+                return;
+            }
+            if (pPayload[0] == 'M')
+            {
+                i = (len - n - 1 == 2 * iLen) ?
+                    gdb_hex_decode(pBuf, pPayload + n + 1, 2 * iLen) : 0;
+            }
+            else
+            {
+                i = gdb_unescape(pBuf, pPayload + n + 1, len - n - 1);
+            }
+
+            //
+            // Flash is only written with vFlashWrite
+            //
+            pMem = sim_memory(pSim, iAddr, iLen, 1);
+            if ((i != iLen) || (pMem == NULL) || (iAddr < SIM_FLASH_SIZE))
+            {
+                sim_reply_str(pSim, "E01");
+                return;
+            }
+            memcpy(pMem, pBuf, iLen);
+            sim_reply_str(pSim, "OK");
+            return;
+
+        case 'c':
+        case 'C':
+            sim_continue(pSim);
+            return;
+
+        case 's':
+        case 'S':
+            pSim->pRegs[SIM_REG_PC] += 2;
+            sim_reply_str(pSim, "S05");
+            return;
+
+        case 'R':
+            sim_reset(pSim);
+            pSim->bRunning = 1;
+            return;
+
+        case 'k':
+            sim_reset(pSim);
+            return;
+
+        case 'Z':
+        case 'z':
+            if ((len < 4) || ((pPayload[1] != '0') && (pPayload[1] != '1')) ||
+                !gdb_parse_hex(pPayload + 3, len - 3, &iAddr))
+            {
+                sim_reply_str(pSim, "");
+                return;
+            }
+            for (i = 0; (i < pSim->iBps) && (pSim->pBps[i] != iAddr); i++)
+            {
+            }
+            if ((pPayload[0] == 'Z') && (i == pSim->iBps))
+            {
+                if (i == SIM_BPS)
+                {
+                    sim_reply_str(pSim, "E01");
+                    return;
+                }
+                pSim->pBps[pSim->iBps++] = iAddr;
+            }
+            else if ((pPayload[0] == 'z') && (i < pSim->iBps))
+            {
+                pSim->pBps[i] = pSim->pBps[--pSim->iBps];
+            }
+            sim_reply_str(pSim, "OK");
+            return;
+
+        case 'q':
+        case 'Q':
+        case 'v':
+            sim_query(pSim, pPayload, len);
+            return;
+    }
+
+    //
+    // A, G, H, i, I, t, T and anything else do nothing
+    //
+    sim_reply_str(pSim, "");
+}
+
+//
+// A packet, ack or Ctrl-C from the bridge
+//
+static void
+sim_packet(GDBCTX *pGdbCtx, int bCsumValid)
+{
+    SIM *pSim = pGdbCtx->pOwner;
+
+    if (pGdbCtx->iRd == 1)
+    {
+        if ((pGdbCtx->pPkt[0] == 0x03) && pSim->bRunning)
+        {
+            pSim->bRunning = 0;
+            sim_reply_str(pSim, "S02");
+        }
+        return;
+    }
+
+    if (!pSim->bNoAck)
+    {
+        sim_write(pSim, (const unsigned char *)(bCsumValid ? "+" : "-"), 1);
+    }
+
+    if (bCsumValid)
+    {
+        pSim->bRunning = 0;
+        sim_request(pSim, pGdbCtx->pPkt + 1, pGdbCtx->iRd - 4);
+    }
+}
+
+//
+// Answers are in from the simulated ICDI
+//
+static void
+sim_event(int fd, short revents, void *pCtx)
+{
+    static unsigned char pBuf[MSGSIZE];
+    ssize_t rx;
+
+    rx = recv(fd, pBuf, sizeof(pBuf), 0);
+    if (rx > 0)
+    {
+        usb_rx_deliver(pCtx, pBuf, rx);
+    }
+}
+
+//*****************************************************************************
+//
+//! Set the latency, in milliseconds, of the simulated ICDIs opened from
+//! then on.
+//
+//*****************************************************************************
+void
+sim_set_latency(unsigned int iLatency)
+{
+    iSimLatency = iLatency;
+}
+
+//*****************************************************************************
+//
+//! Make simulated ICDI number iIndex, with erased flash and a halted core.
+//!
+//! \return the ICDI, NULL if its link can't be set up.
+//
+//*****************************************************************************
+ICDI *
+sim_open(unsigned int iIndex)
+{
+    ICDI *pIcdi;
+    SIM *pSim;
+
+    pIcdi = calloc(1, sizeof(ICDI));
+    pSim = calloc(1, sizeof(SIM));
+    ASSERT((pIcdi != NULL) && (pSim != NULL));
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pSim->sd) != 0)
+    {
+        perror("socketpair");
+        free(pSim);
+        free(pIcdi);
+        return NULL;
+    }
+
+    pSim->pFlash = malloc(SIM_FLASH_SIZE);
+    pSim->pSram = calloc(1, SIM_SRAM_SIZE);
+    ASSERT((pSim->pFlash != NULL) && (pSim->pSram != NULL));
+    memset(pSim->pFlash, 0xff, SIM_FLASH_SIZE);
+    sim_reset(pSim);
+
+    pSim->pIcdi = pIcdi;
+    pSim->gdbCtx.gdb_state = GDB_IDLE;
+    pSim->gdbCtx.pResp = pSim->pReq;
+    pSim->gdbCtx.pOwner = pSim;
+    pSim->iLatency = iSimLatency;
+    pSim->iTimer = -1;
+
+    pIcdi->pSim = pSim;
+    snprintf(pIcdi->pSerial, sizeof(pIcdi->pSerial), "SIM%04u", iIndex);
+    return pIcdi;
+}
+
+//*****************************************************************************
+//
+//! Hand len bytes at pBuf from the bridge to the simulated ICDI of pIcdi.
+//! They are dealt with before we return.
+//
+//*****************************************************************************
+void
+sim_send(ICDI *pIcdi, const unsigned char *pBuf, unsigned int len)
+{
+    SIM *pSim = pIcdi->pSim;
+
+    //
+    // The event loop is only up once we are bridging
+    //
+    if (!pSim->bAttached)
+    {
+        pSim->bAttached = 1;
+        event_add(pSim->sd[1], POLLIN, sim_event, pIcdi);
+        if (pSim->iLatency)
+        {
+            pSim->iTimer = event_timer_add(1, sim_tick, pSim);
+        }
+    }
+
+    metrics_add(pIcdi, METRIC_USB_BYTES_OUT, len);
+    record_bytes(pIcdi, 0, REC_USB_OUT, pBuf, len);
+    gdb_statemachine(&pSim->gdbCtx, (unsigned char *)pBuf, len, sim_packet);
+}
@@ -43,123 +43,114 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
-static unsigned char pGdbReq[MSGSIZE];
-
-//
-// This GDB context is for tracking the state of packets
-// which come over a TCP socket.  That is to say, GDB 
-// requests from the client.
-static GDBCTX gdbCliCtx = 
-{
-    GDB_IDLE,
-    pGdbReq,
-    0, 0, 0, 0
-};
-        
-static int sdAccept;
 // static unsigned char endpOut;
 
-static struct libusb_transfer *pTransReq;
-
 //*****************************************************************************
 //
-//! This is the callback for handling the transfer completion of the GDB ack
-//!
-//! \param pTrans is pointer to the usb transaction structure in which we   
-//! transmitted the [N]ACK packet.
-//!
-//! \return None
+//! Send everything queued up for pCli.
 //
 //*****************************************************************************
-static void
-usb_req_callback(struct libusb_transfer *pTrans)
+void
+client_flush(GDBCLIENT *pCli)
 {
-    if (pTrans->status != LIBUSB_TRANSFER_COMPLETED)
-    {
-        TRACE(ALWAYS, "%s: Unable to send request (status = %d)\n", 
-              __FUNCTION__, pTrans->status);
-    }
-    else
+    ssize_t tx;
+    unsigned int iSent = 0;
+
+    while ((pCli->sd >= 0) && (iSent < pCli->iOut))
     {
-        TRACE(1, "%s: GDB REQ sent successfully\n", __FUNCTION__);
+        tx = send(pCli->sd, pCli->pOut + iSent, pCli->iOut - iSent, 0);
+        if (tx <= 0)
+        {
+            perror("send() failed");
+            break;
+        }
+        iSent += tx;
     }
+    metrics_add(pCli->pIcdi, METRIC_GDB_BYTES_OUT, iSent);
+    record_bytes(pCli->pIcdi, pCli->iSession, REC_GDB_OUT, pCli->pOut, iSent);
+    pCli->iOut = 0;
 }
 
+//*****************************************************************************
 //
-// After we receive a complete packet from a TCP socket we send it 
-// off asynchronously.
+//! Make room for len bytes, at most MSGSIZE, at the end of pCli's output
+//! and return where they go.  They are only sent once client_commit() says
+//! they are there.
 //
-static void
-usbTxReq(GDBCTX *pGdbCtx, int ack)
+//*****************************************************************************
+unsigned char *
+client_reserve(GDBCLIENT *pCli, unsigned int len)
 {
-    int rc;
-    static char bInited = 0;
+    ASSERT(len <= sizeof(pCli->pOut));
 
-    if (!bInited)
+    if (pCli->iOut + len > sizeof(pCli->pOut))
     {
-        //
-        // Set up an async transfer to ack gdb responses...
-        //
-        pTransReq = libusb_alloc_transfer(0);
-        ASSERT(pTransReq != NULL);
-            
-        pTransReq->dev_handle = phDev;
-        pTransReq->flags = 0;
-        pTransReq->endpoint = pdEndpOut->bEndpointAddress;
-        pTransReq->type = LIBUSB_TRANSFER_TYPE_BULK;
-        pTransReq->timeout = 1000;
-        pTransReq->callback = usb_req_callback;
-        pTransReq->num_iso_packets = 0;
-        bInited = 1;
+        client_flush(pCli);
     }
+    return pCli->pOut + pCli->iOut;
+}
 
-    //
-    // NOTE: There is a possible race condition here because USB may not
-    // consume this buffer before we start writing to it.  BUT
-    // since the GDB protocol is inherently syncrhonous,  I think 
-    // we avoid that scenario.
-    //
-    pGdbCtx->pResp[pGdbCtx->iRd] = 0;
-    pTransReq->buffer = pGdbCtx->pResp;
-    pTransReq->length = pGdbCtx->iRd;
-
-    TRACE(0, "%s: '%s'\n", __FUNCTION__, pGdbCtx->pResp);
+//*****************************************************************************
+//
+//! Queue the len bytes written where client_reserve() said.  While a batch
+//! of client input is being handled the data is held back so acks and
+//! locally generated responses leave in a single send(), otherwise it goes
+//! out straight away.
+//
+//*****************************************************************************
+void
+client_commit(GDBCLIENT *pCli, unsigned int len)
+{
+    pCli->iOut += len;
 
-    rc = libusb_submit_transfer(pTransReq);
-    //
-    // TODO: handle the case where we don't send the whole packet...
-    //
-    if (rc != 0)
+    if (!pCli->bBatch)
     {
-        TRACE(ALWAYS, "%s: ERROR rc = %d\n", __FUNCTION__, rc);
+        client_flush(pCli);
     }
-
-    TRACE(1, "%s: ...done\n", __FUNCTION__);
- 
 }
 
+//*****************************************************************************
 //
-// Whenever we receive a packet from USB (ie. the server)
-// send it over the TCP socket.
+//! Queue len bytes for pCli.
 //
+//*****************************************************************************
 void
-usbRxResp(unsigned char *pResp, unsigned int len)
+client_write(GDBCLIENT *pCli, const unsigned char *pBuf, unsigned int len)
 {
-    pResp[len] = 0;
-    TRACE(1, "%s: '%s'\n", __FUNCTION__, pResp);
-    send(sdAccept, pResp, len, 0);
+    if (len > sizeof(pCli->pOut))
+    {
+        client_flush(pCli);
+        if ((pCli->sd >= 0) && (send(pCli->sd, pBuf, len, 0) > 0))
+        {
+            metrics_add(pCli->pIcdi, METRIC_GDB_BYTES_OUT, len);
+            record_bytes(pCli->pIcdi, pCli->iSession, REC_GDB_OUT, pBuf, len);
+        }
+        return;
+    }
+
+    memcpy(client_reserve(pCli, len), pBuf, len);
+    client_commit(pCli, len);
 }
 
+static void
+client_packet(GDBCTX *pGdbCtx, int bCsumValid)
+{
+    bridge_client_packet(pGdbCtx->pOwner, pGdbCtx, bCsumValid);
+}
+
+//*****************************************************************************
 //
-// Wait for a connection on iPort and return the 
-// 
-static int
+//! Open a socket listening on iPort.
+//!
+//! \return the socket, or -1 on failure.
+//
+//*****************************************************************************
+int
 Listen(unsigned int iPort)
 {
-    unsigned int addrlen;
    	struct   sockaddr_in sin;
-	struct   sockaddr_in pin;
 	int so_reuseaddr = 1;
     int sdListen;
 
@@ -192,6 +183,7 @@ Listen(unsigned int iPort)
     TRACE(1, "bind to port %d\n", iPort);
 	if (bind(sdListen, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
 		perror("bind");
+		close(sdListen);
 		return(-1);
 	}
 
@@ -200,222 +192,247 @@ Listen(unsigned int iPort)
     // incoming connection
     //
     TRACE(1, "listen\n");
-	if (listen(sdListen, 1) == -1) {
+	if (listen(sdListen, 8) == -1) {
 		perror("listen");
+		close(sdListen);
 		return(-1);
 	} 
 
-    // 
-    // Accept() will block until someone connects.  In return it gives
-    // us a new file descriptor back.
-    //
-    TRACE(1, "accept...\n");
-    addrlen = sizeof(pin); 
-	if ((sdAccept = accept(sdListen, (struct sockaddr *)  &pin, &addrlen)) == -1) {
-		perror("accept");
-		return(-1);
-	}
-
-    //
-    // Close the file descriptor that we used for listening
-    //
-    close(sdListen);
-
-    return sdAccept;
+    return sdListen;
 }
 
-static int 
-doGdb(int sdAccept, struct pollfd *pPollFds, int iFds)
+static void listen_event(int fd, short revents, void *pCtx);
+
+//
+// pCli went away (or we failed talking to it).  Close the socket and take
+// it off its ICDI.  Once the last client of a farm board is gone the board
+// goes to the next session waiting in the farm, otherwise we make sure
+// there is room for a new connection.
+//
+static void
+client_close(GDBCLIENT *pCli)
 {
-    static unsigned char pMsg[MSGSIZE];
-    ssize_t  rx;
-    int      rc, iTimeoutms, i;
-    struct   timeval tv;
+    ICDI *pIcdi = pCli->pIcdi;
+    GDBCLIENT **ppCli;
 
-    rc = 0;
-    while(1) 
+    TRACE(1, "%s: closing client socket %d\n", __FUNCTION__, pCli->sd);
+    record_bytes(pIcdi, pCli->iSession, REC_CLOSE, NULL, 0);
+    event_del(pCli->sd);
+    close(pCli->sd);
+    pCli->sd = -1;
+
+    for (ppCli = &pIcdi->pClients; *ppCli != pCli; ppCli = &(*ppCli)->pNext)
     {
-        //
-        // A bit of paranoia coding.  Clear out the old buffer before rx'ing
-        // the next packet
-        //
-        memset(pMsg, 0, sizeof(pMsg));
+    }
+    *ppCli = pCli->pNext;
+    pIcdi->iClients--;
 
-        //
-        // Figure out how long the timeout on our next poll will be.
-        //
-        rc = libusb_get_next_timeout(pCtx, &tv);
-        if (rc == 0)
-        {
-            //
-            // no timeouts are pending from usb.  Force to 1ms.
-            //
-            iTimeoutms = 10;
-        }
-        else
+    bridge_client_closed(pCli);
+    free(pCli);
+
+    if (pIcdi->iClients == 0)
+    {
+        pIcdi->tBusy += time(NULL) - pIcdi->tAttached;
+        pIcdi->tAttached = 0;
+    }
+
+    if (pIcdi->bFarm)
+    {
+        if (pIcdi->iClients == 0)
         {
-            unsigned long long usecs;
-            if ((tv.tv_sec == 0) && (tv.tv_usec == 0))
-            {
-                //
-                // we were told we had a timeout with a 0 tv
-                // that means something is already pending...
-                //
-                rc = libusb_handle_events(pCtx);
-                ASSERT(rc == 0);
-            }
-            else
-            {
-                //
-                // Convert the Secs + uSecs in the TV to millisecs.
-                //
-                usecs = tv.tv_sec * 1000000 + tv.tv_usec;
-                iTimeoutms = usecs/1000;
-            }
+            farm_release(pIcdi);
         }
+    }
+    else if (pIcdi->iClients == MAX_CLIENTS - 1)
+    {
+        event_add(pIcdi->sdListen, POLLIN, listen_event, pIcdi);
+    }
+}
 
-        //
-        // Here's the magic!  Wait for something interesting to happen!
-        //
-        rc = poll(pPollFds, iFds, iTimeoutms); 
+//
+// Hand len bytes from pCli to the state machine, which passes complete
+// packets on to the bridge from where they lie in pBuf
+//
+static void
+client_input(GDBCLIENT *pCli, unsigned char *pBuf, unsigned int len)
+{
+    metrics_add(pCli->pIcdi, METRIC_GDB_BYTES_IN, len);
+    record_bytes(pCli->pIcdi, pCli->iSession, REC_GDB_IN, pBuf, len);
+    pCli->bBatch = 1;
+    gdb_statemachine(&pCli->gdbCtx, pBuf, len, client_packet);
+    pCli->bBatch = 0;
+    client_flush(pCli);
+}
 
-        //
-        // If we woke up because of a timeout, just go back to sleep...
-        // (or if we have some other maintenance to do, here is the place
-        // to do it)
-        //
-        if (rc == 0) continue;
+//
+// GDB sent us something.  Receive straight into our buffer and hand it on.
+//
+static void
+client_event(int fd, short revents, void *pCtx)
+{
+    static unsigned char pMsg[MSGSIZE];
+    GDBCLIENT *pCli = pCtx;
+    ssize_t rx;
 
-        //
-        // handle any errors
-        //
-        if (rc == -1) 
-        {
-            TRACE(ALWAYS, "%s: poll() returned error\n", __FUNCTION__);
-            break;
-        }
+    rx = recv(fd, pMsg, sizeof(pMsg), 0);
+    if (rx < 0)
+    {
+        TRACE(ALWAYS, "%s: ERROR: recv()  returned %d\n", 
+              __FUNCTION__, (int)rx);
+        perror("recv() failed");
+        client_close(pCli);
+        return;
+    }
 
+    TRACE(1, "%s: recv returned %d\n", __FUNCTION__, (int)rx);
+    if (rx == 0)
+    {
+        // 
+        // if we RX 0 bytes it usually means that the other 
+        // side closed the connection
         //
-        // If we get here then one or more FD's need servicing...
-        //
-        for (i = 0; i < iFds; i++)
-        {
-            // 
-            // if revents is 0 then we don't care about this file descriptor
-            //
-            if (pPollFds[i].revents == 0)
-            {
-                // change to trace level 1
-                TRACE(1,"%s: Fd[%d].revents = 0\n", __FUNCTION__, i);
-                continue;
-            }
-
-            //
-            // Was it our TCP socket the kicked poll() out of its block?
-            //
-            if (pPollFds[i].fd == sdAccept)
-            {
-                TRACE(1,"%s: socketFd.revents = 0x%08x\n", __FUNCTION__, 
-                      pPollFds[i].revents);
-
-                //
-                // Grab the packet payload...
-                //
-                rx = recv(sdAccept, pMsg, MSGSIZE, 0);
-                if (rx < 0)
-                {
-                    TRACE(ALWAYS, "%s: ERROR: recv()  returned %d\n", 
-                          __FUNCTION__, (int)rx);
-                    perror("recv() failed");
-                }
-                else
-                {
-                    TRACE(1, "%s: recv returned %d\n", __FUNCTION__, (int)rx);
-                    if (rx == 0)
-                    {
-                        // 
-                        // if we RX 0 bytes it usually means that the other 
-                        // side closed the connection
-                        //
-                        rc = 0;
-                        break;
-                    }
-                    gdb_statemachine(&gdbCliCtx, pMsg, rx, usbTxReq);
-                }
-            }
-            //
-            // If we get here it's because poll() kicked out, not because
-            // of TCP activity, but because of USB activity.
-            //
-            else
-            {
-                TRACE(1, "%s: USB activity.  Calling handle_events()\n",
-                       __FUNCTION__);
-                rc = libusb_handle_events(pCtx);
-                ASSERT(rc == 0);
-            }
-        } // (for all file descriptors)
-    } // (while 1)
+        client_close(pCli);
+        return;
+    }
+
+    client_input(pCli, pMsg, rx);
+}
+
+//*****************************************************************************
+//
+//! Start a GDB session on pIcdi with the client connected on socket sd.
+//! The iPending bytes at pPending, if any, came from the client before.
+//
+//*****************************************************************************
+void
+client_attach(ICDI *pIcdi, int sd, unsigned char *pPending,
+        unsigned int iPending)
+{
+    GDBCLIENT *pCli;
+    int one = 1;
 
     //
-    // We either encountered an error or the other side closed the connection.
-    // Close our file handle and go back to listening for a new connection.
+    // GDB packets are small and every one is waited for, so don't let
+    // Nagle hold them back
     //
-    close(sdAccept);
-    return rc;        
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    //
+    // The client's GDB context tracks the state of packets which come over
+    // the TCP socket.  That is to say, GDB requests from the client.
+    //
+    pCli = calloc(1, sizeof(GDBCLIENT));
+    ASSERT(pCli != NULL);
+    pCli->pIcdi = pIcdi;
+    pCli->sd = sd;
+    pCli->gdbCtx.gdb_state = GDB_IDLE;
+    pCli->gdbCtx.pResp = pCli->pReq;
+    pCli->gdbCtx.pOwner = pCli;
+
+    pCli->pNext = pIcdi->pClients;
+    pIcdi->pClients = pCli;
+    if (pIcdi->iClients++ == 0)
+    {
+        pIcdi->tAttached = time(NULL);
+    }
+    pCli->iSession = ++pIcdi->iSessions;
+    record_bytes(pIcdi, pCli->iSession, REC_OPEN, NULL, 0);
+
+    event_add(pCli->sd, POLLIN, client_event, pCli);
+    if (iPending)
+    {
+        client_input(pCli, pPending, iPending);
+    }
 }
 
-int SocketIO(int iPort, libusb_device_handle *phDev)
+//
+// Someone connected to the port of pIcdi.  Once it has MAX_CLIENTS we
+// stop accepting until one of them goes away.
+//
+static void
+listen_event(int fd, short revents, void *pCtx)
 {
-    int      iCount, iFds;
+    ICDI *pIcdi = pCtx;
+    struct sockaddr_in pin;
+    socklen_t addrlen = sizeof(pin);
+    int sd;
 
-    const struct   libusb_pollfd **ppUsbFds;
-    const struct   libusb_pollfd **ppTmpFd;
+    TRACE(1, "accept...\n");
+	if ((sd = accept(fd, (struct sockaddr *)  &pin, &addrlen)) == -1) {
+		perror("accept");
+		return;
+	}
 
-    struct   pollfd *pPollFds;
+    client_attach(pIcdi, sd, NULL, 0);
+    if (pIcdi->iClients == MAX_CLIENTS)
+    {
+        event_del(pIcdi->sdListen);
+    }
+}
 
-    ppTmpFd = ppUsbFds = libusb_get_pollfds(pCtx);
+//*****************************************************************************
+//
+//! Serve every ICDI in the list pIcdiList on its own port, all from one
+//! event loop, with the USB transfers completing on a thread of their own.
+//! An ICDI whose port can't be opened is left out.  With a farm port
+//! (iFarmPort >= 0) the ICDIs are instead pooled and handed out to the
+//! sessions connecting there.  With a metrics port (iMetricsPort >= 0)
+//! their counters are served over HTTP there too.
+//!
+//! \return the result of event_run(), or -1 if no port could be opened.
+//
+//*****************************************************************************
+int SocketIO(ICDI *pIcdiList, int iFarmPort, int iMetricsPort)
+{
+    ICDI *pIcdi;
+    unsigned int n = 0;
+    int rc;
 
-    //
-    // find out how many USB FD's we have to poll
-    //
-    iCount = 0;
-    while (*ppTmpFd++)
+    if (event_init() != 0)
     {
-        iCount++;
-    }
-    
-    // 
-    // allocate iCount + 1 pollfd's to account for the socket
-    // that we'll open below
-    //
-    pPollFds = calloc(iCount + 1, sizeof(struct pollfd));
-    ASSERT(pPollFds != NULL);
-    
-    for (iFds = 0; iFds < iCount; iFds++)
-    {   
-        pPollFds[iFds].fd = (*(ppUsbFds[iFds])).fd;
-        pPollFds[iFds].events = (*(ppUsbFds[iFds])).events;
+        TRACE(ALWAYS, "%s: unable to set up the event loop\n", __FUNCTION__);
+        return(-1);
     }
 
-    while (1)
-    {   
-        sdAccept = Listen(iPort);
-        if (sdAccept > 0) 
+    for (pIcdi = pIcdiList; pIcdi && (iFarmPort < 0); pIcdi = pIcdi->pNext)
+    {
+        pIcdi->sdListen = Listen(pIcdi->iPort);
+        if (pIcdi->sdListen < 0)
         {
-            //
-            // Set our socket as the last filedescriptor to poll
-            //
-            pPollFds[iFds].fd = sdAccept;
-            pPollFds[iFds].events = POLLIN | POLLPRI | POLLRDNORM; // | POLLRDHUP;
-            iFds++;
-
-            //
-            // Do the bridging between the socket and the usb bulk device
-            //
-            doGdb(sdAccept, pPollFds, iFds);
+            TRACE(ALWAYS, "ICDI %s: unable to listen on port %d\n",
+                  pIcdi->pSerial, pIcdi->iPort);
+            continue;
         }
+
+        TRACE(ALWAYS, "ICDI %s on port %d\n", pIcdi->pSerial, pIcdi->iPort);
+        event_add(pIcdi->sdListen, POLLIN, listen_event, pIcdi);
+        n++;
     }
 
-    return(0);
+    if (iFarmPort >= 0)
+    {
+        n = (farm_init(pIcdiList, iFarmPort) == 0);
+    }
+
+    if (n == 0)
+    {
+        return(-1);
+    }
+
+    if (iMetricsPort >= 0)
+    {
+        metrics_serve(pIcdiList, iMetricsPort);
+    }
+
+    if (usb_thread_start(pCtx) != 0)
+    {
+        return(-1);
+    }
+
+    //
+    // Do the bridging between the sockets and the usb bulk devices
+    //
+    rc = event_run();
+    usb_thread_stop();
+    return(rc);
 }
@@ -0,0 +1,294 @@
+//*****************************************************************************
+//
+// step.c - range stepping and the rest of vCont, for GDB.
+//
+// To step over a source line GDB steps instruction by instruction until
+// the PC leaves the line's addresses, looking at the registers after each
+// step.  With vCont;r it hands us the range instead: we step the core
+// with 's' and check the PC here, and GDB hears back only once the PC
+// leaves the range, lands on one of its breakpoints or the core stops for
+// any other reason.
+//
+// The other vCont actions are run as the plain packets they amount to on
+// our single core, so the ICDI needn't know vCont at all.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+
+#define REG_PC                  15
+
+struct _STEP
+{
+    //
+    // The range step we run for pCli, [iStart, iEnd)
+    //
+    int bActive;
+    int bInterrupt;
+    GDBCLIENT *pCli;
+    unsigned int iStart;
+    unsigned int iEnd;
+    unsigned int iStop;
+    unsigned char pStop[MSGSIZE];
+    unsigned int iSteps;
+};
+
+//
+// Give GDB the stop reply of the range step and tell the other clients
+//
+static void
+step_report(ICDI *pIcdi)
+{
+    STEP *pStep = pIcdi->pStep;
+
+    TRACE(1, "%s: range 0x%x-0x%x left after %u steps\n", __FUNCTION__,
+          pStep->iStart, pStep->iEnd, pStep->iSteps);
+    pStep->bActive = 0;
+    regcache_set_halted(pIcdi, (pStep->iStop >= 3) &&
+                        ((pStep->pStop[0] == 'S') || (pStep->pStop[0] == 'T')));
+    gdb_reply(pStep->pCli, pStep->pStop, pStep->iStop);
+    bridge_stop_broadcast(pIcdi, pStep->pCli, pStep->pStop, pStep->iStop);
+    pStep->pCli = NULL;
+}
+
+static void step_done(PROBEREQ *pReq, unsigned char *pPayload,
+        unsigned int len);
+
+//
+// Step once more
+//
+static void
+step_next(ICDI *pIcdi)
+{
+    pIcdi->pStep->iSteps++;
+    probe_submit(pIcdi, NULL, (const unsigned char *)"s", 1, step_done, NULL);
+}
+
+//
+// The core stopped at iPc after a step.  Step again while it is in the
+// range and not on a breakpoint.
+//
+static void
+step_at(ICDI *pIcdi, unsigned int iPc)
+{
+    STEP *pStep = pIcdi->pStep;
+
+    if (pStep->bInterrupt || (pStep->pCli == NULL) ||
+        (iPc < pStep->iStart) || (iPc >= pStep->iEnd) ||
+        cond_breakpoint_at(pIcdi, iPc))
+    {
+        step_report(pIcdi);
+        return;
+    }
+    step_next(pIcdi);
+}
+
+static unsigned int
+step_le32(const unsigned char *pHex)
+{
+    unsigned char pData[4];
+
+    gdb_hex_decode(pData, pHex, 8);
+    return pData[0] | (pData[1] << 8) | (pData[2] << 16) |
+           ((unsigned int)pData[3] << 24);
+}
+
+static void
+step_pc_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    if ((len != 8) || !isxdigit(pPayload[0]))
+    {
+        step_report(pReq->pIcdi);
+        return;
+    }
+    step_at(pReq->pIcdi, step_le32(pPayload));
+}
+
+//
+// A step is done.  Take the PC from the stop reply if the ICDI put it
+// there, or read it.
+//
+static void
+step_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    ICDI *pIcdi = pReq->pIcdi;
+    STEP *pStep = pIcdi->pStep;
+    unsigned char pBuf[8];
+    unsigned int i, n, iReg;
+
+    memcpy(pStep->pStop, pPayload, len);
+    pStep->iStop = len;
+
+    //
+    // Only a trap is the step itself finishing
+    //
+    if ((len < 3) || ((pPayload[0] != 'S') && (pPayload[0] != 'T')) ||
+        (memcmp(pPayload + 1, "05", 2) != 0))
+    {
+        step_report(pIcdi);
+        return;
+    }
+
+    //
+    // T05 n:r;n:r;...
+    //
+    for (i = 3; (pPayload[0] == 'T') && (i < len); i = n + 1)
+    {
+        for (n = i; (n < len) && (pPayload[n] != ';'); n++)
+        {
+        }
+
+        if ((gdb_parse_hex(pPayload + i, n - i, &iReg) == 1) &&
+            (iReg == REG_PC) && (n - i == 10) && (pPayload[i + 1] == ':'))
+        {
+            step_at(pIcdi, step_le32(pPayload + i + 2));
+            return;
+        }
+    }
+
+    n = sprintf((char *)pBuf, "p%x", REG_PC);
+    probe_submit(pIcdi, NULL, pBuf, n, step_pc_done, NULL);
+}
+
+//*****************************************************************************
+//
+//! Set up the range stepping of pIcdi.
+//
+//*****************************************************************************
+void
+step_init(ICDI *pIcdi)
+{
+    pIcdi->pStep = calloc(1, sizeof(STEP));
+    ASSERT(pIcdi->pStep != NULL);
+}
+
+//*****************************************************************************
+//
+//! Rewrite the vCont packet in pPayload, of len bytes, as the c, C, s or S
+//! packet its first action amounts to.  Range steps, and anything else that
+//! isn't vCont, are left alone.
+//!
+//! \return the length of the packet.
+//
+//*****************************************************************************
+unsigned int
+step_vcont(unsigned char *pPayload, unsigned int len)
+{
+    unsigned int n;
+
+    if (!PKT_IS(pPayload, len, "vCont;") || (len < 7))
+    {
+        return len;
+    }
+
+    //
+    // The action ends at the thread it applies to or the next action
+    //
+    for (n = 6; (n < len) && (pPayload[n] != ':') && (pPayload[n] != ';'); n++)
+    {
+    }
+
+    switch (pPayload[6])
+    {
+        case 'c':
+        case 's':
+            if (n == 7)
+            {
+                pPayload[0] = pPayload[6];
+                return 1;
+            }
+            break;
+
+        case 'C':
+        case 'S':
+            if (n == 9)
+            {
+                memmove(pPayload, pPayload + 6, 3);
+                return 3;
+            }
+            break;
+    }
+    return len;
+}
+
+//*****************************************************************************
+//
+//! Handle the packets from pCli that concern range stepping:
+//!
+//!   vCont?                      the actions we take, range steps included
+//!   vCont;rstart,end[:thread]   step while start <= PC < end
+//!
+//! \return 1 if the packet was handled here, 0 otherwise.
+//
+//*****************************************************************************
+int
+step_request(GDBCLIENT *pCli, const unsigned char *pPayload, unsigned int len)
+{
+    static const char pActions[] = "vCont;c;C;s;S;r";
+    ICDI *pIcdi = pCli->pIcdi;
+    STEP *pStep = pIcdi->pStep;
+    unsigned int iStart, iEnd;
+
+    if ((len == 6) && (memcmp(pPayload, "vCont?", 6) == 0))
+    {
+        gdb_reply(pCli, (const unsigned char *)pActions, sizeof(pActions) - 1);
+        return 1;
+    }
+
+    if (!PKT_IS(pPayload, len, "vCont;r") ||
+        (gdb_parse_range(pPayload + 7, len - 7, &iStart, &iEnd) == 0))
+    {
+        return 0;
+    }
+
+    if (pStep->bActive)
+    {
+        gdb_reply(pCli, (const unsigned char *)"E01", 3);
+        return 1;
+    }
+
+    pStep->bActive = 1;
+    pStep->bInterrupt = 0;
+    pStep->pCli = pCli;
+    pStep->iStart = iStart;
+    pStep->iEnd = iEnd;
+    pStep->iSteps = 0;
+
+    //
+    // The first step is taken whatever the range, so an empty range is a
+    // plain step
+    //
+    regcache_set_halted(pIcdi, 0);
+    step_next(pIcdi);
+    return 1;
+}
+
+//*****************************************************************************
+//
+//! GDB interrupted pIcdi.  A range step stops at the next step.
+//
+//*****************************************************************************
+void
+step_interrupt(ICDI *pIcdi)
+{
+    pIcdi->pStep->bInterrupt = 1;
+}
+
+//*****************************************************************************
+//
+//! pCli disconnected.  A range step we run for it ends at the next step.
+//
+//*****************************************************************************
+void
+step_client_closed(GDBCLIENT *pCli)
+{
+    STEP *pStep = pCli->pIcdi->pStep;
+
+    if (pStep->pCli == pCli)
+    {
+        pStep->pCli = NULL;
+    }
+}
@@ -0,0 +1,637 @@
+//*****************************************************************************
+//
+// usb.c - the bulk transfers that carry GDB packets to and from the ICDI.
+//
+// Outgoing packets go out in transfers taken from a pool and queued, so any
+// number of packets can be sent back to back.  usbTxReq() copies the data,
+// usbTxPkt() sends it from where it lies and tells the caller when it is
+// done with it.  On the receive side several transfers are kept pending
+// so there is always one ready when the ICDI answers.  Simulated ICDIs
+// (sim.c) take the packets directly.
+//
+// The transfers complete on a thread of their own, which does nothing but
+// run libusb's event handling.  A client that is slow to take its answers
+// or a burst of tracing on the network side then can't hold up the USB
+// side.  What the ICDI sends is copied to a packet from a pool allocated
+// up front, the transfer goes straight back to the ICDI, and the packet is
+// passed to the event loop through a lock-free queue.  The event loop
+// hands the packet back through another one once it has parsed it.
+// Completed OUT transfers are passed up the same way.  Everything else in
+// the bridge, sending included, stays on the thread of the event loop.
+// libusb lets any thread submit transfers.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+//
+// OUT transfers submitted at once, further packets wait in the queue
+//
+#define USB_TX_DEPTH            4
+
+//
+// IN transfers kept pending
+//
+#define USB_RX_DEPTH            4
+#define USB_RX_SIZE             MSGSIZE
+
+//
+// Packets received that the event loop hasn't parsed yet.  Once they are
+// all in use, IN transfers are handed up instead of being resubmitted.
+//
+#define USB_POOL                16
+
+//
+// Entries in each queue between the threads: a power of two, with room for
+// the whole pool and every transfer
+//
+#define USB_RING                32
+
+//
+// How often, in ms, the USB thread looks whether it is to stop
+//
+#define USB_STOP_POLL           100
+
+typedef struct _USBXFER
+{
+    struct _USBXFER *pNext;
+    ICDI *pIcdi;
+    struct libusb_transfer *pTrans;
+    void (*pfnDone)(void *pCtx);
+    void *pCtx;
+    unsigned char pBuf[MSGSIZE];
+} USBXFER;
+
+typedef struct _USBPKT
+{
+    unsigned int iLen;
+    unsigned char pBuf[USB_RX_SIZE];
+} USBPKT;
+
+//
+// A queue with a single producer and a single consumer, each the only one
+// writing its own index.  An entry is either a packet received or a
+// transfer that completed.
+//
+typedef struct _USBEVT
+{
+    USBPKT *pPkt;
+    USBXFER *pXfer;
+} USBEVT;
+
+typedef struct _USBRING
+{
+    unsigned int iHead;         // written by the producer
+    unsigned int iTail;         // written by the consumer
+    USBEVT pEvts[USB_RING];
+} USBRING;
+
+//
+// The transfers of one ICDI
+//
+struct _USBIO
+{
+    USBIO *pNext;               // all of them, for the event loop
+    ICDI *pIcdi;
+
+    //
+    // Transfers ready for use, and the packets waiting to be submitted
+    //
+    USBXFER *pTxFree;
+    USBXFER *pTxHead;
+    USBXFER *pTxTail;
+    unsigned int iTxInFlight;
+
+    USBXFER pRx[USB_RX_DEPTH];
+
+    //
+    // Between the threads: what completed, up to the event loop, and the
+    // packets it is done with, back down.  Resubmits that failed on the
+    // USB thread are counted in iErrors.
+    //
+    USBRING ringDone;
+    USBRING ringFree;
+    unsigned int iErrors;
+    USBPKT pPool[USB_POOL];
+};
+
+static USBIO *pUsbList;
+static pthread_t usbThread;
+static int bUsbThread;
+static int bUsbStop;
+static int bUsbPosted;          // USB thread only
+static int pUsbWake[2] = { -1, -1 };
+
+static void usb_tx_kick(USBIO *pUsb);
+
+static int
+usb_ring_put(USBRING *pRing, USBPKT *pPkt, USBXFER *pXfer)
+{
+    unsigned int iHead = pRing->iHead;
+
+    if (iHead - __atomic_load_n(&pRing->iTail, __ATOMIC_ACQUIRE) == USB_RING)
+    {
+        return -1;
+    }
+
+    pRing->pEvts[iHead % USB_RING].pPkt = pPkt;
+    pRing->pEvts[iHead % USB_RING].pXfer = pXfer;
+    __atomic_store_n(&pRing->iHead, iHead + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int
+usb_ring_get(USBRING *pRing, USBEVT *pEvt)
+{
+    unsigned int iTail = pRing->iTail;
+
+    if (__atomic_load_n(&pRing->iHead, __ATOMIC_ACQUIRE) == iTail)
+    {
+        return -1;
+    }
+
+    *pEvt = pRing->pEvts[iTail % USB_RING];
+    __atomic_store_n(&pRing->iTail, iTail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//
+// On the USB thread: pass a completion up to the event loop.  The queue
+// has room for every packet and transfer there is, so it can't be full.
+//
+static void
+usb_post(USBIO *pUsb, USBPKT *pPkt, USBXFER *pXfer)
+{
+    int rc;
+
+    rc = usb_ring_put(&pUsb->ringDone, pPkt, pXfer);
+    ASSERT(rc == 0);
+    bUsbPosted = 1;
+}
+
+static void
+usb_tx_release(USBXFER *pXfer)
+{
+    USBIO *pUsb = pXfer->pIcdi->pUsb;
+
+    if (pXfer->pfnDone)
+    {
+        pXfer->pfnDone(pXfer->pCtx);
+        pXfer->pfnDone = NULL;
+    }
+    pXfer->pTrans->buffer = pXfer->pBuf;
+    pXfer->pNext = pUsb->pTxFree;
+    pUsb->pTxFree = pXfer;
+}
+
+//
+// On the USB thread: a packet sent to the ICDI, for usb_tx_done()
+//
+static void LIBUSB_CALL
+usb_req_callback(struct libusb_transfer *pTrans)
+{
+    USBXFER *pXfer = pTrans->user_data;
+
+    usb_post(pXfer->pIcdi->pUsb, NULL, pXfer);
+}
+
+//*****************************************************************************
+//
+//! This handles the transfer completion of a packet sent to the ICDI.  The
+//! transfer goes back to the pool and the next queued packet, if any, is
+//! submitted.
+//!
+//! \param pXfer is the transfer in which we transmitted the packet.
+//!
+//! \return None
+//
+//*****************************************************************************
+static void
+usb_tx_done(USBXFER *pXfer)
+{
+    struct libusb_transfer *pTrans = pXfer->pTrans;
+    USBIO *pUsb = pXfer->pIcdi->pUsb;
+
+    if (pTrans->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+        TRACE(ALWAYS, "%s: Unable to send request (status = %d)\n",
+              __FUNCTION__, pTrans->status);
+        metrics_add(pXfer->pIcdi, METRIC_USB_ERRORS, 1);
+    }
+    else
+    {
+        TRACE(1, "%s: GDB REQ sent successfully\n", __FUNCTION__);
+        metrics_add(pXfer->pIcdi, METRIC_USB_BYTES_OUT, pTrans->actual_length);
+    }
+
+    pUsb->iTxInFlight--;
+    usb_tx_release(pXfer);
+    usb_tx_kick(pUsb);
+}
+
+//
+// Submit queued packets while we have room on the bus
+//
+static void
+usb_tx_kick(USBIO *pUsb)
+{
+    USBXFER *pXfer;
+    int rc;
+
+    while (pUsb->pTxHead && (pUsb->iTxInFlight < USB_TX_DEPTH))
+    {
+        pXfer = pUsb->pTxHead;
+        pUsb->pTxHead = pXfer->pNext;
+        if (pUsb->pTxHead == NULL)
+        {
+            pUsb->pTxTail = NULL;
+        }
+
+        record_bytes(pXfer->pIcdi, 0, REC_USB_OUT, pXfer->pTrans->buffer,
+                     pXfer->pTrans->length);
+        rc = libusb_submit_transfer(pXfer->pTrans);
+        if (rc != 0)
+        {
+            TRACE(ALWAYS, "%s: ERROR rc = %d\n", __FUNCTION__, rc);
+            metrics_add(pXfer->pIcdi, METRIC_USB_ERRORS, 1);
+            usb_tx_release(pXfer);
+            continue;
+        }
+        pUsb->iTxInFlight++;
+    }
+}
+
+//
+// Take a transfer from the pool, growing it if they are all in use
+//
+static USBXFER *
+usb_tx_alloc(ICDI *pIcdi)
+{
+    USBIO *pUsb = pIcdi->pUsb;
+    USBXFER *pXfer = pUsb->pTxFree;
+
+    if (pXfer)
+    {
+        pUsb->pTxFree = pXfer->pNext;
+        return pXfer;
+    }
+
+    pXfer = malloc(sizeof(USBXFER));
+    ASSERT(pXfer != NULL);
+    pXfer->pIcdi = pIcdi;
+    pXfer->pfnDone = NULL;
+    pXfer->pTrans = libusb_alloc_transfer(0);
+    ASSERT(pXfer->pTrans != NULL);
+
+    libusb_fill_bulk_transfer(pXfer->pTrans, pIcdi->phDev, pIcdi->iEndpOut,
+            pXfer->pBuf, 0, usb_req_callback, pXfer, 1000);
+    return pXfer;
+}
+
+static void
+usb_tx_queue(USBXFER *pXfer, unsigned int len)
+{
+    USBIO *pUsb = pXfer->pIcdi->pUsb;
+
+    pXfer->pTrans->length = len;
+    pXfer->pNext = NULL;
+
+    if (pUsb->pTxTail)
+    {
+        pUsb->pTxTail->pNext = pXfer;
+    }
+    else
+    {
+        pUsb->pTxHead = pXfer;
+    }
+    pUsb->pTxTail = pXfer;
+
+    usb_tx_kick(pUsb);
+}
+
+//*****************************************************************************
+//
+//! Queue len bytes at pBuf for pIcdi.  The data is copied, so pBuf may be
+//! reused as soon as we return.
+//
+//*****************************************************************************
+void
+usbTxReq(ICDI *pIcdi, const unsigned char *pBuf, unsigned int len)
+{
+    USBXFER *pXfer;
+
+    ASSERT(len <= MSGSIZE);
+
+    if (pIcdi->pSim)
+    {
+        sim_send(pIcdi, pBuf, len);
+        return;
+    }
+
+    pXfer = usb_tx_alloc(pIcdi);
+    memcpy(pXfer->pBuf, pBuf, len);
+    usb_tx_queue(pXfer, len);
+}
+
+//*****************************************************************************
+//
+//! Queue len bytes at pBuf for pIcdi without copying them.  pBuf must stay
+//! as it is until pfnDone(pCtx) is called, which happens once the transfer
+//! has finished with it, whether it was sent or not.
+//
+//*****************************************************************************
+void
+usbTxPkt(ICDI *pIcdi, unsigned char *pBuf, unsigned int len,
+        void (*pfnDone)(void *pCtx), void *pCtx)
+{
+    USBXFER *pXfer;
+
+    if (pIcdi->pSim)
+    {
+        sim_send(pIcdi, pBuf, len);
+        pfnDone(pCtx);
+        return;
+    }
+
+    pXfer = usb_tx_alloc(pIcdi);
+    pXfer->pTrans->buffer = pBuf;
+    pXfer->pfnDone = pfnDone;
+    pXfer->pCtx = pCtx;
+    usb_tx_queue(pXfer, len);
+}
+
+//*****************************************************************************
+//
+//! Feed len bytes at pBuf that came from pIcdi into its GDB context.  When
+//! a complete GDB packet has been received the state machine calls
+//! bridge_usb_packet().
+//
+//*****************************************************************************
+void
+usb_rx_deliver(ICDI *pIcdi, unsigned char *pBuf, unsigned int len)
+{
+    metrics_add(pIcdi, METRIC_USB_BYTES_IN, len);
+    record_bytes(pIcdi, 0, REC_USB_IN, pBuf, len);
+    gdb_statemachine(&pIcdi->gdbUsbCtx, pBuf, len, bridge_usb_packet);
+}
+
+//****************************************************************************
+//
+//  This is the USB callback that gets called whenever our background read
+//  operation RX'es anything from the USB devices (ie. the GDB server).  It
+//  runs on the USB thread.
+//
+//****************************************************************************
+void LIBUSB_CALL
+usb_callback(struct libusb_transfer *pTrans)
+{
+    USBXFER *pRx = pTrans->user_data;
+    USBIO *pUsb = pRx->pIcdi->pUsb;
+    USBEVT evt;
+    int rc;
+
+    TRACE(1, "%s: enter\n", __FUNCTION__);
+
+    //
+    // With no packet free, or on an error, the transfer itself goes up and
+    // usb_rx_done() deals with it
+    //
+    if ((pTrans->status != LIBUSB_TRANSFER_COMPLETED) ||
+        (usb_ring_get(&pUsb->ringFree, &evt) != 0))
+    {
+        usb_post(pUsb, NULL, pRx);
+        return;
+    }
+
+    memcpy(evt.pPkt->pBuf, pTrans->buffer, pTrans->actual_length);
+    evt.pPkt->iLen = pTrans->actual_length;
+    usb_post(pUsb, evt.pPkt, NULL);
+
+    //
+    // Requeue the async RX operation so that we catch the next packet
+    // from the USB device
+    //
+    rc = libusb_submit_transfer(pTrans);
+    if (rc != 0)
+    {
+        TRACE(ALWAYS, "%s: submit_transfer: rc = 0x%08x\n", __FUNCTION__, rc);
+        __atomic_fetch_add(&pUsb->iErrors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//
+// An IN transfer the USB thread couldn't copy from
+//
+static void
+usb_rx_done(USBXFER *pRx)
+{
+    struct libusb_transfer *pTrans = pRx->pTrans;
+    int rc;
+
+    switch(pTrans->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            usb_rx_deliver(pRx->pIcdi, pTrans->buffer, pTrans->actual_length);
+
+            rc = libusb_submit_transfer(pTrans);
+            if (rc != 0)
+            {
+                TRACE(ALWAYS, "%s: submit_transfer: rc = 0x%08x\n",
+                      __FUNCTION__, rc);
+                metrics_add(pRx->pIcdi, METRIC_USB_ERRORS, 1);
+            }
+            break;
+
+        default:
+            TRACE(ALWAYS, "%s: status = 0x%08x\n", __FUNCTION__, pTrans->status);
+            metrics_add(pRx->pIcdi, METRIC_USB_ERRORS, 1);
+            break;
+    }
+}
+
+//
+// The USB thread has passed something up
+//
+static void
+usb_wake_event(int fd, short revents, void *pCtx)
+{
+    char pBuf[64];
+    USBIO *pUsb;
+    USBEVT evt;
+    unsigned int n;
+
+    while (read(fd, pBuf, sizeof(pBuf)) > 0)
+    {
+    }
+
+    for (pUsb = pUsbList; pUsb; pUsb = pUsb->pNext)
+    {
+        n = __atomic_exchange_n(&pUsb->iErrors, 0, __ATOMIC_RELAXED);
+        if (n)
+        {
+            metrics_add(pUsb->pIcdi, METRIC_USB_ERRORS, n);
+        }
+
+        while (usb_ring_get(&pUsb->ringDone, &evt) == 0)
+        {
+            if (evt.pPkt)
+            {
+                usb_rx_deliver(pUsb->pIcdi, evt.pPkt->pBuf, evt.pPkt->iLen);
+                usb_ring_put(&pUsb->ringFree, evt.pPkt, NULL);
+            }
+            else if (evt.pXfer->pTrans->endpoint & LIBUSB_ENDPOINT_IN)
+            {
+                usb_rx_done(evt.pXfer);
+            }
+            else
+            {
+                usb_tx_done(evt.pXfer);
+            }
+        }
+    }
+}
+
+static void *
+usb_thread(void *pArg)
+{
+    struct timeval tv;
+    int rc;
+
+    while (!__atomic_load_n(&bUsbStop, __ATOMIC_ACQUIRE))
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = USB_STOP_POLL * 1000;
+        rc = libusb_handle_events_timeout(pArg, &tv);
+        if (rc != 0)
+        {
+            TRACE(ALWAYS, "%s: libusb_handle_events_timeout rc = %d\n",
+                  __FUNCTION__, rc);
+        }
+
+        //
+        // Wake the event loop once for whatever was passed up.  If the
+        // pipe is full it has plenty of wakeups pending already.
+        //
+        if (bUsbPosted)
+        {
+            bUsbPosted = 0;
+            rc = write(pUsbWake[1], "", 1);
+        }
+    }
+    return NULL;
+}
+
+//*****************************************************************************
+//
+//! Start the thread completing the USB transfers of the libusb context
+//! pUsbCtx, after event_init().  Nothing is received from the ICDIs before
+//! this.
+//!
+//! \return 0 on success, -1 otherwise.
+//
+//*****************************************************************************
+int
+usb_thread_start(struct libusb_context *pUsbCtx)
+{
+    if (pUsbList == NULL)
+    {
+        return 0;
+    }
+
+    if (pipe(pUsbWake) != 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(pUsbWake[0], F_SETFL, O_NONBLOCK);
+    fcntl(pUsbWake[1], F_SETFL, O_NONBLOCK);
+
+    if ((event_add(pUsbWake[0], POLLIN, usb_wake_event, NULL) != 0) ||
+        (pthread_create(&usbThread, NULL, usb_thread, pUsbCtx) != 0))
+    {
+        TRACE(ALWAYS, "%s: unable to start the USB thread\n", __FUNCTION__);
+        return -1;
+    }
+    bUsbThread = 1;
+    return 0;
+}
+
+//*****************************************************************************
+//
+//! Stop the USB thread, if it was started.
+//
+//*****************************************************************************
+void
+usb_thread_stop(void)
+{
+    if (bUsbThread)
+    {
+        __atomic_store_n(&bUsbStop, 1, __ATOMIC_RELEASE);
+        pthread_join(usbThread, NULL);
+        bUsbThread = 0;
+    }
+}
+
+//*****************************************************************************
+//
+//! Set up the transfers of pIcdi and start the receive ones, which feed
+//! responses from the ICDI into its GDB context.  usb_callback() resubmits
+//! each of them as it completes, and libusb completes them in the order
+//! they were submitted.
+//!
+//! \return 0 on success, -1 if none could be started.
+//
+//*****************************************************************************
+int
+usb_rx_start(ICDI *pIcdi)
+{
+    USBIO *pUsb;
+    USBXFER *pRx;
+    unsigned int i, n = 0;
+    int rc;
+
+    pUsb = calloc(1, sizeof(USBIO));
+    ASSERT(pUsb != NULL);
+    pIcdi->pUsb = pUsb;
+    pUsb->pIcdi = pIcdi;
+
+    if (pIcdi->pSim)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < USB_POOL; i++)
+    {
+        usb_ring_put(&pUsb->ringFree, &pUsb->pPool[i], NULL);
+    }
+    pUsb->pNext = pUsbList;
+    pUsbList = pUsb;
+
+    for (i = 0; i < USB_RX_DEPTH; i++)
+    {
+        pRx = &pUsb->pRx[i];
+        pRx->pIcdi = pIcdi;
+        pRx->pTrans = libusb_alloc_transfer(0);
+        ASSERT(pRx->pTrans != NULL);
+
+        libusb_fill_bulk_transfer(pRx->pTrans, pIcdi->phDev, pIcdi->iEndpIn,
+                pRx->pBuf, USB_RX_SIZE, usb_callback, pRx, 0);
+
+        rc = libusb_submit_transfer(pRx->pTrans);
+        if (rc != 0)
+        {
+            TRACE(ALWAYS, "%s: ERROR: submit_transfer rc = %d\n",
+                  __FUNCTION__, rc);
+            continue;
+        }
+        n++;
+    }
+
+    return n ? 0 : -1;
+}
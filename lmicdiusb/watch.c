@@ -0,0 +1,736 @@
+//*****************************************************************************
+//
+// watch.c - live sampling of firmware variables, streamed over TCP.
+//
+// "monitor watch add" builds a list of variables, by address or by the
+// name of a variable in the ELF file loaded with "monitor elf".  Once
+// started, the watch reads them all at a fixed rate through the same
+// request queue as GDB and streams each sample, time stamped, to the
+// client connected to its port: as CSV, or as binary records of a
+// little endian 64 bit time in microseconds followed by the raw values
+// in the order they were added.
+//
+// Variables close together in memory are read in one request, reading
+// over the gaps between them, so a sample costs a request per cluster
+// rather than per variable.  If the previous sample is still on the wire
+// when the next is due, the new one is skipped and counted.
+//
+// This file is part of lmicdiusb and is distributed under the same terms,
+// see license.txt.
+//
+//*****************************************************************************
+
+#include "lmicdi.h"
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define WATCH_PORT              19300       // of the first ICDI
+#define WATCH_RATE              100         // default samples per second
+#define WATCH_MAX_RATE          1000
+#define WATCH_VARS              64
+#define WATCH_GAP               32          // bytes read over to save a read
+#define WATCH_NAME              48
+
+typedef enum
+{
+    WATCH_U8, WATCH_I8, WATCH_U16, WATCH_I16, WATCH_U32, WATCH_I32, WATCH_F32
+} WATCH_TYPE;
+
+static const struct
+{
+    const char *pName;
+    unsigned int iSize;
+} g_pTypes[] =
+{
+    { "u8", 1 }, { "i8", 1 }, { "u16", 2 }, { "i16", 2 },
+    { "u32", 4 }, { "i32", 4 }, { "f32", 4 },
+};
+
+//
+// A variable watched, and where its value lies in the sample
+//
+typedef struct _WATCHVAR
+{
+    char pName[WATCH_NAME];
+    unsigned int iAddr;
+    WATCH_TYPE eType;
+    unsigned int iOff;
+} WATCHVAR;
+
+//
+// The memory read in one request
+//
+typedef struct _WATCHRANGE
+{
+    unsigned int iAddr;
+    unsigned int iLen;
+    unsigned int iOff;
+} WATCHRANGE;
+
+struct _WATCH
+{
+    WATCHVAR pVars[WATCH_VARS];
+    unsigned int iVars;
+
+    //
+    // The reads of a sample, and the memory they read
+    //
+    WATCHRANGE pRanges[WATCH_VARS];
+    unsigned int iRanges;
+    unsigned char *pData;
+
+    int bRunning;
+    int bBinary;
+    unsigned int iRate;
+    int iTimer;
+    int iPort;
+    int sdListen;
+    int sd;
+
+    //
+    // The sample on the wire: its requests still to come back, when it
+    // was taken and whether a read of it failed
+    //
+    unsigned int iGen;
+    unsigned int iPending;
+    unsigned long long iTime;
+    int bFailed;
+    unsigned long long iStart;
+
+    //
+    // What became of the samples taken so far
+    //
+    unsigned int iSamples;
+    unsigned int iSkipped;
+    unsigned int iErrors;
+};
+
+//
+// The context of our requests, to tell them from those of a watch that
+// has since been stopped
+//
+typedef struct _WATCHREQ
+{
+    unsigned int iGen;
+    unsigned int iRange;
+} WATCHREQ;
+
+static unsigned long long
+watch_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+// Send len bytes to the client, if there is one
+//
+static void
+watch_send(WATCH *pWatch, const void *pBuf, unsigned int len)
+{
+    const char *pData = pBuf;
+    ssize_t tx;
+
+    while ((pWatch->sd >= 0) && (len > 0))
+    {
+        tx = send(pWatch->sd, pData, len, 0);
+        if (tx <= 0)
+        {
+            perror("send() failed");
+            break;
+        }
+        pData += tx;
+        len -= tx;
+    }
+}
+
+//
+// The value of pVar in the sample, formatted for CSV
+//
+static int
+watch_format(WATCH *pWatch, const WATCHVAR *pVar, char *pBuf,
+        unsigned int iSize)
+{
+    const unsigned char *pData = pWatch->pData + pVar->iOff;
+    unsigned int iVal;
+    union
+    {
+        unsigned int i;
+        float f;
+    } u;
+
+    iVal = pData[0];
+    if (g_pTypes[pVar->eType].iSize >= 2)
+    {
+        iVal |= pData[1] << 8;
+    }
+    if (g_pTypes[pVar->eType].iSize == 4)
+    {
+        iVal |= (pData[2] << 16) | ((unsigned int)pData[3] << 24);
+    }
+
+    switch (pVar->eType)
+    {
+        case WATCH_I8:
+            return snprintf(pBuf, iSize, ",%d", (signed char)iVal);
+
+        case WATCH_I16:
+            return snprintf(pBuf, iSize, ",%d", (short)iVal);
+
+        case WATCH_I32:
+            return snprintf(pBuf, iSize, ",%d", (int)iVal);
+
+        case WATCH_F32:
+            u.i = iVal;
+            return snprintf(pBuf, iSize, ",%.9g", u.f);
+
+        default:
+            return snprintf(pBuf, iSize, ",%u", iVal);
+    }
+}
+
+//
+// The sample is complete.  Stream it to the client.
+//
+static void
+watch_emit(WATCH *pWatch)
+{
+    unsigned char pBuf[WATCH_VARS * 16 + 32];
+    unsigned long long iTime = pWatch->iTime - pWatch->iStart;
+    unsigned int i, n = 0;
+
+    if (pWatch->bBinary)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            pBuf[n++] = iTime >> (8 * i);
+        }
+        for (i = 0; i < pWatch->iVars; i++)
+        {
+            memcpy(pBuf + n, pWatch->pData + pWatch->pVars[i].iOff,
+                   g_pTypes[pWatch->pVars[i].eType].iSize);
+            n += g_pTypes[pWatch->pVars[i].eType].iSize;
+        }
+    }
+    else
+    {
+        n = sprintf((char *)pBuf, "%llu", iTime);
+        for (i = 0; i < pWatch->iVars; i++)
+        {
+            n += watch_format(pWatch, &pWatch->pVars[i], (char *)pBuf + n,
+                              sizeof(pBuf) - n);
+        }
+        pBuf[n++] = '\n';
+    }
+
+    watch_send(pWatch, pBuf, n);
+}
+
+//
+// A read of the sample came in
+//
+static void
+watch_read_done(PROBEREQ *pReq, unsigned char *pPayload, unsigned int len)
+{
+    WATCH *pWatch = pReq->pIcdi->pWatch;
+    WATCHREQ *pCtx = pReq->pCtx;
+    WATCHRANGE *pRange = &pWatch->pRanges[pCtx->iRange];
+    int n;
+
+    if (pCtx->iGen != pWatch->iGen)
+    {
+        free(pCtx);
+        return;
+    }
+    free(pCtx);
+
+    n = -1;
+    if ((len >= 3) && (memcmp(pPayload, "OK:", 3) == 0))
+    {
+        n = gdb_unescape(pPayload, pPayload + 3, len - 3);
+    }
+
+    if (n == (int)pRange->iLen)
+    {
+        memcpy(pWatch->pData + pRange->iOff, pPayload, n);
+    }
+    else
+    {
+        pWatch->bFailed = 1;
+    }
+
+    if (--pWatch->iPending != 0)
+    {
+        return;
+    }
+
+    if (pWatch->bFailed)
+    {
+        pWatch->iErrors++;
+        return;
+    }
+    pWatch->iSamples++;
+    watch_emit(pWatch);
+}
+
+//
+// Take a sample, unless the last one is still on the wire or no one is
+// listening
+//
+static void
+watch_tick(void *pCtx)
+{
+    ICDI *pIcdi = pCtx;
+    WATCH *pWatch = pIcdi->pWatch;
+    unsigned char pBuf[32];
+    WATCHREQ *pReq;
+    unsigned int i, n;
+
+    if (pWatch->sd < 0)
+    {
+        return;
+    }
+
+    if (pWatch->iPending)
+    {
+        pWatch->iSkipped++;
+        return;
+    }
+
+    pWatch->iTime = watch_now();
+    pWatch->bFailed = 0;
+    for (i = 0; i < pWatch->iRanges; i++)
+    {
+        pReq = malloc(sizeof(WATCHREQ));
+        ASSERT(pReq != NULL);
+        pReq->iGen = pWatch->iGen;
+        pReq->iRange = i;
+
+        n = sprintf((char *)pBuf, "x%x,%x", pWatch->pRanges[i].iAddr,
+                    pWatch->pRanges[i].iLen);
+        pWatch->iPending++;
+        probe_submit(pIcdi, NULL, pBuf, n, watch_read_done, pReq);
+    }
+}
+
+static int
+var_compare(const void *pA, const void *pB)
+{
+    const WATCHVAR *pVarA = *(const WATCHVAR * const *)pA;
+    const WATCHVAR *pVarB = *(const WATCHVAR * const *)pB;
+
+    return (pVarA->iAddr > pVarB->iAddr) - (pVarA->iAddr < pVarB->iAddr);
+}
+
+//
+// Group the variables into the reads of a sample.  A variable joins the
+// read before it if it is no more than WATCH_GAP bytes past it and the
+// read stays within what the ICDI returns in one go.
+//
+static void
+watch_plan(ICDI *pIcdi)
+{
+    WATCH *pWatch = pIcdi->pWatch;
+    unsigned int iChunk = (probe_packet_size(pIcdi) - 8) / 2;
+    WATCHVAR *pSorted[WATCH_VARS];
+    WATCHRANGE *pRange = NULL;
+    unsigned int i, iEnd, iOff = 0;
+    WATCHVAR *pVar;
+
+    for (i = 0; i < pWatch->iVars; i++)
+    {
+        pSorted[i] = &pWatch->pVars[i];
+    }
+    qsort(pSorted, pWatch->iVars, sizeof(WATCHVAR *), var_compare);
+
+    pWatch->iRanges = 0;
+    for (i = 0; i < pWatch->iVars; i++)
+    {
+        pVar = pSorted[i];
+        iEnd = pVar->iAddr + g_pTypes[pVar->eType].iSize;
+
+        if ((pRange == NULL) ||
+            (pVar->iAddr > pRange->iAddr + pRange->iLen + WATCH_GAP) ||
+            (iEnd - pRange->iAddr > iChunk))
+        {
+            if (pRange)
+            {
+                iOff += pRange->iLen;
+            }
+            pRange = &pWatch->pRanges[pWatch->iRanges++];
+            pRange->iAddr = pVar->iAddr;
+            pRange->iLen = 0;
+            pRange->iOff = iOff;
+        }
+
+        if (iEnd - pRange->iAddr > pRange->iLen)
+        {
+            pRange->iLen = iEnd - pRange->iAddr;
+        }
+        pVar->iOff = pRange->iOff + pVar->iAddr - pRange->iAddr;
+    }
+    if (pRange)
+    {
+        iOff += pRange->iLen;
+    }
+
+    free(pWatch->pData);
+    pWatch->pData = calloc(1, iOff + 1);
+    ASSERT(pWatch->pData != NULL);
+}
+
+static void watch_listen_event(int fd, short revents, void *pCtx);
+
+//
+// The client went away
+//
+static void
+watch_client_close(WATCH *pWatch)
+{
+    event_del(pWatch->sd);
+    close(pWatch->sd);
+    pWatch->sd = -1;
+
+    if (pWatch->sdListen >= 0)
+    {
+        event_add(pWatch->sdListen, POLLIN, watch_listen_event, pWatch);
+    }
+}
+
+//
+// The client has nothing to tell us, so anything from it means it's gone
+//
+static void
+watch_client_event(int fd, short revents, void *pCtx)
+{
+    WATCH *pWatch = pCtx;
+    char pBuf[64];
+
+    if (recv(fd, pBuf, sizeof(pBuf), 0) <= 0)
+    {
+        watch_client_close(pWatch);
+    }
+}
+
+//
+// Someone connected to the port of the watch.  One client at a time, who
+// gets the column names first when the samples are CSV.
+//
+static void
+watch_listen_event(int fd, short revents, void *pCtx)
+{
+    WATCH *pWatch = pCtx;
+    struct sockaddr_in pin;
+    socklen_t addrlen = sizeof(pin);
+    char pLine[WATCH_VARS * (WATCH_NAME + 1) + 16];
+    unsigned int i, n;
+
+	if ((pWatch->sd = accept(fd, (struct sockaddr *)  &pin, &addrlen)) == -1) {
+		perror("accept");
+		return;
+	}
+
+    TRACE(1, "%s: watch client connected\n", __FUNCTION__);
+    event_del(pWatch->sdListen);
+    event_add(pWatch->sd, POLLIN, watch_client_event, pWatch);
+
+    if (!pWatch->bBinary)
+    {
+        n = sprintf(pLine, "time_us");
+        for (i = 0; i < pWatch->iVars; i++)
+        {
+            n += sprintf(pLine + n, ",%s", pWatch->pVars[i].pName);
+        }
+        pLine[n++] = '\n';
+        watch_send(pWatch, pLine, n);
+    }
+}
+
+//
+// Stop sampling and close the port
+//
+static void
+watch_stop(WATCH *pWatch)
+{
+    if (pWatch->sd >= 0)
+    {
+        watch_client_close(pWatch);
+    }
+    if (pWatch->sdListen >= 0)
+    {
+        event_del(pWatch->sdListen);
+        close(pWatch->sdListen);
+        pWatch->sdListen = -1;
+    }
+
+    event_timer_del(pWatch->iTimer);
+    pWatch->iTimer = -1;
+    pWatch->bRunning = 0;
+    pWatch->iPending = 0;
+    pWatch->iGen++;
+}
+
+//
+// Start sampling at iRate on iPort.  Returns a message if that fails.
+//
+static const char *
+watch_start(ICDI *pIcdi, unsigned int iRate, int iPort)
+{
+    WATCH *pWatch = pIcdi->pWatch;
+
+    if (pWatch->iVars == 0)
+    {
+        return "nothing to watch\n";
+    }
+
+    pWatch->sdListen = Listen(iPort);
+    if (pWatch->sdListen < 0)
+    {
+        return "can't listen on the port\n";
+    }
+
+    watch_plan(pIcdi);
+    pWatch->iPort = iPort;
+    pWatch->iRate = iRate;
+    pWatch->iSamples = 0;
+    pWatch->iSkipped = 0;
+    pWatch->iErrors = 0;
+    pWatch->iStart = watch_now();
+    pWatch->bRunning = 1;
+    pWatch->iTimer = event_timer_add(1000 / iRate, watch_tick, pIcdi);
+    event_add(pWatch->sdListen, POLLIN, watch_listen_event, pWatch);
+
+    TRACE(ALWAYS, "ICDI %s: watch on port %d, %d reads a sample\n",
+          pIcdi->pSerial, iPort, pWatch->iRanges);
+    return NULL;
+}
+
+//
+// Add the variable pName (a variable of the ELF file, or an address) of
+// type pType, or of the type its size suggests.  Returns a message if that
+// fails.
+//
+static const char *
+watch_add(ICDI *pIcdi, const char *pName, const char *pType)
+{
+    WATCH *pWatch = pIcdi->pWatch;
+    unsigned int iAddr, iSize = 4, i;
+    WATCHVAR *pVar;
+    char *pEnd;
+
+    if (pWatch->iVars == WATCH_VARS)
+    {
+        return "too many variables\n";
+    }
+
+    if (strlen(pName) >= WATCH_NAME)
+    {
+        return "name too long\n";
+    }
+
+    iAddr = strtoul(pName, &pEnd, 0);
+    if ((*pEnd != 0) && !elf_object(pIcdi->pElf, pName, &iAddr, &iSize))
+    {
+        return "no such variable\n";
+    }
+
+    pVar = &pWatch->pVars[pWatch->iVars];
+    strcpy(pVar->pName, pName);
+    pVar->iAddr = iAddr;
+    pVar->eType = (iSize == 1) ? WATCH_U8 :
+                  (iSize == 2) ? WATCH_U16 : WATCH_U32;
+
+    if (pType[0])
+    {
+        for (i = 0; (i < sizeof(g_pTypes) / sizeof(g_pTypes[0])) &&
+                    (strcmp(pType, g_pTypes[i].pName) != 0); i++)
+        {
+        }
+        if (i == sizeof(g_pTypes) / sizeof(g_pTypes[0]))
+        {
+            return "type is one of u8, i8, u16, i16, u32, i32 and f32\n";
+        }
+        pVar->eType = i;
+    }
+
+    pWatch->iVars++;
+    return NULL;
+}
+
+//
+// Remove the variable pName.  Returns a message if there's none.
+//
+static const char *
+watch_del(WATCH *pWatch, const char *pName)
+{
+    unsigned int i;
+
+    for (i = 0; i < pWatch->iVars; i++)
+    {
+        if (strcmp(pWatch->pVars[i].pName, pName) == 0)
+        {
+            pWatch->iVars--;
+            memmove(&pWatch->pVars[i], &pWatch->pVars[i + 1],
+                    (pWatch->iVars - i) * sizeof(WATCHVAR));
+            return NULL;
+        }
+    }
+    return "no such variable watched\n";
+}
+
+//
+// Print where the watch stands
+//
+static void
+watch_status(WATCH *pWatch, GDBCLIENT *pCli)
+{
+    char pLine[160];
+    unsigned int i;
+
+    if (pWatch->bRunning)
+    {
+        snprintf(pLine, sizeof(pLine),
+                 "watching at %u Hz on port %d, %s, %s, %u reads a sample\n"
+                 "%u samples, %u skipped, %u failed\n",
+                 pWatch->iRate, pWatch->iPort,
+                 pWatch->bBinary ? "binary" : "CSV",
+                 (pWatch->sd >= 0) ? "connected" : "idle",
+                 pWatch->iRanges, pWatch->iSamples, pWatch->iSkipped,
+                 pWatch->iErrors);
+    }
+    else
+    {
+        snprintf(pLine, sizeof(pLine), "watch stopped\n");
+    }
+    gdb_console(pCli, pLine);
+
+    for (i = 0; i < pWatch->iVars; i++)
+    {
+        snprintf(pLine, sizeof(pLine), "0x%08x %-3s %s\n",
+                 pWatch->pVars[i].iAddr, g_pTypes[pWatch->pVars[i].eType].pName,
+                 pWatch->pVars[i].pName);
+        gdb_console(pCli, pLine);
+    }
+}
+
+//*****************************************************************************
+//
+//! Set up the watch of pIcdi, with nothing to watch yet.
+//
+//*****************************************************************************
+void
+watch_init(ICDI *pIcdi)
+{
+    pIcdi->pWatch = calloc(1, sizeof(WATCH));
+    ASSERT(pIcdi->pWatch != NULL);
+    pIcdi->pWatch->iTimer = -1;
+    pIcdi->pWatch->sdListen = -1;
+    pIcdi->pWatch->sd = -1;
+}
+
+//*****************************************************************************
+//
+//! Handle "monitor watch ..." from pCli:
+//!
+//!   watch                             show the state of the watch
+//!   watch add var|addr [type]         watch a variable of the ELF file, or
+//!                                     the type (u32) at addr
+//!   watch del var|addr
+//!   watch clear                       watch nothing
+//!   watch start [rate [port]] [bin]   sample rate times a second (100) to
+//!                                     the client on port (WATCH_PORT +
+//!                                     iIndex), as CSV or binary
+//!   watch stop
+//!
+//! The variables can only change while the watch is stopped.
+//!
+//! \return 1 if the packet was handled here, 0 otherwise.
+//
+//*****************************************************************************
+int
+watch_request(GDBCLIENT *pCli, const unsigned char *pPayload,
+        unsigned int len)
+{
+    ICDI *pIcdi = pCli->pIcdi;
+    WATCH *pWatch = pIcdi->pWatch;
+    char pCmd[256], pName[128], pType[8];
+    unsigned int iRate = WATCH_RATE, iPort = WATCH_PORT + pIcdi->iIndex;
+    const char *pMsg = NULL;
+
+    if (!gdb_monitor(pPayload, len, pCmd, sizeof(pCmd)) ||
+        (strncmp(pCmd, "watch", 5) != 0) ||
+        ((pCmd[5] != 0) && (pCmd[5] != ' ')))
+    {
+        return 0;
+    }
+
+    pType[0] = 0;
+    if ((strncmp(pCmd + 5, " add ", 5) == 0) ||
+        (strncmp(pCmd + 5, " del ", 5) == 0) ||
+        (strcmp(pCmd + 5, " clear") == 0))
+    {
+        if (pWatch->bRunning)
+        {
+            pMsg = "stop the watch first\n";
+        }
+        else if (sscanf(pCmd + 5, " add %127s %7s", pName, pType) >= 1)
+        {
+            pMsg = watch_add(pIcdi, pName, pType);
+        }
+        else if (sscanf(pCmd + 5, " del %127s", pName) == 1)
+        {
+            pMsg = watch_del(pWatch, pName);
+        }
+        else if (strcmp(pCmd + 5, " clear") == 0)
+        {
+            pWatch->iVars = 0;
+        }
+    }
+    else if (strncmp(pCmd + 5, " start", 6) == 0)
+    {
+        sscanf(pCmd + 5, " start %u %u", &iRate, &iPort);
+        if (pWatch->bRunning)
+        {
+            pMsg = "already watching\n";
+        }
+        else if ((iRate == 0) || (iRate > WATCH_MAX_RATE))
+        {
+            pMsg = "rate out of range\n";
+        }
+        else
+        {
+            len = strlen(pCmd);
+            pWatch->bBinary = (len > 4) && (strcmp(pCmd + len - 4, " bin") == 0);
+            pMsg = watch_start(pIcdi, iRate, iPort);
+            if (pMsg == NULL)
+            {
+                bridge_warn_resumed(pCli, "the watch");
+                watch_status(pWatch, pCli);
+            }
+        }
+    }
+    else if (strcmp(pCmd + 5, " stop") == 0)
+    {
+        watch_stop(pWatch);
+    }
+    else if (pCmd[5] == 0)
+    {
+        watch_status(pWatch, pCli);
+    }
+    else
+    {
+        pMsg = "usage: watch [add var|addr [type]|del var|addr|clear|"
+               "start [rate [port]] [bin]|stop]\n";
+    }
+
+    if (pMsg)
+    {
+        gdb_console(pCli, pMsg);
+    }
+    gdb_reply(pCli, (const unsigned char *)"OK", 2);
+    return 1;
+}